@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include "admission.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char *const shed_reason_names[SHED_REASONS] = {
+  "saturated", "source_rate", "prefix_rate", "source_connections", "source_updates", "prefix_updates",
+  "source_datagrams", "prefix_datagrams",
+};
+
+// Slots of an address in the source and the prefix table
+typedef struct SourceKey {
+  size_t source;
+  size_t prefix;
+} source_key_t;
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Murmur3 finalizer
+static uint64_t mix(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/*
+ * An IPv4 source is its address, its prefix the /24. IPv6 hosts tend
+ * to own a whole /64, which is the source then, and the prefix is the
+ * /48. IPv4-mapped IPv6 addresses count as IPv4.
+ */
+
+static source_key_t source_key(const struct sockaddr_storage *peer) {
+  uint64_t source = 0, prefix = 0;
+  if (peer->ss_family == AF_INET6) {
+    const struct in6_addr *addr = &((const struct sockaddr_in6 *) peer)->sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(addr)) {
+      uint32_t v4;
+      memcpy(&v4, addr->s6_addr + 12, sizeof(v4));
+      source = (uint64_t) AF_INET << 32 | ntohl(v4);
+      prefix = (uint64_t) AF_INET << 32 | (ntohl(v4) & 0xFFFFFF00);
+    } else {
+      memcpy(&source, addr->s6_addr, sizeof(source));
+      source = be64toh(source);
+      prefix = source & 0xFFFFFFFFFFFF0000ULL;
+    }
+  } else if (peer->ss_family == AF_INET) {
+    uint32_t v4 = ntohl(((const struct sockaddr_in *) peer)->sin_addr.s_addr);
+    source = (uint64_t) AF_INET << 32 | v4;
+    prefix = (uint64_t) AF_INET << 32 | (v4 & 0xFFFFFF00);
+  }
+  return (source_key_t) { .source = mix(source) % ADMISSION_SLOTS, .prefix = mix(prefix) % ADMISSION_SLOTS };
+}
+
+// Refills the bucket for the time since it was last used and takes a token if there is one
+static bool take_token(token_bucket_t *bucket, double rate, double burst, int64_t now) {
+  bucket->tokens += (double) (now - bucket->last_ms) * rate / 1000;
+  if (bucket->tokens > burst) {
+    bucket->tokens = burst;
+  }
+  bucket->last_ms = now;
+  if (bucket->tokens < 1) {
+    return false;
+  }
+  bucket->tokens -= 1;
+  return true;
+}
+
+static void shed(admission_t *admission, shed_reason_t reason) {
+  atomic_fetch_add_explicit(&admission->n_shed[reason], 1, memory_order_relaxed);
+}
+
+/*
+ * Initializes the admission control with full buckets. Throws an
+ * assertion if the parameter is NULL or if a memory allocation error
+ * occurs. Call admission_free() afterwards to avoid memory leaks!
+ */
+
+void admission_init(admission_t *admission) {
+  assert(admission != NULL);
+  *admission = (admission_t) { 0 };
+  // A bucket that was never used refills to its burst on first use
+  admission->sources = calloc(ADMISSION_SLOTS, sizeof(admission_slot_t));
+  admission->prefixes = calloc(ADMISSION_SLOTS, sizeof(admission_slot_t));
+  assert(admission->sources != NULL && admission->prefixes != NULL);
+  for (size_t i = 0; i < ADMISSION_LOCKS; i++) {
+    pthread_mutex_init(&admission->locks[i], NULL);
+  }
+}
+
+void admission_free(admission_t *admission) {
+  if (admission == NULL || admission->sources == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < ADMISSION_LOCKS; i++) {
+    pthread_mutex_destroy(&admission->locks[i]);
+  }
+  free(admission->sources);
+  free(admission->prefixes);
+  admission->sources = NULL;
+  admission->prefixes = NULL;
+}
+
+/*
+ * Decides whether a freshly accepted connection from the given peer is
+ * served, given the number of handshakes its worker has in flight. An
+ * admitted connection counts against its address until it is released
+ * with admission_release(). Throws an assertion if any of the
+ * parameters are NULL. Returns false and counts the reason if the
+ * connection is shed.
+ */
+
+bool admission_accept(admission_t *admission, const struct sockaddr_storage *peer, size_t n_handshakes) {
+  assert(admission != NULL && peer != NULL);
+  if (n_handshakes >= ADMISSION_HANDSHAKES) {
+    shed(admission, SHED_SATURATED);
+    return false;
+  }
+
+  source_key_t key = source_key(peer);
+  int64_t now = now_ms();
+  shed_reason_t reason = SHED_REASONS;
+  admission_slot_t *source = &admission->sources[key.source];
+  pthread_mutex_lock(&admission->locks[key.source % ADMISSION_LOCKS]);
+  if (source->n_open >= ADMISSION_SOURCE_CONNECTIONS) {
+    reason = SHED_SOURCE_CONNECTIONS;
+  } else if (!take_token(&source->connections, ADMISSION_SOURCE_RATE, ADMISSION_SOURCE_BURST, now)) {
+    reason = SHED_SOURCE_RATE;
+  } else {
+    source->n_open++;
+  }
+  pthread_mutex_unlock(&admission->locks[key.source % ADMISSION_LOCKS]);
+  if (reason != SHED_REASONS) {
+    shed(admission, reason);
+    return false;
+  }
+
+  pthread_mutex_lock(&admission->locks[key.prefix % ADMISSION_LOCKS]);
+  bool admitted = take_token(&admission->prefixes[key.prefix].connections, ADMISSION_PREFIX_RATE,
+                             ADMISSION_PREFIX_BURST, now);
+  pthread_mutex_unlock(&admission->locks[key.prefix % ADMISSION_LOCKS]);
+  if (!admitted) {
+    admission_release(admission, peer);
+    shed(admission, SHED_PREFIX_RATE);
+  }
+  return admitted;
+}
+
+/*
+ * Gives back the open connection an admitted peer counts against.
+ * Throws an assertion if any of the parameters are NULL.
+ */
+
+void admission_release(admission_t *admission, const struct sockaddr_storage *peer) {
+  assert(admission != NULL && peer != NULL);
+  source_key_t key = source_key(peer);
+  pthread_mutex_lock(&admission->locks[key.source % ADMISSION_LOCKS]);
+  if (admission->sources[key.source].n_open > 0) {
+    admission->sources[key.source].n_open--;
+  }
+  pthread_mutex_unlock(&admission->locks[key.source % ADMISSION_LOCKS]);
+}
+
+/*
+ * Takes a token from the given bucket of the peer's address slot and
+ * then of its prefix slot, see admission_slot_t. Returns false and
+ * counts the reason of the bucket that ran dry if the request is shed.
+ */
+
+static bool meter(admission_t *admission, const struct sockaddr_storage *peer, size_t bucket, double rate,
+                  double burst, double prefix_rate, double prefix_burst, shed_reason_t reason,
+                  shed_reason_t prefix_reason) {
+  source_key_t key = source_key(peer);
+  int64_t now = now_ms();
+  pthread_mutex_lock(&admission->locks[key.source % ADMISSION_LOCKS]);
+  bool admitted = take_token((token_bucket_t *) ((char *) &admission->sources[key.source] + bucket), rate, burst,
+                             now);
+  pthread_mutex_unlock(&admission->locks[key.source % ADMISSION_LOCKS]);
+  if (!admitted) {
+    shed(admission, reason);
+    return false;
+  }
+
+  pthread_mutex_lock(&admission->locks[key.prefix % ADMISSION_LOCKS]);
+  admitted = take_token((token_bucket_t *) ((char *) &admission->prefixes[key.prefix] + bucket), prefix_rate,
+                        prefix_burst, now);
+  pthread_mutex_unlock(&admission->locks[key.prefix % ADMISSION_LOCKS]);
+  if (!admitted) {
+    shed(admission, prefix_reason);
+  }
+  return admitted;
+}
+
+/*
+ * Takes a token for an update request from the given peer's address
+ * and prefix buckets. Throws an assertion if any of the parameters are
+ * NULL. Returns false and counts the reason if the request is shed.
+ */
+
+bool admission_update(admission_t *admission, const struct sockaddr_storage *peer) {
+  assert(admission != NULL && peer != NULL);
+  return meter(admission, peer, offsetof(admission_slot_t, updates), ADMISSION_UPDATE_RATE, ADMISSION_UPDATE_BURST,
+               ADMISSION_PREFIX_UPDATE_RATE, ADMISSION_PREFIX_UPDATE_BURST, SHED_SOURCE_UPDATES, SHED_PREFIX_UPDATES);
+}
+
+/*
+ * Takes a token for a datagram fetch from the given peer's address and
+ * prefix buckets. The address isn't proven by a handshake, a flood
+ * with spoofed ones drains the prefix buckets of the sources it
+ * pretends to come from. Throws an assertion if any of the parameters
+ * are NULL. Returns false and counts the reason if the query is shed.
+ */
+
+bool admission_datagram(admission_t *admission, const struct sockaddr_storage *peer) {
+  assert(admission != NULL && peer != NULL);
+  return meter(admission, peer, offsetof(admission_slot_t, datagrams), ADMISSION_DATAGRAM_RATE,
+               ADMISSION_DATAGRAM_BURST, ADMISSION_PREFIX_DATAGRAM_RATE, ADMISSION_PREFIX_DATAGRAM_BURST,
+               SHED_SOURCE_DATAGRAMS, SHED_PREFIX_DATAGRAMS);
+}
@@ -0,0 +1,120 @@
+#ifndef CHAT_ADMISSION_H
+#define CHAT_ADMISSION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Sources and prefixes are hashed into this many slots each, the ones
+// that share a slot share its buckets
+#define ADMISSION_SLOTS (1 << 15)
+#define ADMISSION_LOCKS (64)
+
+// New connections per second and burst from one address (an IPv6 /64)
+#ifndef ADMISSION_SOURCE_RATE
+#define ADMISSION_SOURCE_RATE (100)
+#endif
+#ifndef ADMISSION_SOURCE_BURST
+#define ADMISSION_SOURCE_BURST (200)
+#endif
+// New connections per second and burst from one IPv4 /24 or IPv6 /48
+#ifndef ADMISSION_PREFIX_RATE
+#define ADMISSION_PREFIX_RATE (1000)
+#endif
+#ifndef ADMISSION_PREFIX_BURST
+#define ADMISSION_PREFIX_BURST (2000)
+#endif
+// Update requests per second and burst, per address and per prefix
+#ifndef ADMISSION_UPDATE_RATE
+#define ADMISSION_UPDATE_RATE (200)
+#endif
+#ifndef ADMISSION_UPDATE_BURST
+#define ADMISSION_UPDATE_BURST (400)
+#endif
+#ifndef ADMISSION_PREFIX_UPDATE_RATE
+#define ADMISSION_PREFIX_UPDATE_RATE (2000)
+#endif
+#ifndef ADMISSION_PREFIX_UPDATE_BURST
+#define ADMISSION_PREFIX_UPDATE_BURST (4000)
+#endif
+// Datagram fetches per second and burst, per address and per prefix
+#ifndef ADMISSION_DATAGRAM_RATE
+#define ADMISSION_DATAGRAM_RATE (200)
+#endif
+#ifndef ADMISSION_DATAGRAM_BURST
+#define ADMISSION_DATAGRAM_BURST (400)
+#endif
+#ifndef ADMISSION_PREFIX_DATAGRAM_RATE
+#define ADMISSION_PREFIX_DATAGRAM_RATE (2000)
+#endif
+#ifndef ADMISSION_PREFIX_DATAGRAM_BURST
+#define ADMISSION_PREFIX_DATAGRAM_BURST (4000)
+#endif
+// Open connections per address
+#ifndef ADMISSION_SOURCE_CONNECTIONS
+#define ADMISSION_SOURCE_CONNECTIONS (64)
+#endif
+// A worker with this many handshakes in flight is saturated and
+// refuses new connections outright
+#ifndef ADMISSION_HANDSHAKES
+#define ADMISSION_HANDSHAKES (128)
+#endif
+
+typedef struct TokenBucket {
+  double tokens;
+  int64_t last_ms;
+} token_bucket_t;
+
+typedef struct AdmissionSlot {
+  token_bucket_t connections;
+  token_bucket_t updates;
+  token_bucket_t datagrams;
+  uint32_t n_open;
+} admission_slot_t;
+
+typedef enum ShedReason {
+  SHED_SATURATED,
+  SHED_SOURCE_RATE,
+  SHED_PREFIX_RATE,
+  SHED_SOURCE_CONNECTIONS,
+  SHED_SOURCE_UPDATES,
+  SHED_PREFIX_UPDATES,
+  SHED_SOURCE_DATAGRAMS,
+  SHED_PREFIX_DATAGRAMS,
+  SHED_REASONS,
+} shed_reason_t;
+
+/*
+ * Admission control in front of the lookup server, shared by every
+ * worker. New connections are checked right after accept(), before any
+ * TLS work: a saturated worker refuses them, every source address and
+ * prefix has a token bucket of new connections and an address can only
+ * hold so many open. Update requests and datagram fetches, which
+ * skip the handshake, are metered by buckets of their own. Slots are
+ * striped over ADMISSION_LOCKS locks.
+ */
+typedef struct Admission {
+  admission_slot_t *sources;
+  admission_slot_t *prefixes;
+  pthread_mutex_t locks[ADMISSION_LOCKS];
+  _Atomic uint64_t n_shed[SHED_REASONS];
+} admission_t;
+
+extern const char *const shed_reason_names[SHED_REASONS];
+
+void admission_init(admission_t *);
+
+void admission_free(admission_t *);
+
+bool admission_accept(admission_t *, const struct sockaddr_storage *, size_t);
+
+void admission_release(admission_t *, const struct sockaddr_storage *);
+
+bool admission_update(admission_t *, const struct sockaddr_storage *);
+
+bool admission_datagram(admission_t *, const struct sockaddr_storage *);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * Microbenchmarks for the lookup server's hash table. For every table
+ * size the same keys are inserted into an empty table (crossing every
+ * resize on the way), looked up in random order, looked up as misses,
+ * sent a heartbeat each, searched by prefix, churned with delete and
+ * insert pairs, saved as a snapshot and loaded back, which rebuilds the
+ * name index in hash order. Reports the wall time per operation and
+ * the memory of the table and the name index, and, where perf_event_open
+ * is permitted, the cycles and cache misses per operation. The table
+ * runs without its journal and without leases so that only the table
+ * itself is measured, its files live in a temporary directory.
+ */
+
+#define _GNU_SOURCE
+
+#include "hashtable.h"
+#include "journal.h"
+
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_SIZES (8)
+
+typedef enum Counter {
+  COUNTER_CYCLES,
+  COUNTER_CACHE_MISSES,
+  N_COUNTERS,
+} counter_t;
+
+typedef struct Measurement {
+  int64_t started_ns;
+  int64_t elapsed_ns;
+  uint64_t counts[N_COUNTERS];
+} measurement_t;
+
+// -1 where the counter could not be opened
+static int counter_fds[N_COUNTERS] = { -1, -1 };
+static char temp_dir[] = "/tmp/bench-hashtable-XXXXXX";
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Opens the hardware counters for the calling thread, user space only.
+ * Counters the kernel refuses (no PMU in a VM, perf_event_paranoid too
+ * high) stay closed and are reported as n/a.
+ */
+
+static void open_counters() {
+  const uint64_t configs[N_COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES };
+  for (int i = 0; i < N_COUNTERS; i++) {
+    struct perf_event_attr attr = { 0 };
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = configs[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counter_fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void close_counters() {
+  for (int i = 0; i < N_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      close(counter_fds[i]);
+    }
+  }
+}
+
+static void measure_start(measurement_t *m) {
+  for (int i = 0; i < N_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  m->started_ns = now_ns();
+}
+
+static void measure_stop(measurement_t *m) {
+  m->elapsed_ns = now_ns() - m->started_ns;
+  for (int i = 0; i < N_COUNTERS; i++) {
+    m->counts[i] = 0;
+    if (counter_fds[i] >= 0) {
+      ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+      if (read(counter_fds[i], &m->counts[i], sizeof(uint64_t)) != sizeof(uint64_t)) {
+        m->counts[i] = 0;
+      }
+    }
+  }
+}
+
+static void print_row(size_t n_entries, const char *name, const measurement_t *m, size_t n_ops) {
+  printf("%-9lu %-10s %10lu %11.1f", n_entries, name, n_ops, m->elapsed_ns / (double) n_ops);
+  for (int i = 0; i < N_COUNTERS; i++) {
+    if (counter_fds[i] >= 0) {
+      printf(" %11.1f", m->counts[i] / (double) n_ops);
+    } else {
+      printf(" %11s", "n/a");
+    }
+  }
+  putchar('\n');
+}
+
+static userdata_t make_user(const char *prefix, size_t i) {
+  userdata_t data = { 0 };
+  snprintf(data.username, sizeof(data.username), "%s%09lu", prefix, i);
+  data.ip.family = AF_INET;
+  data.ip.addr.v4.s_addr = (uint32_t) i;
+  return data;
+}
+
+/*
+ * Opens an empty table for the benchmark, with its journal detached.
+ * Any snapshot left by a previous size is removed first.
+ */
+
+static hashtable_t open_table() {
+  unlink(global_table_filename);
+  hashtable_t ht = generate_hashmap(0);
+  journal_close(ht.journal);
+  ht.journal = NULL;
+  return ht;
+}
+
+/*
+ * Runs every benchmark at the given number of entries. Returns the
+ * number of entries the table actually held, which is less than
+ * requested once the table can't grow any further.
+ */
+
+static size_t bench_size(size_t n_entries) {
+  userdata_t *users = malloc(n_entries * sizeof(userdata_t));
+  assert(users != NULL);
+  for (size_t i = 0; i < n_entries; i++) {
+    users[i] = make_user("user", i);
+  }
+  size_t *order = malloc(n_entries * sizeof(size_t));
+  assert(order != NULL);
+  uint64_t rng = 0x9E3779B97F4A7C15ULL ^ n_entries;
+  for (size_t i = 0; i < n_entries; i++) {
+    order[i] = i;
+  }
+  for (size_t i = n_entries - 1; i > 0; i--) {
+    size_t j = next_random(&rng) % (i + 1);
+    size_t tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  hashtable_t ht = open_table();
+  measurement_t m;
+
+  size_t n_inserted = 0;
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    n_inserted += insert(&ht, users[i]) == 0;
+  }
+  measure_stop(&m);
+  print_row(n_entries, "insert", &m, n_entries);
+  // Later numbers shouldn't include migrating the last resizes
+  resize_step(&ht, SIZE_MAX);
+  table_stats_t stats = table_stats(&ht);
+  printf("%-9lu table holds %lu entries in %lu slots, %.1f bytes per entry\n", n_entries, n_inserted, stats.size,
+         stats.memory_used / (double) n_inserted);
+
+  userdata_t out;
+  size_t n_found = 0;
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    n_found += read_user(&ht, users[order[i]].username, &out);
+  }
+  measure_stop(&m);
+  print_row(n_entries, "hit", &m, n_entries);
+  assert(n_found == n_inserted);
+
+  userdata_t miss = make_user("miss", 0);
+  n_found = 0;
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    snprintf(miss.username + 4, sizeof(miss.username) - 4, "%09lu", i);
+    n_found += read_user(&ht, miss.username, &out);
+  }
+  measure_stop(&m);
+  print_row(n_entries, "miss", &m, n_entries);
+  assert(n_found == 0);
+
+  int64_t now = time(NULL);
+  n_found = 0;
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    n_found += touch_user(&ht, users[order[i]].username, &users[order[i]].ip, now) == 0;
+  }
+  measure_stop(&m);
+  print_row(n_entries, "heartbeat", &m, n_entries);
+  assert(n_found == n_inserted);
+
+  // A page of the names that share the first 10 characters with a user, from that user on
+  char names[SEARCH_PAGE_MAX][MAX_USERNAME_LEN];
+  char prefix[MAX_USERNAME_LEN] = { '\0' };
+  size_t n_names = 0;
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    memcpy(prefix, users[order[i]].username, 10);
+    bool more = false;
+    n_names += table_search(&ht, prefix, users[order[i]].username, SEARCH_PAGE_MAX, names, &more);
+  }
+  measure_stop(&m);
+  print_row(n_entries, "search", &m, n_entries);
+  printf("%-9lu searches returned %.1f names per page\n", n_entries, n_names / (double) n_entries);
+
+  // Every pair deletes a present user and registers a new one, tombstones pile up until compacted
+  measure_start(&m);
+  for (size_t i = 0; i < n_entries; i++) {
+    if (delete_data(&ht, users[order[i]].username) == 0) {
+      users[order[i]] = make_user("churn", i);
+      insert(&ht, users[order[i]]);
+    }
+  }
+  measure_stop(&m);
+  print_row(n_entries, "churn", &m, n_entries);
+
+  resize_step(&ht, SIZE_MAX);
+  size_t n_stored = table_count(&ht);
+  measure_start(&m);
+  write_table(&ht);
+  measure_stop(&m);
+  print_row(n_entries, "save", &m, n_stored);
+  free_hashmap(&ht);
+
+  measure_start(&m);
+  ht = generate_hashmap(0);
+  measure_stop(&m);
+  print_row(n_entries, "load", &m, n_stored);
+  assert(table_count(&ht) == n_stored);
+  // Loaded in hash order, unlike the inserts above, which come sorted and leave the leaves half full
+  printf("%-9lu name index takes %.1f bytes per entry, %lu leaves, height %lu\n", n_entries,
+         ht.names->memory_used / (double) n_stored, ht.names->n_leaves, ht.names->height);
+  free_hashmap(&ht);
+
+  free(order);
+  free(users);
+  return n_inserted;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-n entries]...\n", name);
+}
+
+int main(int argc, char **argv) {
+  size_t sizes[BENCH_MAX_SIZES] = { 10000, 100000, 1000000 };
+  size_t n_sizes = 3;
+  bool custom_sizes = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt == 'n' && n_sizes < BENCH_MAX_SIZES) {
+      if (!custom_sizes) {
+        n_sizes = 0;
+        custom_sizes = true;
+      }
+      sizes[n_sizes] = strtoul(optarg, NULL, 10);
+      if (sizes[n_sizes] == 0) {
+        usage(argv[0]);
+        return 1;
+      }
+      n_sizes++;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (mkdtemp(temp_dir) == NULL) {
+    fprintf(stderr, "[ERROR] Could not create a temporary directory\n");
+    return 1;
+  }
+  snprintf(global_table_filename, sizeof(global_table_filename), "%s%s", temp_dir, STORAGE_FILE);
+  snprintf(global_journal_filename, sizeof(global_journal_filename), "%s%s", temp_dir, JOURNAL_FILE);
+  snprintf(global_rotated_journal_filename, sizeof(global_rotated_journal_filename), "%s%s",
+           temp_dir, ROTATED_JOURNAL_FILE);
+
+  open_counters();
+  printf("%-9s %-10s %10s %11s %11s %11s\n", "entries", "op", "ops", "ns/op", "cycles/op", "misses/op");
+  for (size_t i = 0; i < n_sizes; i++) {
+    bench_size(sizes[i]);
+  }
+  close_counters();
+
+  unlink(global_table_filename);
+  unlink(global_journal_filename);
+  unlink(global_rotated_journal_filename);
+  rmdir(temp_dir);
+  return 0;
+}
@@ -0,0 +1,576 @@
+/*
+ * Load generator for the lookup server. N client threads replay a mix
+ * of UPDATE, HEARTBEAT, SEARCH and FETCH requests against a running
+ * lookup server for a fixed duration and the request latencies are
+ * collected into one histogram. Usernames are drawn from a Zipfian
+ * distribution over the preloaded key space, a share of the fetches
+ * asks for users that don't exist and searches ask for a page of the
+ * names that share a drawn name's first BENCH_SEARCH_PREFIX
+ * characters. Clients either keep one connection open (the binary
+ * session protocol), with or without fetching over signed datagrams,
+ * or open a new connection per request with a full TLS handshake or
+ * with a resumed TLS session. Against a cluster every request goes to
+ * the node that owns its username.
+ */
+
+#define _GNU_SOURCE
+
+#include "frame.h"
+#include "metrics.h"
+#include "server.h"
+#include "shared_protocol.h"
+#include "ssl.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_MAX_CLIENTS (1024)
+// Usernames registered per request while preloading the key space
+#define BENCH_PRELOAD_BATCH (1000)
+// "bench" and the first two digits
+#define BENCH_SEARCH_PREFIX (7)
+
+typedef enum ConnectionMode {
+  MODE_KEEP,
+  MODE_FRESH,
+  MODE_RESUME,
+  // Like MODE_KEEP, fetches go out as signed datagrams first
+  MODE_DATAGRAM,
+  MODES,
+} connection_mode_t;
+
+typedef struct BenchConfig {
+  ip_addr_t addr;
+  in_port_t port;
+  // Node list, set from the address and port unless given
+  const char *nodes;
+  ring_t ring;
+  int n_clients;
+  double duration_s;
+  size_t n_users;
+  double zipf_s;
+  double update_ratio;
+  double heartbeat_ratio;
+  double search_ratio;
+  double miss_ratio;
+  connection_mode_t mode;
+  bool json;
+} bench_config_t;
+
+typedef struct BenchClient {
+  pthread_t thread;
+  uint64_t rng;
+  lookup_cluster_t *cluster;
+  // One per node, a session only resumes on the node that issued it
+  SSL_SESSION *tls_sessions[RING_MAX_NODES];
+  size_t n_fetches;
+  size_t n_updates;
+  size_t n_heartbeats;
+  size_t n_searches;
+  size_t n_found;
+  size_t n_errors;
+  size_t n_connections;
+  size_t n_resumed;
+} bench_client_t;
+
+static const char *mode_names[MODES] = { "keep", "fresh", "resume", "datagram" };
+
+static bench_config_t config = {
+  .port = LOOKUP_PORT,
+  .n_clients = 8,
+  .duration_s = 10,
+  .n_users = 10000,
+  .zipf_s = 0.99,
+  .update_ratio = 0.1,
+  .miss_ratio = 0.05,
+  .mode = MODE_KEEP,
+};
+static SSL_CTX *ctx = NULL;
+// Cumulative probabilities of the key space ranks
+static double *zipf_cdf = NULL;
+static histogram_t latency_us;
+static _Atomic bool stop = false;
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift64*, one state per client
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double next_uniform(uint64_t *state) {
+  return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+/*
+ * Precomputes the distribution of n ranks where rank k has a weight of
+ * 1 / (k + 1)^s. An exponent of 0 gives a uniform distribution. Throws
+ * an assertion if a memory allocation error occurs.
+ */
+
+static double *zipf_create(size_t n, double s) {
+  double *cdf = malloc(n * sizeof(double));
+  assert(cdf != NULL);
+  double sum = 0;
+  for (size_t k = 0; k < n; k++) {
+    sum += 1 / pow((double) (k + 1), s);
+    cdf[k] = sum;
+  }
+  for (size_t k = 0; k < n; k++) {
+    cdf[k] /= sum;
+  }
+  return cdf;
+}
+
+static size_t zipf_sample(uint64_t *state) {
+  double u = next_uniform(state);
+  size_t low = 0, high = config.n_users - 1;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (zipf_cdf[mid] < u) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/*
+ * Opens a connection to the given lookup node, resuming the given TLS
+ * session if it isn't NULL. Returns the connection and sets the
+ * socket, or returns NULL on failure.
+ */
+
+static SSL *connect_server(const ring_node_t *node, SSL_SESSION *tls_session, int *out_fd) {
+  struct sockaddr_storage ss = { 0 };
+  socklen_t ss_length = 0;
+  if (node->addr.family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+    sin->sin_family = AF_INET;
+    sin->sin_addr = node->addr.addr.v4;
+    sin->sin_port = htons(node->port);
+    ss_length = sizeof(*sin);
+  } else {
+    struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &ss;
+    sin->sin6_family = AF_INET6;
+    sin->sin6_addr = node->addr.addr.v6;
+    sin->sin6_port = htons(node->port);
+    ss_length = sizeof(*sin);
+  }
+
+  int fd = socket(node->addr.family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  if (connect(fd, (struct sockaddr *) &ss, ss_length) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  SSL *ssl = SSL_new(ctx);
+  if (ssl == NULL) {
+    close(fd);
+    return NULL;
+  }
+  SSL_set_fd(ssl, fd);
+  if (tls_session != NULL) {
+    SSL_set_session(ssl, tls_session);
+  }
+  if (SSL_connect(ssl) != 1) {
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+  }
+  *out_fd = fd;
+  return ssl;
+}
+
+/*
+ * Sends a single request frame over a new connection to the given
+ * node and reads the reply. In resume mode the TLS session is kept for
+ * the next connection to the node. Returns 0 on success, -1 on failure.
+ */
+
+static int one_shot_request(bench_client_t *client, size_t node, const frame_t *request, frame_t *reply) {
+  int fd = -1;
+  SSL *ssl = connect_server(&config.ring.nodes[node], config.mode == MODE_RESUME ? client->tls_sessions[node] : NULL,
+                            &fd);
+  if (ssl == NULL) {
+    return -1;
+  }
+  client->n_connections++;
+  client->n_resumed += SSL_session_reused(ssl) ? 1 : 0;
+
+  uint8_t buf[FRAME_SIZE_MAX];
+  size_t len = frame_encode(request, buf);
+  int result = SSL_write(ssl, buf, (int) len) == (int) len ? 0 : -1;
+  len = 0;
+  while (result == 0) {
+    long frame_len = frame_decode(buf, len, reply);
+    if (frame_len != 0) {
+      result = frame_len > 0 ? 0 : -1;
+      break;
+    }
+    int bytes_read = SSL_read(ssl, buf + len, (int) (sizeof(buf) - len));
+    if (bytes_read <= 0) {
+      result = -1;
+      break;
+    }
+    len += (size_t) bytes_read;
+  }
+
+  // TLS 1.3 tickets arrive after the handshake, they have been read by now
+  if (result == 0 && config.mode == MODE_RESUME) {
+    SSL_SESSION *tls_session = SSL_get1_session(ssl);
+    if (tls_session != NULL) {
+      SSL_SESSION_free(client->tls_sessions[node]);
+      client->tls_sessions[node] = tls_session;
+    }
+  }
+  SSL_shutdown(ssl);
+  SSL_free(ssl);
+  close(fd);
+  return result;
+}
+
+/*
+ * Sends a SEARCH request for a page of the names with the given prefix
+ * to every node, over new connections unless they are kept. Returns 0
+ * on success and sets found if any name matched, returns -1 if the
+ * request to any node failed.
+ */
+
+static int send_search(bench_client_t *client, const char *prefix, bool *found) {
+  if (client->cluster != NULL) {
+    char names[SEARCH_PAGE_MAX][FRAME_NAME_MAX + 1];
+    size_t n_found = 0;
+    bool more = false;
+    int result = lookup_cluster_search(client->cluster, prefix, NULL, SEARCH_PAGE_MAX, names, &n_found, &more);
+    *found = n_found != 0;
+    return result;
+  }
+
+  frame_t request, reply;
+  frame_init(&request, FRAME_OP_SEARCH, FRAME_STATUS_OK);
+  frame_put_status(&request, SEARCH_PAGE_MAX);
+  frame_put_name(&request, prefix);
+  for (size_t node = 0; node < config.ring.n_nodes; node++) {
+    if (one_shot_request(client, node, &request, &reply) != 0 || reply.status != FRAME_STATUS_OK
+        || reply.length == 0) {
+      return -1;
+    }
+    *found = *found || reply.length > 1;
+  }
+  return 0;
+}
+
+/*
+ * Sends one FETCH, UPDATE, HEARTBEAT or SEARCH request for the given
+ * username, a search takes it as the prefix. Returns 0 on success and
+ * sets found for fetches and searches, returns -1 if the request
+ * failed.
+ */
+
+static int send_request(bench_client_t *client, uint8_t opcode, const char *username, bool *found) {
+  *found = false;
+  if (opcode == FRAME_OP_SEARCH) {
+    return send_search(client, username, found);
+  }
+  if (client->cluster != NULL) {
+    ip_addr_t addr;
+    bool ok = false;
+    const char *usernames[] = { username };
+    if (opcode == FRAME_OP_UPDATE) {
+      return lookup_cluster_update_many(client->cluster, usernames, 1, &ok) == 0 && ok ? 0 : -1;
+    }
+    if (opcode == FRAME_OP_HEARTBEAT) {
+      return lookup_cluster_heartbeat_many(client->cluster, usernames, 1, &ok) == 0 && ok ? 0 : -1;
+    }
+    return lookup_cluster_fetch_many(client->cluster, usernames, 1, &addr, NULL, found);
+  }
+
+  frame_t request, reply;
+  frame_init(&request, opcode, FRAME_STATUS_OK);
+  frame_put_name(&request, username);
+  size_t node = ring_owner(&config.ring, username);
+  if (one_shot_request(client, node, &request, &reply) != 0 || reply.status != FRAME_STATUS_OK) {
+    return -1;
+  }
+  if (opcode != FRAME_OP_FETCH) {
+    return reply.length == 1 && reply.payload[0] == FRAME_STATUS_OK ? 0 : -1;
+  }
+  size_t offset = 0;
+  ip_addr_t addr;
+  uint32_t last_seen = 0;
+  if (!frame_get_addr(&reply, &offset, &addr) || !frame_get_u32(&reply, &offset, &last_seen)) {
+    return -1;
+  }
+  *found = addr.family != AF_UNSPEC;
+  return 0;
+}
+
+static void *run_client(void *arg) {
+  bench_client_t *client = (bench_client_t *) arg;
+  char username[32];
+  while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+    double kind = next_uniform(&client->rng);
+    uint8_t opcode = kind < config.update_ratio                                                ? FRAME_OP_UPDATE
+                   : kind < config.update_ratio + config.heartbeat_ratio                       ? FRAME_OP_HEARTBEAT
+                   : kind < config.update_ratio + config.heartbeat_ratio + config.search_ratio ? FRAME_OP_SEARCH
+                                                                                               : FRAME_OP_FETCH;
+    if (opcode == FRAME_OP_FETCH && next_uniform(&client->rng) < config.miss_ratio) {
+      snprintf(username, sizeof(username), "miss%lu", next_random(&client->rng) % 1000000000);
+    } else {
+      snprintf(username, sizeof(username), "bench%lu", zipf_sample(&client->rng));
+    }
+    if (opcode == FRAME_OP_SEARCH) {
+      username[BENCH_SEARCH_PREFIX] = '\0';
+    }
+
+    bool found = false;
+    int64_t started_us = now_us();
+    int result = send_request(client, opcode, username, &found);
+    histogram_record(&latency_us, (uint64_t) (now_us() - started_us));
+
+    if (opcode == FRAME_OP_UPDATE) {
+      client->n_updates++;
+    } else if (opcode == FRAME_OP_HEARTBEAT) {
+      client->n_heartbeats++;
+    } else if (opcode == FRAME_OP_SEARCH) {
+      client->n_searches++;
+    } else {
+      client->n_fetches++;
+      client->n_found += found ? 1 : 0;
+    }
+    client->n_errors += result != 0 ? 1 : 0;
+  }
+  return NULL;
+}
+
+/*
+ * Registers every username of the key space before the run, so that
+ * only the fetches meant to miss do. Returns 0 on success, -1 on
+ * failure.
+ */
+
+static int preload_users() {
+  lookup_cluster_t *cluster = lookup_cluster_open(config.nodes, ctx);
+  char (*names)[32] = malloc(BENCH_PRELOAD_BATCH * sizeof(*names));
+  const char **usernames = malloc(BENCH_PRELOAD_BATCH * sizeof(char *));
+  bool *ok = malloc(BENCH_PRELOAD_BATCH * sizeof(bool));
+  assert(names != NULL && usernames != NULL && ok != NULL);
+
+  int result = 0;
+  for (size_t start = 0; start < config.n_users && result == 0; start += BENCH_PRELOAD_BATCH) {
+    size_t n = config.n_users - start < BENCH_PRELOAD_BATCH ? config.n_users - start : BENCH_PRELOAD_BATCH;
+    for (size_t i = 0; i < n; i++) {
+      snprintf(names[i], sizeof(names[i]), "bench%lu", start + i);
+      usernames[i] = names[i];
+    }
+    result = lookup_cluster_update_many(cluster, usernames, n, ok);
+  }
+  free(names);
+  free(usernames);
+  free(ok);
+  lookup_cluster_close(cluster);
+  return result;
+}
+
+static void print_report(const bench_client_t *clients, double elapsed_s) {
+  bench_client_t total = { 0 };
+  for (int i = 0; i < config.n_clients; i++) {
+    total.n_fetches += clients[i].n_fetches;
+    total.n_updates += clients[i].n_updates;
+    total.n_heartbeats += clients[i].n_heartbeats;
+    total.n_searches += clients[i].n_searches;
+    total.n_found += clients[i].n_found;
+    total.n_errors += clients[i].n_errors;
+    total.n_connections += clients[i].n_connections;
+    total.n_resumed += clients[i].n_resumed;
+  }
+  size_t n_requests = total.n_fetches + total.n_updates + total.n_heartbeats + total.n_searches;
+  double throughput = n_requests / elapsed_s;
+  uint64_t p50 = histogram_percentile(&latency_us, 0.5);
+  uint64_t p99 = histogram_percentile(&latency_us, 0.99);
+  uint64_t p999 = histogram_percentile(&latency_us, 0.999);
+  uint64_t max = atomic_load(&latency_us.max);
+
+  if (config.json) {
+    printf("{\"mode\": \"%s\", \"nodes\": %lu, \"clients\": %d, \"duration_s\": %.3f, \"users\": %lu, \"zipf_s\": %.3f, "
+           "\"update_ratio\": %.3f, \"heartbeat_ratio\": %.3f, \"search_ratio\": %.3f, \"miss_ratio\": %.3f, "
+           "\"requests\": %lu, \"fetches\": %lu, \"updates\": %lu, \"heartbeats\": %lu, \"searches\": %lu, "
+           "\"found\": %lu, \"errors\": %lu, \"connections\": %lu, \"resumed\": %lu, "
+           "\"throughput_rps\": %.1f, \"latency_us\": {\"p50\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu}}\n",
+           mode_names[config.mode], config.ring.n_nodes, config.n_clients, elapsed_s, config.n_users, config.zipf_s,
+           config.update_ratio, config.heartbeat_ratio, config.search_ratio, config.miss_ratio, n_requests,
+           total.n_fetches, total.n_updates, total.n_heartbeats, total.n_searches, total.n_found, total.n_errors,
+           total.n_connections, total.n_resumed,
+           throughput, p50, p99, p999, max);
+    return;
+  }
+  printf("Mode %s, %lu nodes, %d clients, %.1f s, %lu users (zipf %.2f), %.0f%% updates, %.0f%% heartbeats, "
+         "%.0f%% searches, %.0f%% misses\n", mode_names[config.mode], config.ring.n_nodes, config.n_clients, elapsed_s,
+         config.n_users, config.zipf_s, config.update_ratio * 100, config.heartbeat_ratio * 100,
+         config.search_ratio * 100, config.miss_ratio * 100);
+  printf("Requests:    %lu (%lu fetches, %lu found, %lu updates, %lu heartbeats, %lu searches), %lu errors\n",
+         n_requests, total.n_fetches, total.n_found, total.n_updates, total.n_heartbeats, total.n_searches,
+         total.n_errors);
+  if (config.mode == MODE_FRESH || config.mode == MODE_RESUME) {
+    printf("Connections: %lu, %lu with a resumed TLS session\n", total.n_connections, total.n_resumed);
+  }
+  printf("Throughput:  %.1f requests/s\n", throughput);
+  printf("Latency:     p50 %lu us, p99 %lu us, p999 %lu us, max %lu us\n", p50, p99, p999, max);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-a address] [-p port] [-N node list] [-c clients] [-d seconds] [-n users]\n"
+          "       [-z zipf exponent] [-u update ratio] [-b heartbeat ratio] [-r search ratio]\n"
+          "       [-m miss ratio] [-s keep|fresh|resume|datagram] [-j]\n",
+          name);
+}
+
+static bool parse_args(int argc, char **argv) {
+  config.addr.family = AF_INET;
+  config.addr.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
+  int opt;
+  while ((opt = getopt(argc, argv, "a:p:N:c:d:n:z:u:b:r:m:s:j")) != -1) {
+    if (opt == 'a') {
+      if (inet_pton(AF_INET, optarg, &config.addr.addr.v4) == 1) {
+        config.addr.family = AF_INET;
+      } else if (inet_pton(AF_INET6, optarg, &config.addr.addr.v6) == 1) {
+        config.addr.family = AF_INET6;
+      } else {
+        return false;
+      }
+    } else if (opt == 'p') {
+      long port = strtol(optarg, NULL, 10);
+      if (port < 1 || port > 65535) {
+        return false;
+      }
+      config.port = (in_port_t) port;
+    } else if (opt == 'N') {
+      // "address:port,address:port,...", see ring_parse()
+      config.nodes = optarg;
+    } else if (opt == 'c') {
+      config.n_clients = atoi(optarg);
+    } else if (opt == 'd') {
+      config.duration_s = atof(optarg);
+    } else if (opt == 'n') {
+      config.n_users = strtoul(optarg, NULL, 10);
+    } else if (opt == 'z') {
+      config.zipf_s = atof(optarg);
+    } else if (opt == 'u') {
+      config.update_ratio = atof(optarg);
+    } else if (opt == 'b') {
+      config.heartbeat_ratio = atof(optarg);
+    } else if (opt == 'r') {
+      config.search_ratio = atof(optarg);
+    } else if (opt == 'm') {
+      config.miss_ratio = atof(optarg);
+    } else if (opt == 's') {
+      size_t i = 0;
+      while (i < MODES && strcmp(optarg, mode_names[i]) != 0) {
+        i++;
+      }
+      if (i == MODES) {
+        return false;
+      }
+      config.mode = (connection_mode_t) i;
+    } else if (opt == 'j') {
+      config.json = true;
+    } else {
+      return false;
+    }
+  }
+  if (config.nodes == NULL) {
+    static char node_name[RING_NODE_STRLEN];
+    ring_node_t node = { .addr = config.addr, .port = config.port };
+    ring_node_format(&node, node_name);
+    config.nodes = node_name;
+  }
+  if (ring_parse(&config.ring, config.nodes) != 0) {
+    return false;
+  }
+  return config.n_clients >= 1 && config.n_clients <= BENCH_MAX_CLIENTS && config.duration_s > 0
+      && config.n_users >= 1 && config.zipf_s >= 0 && config.update_ratio >= 0 && config.heartbeat_ratio >= 0
+      && config.search_ratio >= 0 && config.update_ratio + config.heartbeat_ratio + config.search_ratio <= 1
+      && config.miss_ratio >= 0 && config.miss_ratio <= 1;
+}
+
+int main(int argc, char **argv) {
+  if (!parse_args(argc, argv)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  get_cert_dirs();
+  ctx = init_openssl(CLIENT);
+  if (ctx == NULL) {
+    return 1;
+  }
+  zipf_cdf = zipf_create(config.n_users, config.zipf_s);
+  if (preload_users() != 0) {
+    fprintf(stderr, "[ERROR] Could not preload the users, is the lookup server running?\n");
+    return 1;
+  }
+
+  bench_client_t *clients = calloc(config.n_clients, sizeof(bench_client_t));
+  assert(clients != NULL);
+  int64_t started_us = now_us();
+  for (int i = 0; i < config.n_clients; i++) {
+    clients[i].rng = 0x9E3779B97F4A7C15ULL * (uint64_t) (i + 1);
+    if (config.mode == MODE_KEEP || config.mode == MODE_DATAGRAM) {
+      clients[i].cluster = lookup_cluster_open(config.nodes, ctx);
+      for (size_t j = 0; j < config.ring.n_nodes; j++) {
+        clients[i].cluster->sessions[j]->datagrams = config.mode == MODE_DATAGRAM;
+      }
+    }
+    pthread_create(&clients[i].thread, NULL, run_client, &clients[i]);
+  }
+  poll(NULL, 0, (int) (config.duration_s * 1000));
+  atomic_store(&stop, true);
+  for (int i = 0; i < config.n_clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+  }
+  double elapsed_s = (now_us() - started_us) / 1e6;
+
+  print_report(clients, elapsed_s);
+
+  for (int i = 0; i < config.n_clients; i++) {
+    lookup_cluster_close(clients[i].cluster);
+    for (size_t j = 0; j < config.ring.n_nodes; j++) {
+      SSL_SESSION_free(clients[i].tls_sessions[j]);
+    }
+  }
+  free(clients);
+  free(zipf_cdf);
+  ring_free(&config.ring);
+  SSL_CTX_free(ctx);
+  return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * A blocked Bloom filter keyed by precomputed 64-bit hashes.
+ * Every key maps to a single 512-bit block and sets BLOOM_N_HASHES
+ * bits inside it, so a query touches exactly one cache line.
+ * Deletions are not supported; stale bits only cause false positives.
+ */
+
+#include "bloom.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WORDS_PER_BLOCK (BLOOM_BLOCK_BITS / 64)
+
+/*
+ * Returns the number of blocks of a filter sized for the given
+ * number of table slots.
+ */
+
+size_t bloom_create_size(size_t n_slots) {
+  size_t n_blocks = (n_slots * BLOOM_BITS_PER_SLOT + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+  return n_blocks == 0 ? 1 : n_blocks;
+}
+
+/*
+ * Creates a filter sized for the given number of table slots.
+ * Returns a filter without bits if a memory allocation error occurs.
+ * Call bloom_free() afterwards to avoid memory leaks!
+ */
+
+bloom_t bloom_create(size_t n_slots) {
+  size_t n_blocks = bloom_create_size(n_slots);
+  uint64_t *bits = aligned_alloc(64, n_blocks * WORDS_PER_BLOCK * sizeof(uint64_t));
+  if (bits == NULL) {
+    return (bloom_t) { 0 };
+  }
+  memset(bits, 0, n_blocks * WORDS_PER_BLOCK * sizeof(uint64_t));
+  return (bloom_t) { .bits = bits, .n_blocks = n_blocks };
+}
+
+void bloom_free(bloom_t *bf) {
+  free(bf->bits);
+  bf->bits = NULL;
+  bf->n_blocks = 0;
+}
+
+/*
+ * The table already uses the low bits of the hash, so the filter
+ * remixes it. The high half picks the block, the low half yields the
+ * bit positions inside it through double hashing.
+ */
+
+static inline uint64_t *select_block(const bloom_t *bf, uint64_t *hash) {
+  uint64_t mixed = *hash * 0x9E3779B97F4A7C15ULL;
+  size_t block = (size_t) (((mixed >> 32) * bf->n_blocks) >> 32);
+  *hash = mixed;
+  return bf->bits + block * WORDS_PER_BLOCK;
+}
+
+static inline unsigned bit_position(uint64_t hash, int i) {
+  unsigned first = (unsigned) hash & (BLOOM_BLOCK_BITS - 1);
+  unsigned step = ((unsigned) (hash >> 9) & (BLOOM_BLOCK_BITS - 1)) | 1;
+  return (first + i * step) & (BLOOM_BLOCK_BITS - 1);
+}
+
+void bloom_add(bloom_t *bf, uint64_t hash) {
+  assert(bf != NULL && bf->bits != NULL);
+  uint64_t *block = select_block(bf, &hash);
+  for (int i = 0; i < BLOOM_N_HASHES; i++) {
+    unsigned bit = bit_position(hash, i);
+    block[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+/*
+ * Returns false if the key was definitely never added,
+ * true if it may have been.
+ */
+
+bool bloom_may_contain(const bloom_t *bf, uint64_t hash) {
+  assert(bf != NULL && bf->bits != NULL);
+  const uint64_t *block = select_block(bf, &hash);
+  for (int i = 0; i < BLOOM_N_HASHES; i++) {
+    unsigned bit = bit_position(hash, i);
+    if ((block[bit / 64] & (1ULL << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
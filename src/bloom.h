@@ -0,0 +1,28 @@
+#ifndef CHAT_BLOOM_H
+#define CHAT_BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bits are grouped into cache line sized blocks, one block per key
+#define BLOOM_BLOCK_BITS (512)
+#define BLOOM_BITS_PER_SLOT (8)
+#define BLOOM_N_HASHES (4)
+
+typedef struct BloomFilter {
+  uint64_t *bits;
+  size_t n_blocks;
+} bloom_t;
+
+size_t bloom_create_size(size_t);
+
+bloom_t bloom_create(size_t);
+
+void bloom_free(bloom_t *);
+
+void bloom_add(bloom_t *, uint64_t);
+
+bool bloom_may_contain(const bloom_t *, uint64_t);
+
+#endif
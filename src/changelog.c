@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+
+#include "changelog.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <time.h>
+
+/*
+ * Creates an empty change log with a fresh stream id. Throws an
+ * assertion if a memory allocation error occurs. Call changelog_free()
+ * afterwards to avoid memory leaks!
+ */
+
+change_log_t *changelog_create() {
+  change_log_t *log = calloc(1, sizeof(change_log_t));
+  assert(log != NULL);
+  log->records = malloc(CHANGELOG_RECORDS * sizeof(change_record_t));
+  assert(log->records != NULL);
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&log->appended, &attr);
+  pthread_condattr_destroy(&attr);
+
+  // 0 is what a follower that never synced sends
+  while (log->stream == 0) {
+    if (getrandom(&log->stream, sizeof(log->stream), 0) != sizeof(log->stream)) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      log->stream = (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+    }
+  }
+  return log;
+}
+
+void changelog_free(change_log_t *log) {
+  if (log == NULL) {
+    return;
+  }
+  pthread_cond_destroy(&log->appended);
+  pthread_mutex_destroy(&log->lock);
+  free(log->records);
+  free(log);
+}
+
+/*
+ * Appends a change and wakes up the readers waiting for one. Meant to
+ * be called by the table with its lock held. Throws an assertion if
+ * any of the parameters are NULL.
+ */
+
+void changelog_append(change_log_t *log, char op, const userdata_t *data) {
+  assert(log != NULL && data != NULL);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  pthread_mutex_lock(&log->lock);
+  change_record_t *record = &log->records[log->next_seq % CHANGELOG_RECORDS];
+  record->op = op;
+  record->data = *data;
+  record->time_us = (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  log->next_seq++;
+  pthread_cond_broadcast(&log->appended);
+  pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * Returns the sequence number the next change will get. Throws an
+ * assertion if the log is NULL.
+ */
+
+uint64_t changelog_next(change_log_t *log) {
+  assert(log != NULL);
+  pthread_mutex_lock(&log->lock);
+  uint64_t next_seq = log->next_seq;
+  pthread_mutex_unlock(&log->lock);
+  return next_seq;
+}
+
+/*
+ * Copies up to max records from the given sequence number on into out,
+ * waiting up to timeout_ms for one if there is none yet. Throws an
+ * assertion if any of the parameters are NULL. Returns the number of
+ * records copied, 0 on a timeout, -1 if the records from the given
+ * sequence number on were already overwritten or don't exist.
+ */
+
+long changelog_read(change_log_t *log, uint64_t from, change_record_t *out, size_t max, int timeout_ms) {
+  assert(log != NULL && out != NULL);
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&log->lock);
+  while (log->next_seq == from && timeout_ms > 0) {
+    if (pthread_cond_timedwait(&log->appended, &log->lock, &deadline) != 0) {
+      break;
+    }
+  }
+  uint64_t oldest = log->next_seq > CHANGELOG_RECORDS ? log->next_seq - CHANGELOG_RECORDS : 0;
+  if (from < oldest || from > log->next_seq) {
+    pthread_mutex_unlock(&log->lock);
+    return -1;
+  }
+  size_t n = (size_t) (log->next_seq - from) < max ? (size_t) (log->next_seq - from) : max;
+  for (size_t i = 0; i < n; i++) {
+    out[i] = log->records[(from + i) % CHANGELOG_RECORDS];
+  }
+  pthread_mutex_unlock(&log->lock);
+  return (long) n;
+}
@@ -0,0 +1,56 @@
+#ifndef CHAT_CHANGELOG_H
+#define CHAT_CHANGELOG_H
+
+#include "hashtable.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Changes kept for followers that fell behind, one that falls further
+// behind has to start over from a snapshot
+#ifndef CHANGELOG_RECORDS
+#define CHANGELOG_RECORDS (1 << 16)
+#endif
+
+// A heartbeat refreshed the last-seen time, never journaled
+#define CHANGE_OP_SEEN ('S')
+
+typedef struct ChangeRecord {
+  // JOURNAL_OP_UPDATE, JOURNAL_OP_DELETE or CHANGE_OP_SEEN, deletions
+  // only carry the username and heartbeats the last-seen time as well
+  char op;
+  userdata_t data;
+  // Wall clock time of the change in microseconds
+  int64_t time_us;
+} change_record_t;
+
+/*
+ * In-memory tail of the lookup table's mutations that followers
+ * stream, see replication.h. Records are numbered by a sequence number
+ * that only grows, the last CHANGELOG_RECORDS of them are kept in a
+ * ring. Writers append holding the table lock, readers only take the
+ * log's own lock.
+ */
+typedef struct ChangeLog {
+  pthread_mutex_t lock;
+  pthread_cond_t appended;
+  change_record_t *records;
+  // Sequence number of the next record
+  uint64_t next_seq;
+  // Random per process, sequence numbers of another stream mean nothing here
+  uint64_t stream;
+} change_log_t;
+
+change_log_t *changelog_create();
+
+void changelog_free(change_log_t *);
+
+void changelog_append(change_log_t *, char, const userdata_t *);
+
+uint64_t changelog_next(change_log_t *);
+
+long changelog_read(change_log_t *, uint64_t, change_record_t *, size_t, int);
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 void terminate(int n) {
   global_terminate_program = true;
@@ -17,6 +18,76 @@ void clear_screen() {
   fflush(stdout);
 }
 
+/*
+ * Tells whether a peer last seen at the given time is offline, in
+ * which case the user is told instead of waiting for connect() to time
+ * out. An unknown time (0) is not taken as offline.
+ */
+
+static bool peer_offline(const char *username, int64_t last_seen) {
+  int64_t ago = (int64_t) time(NULL) - last_seen;
+  if (last_seen == 0 || ago <= PRESENCE_STALE_SECONDS) {
+    return false;
+  }
+  printf("[ERROR] %s is offline, last seen %ld minutes ago.\n", username, ago / 60);
+  return true;
+}
+
+/*
+ * Looks the typed text up as a username prefix and lets the user pick
+ * one of the matches, a page at a time. A username registered exactly
+ * as typed is picked right away, and so is the typed text if the
+ * lookup server can't search. Copies the pick into out, a buffer of
+ * FRAME_NAME_MAX + 1 bytes. Returns false if nothing was picked.
+ */
+
+static bool pick_username(const char *typed, SSL_CTX *ctx, char *out) {
+  char names[SEARCH_PAGE_MAX][FRAME_NAME_MAX + 1];
+  char after[FRAME_NAME_MAX + 1] = { '\0' };
+  while (true) {
+    size_t n_found = 0;
+    bool more = false;
+    int status_code = search_lookup_server(typed, after, ctx, names, &n_found, &more);
+    if (n_found == 0 && status_code != 0) {
+      // Fetching the name as typed still tells whether it exists
+      snprintf(out, FRAME_NAME_MAX + 1, "%s", typed);
+      return true;
+    }
+    if (n_found == 0) {
+      printf("[ERROR] No user starting with '%s' on the lookup server.\n", typed);
+      getchar();
+      return false;
+    }
+    if (after[0] == '\0' && strcmp(names[0], typed) == 0) {
+      memcpy(out, names[0], FRAME_NAME_MAX + 1);
+      return true;
+    }
+
+    for (size_t i = 0; i < n_found; i++) {
+      printf("%lu) %s\n", i + 1, names[i]);
+    }
+    if (more) {
+      puts("- Enter n for more users.");
+    }
+    printf("- Enter 0 to cancel.\n>> ");
+    char choice[16] = { '\0' };
+    if (fgets(choice, sizeof(choice), stdin) == NULL) {
+      return false;
+    }
+    choice[strcspn(choice, "\n")] = 0;
+    if (more && strcmp(choice, "n") == 0) {
+      memcpy(after, names[n_found - 1], sizeof(after));
+      continue;
+    }
+    int index = atoi(choice);
+    if (index < 1 || (size_t) index > n_found) {
+      return false;
+    }
+    memcpy(out, names[index - 1], FRAME_NAME_MAX + 1);
+    return true;
+  }
+}
+
 /*
  * Prints out the header for the CLI. Asserts that
  * the given parameter is not NULL.
@@ -75,10 +146,12 @@ void display_chat_interface(sqlite3 *db, int id, const char *chat_name, const ch
     } else if (strlen(input_buf) > 0) {
       // Send logic
       bool success = false;
-      ip_addr_t lookup_addr = (ip_addr_t) { .family = AF_INET, .addr.v4.s_addr = htonl(LOOKUP_ADDR)};
-      ip_addr_t peer_addr = fetch_user_ip(chat_name, lookup_addr, ctx, &success);
+      int64_t last_seen = 0;
+      ip_addr_t peer_addr = fetch_user_ip(chat_name, ctx, &last_seen, &success);
       
-      if (success) {
+      if (success && peer_offline(chat_name, last_seen)) {
+        getchar();
+      } else if (success) {
         if (send_message(my_username, input_buf, peer_addr, ctx, NULL) == 0) {
           insert_message(db, id, true, input_buf);
           // Refresh messages
@@ -192,26 +265,31 @@ void cli_loop(sqlite3 *db, const char *username, SSL_CTX *ctx) {
 void start_new_chat(sqlite3 *db, const char *my_username, SSL_CTX *ctx) {
   assert(db != NULL && my_username != NULL && ctx != NULL);
 
-  printf(">> Enter username of the person you want to chat with:\n>> ");
-  char target_username[32] = { '\0' };
-  if (fgets(target_username, 31, stdin) == NULL) {
+  printf(">> Enter the username, or the start of it, of the person you want to chat with:\n>> ");
+  char typed_username[32] = { '\0' };
+  if (fgets(typed_username, 31, stdin) == NULL) {
     return;
   }
-  target_username[strcspn(target_username, "\n")] = 0;
+  typed_username[strcspn(typed_username, "\n")] = 0;
 
-  if (strlen(target_username) == 0) {
+  char target_username[32] = { '\0' };
+  if (strlen(typed_username) == 0 || !pick_username(typed_username, ctx, target_username)) {
     return;
   }
 
   bool success = false;
-  ip_addr_t lookup_addr = (ip_addr_t) { .family = AF_INET, .addr.v4.s_addr = htonl(LOOKUP_ADDR)};
-  ip_addr_t peer_addr = fetch_user_ip(target_username, lookup_addr, ctx, &success);
+  int64_t last_seen = 0;
+  ip_addr_t peer_addr = fetch_user_ip(target_username, ctx, &last_seen, &success);
 
   if (!success) {
     printf("[ERROR] User '%s' not found on the lookup server.\n", target_username);
     getchar();
     return;
   }
+  if (peer_offline(target_username, last_seen)) {
+    getchar();
+    return;
+  }
 
   printf(">> Enter your first message to %s:\n>> ", target_username);
   char message[256] = { '\0' };
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+
+#include "cluster.h"
+
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// A registration on its way to its new owner
+typedef struct HandoffEntry {
+  userdata_t data;
+  size_t owner;
+  bool acked;
+} handoff_entry_t;
+
+typedef struct HandoffBatch {
+  cluster_t *cluster;
+  handoff_entry_t entries[HANDOFF_BATCH];
+  size_t n_entries;
+} handoff_batch_t;
+
+static bool node_sockaddr(const ring_node_t *node, struct sockaddr_storage *ss, socklen_t *ss_length) {
+  *ss = (struct sockaddr_storage) { 0 };
+  if (node->addr.family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+    sin->sin_family = AF_INET;
+    sin->sin_addr = node->addr.addr.v4;
+    sin->sin_port = htons(node->port);
+    *ss_length = sizeof(*sin);
+  } else if (node->addr.family == AF_INET6) {
+    struct sockaddr_in6 *sin = (struct sockaddr_in6 *) ss;
+    sin->sin6_family = AF_INET6;
+    sin->sin6_addr = node->addr.addr.v6;
+    sin->sin6_port = htons(node->port);
+    *ss_length = sizeof(*sin);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Returns the index of the node on the ring that is this process: the
+ * first one on this node's port with an address of this host, or -1
+ * if there is none. An address is local if a socket can be bound to
+ * it.
+ */
+
+static long find_self(const ring_t *ring, in_port_t port) {
+  for (size_t i = 0; i < ring->n_nodes; i++) {
+    ring_node_t node = ring->nodes[i];
+    if (node.port != port) {
+      continue;
+    }
+    node.port = 0;
+    struct sockaddr_storage ss;
+    socklen_t ss_length;
+    int fd = socket(node.addr.family, SOCK_DGRAM, 0);
+    bool local = fd >= 0 && node_sockaddr(&node, &ss, &ss_length) && bind(fd, (struct sockaddr *) &ss, ss_length) == 0;
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (local) {
+      return (long) i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Reads the node list from the cluster file and replaces the ring with
+ * it, then starts a handoff of every registration this node doesn't
+ * own anymore. A node missing from the list has left the cluster, it
+ * refuses every registration and hands all of its own off. Must be
+ * called from the thread that runs cluster_handoff(), without the
+ * table lock. Throws an assertion if the cluster is NULL. Returns 0 on
+ * success, -1 if the file can't be read or is invalid, the ring is
+ * left as it was then.
+ */
+
+int cluster_load(cluster_t *cluster) {
+  assert(cluster != NULL);
+  FILE *file = fopen(cluster->filename, "r");
+  if (file == NULL) {
+    log_write(LOG_ERROR, "Could not open the cluster file %s (%d)", cluster->filename, errno);
+    return -1;
+  }
+  char *list = malloc(CLUSTER_FILE_MAX + 1);
+  assert(list != NULL);
+  size_t len = fread(list, 1, CLUSTER_FILE_MAX, file);
+  list[len] = '\0';
+  fclose(file);
+
+  ring_t ring;
+  int result = ring_parse(&ring, list);
+  free(list);
+  if (result != 0) {
+    log_write(LOG_ERROR, "Invalid node list in %s, keeping the current one", cluster->filename);
+    ring_free(&ring);
+    return -1;
+  }
+
+  long self = find_self(&ring, cluster->port);
+  pthread_mutex_lock(&global_table_lock);
+  ring_t old = cluster->ring;
+  cluster->ring = ring;
+  cluster->self = self;
+  pthread_mutex_unlock(&global_table_lock);
+  ring_free(&old);
+
+  if (self == -1) {
+    log_write(LOG_WARNING, "This node is not in %s anymore, handing off every registration", cluster->filename);
+  } else {
+    char name[RING_NODE_STRLEN];
+    ring_node_format(&ring.nodes[self], name);
+    log_write(LOG_INFO, "Cluster of %lu nodes, this node is %s", ring.n_nodes, name);
+  }
+  cluster->handoff_pending = true;
+  cluster->cursor = (table_cursor_t) { 0 };
+  cluster->n_found = 0;
+  cluster->pass_failed = false;
+  cluster->retry_time = 0;
+  memset(cluster->failed, 0, sizeof(cluster->failed));
+  return 0;
+}
+
+/*
+ * Returns true if this node owns the given username, always for a node
+ * that isn't part of a cluster. The caller must hold the table lock or
+ * be the thread that loads the ring. Throws an assertion if any of the
+ * parameters are NULL.
+ */
+
+bool cluster_owns(const cluster_t *cluster, const char *username) {
+  assert(cluster != NULL && username != NULL);
+  if (cluster->ring.n_nodes == 0) {
+    return true;
+  }
+  return cluster->self != -1 && ring_owner(&cluster->ring, username) == (size_t) cluster->self;
+}
+
+/*
+ * Returns true if the peer of the given server side connection is
+ * another node of the cluster, that is it presented the same
+ * certificate as this node. Throws an assertion if the connection is
+ * NULL.
+ */
+
+bool cluster_is_peer(SSL *ssl) {
+  assert(ssl != NULL);
+  X509 *own = SSL_get_certificate(ssl);
+  X509 *peer = SSL_get1_peer_certificate(ssl);
+  bool result = own != NULL && peer != NULL && X509_cmp(own, peer) == 0;
+  X509_free(peer);
+  return result;
+}
+
+// Table visitor, collects the registrations that belong to another reachable node
+static bool collect_moved(const userdata_t *data, void *ctx) {
+  handoff_batch_t *batch = (handoff_batch_t *) ctx;
+  cluster_t *cluster = batch->cluster;
+  if (cluster_owns(cluster, data->username)) {
+    return true;
+  }
+  size_t owner = ring_owner(&cluster->ring, data->username);
+  cluster->n_found++;
+  if (cluster->failed[owner]) {
+    return true;
+  }
+  if (batch->n_entries == HANDOFF_BATCH) {
+    // Visited again by the next call
+    cluster->n_found--;
+    return false;
+  }
+  batch->entries[batch->n_entries++] = (handoff_entry_t) { .data = *data, .owner = owner };
+  return true;
+}
+
+/*
+ * Opens a TLS connection to the given node, blocking calls on it give
+ * up after HANDOFF_TIMEOUT_MS. Throws an assertion if any of the
+ * parameters are NULL. Returns the connection and sets the socket, or
+ * returns NULL on failure.
+ */
+
+SSL *cluster_connect(const ring_node_t *node, SSL_CTX *ctx, int *out_fd) {
+  assert(node != NULL && ctx != NULL && out_fd != NULL);
+  struct sockaddr_storage ss;
+  socklen_t ss_length;
+  if (!node_sockaddr(node, &ss, &ss_length)) {
+    return NULL;
+  }
+  int fd = socket(node->addr.family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct timeval timeout = { .tv_sec = HANDOFF_TIMEOUT_MS / 1000, .tv_usec = HANDOFF_TIMEOUT_MS % 1000 * 1000 };
+  int opt = 1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // Also bounds connect()
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  if (connect(fd, (struct sockaddr *) &ss, ss_length) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  SSL *ssl = SSL_new(ctx);
+  if (ssl == NULL) {
+    close(fd);
+    return NULL;
+  }
+  SSL_set_fd(ssl, fd);
+  if (SSL_connect(ssl) != 1) {
+    SSL_free(ssl);
+    close(fd);
+    return NULL;
+  }
+  *out_fd = fd;
+  return ssl;
+}
+
+/*
+ * Reads the next frame of a blocking connection into out. The buffer
+ * holds 2 * FRAME_SIZE_MAX bytes of which len are already read, the
+ * bytes behind the frame stay in it. Returns 0 on success, -1 if the
+ * connection fails or sends garbage.
+ */
+
+int cluster_read_frame(SSL *ssl, uint8_t *buf, size_t *len, frame_t *out) {
+  while (true) {
+    long frame_len = frame_decode(buf, *len, out);
+    if (frame_len < 0) {
+      return -1;
+    }
+    if (frame_len > 0) {
+      memmove(buf, buf + frame_len, *len - (size_t) frame_len);
+      *len -= (size_t) frame_len;
+      return 0;
+    }
+    int bytes_read = SSL_read(ssl, buf + *len, (int) (FRAME_SIZE_MAX * 2 - *len));
+    if (bytes_read <= 0) {
+      return -1;
+    }
+    *len += (size_t) bytes_read;
+  }
+}
+
+/*
+ * Sends the batch's registrations owned by the given node to it as
+ * pipelined transfer frames and marks the ones it took. Returns 0 on
+ * success, -1 if the node couldn't be reached or refused any of them.
+ */
+
+static int transfer_to(cluster_t *cluster, handoff_batch_t *batch, size_t node) {
+  size_t *indexes = malloc(batch->n_entries * sizeof(size_t));
+  frame_t *frames = malloc(batch->n_entries * sizeof(frame_t));
+  uint8_t *buf = malloc(batch->n_entries * FRAME_SIZE_MAX);
+  assert(indexes != NULL && frames != NULL && buf != NULL);
+
+  size_t n_indexes = 0, n_frames = 0;
+  for (size_t i = 0; i < batch->n_entries; i++) {
+    if (batch->entries[i].owner != node) {
+      continue;
+    }
+    if (n_frames == 0 || frames[n_frames - 1].length + FRAME_TRANSFER_ENTRY_MAX > FRAME_PAYLOAD_MAX) {
+      frame_init(&frames[n_frames++], FRAME_OP_TRANSFER, FRAME_STATUS_OK);
+    }
+    const userdata_t *data = &batch->entries[i].data;
+    frame_t *frame = &frames[n_frames - 1];
+    frame_put_name(frame, data->username);
+    frame_put_addr(frame, &data->ip);
+    frame_put_u32(frame, (uint32_t) data->lease_expiry);
+    frame_put_u32(frame, (uint32_t) data->last_seen);
+    indexes[n_indexes++] = i;
+  }
+
+  size_t len = 0;
+  for (size_t i = 0; i < n_frames; i++) {
+    len += frame_encode(&frames[i], buf + len);
+  }
+  int fd = -1;
+  SSL *ssl = cluster_connect(&cluster->ring.nodes[node], cluster->ctx, &fd);
+  int result = ssl != NULL && SSL_write(ssl, buf, (int) len) == (int) len ? 0 : -1;
+
+  // Replies carry one status per registration, in request order
+  uint8_t in[FRAME_SIZE_MAX * 2];
+  size_t in_len = 0;
+  size_t next = 0;
+  frame_t reply;
+  for (size_t i = 0; i < n_frames && result == 0; i++) {
+    if (cluster_read_frame(ssl, in, &in_len, &reply) != 0 || reply.status != FRAME_STATUS_OK) {
+      result = -1;
+      break;
+    }
+    for (size_t j = 0; j < reply.length && next < n_indexes; j++, next++) {
+      if (reply.payload[j] == FRAME_STATUS_OK) {
+        batch->entries[indexes[next]].acked = true;
+      } else {
+        result = -1;
+      }
+    }
+  }
+  if (ssl != NULL) {
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+  }
+  free(indexes);
+  free(frames);
+  free(buf);
+  return result;
+}
+
+/*
+ * Collects up to HANDOFF_BATCH registrations this node doesn't own,
+ * sends them to their owners and deletes the ones the owners took.
+ * The table lock is only held while collecting and deleting, never
+ * while talking to the other nodes. Ends the pass once the cursor is
+ * past the table.
+ */
+
+static void handoff_batch(cluster_t *cluster, hashtable_t *ht, int64_t now) {
+  handoff_batch_t *batch = malloc(sizeof(handoff_batch_t));
+  assert(batch != NULL);
+  batch->cluster = cluster;
+  batch->n_entries = 0;
+  pthread_mutex_lock(&global_table_lock);
+  bool more = table_scan(ht, &cluster->cursor, HANDOFF_SCAN_SLOTS, collect_moved, batch);
+  pthread_mutex_unlock(&global_table_lock);
+
+  // Only this thread replaces the ring, it can be read without the lock here
+  bool sent[RING_MAX_NODES] = { false };
+  for (size_t i = 0; i < batch->n_entries; i++) {
+    size_t node = batch->entries[i].owner;
+    if (sent[node]) {
+      continue;
+    }
+    sent[node] = true;
+    if (transfer_to(cluster, batch, node) != 0) {
+      char name[RING_NODE_STRLEN];
+      ring_node_format(&cluster->ring.nodes[node], name);
+      log_write(LOG_WARNING, "Could not hand registrations off to %s, retrying in %d seconds",
+                name, HANDOFF_RETRY_SECONDS);
+      cluster->failed[node] = true;
+      cluster->pass_failed = true;
+    }
+  }
+
+  size_t n_acked = 0;
+  pthread_mutex_lock(&global_table_lock);
+  table_write_begin(ht);
+  for (size_t i = 0; i < batch->n_entries; i++) {
+    if (batch->entries[i].acked) {
+      delete_data(ht, batch->entries[i].data.username);
+      n_acked++;
+    }
+  }
+  table_write_end(ht);
+  pthread_mutex_unlock(&global_table_lock);
+  cluster->n_handed_off += n_acked;
+  cluster->n_handoff_failures += batch->n_entries - n_acked;
+  free(batch);
+
+  if (more) {
+    return;
+  }
+  if (cluster->n_found == 0) {
+    cluster->handoff_pending = false;
+    log_write(LOG_INFO, "Handoff finished, %lu registrations handed off so far", cluster->n_handed_off);
+    return;
+  }
+  // The owners of some registrations couldn't be reached or refused them
+  if (cluster->pass_failed) {
+    cluster->retry_time = now + HANDOFF_RETRY_SECONDS;
+  }
+  cluster->cursor = (table_cursor_t) { 0 };
+  cluster->n_found = 0;
+  cluster->pass_failed = false;
+  memset(cluster->failed, 0, sizeof(cluster->failed));
+}
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Runs a pending handoff for up to HANDOFF_BUDGET_MS, meant to run once
+ * per maintenance pass, see handoff_batch(). A node that can't be
+ * reached is skipped for the rest of the pass and the pass is repeated
+ * after HANDOFF_RETRY_SECONDS, the handoff is done once a pass finds
+ * nothing to move. Throws an assertion if any of the parameters are
+ * NULL.
+ */
+
+void cluster_handoff(cluster_t *cluster, hashtable_t *ht, int64_t now) {
+  assert(cluster != NULL && ht != NULL);
+  int64_t deadline_ms = now_ms() + HANDOFF_BUDGET_MS;
+  while (cluster->handoff_pending && now >= cluster->retry_time && now_ms() < deadline_ms) {
+    handoff_batch(cluster, ht, now);
+  }
+}
+
+
+void cluster_free(cluster_t *cluster) {
+  if (cluster == NULL) {
+    return;
+  }
+  ring_free(&cluster->ring);
+  if (cluster->ctx != NULL) {
+    SSL_CTX_free(cluster->ctx);
+  }
+  cluster->ctx = NULL;
+}
@@ -0,0 +1,68 @@
+#ifndef CHAT_CLUSTER_H
+#define CHAT_CLUSTER_H
+
+#include "frame.h"
+#include "hashtable.h"
+#include "ring.h"
+
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Registrations collected and handed off to their new owners at once
+#define HANDOFF_BATCH (256)
+// Slots looked through for a batch while holding the table lock
+#define HANDOFF_SCAN_SLOTS (1 << 16)
+// Batches are handed off for this long per maintenance pass
+#define HANDOFF_BUDGET_MS (250)
+// A pass that couldn't reach every owner is repeated after this long
+#define HANDOFF_RETRY_SECONDS (5)
+// Handoff connections give up on a node that doesn't answer in time
+#define HANDOFF_TIMEOUT_MS (2000)
+#define CLUSTER_FILE_MAX (64 * 1024)
+
+/*
+ * Membership of a lookup node in a cluster. The usernames are split
+ * over the nodes by a consistent-hash ring, a node only takes
+ * registrations it owns and hands the ones it doesn't own anymore off
+ * to their new owners after a membership change.
+ */
+typedef struct Cluster {
+  // The node list is read from here, empty for a node that runs alone
+  char filename[256];
+  in_port_t port;
+  // Replaced under the table lock, request handlers read it holding it
+  ring_t ring;
+  // This node's index in the ring, -1 once it left the cluster
+  long self;
+  // Presents the lookup certificate to the other nodes
+  SSL_CTX *ctx;
+  bool handoff_pending;
+  table_cursor_t cursor;
+  // Registrations of the current pass that belong to another node
+  size_t n_found;
+  // Nodes that failed a handoff in the current pass are skipped
+  bool failed[RING_MAX_NODES];
+  bool pass_failed;
+  int64_t retry_time;
+  size_t n_handed_off;
+  size_t n_handoff_failures;
+} cluster_t;
+
+int cluster_load(cluster_t *);
+
+bool cluster_owns(const cluster_t *, const char *);
+
+bool cluster_is_peer(SSL *);
+
+void cluster_handoff(cluster_t *, hashtable_t *, int64_t);
+
+SSL *cluster_connect(const ring_node_t *, SSL_CTX *, int *);
+
+int cluster_read_frame(SSL *, uint8_t *, size_t *, frame_t *);
+
+void cluster_free(cluster_t *);
+
+#endif
@@ -0,0 +1,184 @@
+#include "datagram.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+static void put_header(uint8_t *out, uint8_t status, uint32_t id) {
+  uint32_t be = htonl(id);
+  out[0] = DATAGRAM_MAGIC;
+  out[1] = DATAGRAM_VERSION;
+  out[2] = DATAGRAM_OP_FETCH;
+  out[3] = status;
+  memcpy(out + 4, &be, sizeof(be));
+}
+
+static uint32_t get_id(const uint8_t *buf) {
+  uint32_t be;
+  memcpy(&be, buf + 4, sizeof(be));
+  return ntohl(be);
+}
+
+/*
+ * Encodes a fetch query for the given username into the given buffer
+ * of DATAGRAM_QUERY_SIZE bytes. Throws an assertion if any of the
+ * pointers are NULL. Returns the size of the query, 0 if the name is
+ * empty or longer than FRAME_NAME_MAX.
+ */
+
+size_t datagram_encode_query(uint32_t id, const char *username, uint8_t *out) {
+  assert(username != NULL && out != NULL);
+  size_t len = strlen(username);
+  if (len == 0 || len > FRAME_NAME_MAX) {
+    return 0;
+  }
+  memset(out, 0, DATAGRAM_QUERY_SIZE);
+  put_header(out, FRAME_STATUS_OK, id);
+  out[DATAGRAM_HEADER_SIZE] = (uint8_t) len;
+  memcpy(out + DATAGRAM_HEADER_SIZE + 1, username, len);
+  return DATAGRAM_QUERY_SIZE;
+}
+
+/*
+ * Decodes the fetch query in the given datagram into its id and the
+ * username, a buffer of FRAME_NAME_MAX + 1 bytes. Queries shorter than
+ * DATAGRAM_QUERY_SIZE are not answered, or the server would send more
+ * than it received. Throws an assertion if any of the pointers are
+ * NULL. Returns 0 for a valid query, 1 for a query of another version,
+ * which only gets its header back, and -1 for anything else.
+ */
+
+int datagram_decode_query(const uint8_t *buf, size_t len, uint32_t *id, char *username) {
+  assert(buf != NULL && id != NULL && username != NULL);
+  if (len < DATAGRAM_HEADER_SIZE || buf[0] != DATAGRAM_MAGIC) {
+    return -1;
+  }
+  *id = get_id(buf);
+  if (buf[1] != DATAGRAM_VERSION) {
+    return 1;
+  }
+  if (len < DATAGRAM_QUERY_SIZE || buf[2] != DATAGRAM_OP_FETCH) {
+    return -1;
+  }
+  size_t name_len = buf[DATAGRAM_HEADER_SIZE];
+  if (name_len == 0 || name_len > FRAME_NAME_MAX) {
+    return -1;
+  }
+  memcpy(username, buf + DATAGRAM_HEADER_SIZE + 1, name_len);
+  username[name_len] = '\0';
+  return memchr(username, '\0', name_len) == NULL ? 0 : -1;
+}
+
+/*
+ * Encodes the username, address, last-seen time and expiry of the
+ * given answer into its bytes and signs them with the given key.
+ * Throws an assertion if any of the parameters are NULL. Returns
+ * false if the key can't sign or its signature doesn't fit.
+ */
+
+bool datagram_sign(datagram_answer_t *answer, EVP_PKEY *key) {
+  assert(answer != NULL && key != NULL);
+  frame_t body;
+  frame_init(&body, DATAGRAM_OP_FETCH, FRAME_STATUS_OK);
+  frame_put_u32(&body, answer->expires);
+  frame_put_u32(&body, answer->last_seen);
+  if (!frame_put_name(&body, answer->username)) {
+    return false;
+  }
+  frame_put_addr(&body, answer->ip.family != AF_UNSPEC ? &answer->ip : NULL);
+
+  uint8_t signature[DATAGRAM_SIGNATURE_MAX];
+  size_t signature_len = sizeof(signature);
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  bool ok = md != NULL && (size_t) EVP_PKEY_get_size(key) <= DATAGRAM_SIGNATURE_MAX
+         && EVP_DigestSignInit(md, NULL, EVP_sha256(), NULL, key) == 1
+         && EVP_DigestSignUpdate(md, DATAGRAM_CONTEXT, strlen(DATAGRAM_CONTEXT)) == 1
+         && EVP_DigestSignUpdate(md, body.payload, body.length) == 1
+         && EVP_DigestSignFinal(md, signature, &signature_len) == 1;
+  EVP_MD_CTX_free(md);
+  if (!ok) {
+    return false;
+  }
+
+  memcpy(answer->bytes, body.payload, body.length);
+  answer->signed_len = body.length;
+  answer->bytes[body.length] = (uint8_t) signature_len;
+  memcpy(answer->bytes + body.length + 1, signature, signature_len);
+  answer->len = body.length + 1 + signature_len;
+  return true;
+}
+
+/*
+ * Encodes a reply with the given id and status into the given buffer
+ * of DATAGRAM_QUERY_SIZE bytes, followed by the signed answer if the
+ * status is FRAME_STATUS_OK. Throws an assertion if the buffer is NULL
+ * or an OK reply has no answer. Returns the size of the reply.
+ */
+
+size_t datagram_encode_reply(uint32_t id, uint8_t status, const datagram_answer_t *answer, uint8_t *out) {
+  assert(out != NULL && (status != FRAME_STATUS_OK || answer != NULL));
+  put_header(out, status, id);
+  if (status != FRAME_STATUS_OK) {
+    return DATAGRAM_HEADER_SIZE;
+  }
+  memcpy(out + DATAGRAM_HEADER_SIZE, answer->bytes, answer->len);
+  return DATAGRAM_HEADER_SIZE + answer->len;
+}
+
+/*
+ * Decodes the reply in the given datagram into its id, its status and,
+ * for FRAME_STATUS_OK, the answer. The signature is not checked, see
+ * datagram_verify(). Throws an assertion if any of the pointers are
+ * NULL. Returns false if the datagram isn't a well-formed reply.
+ */
+
+bool datagram_decode_reply(const uint8_t *buf, size_t len, uint32_t *id, uint8_t *status, datagram_answer_t *out) {
+  assert(buf != NULL && id != NULL && status != NULL && out != NULL);
+  if (len < DATAGRAM_HEADER_SIZE || buf[0] != DATAGRAM_MAGIC || buf[2] != DATAGRAM_OP_FETCH) {
+    return false;
+  }
+  *id = get_id(buf);
+  *status = buf[1] == DATAGRAM_VERSION ? buf[3] : FRAME_STATUS_VERSION;
+  if (*status != FRAME_STATUS_OK) {
+    return true;
+  }
+
+  frame_t body;
+  frame_init(&body, DATAGRAM_OP_FETCH, FRAME_STATUS_OK);
+  body.length = len - DATAGRAM_HEADER_SIZE;
+  if (body.length > DATAGRAM_ANSWER_MAX) {
+    return false;
+  }
+  memcpy(body.payload, buf + DATAGRAM_HEADER_SIZE, body.length);
+  size_t offset = 0;
+  if (!frame_get_u32(&body, &offset, &out->expires) || !frame_get_u32(&body, &offset, &out->last_seen)
+      || !frame_get_name(&body, &offset, out->username) || !frame_get_addr(&body, &offset, &out->ip)
+      || offset >= body.length) {
+    return false;
+  }
+  size_t signature_len = body.payload[offset];
+  if (signature_len == 0 || offset + 1 + signature_len != body.length) {
+    return false;
+  }
+  memcpy(out->bytes, body.payload, body.length);
+  out->signed_len = offset;
+  out->len = body.length;
+  return true;
+}
+
+/*
+ * Checks the signature of a decoded answer against the given public
+ * key. Throws an assertion if any of the parameters are NULL. Returns
+ * true if the key signed the answer.
+ */
+
+bool datagram_verify(const datagram_answer_t *answer, EVP_PKEY *key) {
+  assert(answer != NULL && key != NULL);
+  EVP_MD_CTX *md = EVP_MD_CTX_new();
+  bool ok = md != NULL && EVP_DigestVerifyInit(md, NULL, EVP_sha256(), NULL, key) == 1
+         && EVP_DigestVerifyUpdate(md, DATAGRAM_CONTEXT, strlen(DATAGRAM_CONTEXT)) == 1
+         && EVP_DigestVerifyUpdate(md, answer->bytes, answer->signed_len) == 1
+         && EVP_DigestVerifyFinal(md, answer->bytes + answer->signed_len + 1, answer->bytes[answer->signed_len]) == 1;
+  EVP_MD_CTX_free(md);
+  return ok;
+}
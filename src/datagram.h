@@ -0,0 +1,86 @@
+#ifndef CHAT_DATAGRAM_H
+#define CHAT_DATAGRAM_H
+
+#include "frame.h"
+#include "shared_protocol.h"
+
+#include <openssl/evp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Signed fetches over UDP on the lookup port, one datagram per query
+ * and per reply. A query is a 4 byte header (magic, version, opcode,
+ * status), a 4 byte id and a username, zero padded to
+ * DATAGRAM_QUERY_SIZE so that a reply is never larger than the query
+ * it answers. A reply repeats the header and the id, followed by the
+ * answer: a 4 byte expiry and last-seen time (seconds since the
+ * epoch), the username and an address entry like in frame.h, then a
+ * length byte and the lookup key's signature over DATAGRAM_CONTEXT and
+ * the answer. Big endian throughout.
+ */
+
+// Neither a text method char nor FRAME_MAGIC
+#define DATAGRAM_MAGIC (0xC6)
+#define DATAGRAM_VERSION (1)
+#define DATAGRAM_HEADER_SIZE (8)
+#define DATAGRAM_OP_FETCH (1)
+// Signed in front of every answer, so that no other message of the key verifies as one
+#define DATAGRAM_CONTEXT ("chat-cli lookup datagram v1")
+// An ECDSA P-256 signature in DER, keys with longer ones can't sign datagrams
+#define DATAGRAM_SIGNATURE_MAX (72)
+#define DATAGRAM_ANSWER_MAX (4 + 4 + 1 + FRAME_NAME_MAX + 1 + 16 + 1 + DATAGRAM_SIGNATURE_MAX)
+#define DATAGRAM_QUERY_SIZE (DATAGRAM_HEADER_SIZE + DATAGRAM_ANSWER_MAX)
+
+// Answers are signed to be valid this long, and signed anew once half of it is over
+#ifndef DATAGRAM_SIGNATURE_SECONDS
+#define DATAGRAM_SIGNATURE_SECONDS (120)
+#endif
+// Signed answers cached per worker, by username
+#ifndef DATAGRAM_CACHE_SLOTS
+#define DATAGRAM_CACHE_SLOTS (16384)
+#endif
+// Datagrams a worker reads per wakeup
+#define DATAGRAM_BATCH (32)
+// Clients fall back to TLS for the names not answered in time
+#ifndef DATAGRAM_TIMEOUT_MS
+#define DATAGRAM_TIMEOUT_MS (250)
+#endif
+// A client whose queries went unanswered this many times in a row, or
+// were refused by the host, only uses TLS for a while
+#define DATAGRAM_BACKOFF_ROUNDS (3)
+#ifndef DATAGRAM_BACKOFF_SECONDS
+#define DATAGRAM_BACKOFF_SECONDS (60)
+#endif
+// Fetches of more names than this go over TLS right away
+#define DATAGRAM_FETCH_MAX (8)
+
+// One signed answer, as sent after the header and the id
+typedef struct DatagramAnswer {
+  char username[FRAME_NAME_MAX + 1];
+  // AF_UNSPEC if the name isn't registered, lookup servers refuse
+  // misses unsigned instead of signing them
+  ip_addr_t ip;
+  uint32_t last_seen;
+  // The signature is valid until then
+  uint32_t expires;
+  // Signed bytes, the length byte and the signature
+  uint8_t bytes[DATAGRAM_ANSWER_MAX];
+  size_t signed_len;
+  size_t len;
+} datagram_answer_t;
+
+size_t datagram_encode_query(uint32_t, const char *, uint8_t *);
+
+int datagram_decode_query(const uint8_t *, size_t, uint32_t *, char *);
+
+bool datagram_sign(datagram_answer_t *, EVP_PKEY *);
+
+size_t datagram_encode_reply(uint32_t, uint8_t, const datagram_answer_t *, uint8_t *);
+
+bool datagram_decode_reply(const uint8_t *, size_t, uint32_t *, uint8_t *, datagram_answer_t *);
+
+bool datagram_verify(const datagram_answer_t *, EVP_PKEY *);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+ * Epoch based reclamation for lock-free readers. A reader publishes
+ * the global epoch while it holds pointers into shared memory, memory
+ * the writer unlinks is retired with the epoch it was unlinked in and
+ * only freed once every reader has moved past that epoch.
+ */
+
+#include "epoch.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+static _Atomic uint64_t next_id = 1;
+
+/*
+ * Creates an epoch domain without readers. Throws an assertion if a
+ * memory allocation error occurs. Call epoch_free() afterwards to
+ * avoid memory leaks!
+ */
+
+epoch_t *epoch_create() {
+  epoch_t *epoch = aligned_alloc(64, sizeof(epoch_t));
+  assert(epoch != NULL);
+  atomic_init(&epoch->global, 1);
+  epoch->id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+  atomic_init(&epoch->n_readers, 0);
+  for (int i = 0; i < EPOCH_MAX_READERS; i++) {
+    atomic_init(&epoch->readers[i].epoch, 0);
+  }
+  epoch->retired = NULL;
+  epoch->n_retired = 0;
+  return epoch;
+}
+
+/*
+ * Frees the domain and everything still retired in it. No reader may
+ * be inside the domain.
+ */
+
+void epoch_free(epoch_t *epoch) {
+  if (epoch == NULL) {
+    return;
+  }
+  while (epoch->retired != NULL) {
+    epoch_retired_t *next = epoch->retired->next;
+    epoch->retired->free_fn(epoch->retired->ptr);
+    free(epoch->retired);
+    epoch->retired = next;
+  }
+  free(epoch);
+}
+
+/*
+ * Hands out a reader slot, meant to be called once per thread and domain.
+ * Returns -1 if every slot is taken.
+ */
+
+int epoch_register(epoch_t *epoch) {
+  assert(epoch != NULL);
+  int slot = atomic_fetch_add(&epoch->n_readers, 1);
+  return slot < EPOCH_MAX_READERS ? slot : -1;
+}
+
+void epoch_enter(epoch_t *epoch, int slot) {
+  // Sequentially consistent, so the writer can't miss a reader that
+  // goes on to load a pointer the writer is about to retire
+  atomic_store(&epoch->readers[slot].epoch, atomic_load(&epoch->global));
+}
+
+void epoch_exit(epoch_t *epoch, int slot) {
+  atomic_store_explicit(&epoch->readers[slot].epoch, 0, memory_order_release);
+}
+
+/*
+ * Frees the given pointer with the given function once no reader can
+ * hold it anymore. The pointer must already be unreachable for readers
+ * that enter from now on. Must only be called by the writer. Throws an
+ * assertion if a memory allocation error occurs.
+ */
+
+void epoch_retire(epoch_t *epoch, void *ptr, epoch_free_t free_fn) {
+  assert(epoch != NULL && free_fn != NULL);
+  epoch_retired_t *node = malloc(sizeof(epoch_retired_t));
+  assert(node != NULL);
+  node->ptr = ptr;
+  node->free_fn = free_fn;
+  node->epoch = atomic_fetch_add(&epoch->global, 1);
+  node->next = epoch->retired;
+  epoch->retired = node;
+  epoch->n_retired++;
+  epoch_reclaim(epoch);
+}
+
+/*
+ * Frees the retired pointers no reader can hold anymore. Must only be
+ * called by the writer. Returns the number of pointers freed.
+ */
+
+size_t epoch_reclaim(epoch_t *epoch) {
+  assert(epoch != NULL);
+  uint64_t oldest = atomic_load(&epoch->global);
+  int n_readers = atomic_load(&epoch->n_readers);
+  for (int i = 0; i < n_readers && i < EPOCH_MAX_READERS; i++) {
+    uint64_t entered = atomic_load(&epoch->readers[i].epoch);
+    if (entered != 0 && entered < oldest) {
+      oldest = entered;
+    }
+  }
+
+  size_t n_freed = 0;
+  epoch_retired_t **link = &epoch->retired;
+  while (*link != NULL) {
+    epoch_retired_t *node = *link;
+    if (node->epoch < oldest) {
+      *link = node->next;
+      node->free_fn(node->ptr);
+      free(node);
+      n_freed++;
+    } else {
+      link = &node->next;
+    }
+  }
+  epoch->n_retired -= n_freed;
+  return n_freed;
+}
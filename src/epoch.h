@@ -0,0 +1,50 @@
+#ifndef CHAT_EPOCH_H
+#define CHAT_EPOCH_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define EPOCH_MAX_READERS (128)
+
+typedef void (*epoch_free_t)(void *);
+
+typedef struct EpochRetired {
+  struct EpochRetired *next;
+  void *ptr;
+  epoch_free_t free_fn;
+  uint64_t epoch;
+} epoch_retired_t;
+
+// One cache line per reader so that entering doesn't bounce other readers
+typedef struct EpochReader {
+  _Alignas(64) _Atomic uint64_t epoch;
+} epoch_reader_t;
+
+typedef struct Epoch {
+  _Atomic uint64_t global;
+  // Unique per domain, a new one may be allocated where a freed one was
+  uint64_t id;
+  _Atomic int n_readers;
+  // Epoch every reader entered at, 0 while it is outside
+  epoch_reader_t readers[EPOCH_MAX_READERS];
+  // Only touched by the (single) writer
+  epoch_retired_t *retired;
+  size_t n_retired;
+} epoch_t;
+
+epoch_t *epoch_create();
+
+void epoch_free(epoch_t *);
+
+int epoch_register(epoch_t *);
+
+void epoch_enter(epoch_t *, int);
+
+void epoch_exit(epoch_t *, int);
+
+void epoch_retire(epoch_t *, void *, epoch_free_t);
+
+size_t epoch_reclaim(epoch_t *);
+
+#endif
@@ -0,0 +1,247 @@
+#include "frame.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+
+/*
+ * Clears the given frame and sets the current version, the opcode and
+ * the status. Throws an assertion if the frame is NULL.
+ */
+
+void frame_init(frame_t *frame, uint8_t opcode, uint8_t status) {
+  assert(frame != NULL);
+  frame->version = FRAME_VERSION;
+  frame->opcode = opcode;
+  frame->status = status;
+  frame->length = 0;
+}
+
+/*
+ * Decodes the frame at the start of the given bytes. The version is
+ * not checked, that is up to the receiver. Throws an assertion if any
+ * of the parameters are NULL. Returns the size of the frame, 0 if it
+ * isn't complete yet or -1 if the bytes aren't a valid frame.
+ */
+
+long frame_decode(const uint8_t *buf, size_t len, frame_t *out) {
+  assert(buf != NULL && out != NULL);
+  if (len != 0 && buf[0] != FRAME_MAGIC) {
+    return -1;
+  }
+  if (len < FRAME_HEADER_SIZE) {
+    return 0;
+  }
+
+  uint32_t length;
+  memcpy(&length, buf + 4, sizeof(length));
+  length = ntohl(length);
+  if (length > FRAME_PAYLOAD_MAX) {
+    return -1;
+  }
+  if (len < FRAME_HEADER_SIZE + length) {
+    return 0;
+  }
+
+  out->version = buf[1];
+  out->opcode = buf[2];
+  out->status = buf[3];
+  out->length = length;
+  memcpy(out->payload, buf + FRAME_HEADER_SIZE, length);
+  return (long) (FRAME_HEADER_SIZE + length);
+}
+
+/*
+ * Encodes the frame into the given buffer, which must hold at least
+ * FRAME_SIZE_MAX bytes. Throws an assertion if any of the parameters
+ * are NULL. Returns the number of bytes written.
+ */
+
+size_t frame_encode(const frame_t *frame, uint8_t *out) {
+  assert(frame != NULL && out != NULL && frame->length <= FRAME_PAYLOAD_MAX);
+  uint32_t length = htonl(frame->length);
+  out[0] = FRAME_MAGIC;
+  out[1] = frame->version;
+  out[2] = frame->opcode;
+  out[3] = frame->status;
+  memcpy(out + 4, &length, sizeof(length));
+  memcpy(out + FRAME_HEADER_SIZE, frame->payload, frame->length);
+  return FRAME_HEADER_SIZE + frame->length;
+}
+
+static bool frame_put(frame_t *frame, const void *data, size_t len) {
+  if (frame->length + len > FRAME_PAYLOAD_MAX) {
+    return false;
+  }
+  memcpy(frame->payload + frame->length, data, len);
+  frame->length += len;
+  return true;
+}
+
+/*
+ * Appends a username to the payload. Throws an assertion if any of the
+ * parameters are NULL. Returns false if the name is empty, longer than
+ * FRAME_NAME_MAX or doesn't fit anymore.
+ */
+
+bool frame_put_name(frame_t *frame, const char *name) {
+  assert(frame != NULL && name != NULL);
+  size_t len = strlen(name);
+  if (len == 0 || len > FRAME_NAME_MAX || frame->length + 1 + len > FRAME_PAYLOAD_MAX) {
+    return false;
+  }
+  uint8_t len_byte = (uint8_t) len;
+  return frame_put(frame, &len_byte, 1) && frame_put(frame, name, len);
+}
+
+/*
+ * Reads the username at the given payload offset into the given buffer
+ * of FRAME_NAME_MAX + 1 bytes and advances the offset. Throws an
+ * assertion if any of the parameters are NULL. Returns false at the
+ * end of the payload or if the entry is malformed.
+ */
+
+bool frame_get_name(const frame_t *frame, size_t *offset, char *out) {
+  assert(frame != NULL && offset != NULL && out != NULL);
+  if (*offset >= frame->length) {
+    return false;
+  }
+  size_t len = frame->payload[*offset];
+  if (len == 0 || len > FRAME_NAME_MAX || *offset + 1 + len > frame->length) {
+    return false;
+  }
+  memcpy(out, frame->payload + *offset + 1, len);
+  out[len] = '\0';
+  // Names are C strings on both ends
+  if (memchr(out, '\0', len) != NULL) {
+    return false;
+  }
+  *offset += 1 + len;
+  return true;
+}
+
+/*
+ * Appends an address entry to the payload, FRAME_ADDR_NONE for a
+ * NULL address. Throws an assertion if the frame is NULL. Returns
+ * false if the entry doesn't fit anymore.
+ */
+
+bool frame_put_addr(frame_t *frame, const ip_addr_t *addr) {
+  assert(frame != NULL);
+  uint8_t family = FRAME_ADDR_NONE;
+  if (addr != NULL && addr->family == AF_INET) {
+    family = FRAME_ADDR_V4;
+  } else if (addr != NULL && addr->family == AF_INET6) {
+    family = FRAME_ADDR_V6;
+  }
+  size_t addr_len = family == FRAME_ADDR_V4 ? 4 : family == FRAME_ADDR_V6 ? 16 : 0;
+  if (frame->length + 1 + addr_len > FRAME_PAYLOAD_MAX) {
+    return false;
+  }
+  frame_put(frame, &family, 1);
+  if (family == FRAME_ADDR_V4) {
+    frame_put(frame, &addr->addr.v4, addr_len);
+  } else if (family == FRAME_ADDR_V6) {
+    frame_put(frame, &addr->addr.v6, addr_len);
+  }
+  return true;
+}
+
+/*
+ * Reads the address entry at the given payload offset and advances
+ * the offset. A FRAME_ADDR_NONE entry yields an address with family
+ * AF_UNSPEC. Throws an assertion if any of the parameters are NULL.
+ * Returns false at the end of the payload or if the entry is malformed.
+ */
+
+bool frame_get_addr(const frame_t *frame, size_t *offset, ip_addr_t *out) {
+  assert(frame != NULL && offset != NULL && out != NULL);
+  if (*offset >= frame->length) {
+    return false;
+  }
+  uint8_t family = frame->payload[*offset];
+  size_t addr_len = family == FRAME_ADDR_V4 ? 4 : family == FRAME_ADDR_V6 ? 16 : 0;
+  if ((family != FRAME_ADDR_NONE && addr_len == 0) || *offset + 1 + addr_len > frame->length) {
+    return false;
+  }
+
+  ip_addr_t result = { 0 };
+  result.family = AF_UNSPEC;
+  if (family == FRAME_ADDR_V4) {
+    result.family = AF_INET;
+    memcpy(&result.addr.v4, frame->payload + *offset + 1, addr_len);
+  } else if (family == FRAME_ADDR_V6) {
+    result.family = AF_INET6;
+    memcpy(&result.addr.v6, frame->payload + *offset + 1, addr_len);
+  }
+  *out = result;
+  *offset += 1 + addr_len;
+  return true;
+}
+
+/*
+ * Appends a status byte to the payload. Throws an assertion if the
+ * frame is NULL. Returns false if it doesn't fit anymore.
+ */
+
+bool frame_put_status(frame_t *frame, uint8_t status) {
+  assert(frame != NULL);
+  return frame_put(frame, &status, 1);
+}
+
+/*
+ * Appends a big endian uint32 to the payload. Throws an assertion if
+ * the frame is NULL. Returns false if it doesn't fit anymore.
+ */
+
+bool frame_put_u32(frame_t *frame, uint32_t value) {
+  assert(frame != NULL);
+  uint32_t be = htonl(value);
+  return frame_put(frame, &be, sizeof(be));
+}
+
+/*
+ * Reads the big endian uint32 at the given payload offset and advances
+ * the offset. Throws an assertion if any of the parameters are NULL.
+ * Returns false if the payload ends before it.
+ */
+
+bool frame_get_u32(const frame_t *frame, size_t *offset, uint32_t *out) {
+  assert(frame != NULL && offset != NULL && out != NULL);
+  if (*offset + sizeof(uint32_t) > frame->length) {
+    return false;
+  }
+  uint32_t be;
+  memcpy(&be, frame->payload + *offset, sizeof(be));
+  *out = ntohl(be);
+  *offset += sizeof(be);
+  return true;
+}
+
+/*
+ * Appends a big endian uint64 to the payload. Throws an assertion if
+ * the frame is NULL. Returns false if it doesn't fit anymore.
+ */
+
+bool frame_put_u64(frame_t *frame, uint64_t value) {
+  assert(frame != NULL);
+  return frame_put_u32(frame, (uint32_t) (value >> 32)) && frame_put_u32(frame, (uint32_t) value);
+}
+
+/*
+ * Reads the big endian uint64 at the given payload offset and advances
+ * the offset. Throws an assertion if any of the parameters are NULL.
+ * Returns false if the payload ends before it.
+ */
+
+bool frame_get_u64(const frame_t *frame, size_t *offset, uint64_t *out) {
+  assert(frame != NULL && offset != NULL && out != NULL);
+  uint32_t high = 0, low = 0;
+  if (*offset + sizeof(uint64_t) > frame->length) {
+    return false;
+  }
+  frame_get_u32(frame, offset, &high);
+  frame_get_u32(frame, offset, &low);
+  *out = (uint64_t) high << 32 | low;
+  return true;
+}
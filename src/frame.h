@@ -0,0 +1,113 @@
+#ifndef CHAT_FRAME_H
+#define CHAT_FRAME_H
+
+#include "shared_protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary lookup frames: an 8 byte header (magic, version, opcode,
+ * status, payload length as a big endian uint32) and the payload.
+ * Usernames are sent as a length byte and the name, addresses as a
+ * family byte and the raw 4 or 16 address bytes.
+ */
+
+// Never a text method char, so the first byte tells both protocols apart
+#define FRAME_MAGIC (0xC5)
+#define FRAME_VERSION (2)
+#define FRAME_HEADER_SIZE (8)
+#define FRAME_NAME_MAX (31)
+#define FRAME_PAYLOAD_MAX (LOOKUP_BATCH_MAX * (1 + FRAME_NAME_MAX))
+#define FRAME_SIZE_MAX (FRAME_HEADER_SIZE + FRAME_PAYLOAD_MAX)
+
+// Payload: names. Reply: one address entry and a 4 byte last-seen time
+// (seconds since the epoch, 0 if unknown) per name
+#define FRAME_OP_FETCH (1)
+#define FRAME_FETCH_ENTRY_MAX (1 + 16 + 4)
+// Payload: names. Reply: one status byte per name
+#define FRAME_OP_UPDATE (2)
+// Cluster nodes only. Payload: a name, an address, a 4 byte lease
+// expiry and a 4 byte last-seen time per registration. Reply: one
+// status byte per registration
+#define FRAME_OP_TRANSFER (3)
+#define FRAME_TRANSFER_ENTRY_MAX (1 + FRAME_NAME_MAX + 1 + 16 + 4 + 4)
+// A one byte name with an IPv4 address
+#define FRAME_TRANSFER_ENTRY_MIN (2 + 1 + 4 + 4 + 4)
+// Followers only, turns the connection into a replication stream, see
+// replication.h. Payload: the follower's 8 byte stream id and the 8 byte
+// sequence number it continues from. Reply: the leader's stream id, the
+// sequence number the stream starts at and a byte set if a snapshot
+// comes first
+#define FRAME_OP_REPLICATE (4)
+// Leader to follower. Payload: entries like FRAME_OP_TRANSFER, an empty
+// payload ends the snapshot
+#define FRAME_OP_SNAPSHOT (5)
+// Leader to follower. Payload: the 8 byte sequence number of the first
+// change, the 8 byte wall clock time in microseconds the last one was
+// made at, then per change its op byte and a name, for updates followed
+// by an entry like FRAME_OP_TRANSFER's and for heartbeats by a 4 byte
+// last-seen time. Sent empty when there are no changes
+#define FRAME_OP_CHANGES (6)
+#define FRAME_CHANGES_HEADER (8 + 8)
+#define FRAME_CHANGE_ENTRY_MAX (1 + FRAME_TRANSFER_ENTRY_MAX)
+// Followers only. Payload: an address, then names to register at it.
+// Reply: one status byte per name
+#define FRAME_OP_FORWARD (7)
+// Payload: names registered at the sender's address that are online.
+// Reply: one status byte per name, FRAME_STATUS_ERROR for a name that
+// isn't registered there and has to be updated
+#define FRAME_OP_HEARTBEAT (8)
+// Followers only. Like FRAME_OP_FORWARD, for heartbeats
+#define FRAME_OP_FORWARD_HEARTBEAT (9)
+// Payload: a page size byte (1 to SEARCH_PAGE_MAX), a name prefix and
+// optionally the last name of the previous page. Reply: a byte set if
+// more names match, then the registered names with the prefix in order,
+// from past the given name on, up to a page of them
+#define FRAME_OP_SEARCH (10)
+
+#define FRAME_STATUS_OK (0)
+#define FRAME_STATUS_ERROR (1)
+// Sent once before closing if the server doesn't speak the client's version
+#define FRAME_STATUS_VERSION (2)
+// Per name: another node of the cluster owns the name, see ring.h
+#define FRAME_STATUS_MOVED (3)
+
+#define FRAME_ADDR_NONE (0)
+#define FRAME_ADDR_V4 (4)
+#define FRAME_ADDR_V6 (6)
+
+typedef struct Frame {
+  uint8_t version;
+  uint8_t opcode;
+  uint8_t status;
+  uint32_t length;
+  uint8_t payload[FRAME_PAYLOAD_MAX];
+} frame_t;
+
+void frame_init(frame_t *, uint8_t, uint8_t);
+
+long frame_decode(const uint8_t *, size_t, frame_t *);
+
+size_t frame_encode(const frame_t *, uint8_t *);
+
+bool frame_put_name(frame_t *, const char *);
+
+bool frame_get_name(const frame_t *, size_t *, char *);
+
+bool frame_put_addr(frame_t *, const ip_addr_t *);
+
+bool frame_get_addr(const frame_t *, size_t *, ip_addr_t *);
+
+bool frame_put_status(frame_t *, uint8_t);
+
+bool frame_put_u32(frame_t *, uint32_t);
+
+bool frame_get_u32(const frame_t *, size_t *, uint32_t *);
+
+bool frame_put_u64(frame_t *, uint64_t);
+
+bool frame_get_u64(const frame_t *, size_t *, uint64_t *);
+
+#endif
@@ -0,0 +1,1790 @@
+/*
+ * Hash table behind the lookup server, mapping usernames to addresses.
+ *
+ * The table is split into TABLE_SHARDS shards picked by the top bits
+ * of the username's hash, each one an open addressing table that
+ * grows, shrinks and is migrated on its own. Every slot has a one
+ * byte control tag holding 7 bits of the hash, tags are scanned a
+ * group of 16 at a time and the key is only compared when a tag
+ * matches. Keys and values live in separate arrays: a value packs an
+ * IPv4 address, the lease and the last-seen time into 12 bytes, IPv6
+ * addresses are kept in a small pool of the shard that the value
+ * indexes, and a bitmap tells the two apart. A Bloom filter in front
+ * of every shard answers most misses without probing. Registrations
+ * hold a lease that a timer wheel expires, and the usernames are kept
+ * in order by a B+ tree next to the shards for prefix searches. Every
+ * mutation is appended to a journal that is replayed on startup, and
+ * to a change log that followers tail. Snapshots are written by a
+ * forked child from its copy-on-write view of the table while the
+ * parent keeps serving. Fetches read the table without locking,
+ * validated by a sequence counter that writers bump, arrays dropped
+ * by a resize are freed once no reader holds them.
+ */
+
+#define _GNU_SOURCE
+
+#include "changelog.h"
+#include "hashtable.h"
+#include "log.h"
+#include "ssl.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// The shard descriptors have to fit in the header page
+static_assert(sizeof(snapshot_header_t) + TABLE_SHARDS * sizeof(snapshot_shard_t) <= SNAPSHOT_DATA_OFFSET);
+static_assert(NAME_KEY_LEN == MAX_USERNAME_LEN, "the name index holds whole usernames");
+
+#define V6_POOL_NONE (UINT32_MAX)
+
+char global_table_filename[256] = { '\0' };
+char global_journal_filename[256] = { '\0' };
+char global_rotated_journal_filename[256] = { '\0' };
+
+pthread_mutex_t global_table_lock = PTHREAD_MUTEX_INITIALIZER;
+// Slot of the calling thread in the epoch domain with the id next to it
+static _Thread_local int reader_slot = -1;
+static _Thread_local uint64_t reader_domain = 0;
+
+static inline bool is_full(int8_t ctrl) {
+  return ctrl >= 0;
+}
+
+/*
+ * Returns a bitmask with bit i set if the i-th control byte
+ * of the group equals the given tag.
+ */
+
+static inline uint32_t group_match(const int8_t *group, int8_t tag) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *) group);
+  return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(tag)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] == tag) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+/*
+ * Returns a bitmask of the slots in the group that are either
+ * empty or deleted, that is, whose control byte has the sign bit set.
+ */
+
+static inline uint32_t group_match_free(const int8_t *group) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *) group);
+  return (uint32_t) _mm_movemask_epi8(ctrl);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] < 0) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+static inline int8_t hash_tag(uint64_t hash) {
+  return (int8_t) (hash & 0x7F);
+}
+
+static inline size_t hash_group(uint64_t hash, size_t n_groups) {
+  return (size_t) (hash >> 7) & (n_groups - 1);
+}
+
+static inline size_t hash_shard(uint64_t hash) {
+  return (size_t) (hash >> (64 - TABLE_SHARD_BITS));
+}
+
+static inline size_t bitmap_words(size_t size) {
+  return (size + 63) / 64;
+}
+
+static inline bool is_v6(const shard_arrays_t *arrays, size_t index) {
+  return (arrays->v6_bits[index / 64] >> (index % 64)) & 1;
+}
+
+static inline void set_v6(shard_arrays_t *arrays, size_t index, bool v6) {
+  uint64_t bit = 1ULL << (index % 64);
+  if (v6) {
+    arrays->v6_bits[index / 64] |= bit;
+  } else {
+    arrays->v6_bits[index / 64] &= ~bit;
+  }
+}
+
+/*
+ * Returns the number of bytes the arrays of a shard of the given
+ * size take up, filter included.
+ */
+
+static size_t arrays_bytes(size_t size) {
+  return size + size * MAX_USERNAME_LEN + size * sizeof(slot_value_t)
+       + bitmap_words(size) * sizeof(uint64_t) + bloom_create_size(size) * (BLOOM_BLOCK_BITS / 8);
+}
+
+/*
+ * Allocates the arrays of a shard of the given size. Returns false if
+ * a memory allocation error occurs, nothing is left allocated then.
+ * Throws an assertion if the size is not a multiple of GROUP_WIDTH.
+ */
+
+static bool allocate_arrays(shard_arrays_t *arrays, size_t size) {
+  assert(arrays != NULL && size % GROUP_WIDTH == 0);
+  shard_arrays_t fresh = { .size = size };
+  fresh.ctrl = aligned_alloc(GROUP_WIDTH, size);
+  fresh.keys = calloc(size, MAX_USERNAME_LEN);
+  fresh.values = calloc(size, sizeof(slot_value_t));
+  fresh.v6_bits = calloc(bitmap_words(size), sizeof(uint64_t));
+  fresh.filter = bloom_create(size);
+  if (fresh.ctrl == NULL || fresh.keys == NULL || fresh.values == NULL || fresh.v6_bits == NULL
+      || fresh.filter.bits == NULL) {
+    free(fresh.ctrl);
+    free(fresh.keys);
+    free(fresh.values);
+    free(fresh.v6_bits);
+    bloom_free(&fresh.filter);
+    return false;
+  }
+  memset(fresh.ctrl, CTRL_EMPTY, size);
+  *arrays = fresh;
+  return true;
+}
+
+/*
+ * Frees the given arrays, or drops their reference to the snapshot
+ * they were mapped from and unmaps it once no arrays use it anymore.
+ */
+
+static void free_arrays(shard_arrays_t *arrays) {
+  if (arrays->mapping != NULL) {
+    if (--arrays->mapping->n_users == 0) {
+      munmap(arrays->mapping->addr, arrays->mapping->size);
+      free(arrays->mapping);
+    }
+  } else {
+    free(arrays->ctrl);
+    free(arrays->keys);
+    free(arrays->values);
+    free(arrays->v6_bits);
+    bloom_free(&arrays->filter);
+  }
+  *arrays = (shard_arrays_t) { 0 };
+}
+
+// The name index counts against the limit, but it never refuses a registration on its own
+static bool within_memory_limit(const hashtable_t *ht, size_t bytes) {
+  size_t index_bytes = ht->names != NULL ? ht->names->memory_used : 0;
+  return ht->memory_limit == 0 || ht->memory_used + index_bytes + bytes <= ht->memory_limit;
+}
+
+/*
+ * Counts a registration the table had to refuse. The reason is logged
+ * at most once per maintenance pass so that a full table doesn't flood
+ * the log.
+ */
+
+static void refuse(hashtable_t *ht, const char *reason) {
+  ht->n_rejected++;
+  if (!ht->full_reported) {
+    log_write(LOG_ERROR, "Refusing new registrations at %lu users: %s", table_count(ht), reason);
+    ht->full_reported = true;
+  }
+}
+
+static void refuse_memory(hashtable_t *ht, size_t bytes) {
+  if (within_memory_limit(ht, bytes)) {
+    refuse(ht, "out of memory");
+    return;
+  }
+  char reason[96];
+  snprintf(reason, sizeof(reason), "the memory limit of %lu MB is reached", ht->memory_limit >> 20);
+  refuse(ht, reason);
+}
+
+/*
+ * Stores the given IPv6 address in the pool of the shard and returns
+ * the index of its entry. A full pool is doubled, the old one is freed
+ * once no lock-free reader can hold it. Returns -1 and refuses the
+ * registration if the pool can't grow.
+ */
+
+static int64_t pool_add(hashtable_t *ht, shard_t *shard, const struct in6_addr *addr) {
+  uint32_t index = shard->v6_free;
+  if (index != V6_POOL_NONE) {
+    memcpy(&shard->v6_free, &shard->v6_pool[index], sizeof(uint32_t));
+    shard->v6_pool[index] = *addr;
+    return index;
+  }
+
+  if (shard->v6_count == shard->v6_capacity) {
+    size_t capacity = shard->v6_capacity != 0 ? shard->v6_capacity * 2 : V6_POOL_INITIAL_SIZE;
+    size_t extra = (capacity - shard->v6_capacity) * sizeof(struct in6_addr);
+    struct in6_addr *pool = within_memory_limit(ht, extra) ? malloc(capacity * sizeof(struct in6_addr)) : NULL;
+    if (pool == NULL) {
+      refuse_memory(ht, extra);
+      return -1;
+    }
+    if (shard->v6_count != 0) {
+      memcpy(pool, shard->v6_pool, shard->v6_count * sizeof(struct in6_addr));
+    }
+    struct in6_addr *retired = shard->v6_pool;
+    shard->v6_pool = pool;
+    shard->v6_capacity = capacity;
+    ht->memory_used += extra;
+    if (retired != NULL && ht->readers != NULL) {
+      epoch_retire(ht->readers, retired, free);
+    } else {
+      free(retired);
+    }
+  }
+  shard->v6_pool[shard->v6_count] = *addr;
+  return (int64_t) shard->v6_count++;
+}
+
+static void pool_remove(shard_t *shard, uint32_t index) {
+  memcpy(&shard->v6_pool[index], &shard->v6_free, sizeof(uint32_t));
+  shard->v6_free = index;
+}
+
+/*
+ * Packs the address and lease of the given data into a slot value,
+ * IPv6 addresses take a new pool entry. Returns -1 if the pool can't
+ * grow, 0 on success.
+ */
+
+static int pack_value(hashtable_t *ht, shard_t *shard, const userdata_t *data, slot_value_t *value) {
+  value->lease_expiry = (uint32_t) data->lease_expiry;
+  value->last_seen = (uint32_t) data->last_seen;
+  if (data->ip.family == AF_INET6) {
+    int64_t index = pool_add(ht, shard, &data->ip.addr.v6);
+    if (index < 0) {
+      return -1;
+    }
+    value->addr = (uint32_t) index;
+  } else {
+    memcpy(&value->addr, &data->ip.addr.v4, sizeof(uint32_t));
+  }
+  return 0;
+}
+
+/*
+ * Copies slot index of the given arrays out into the given data.
+ * Returns false if the slot indexes past the end of the pool, which
+ * only happens to a read that raced a writer.
+ */
+
+static bool unpack_slot(const shard_arrays_t *arrays, size_t index, const struct in6_addr *pool, size_t pool_size,
+                        userdata_t *out) {
+  slot_value_t value = arrays->values[index];
+  *out = (userdata_t) { .lease_expiry = value.lease_expiry, .last_seen = value.last_seen };
+  memcpy(out->username, arrays->keys[index], MAX_USERNAME_LEN);
+  if (is_v6(arrays, index)) {
+    if (value.addr >= pool_size) {
+      return false;
+    }
+    out->ip.family = AF_INET6;
+    out->ip.addr.v6 = pool[value.addr];
+  } else {
+    out->ip.family = AF_INET;
+    memcpy(&out->ip.addr.v4, &value.addr, sizeof(uint32_t));
+  }
+  return true;
+}
+
+/*
+ * Returns a summary of the table over every shard. The caller must
+ * hold the table lock. Throws an assertion if the table is NULL.
+ */
+
+table_stats_t table_stats(const hashtable_t *ht) {
+  assert(ht != NULL);
+  table_stats_t stats = { .memory_used = ht->memory_used };
+  if (ht->names != NULL) {
+    stats.index_memory = ht->names->memory_used;
+  }
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    const shard_t *shard = &ht->shards[i];
+    stats.size += shard->current.size;
+    stats.n_elements += shard->current.n_elements;
+    stats.n_tombstones += shard->current.n_tombstones;
+    if (shard->old != NULL) {
+      stats.n_elements += shard->old->n_elements;
+      stats.n_resizing++;
+    }
+    if (shard->current.size > stats.largest_shard) {
+      stats.largest_shard = shard->current.size;
+    }
+  }
+  return stats;
+}
+
+/*
+ * Prints a summary of the current state of the hashtable.
+ * Throws an assertion if the given hashtable pointer
+ * is NULL.
+ */
+
+void print_table(const hashtable_t *ht) {
+  assert(ht != NULL);
+  table_stats_t stats = table_stats(ht);
+  puts("[Info] Printing the current hash table...");
+  puts("------------------------");
+  printf("> Table Size: %lu slots in %d shards, largest %lu\n", stats.size, TABLE_SHARDS, stats.largest_shard);
+  printf("> Number of Entries: %lu\n", stats.n_elements);
+  printf("> Load factor: %lf\n", stats.n_elements / (double) stats.size);
+  printf("> Memory: %.1lf MB\n", stats.memory_used / (1024.0 * 1024.0));
+  if (stats.n_resizing != 0) {
+    printf("> Resizing: %lu shards\n", stats.n_resizing);
+  }
+  printf("> Filter rejects: %lu\n", ht->n_filter_rejects);
+  printf("> Filter false positives: %lu\n", ht->n_filter_false_positives);
+  printf("> Tombstones: %lu\n", stats.n_tombstones);
+  printf("> Average probe length: %.3lf groups\n", average_probe_length(ht));
+  printf("> Expired leases: %lu\n", ht->n_expired);
+  printf("> Refused registrations: %lu\n", ht->n_rejected);
+  printf("> Snapshots: %lu written, %lu failed\n", ht->snapshot.n_written, ht->snapshot.n_failed);
+  puts("------------------------");
+}
+
+/*
+ * Generates and populates the global table and journal filenames.
+ * A node serving another port than LOOKUP_PORT keeps its files in a
+ * directory of its own, so that several nodes can share a host.
+ * Must be called only once in the program.
+ */
+
+void generate_table_filename(in_port_t port) {
+  const char *home_dir = getenv("HOME");
+  char dir[224] = { '\0' };
+  snprintf(dir, sizeof(dir), "%s%s", home_dir, DATA_DIR);
+  mkdir(dir, 0755);
+  if (port != LOOKUP_PORT) {
+    size_t len = strlen(dir);
+    snprintf(dir + len, sizeof(dir) - len, "/%u", port);
+    mkdir(dir, 0755);
+  }
+
+  snprintf(global_table_filename, sizeof(global_table_filename), "%s%s", dir, STORAGE_FILE);
+  snprintf(global_journal_filename, sizeof(global_journal_filename), "%s%s", dir, JOURNAL_FILE);
+  snprintf(global_rotated_journal_filename, sizeof(global_rotated_journal_filename), "%s%s",
+           dir, ROTATED_JOURNAL_FILE);
+}
+
+/*
+ * Checksums the given bytes 8 at a time using four independent lanes,
+ * fast enough to verify a snapshot at memory bandwidth.
+ */
+
+static uint64_t snapshot_checksum(const uint8_t *data, size_t len) {
+  uint64_t lanes[4] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL };
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    for (int lane = 0; lane < 4; lane++) {
+      uint64_t word;
+      memcpy(&word, data + i + lane * 8, sizeof(word));
+      lanes[lane] = (lanes[lane] ^ word) * 0x100000001B3ULL;
+      lanes[lane] ^= lanes[lane] >> 29;
+    }
+  }
+  uint64_t hash = lanes[0] ^ (lanes[1] << 1) ^ (lanes[2] << 2) ^ (lanes[3] << 3) ^ len;
+  for (; i < len; i++) {
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+typedef struct SnapshotSection {
+  size_t offset;
+  size_t len;
+} snapshot_section_t;
+
+#define SHARD_SECTIONS (6)
+
+/*
+ * Computes where the sections of a shard with the given description
+ * live in a snapshot when the shard starts at offset: control bytes,
+ * keys, values, IPv6 bits, filter and IPv6 pool, every one cache line
+ * aligned. Returns the offset past the last section.
+ */
+
+static size_t shard_layout(size_t offset, const snapshot_shard_t *desc, snapshot_section_t *sections) {
+  size_t lens[SHARD_SECTIONS] = {
+    desc->size,
+    desc->size * MAX_USERNAME_LEN,
+    desc->size * sizeof(slot_value_t),
+    bitmap_words(desc->size) * sizeof(uint64_t),
+    desc->filter_blocks * (BLOOM_BLOCK_BITS / 8),
+    desc->v6_count * sizeof(struct in6_addr),
+  };
+  for (int i = 0; i < SHARD_SECTIONS; i++) {
+    sections[i].offset = (offset + 63) / 64 * 64;
+    sections[i].len = lens[i];
+    offset = sections[i].offset + lens[i];
+  }
+  return offset;
+}
+
+// The sections of a shard in memory, in the order of shard_layout()
+static void shard_section_data(const shard_t *shard, const void **data) {
+  data[0] = shard->current.ctrl;
+  data[1] = shard->current.keys;
+  data[2] = shard->current.values;
+  data[3] = shard->current.v6_bits;
+  data[4] = shard->current.filter.bits;
+  data[5] = shard->v6_pool;
+}
+
+static uint64_t fold_checksum(uint64_t checksum, const void *data, size_t len) {
+  return ((checksum << 1) | (checksum >> 63)) ^ snapshot_checksum((const uint8_t *) data, len);
+}
+
+static bool write_all(FILE *file, const void *data, size_t len) {
+  return len == 0 || fwrite(data, len, 1, file) == 1;
+}
+
+static bool write_padding(FILE *file, size_t from, size_t to) {
+  static const uint8_t zeros[SNAPSHOT_DATA_OFFSET] = { 0 };
+  return write_all(file, zeros, to - from);
+}
+
+/*
+ * Writes a snapshot of the given hash table into the given file: a
+ * versioned, checksummed header and one descriptor per shard, followed
+ * by the sections of every shard exactly as they are laid out in
+ * memory, so that map_snapshot() can map them back without rehashing.
+ * Pending resizes must be finished. Returns the number of bytes
+ * written, or 0 if a write error occurs.
+ */
+
+static size_t write_snapshot(const hashtable_t *ht, FILE *file) {
+  snapshot_header_t header = {
+    .version = SNAPSHOT_VERSION,
+    .n_shards = TABLE_SHARDS,
+    .key_size = MAX_USERNAME_LEN,
+    .value_size = sizeof(slot_value_t),
+  };
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  snapshot_shard_t descs[TABLE_SHARDS];
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    const shard_t *shard = &ht->shards[i];
+    descs[i] = (snapshot_shard_t) {
+      .size = shard->current.size,
+      .n_elements = shard->current.n_elements,
+      .n_tombstones = shard->current.n_tombstones,
+      .filter_blocks = shard->current.filter.n_blocks,
+      .v6_count = shard->v6_count,
+      .v6_free = shard->v6_free,
+    };
+  }
+
+  // Same byte stream as on disk, minus the header and padding contents
+  snapshot_section_t sections[SHARD_SECTIONS];
+  const void *data[SHARD_SECTIONS];
+  size_t offset = SNAPSHOT_DATA_OFFSET;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    offset = shard_layout(offset, &descs[i], sections);
+    shard_section_data(&ht->shards[i], data);
+    for (int j = 0; j < SHARD_SECTIONS; j++) {
+      header.checksum = fold_checksum(header.checksum, data[j], sections[j].len);
+    }
+  }
+  size_t total = offset;
+
+  bool ok = write_all(file, &header, sizeof(header))
+         && write_all(file, descs, sizeof(descs))
+         && write_padding(file, sizeof(header) + sizeof(descs), SNAPSHOT_DATA_OFFSET);
+  offset = SNAPSHOT_DATA_OFFSET;
+  for (size_t i = 0; i < TABLE_SHARDS && ok; i++) {
+    shard_layout(offset, &descs[i], sections);
+    shard_section_data(&ht->shards[i], data);
+    for (int j = 0; j < SHARD_SECTIONS && ok; j++) {
+      ok = write_padding(file, offset, sections[j].offset) && write_all(file, data[j], sections[j].len);
+      offset = sections[j].offset + sections[j].len;
+    }
+  }
+  return ok && fflush(file) == 0 ? total : 0;
+}
+
+/*
+ * Writes the given hash table's data to the disk as a snapshot, see
+ * write_snapshot(). Finishes pending resizes first. Overwrites the
+ * existing data atomically by writing a temporary file and renaming
+ * it. Returns the number of bytes written. Throws an assertion if the
+ * table file cannot be opened or if a write error occurs.
+ */
+
+size_t write_table(hashtable_t *ht) {
+  if (global_table_filename[0] == '\0') {
+    generate_table_filename(LOOKUP_PORT);
+  }
+  resize_step(ht, SIZE_MAX);
+
+  char temp_filename[264] = { '\0' };
+  snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", global_table_filename);
+  FILE *file = fopen(temp_filename, "w");
+  assert(file != NULL);
+
+  size_t total = write_snapshot(ht, file);
+  assert(total != 0);
+  fsync(fileno(file));
+  fclose(file);
+  file = NULL;
+  int status_code = rename(temp_filename, global_table_filename);
+  assert(status_code == 0);
+  return total;
+}
+
+/*
+ * Writes a snapshot of the given hash table into an anonymous shared
+ * memory file instead of the disk, for a process taking this one's
+ * place, see import_hashmap(). Finishes pending resizes first, so the
+ * caller must hold the table lock and bracket the call for the
+ * readers. Returns the file descriptor, or -1 on failure.
+ */
+
+int export_table(hashtable_t *ht) {
+  assert(ht != NULL);
+  resize_step(ht, SIZE_MAX);
+  int fd = memfd_create("chat-lookup-table", MFD_CLOEXEC);
+  if (fd < 0) {
+    log_write(LOG_ERROR, "memfd_create() failed (%d)", errno);
+    return -1;
+  }
+  int file_fd = dup(fd);
+  FILE *file = file_fd >= 0 ? fdopen(file_fd, "w") : NULL;
+  if (file == NULL) {
+    if (file_fd >= 0) {
+      close(file_fd);
+    }
+    close(fd);
+    return -1;
+  }
+  size_t total = write_snapshot(ht, file);
+  fclose(file);
+  if (total == 0) {
+    log_write(LOG_ERROR, "Could not write the table to shared memory (%d)", errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+typedef struct SnapshotResult {
+  size_t bytes;
+  int64_t duration_ms;
+} snapshot_result_t;
+
+/*
+ * Starts writing a snapshot in the background. The journal is rotated
+ * first so that the rotated file holds exactly the records the snapshot
+ * covers, then a child is forked and writes the table from its copy of
+ * the memory while the parent keeps serving. Doesn't do anything if a
+ * snapshot is already running. Call finish_snapshot() to reap it.
+ */
+
+void start_snapshot(hashtable_t *ht) {
+  assert(ht != NULL);
+  if (ht->snapshot.pid != 0) {
+    return;
+  }
+  if (ht->journal != NULL
+      && journal_rotate(ht->journal, global_journal_filename, global_rotated_journal_filename) != 0) {
+    // A stale rotated journal from a crash is merged back and retried later
+    journal_reopen_merged(ht->journal, global_journal_filename, global_rotated_journal_filename);
+    return;
+  }
+
+  int fds[2];
+  if (pipe(fds) != 0) {
+    log_write(LOG_ERROR, "Could not create the snapshot pipe");
+    if (ht->journal != NULL) {
+      journal_reopen_merged(ht->journal, global_journal_filename, global_rotated_journal_filename);
+    }
+    return;
+  }
+
+  // Buffered output would otherwise be printed by both processes
+  fflush(stdout);
+  fflush(stderr);
+  int64_t fork_start = now_us();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    int64_t start = journal_now_ms();
+    snapshot_result_t result = { .bytes = write_table(ht) };
+    result.duration_ms = journal_now_ms() - start;
+    ssize_t written = write(fds[1], &result, sizeof(result));
+    _exit(written == sizeof(result) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  if (pid < 0) {
+    log_write(LOG_ERROR, "Could not fork the snapshot writer (%d)", errno);
+    close(fds[0]);
+    if (ht->journal != NULL) {
+      journal_reopen_merged(ht->journal, global_journal_filename, global_rotated_journal_filename);
+    }
+    ht->snapshot.n_failed++;
+    return;
+  }
+  ht->snapshot.fork_us = now_us() - fork_start;
+  ht->snapshot.pid = pid;
+  ht->snapshot.pipe_fd = fds[0];
+  ht->snapshot.started_ms = journal_now_ms();
+}
+
+/*
+ * Reaps the snapshot child if it has exited, or waits for it if block
+ * is set. A successful snapshot covers the rotated journal, which is
+ * removed. After a failure the rotated journal is merged back so that
+ * no records are lost.
+ */
+
+void finish_snapshot(hashtable_t *ht, bool block) {
+  assert(ht != NULL);
+  if (ht->snapshot.pid == 0) {
+    return;
+  }
+
+  int status;
+  pid_t pid = waitpid(ht->snapshot.pid, &status, block ? 0 : WNOHANG);
+  if (pid == 0 || (pid < 0 && errno == EINTR)) {
+    return;
+  }
+
+  snapshot_result_t result = { 0 };
+  bool ok = pid == ht->snapshot.pid && WIFEXITED(status) && WEXITSTATUS(status) == 0
+         && read(ht->snapshot.pipe_fd, &result, sizeof(result)) == sizeof(result);
+  close(ht->snapshot.pipe_fd);
+  ht->snapshot.pid = 0;
+  ht->snapshot.pipe_fd = -1;
+
+  if (ok) {
+    unlink(global_rotated_journal_filename);
+    ht->snapshot.bytes = result.bytes;
+    ht->snapshot.duration_ms = result.duration_ms;
+    ht->snapshot.n_written++;
+    log_write(LOG_INFO, "Snapshot written: %lu bytes in %ld ms (fork took %ld us)",
+           result.bytes, result.duration_ms, ht->snapshot.fork_us);
+  } else {
+    log_write(LOG_ERROR, "Snapshot writer failed, keeping the journal");
+    if (ht->journal != NULL) {
+      journal_reopen_merged(ht->journal, global_journal_filename, global_rotated_journal_filename);
+    }
+    ht->snapshot.n_failed++;
+  }
+}
+
+static bool valid_shard(const snapshot_shard_t *desc) {
+  return desc->size >= GROUP_WIDTH && desc->size <= MAX_SHARD_SIZE && (desc->size & (desc->size - 1)) == 0
+      && desc->filter_blocks == bloom_create_size(desc->size)
+      && desc->n_elements + desc->n_tombstones <= desc->size
+      && desc->v6_count <= MAX_SHARD_SIZE
+      && (desc->v6_free == V6_POOL_NONE || desc->v6_free < desc->v6_count);
+}
+
+/*
+ * Maps the snapshot in the given file, which is closed, into the
+ * shards of the given table, the name only goes into warnings. The
+ * mapping is private, so pages are only copied once they are written
+ * to. The IPv6 pools are copied to the heap so that they can grow.
+ * Returns false if the file fails validation, the table is left
+ * untouched in that case. Throws an assertion if a memory allocation
+ * error occurs.
+ */
+
+static bool map_snapshot(hashtable_t *ht, int fd, const char *name) {
+
+  struct stat st;
+  snapshot_header_t header;
+  snapshot_shard_t descs[TABLE_SHARDS];
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < SNAPSHOT_DATA_OFFSET
+      || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    log_write(LOG_WARNING, "Ignoring unreadable snapshot \"%s\"", name);
+    close(fd);
+    return false;
+  }
+
+  bool valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0
+            && header.version == SNAPSHOT_VERSION && header.n_shards == TABLE_SHARDS
+            && header.key_size == MAX_USERNAME_LEN && header.value_size == sizeof(slot_value_t)
+            && pread(fd, descs, sizeof(descs), sizeof(header)) == sizeof(descs);
+  snapshot_section_t sections[SHARD_SECTIONS];
+  size_t total = SNAPSHOT_DATA_OFFSET;
+  for (size_t i = 0; i < TABLE_SHARDS && valid; i++) {
+    valid = valid_shard(&descs[i]);
+    total = valid ? shard_layout(total, &descs[i], sections) : total;
+  }
+  if (!valid || total != (size_t) st.st_size) {
+    log_write(LOG_WARNING, "Ignoring incompatible snapshot \"%s\"", name);
+    close(fd);
+    return false;
+  }
+
+  uint8_t *addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    log_write(LOG_WARNING, "Could not map snapshot (%d)", errno);
+    return false;
+  }
+
+  uint64_t checksum = 0;
+  size_t offset = SNAPSHOT_DATA_OFFSET;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    offset = shard_layout(offset, &descs[i], sections);
+    for (int j = 0; j < SHARD_SECTIONS; j++) {
+      checksum = fold_checksum(checksum, addr + sections[j].offset, sections[j].len);
+    }
+  }
+  if (checksum != header.checksum) {
+    log_write(LOG_WARNING, "Ignoring corrupt snapshot \"%s\"", name);
+    munmap(addr, total);
+    return false;
+  }
+
+  snapshot_mapping_t *mapping = malloc(sizeof(snapshot_mapping_t));
+  assert(mapping != NULL);
+  *mapping = (snapshot_mapping_t) { .addr = addr, .size = total, .n_users = TABLE_SHARDS };
+  offset = SNAPSHOT_DATA_OFFSET;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    const snapshot_shard_t *desc = &descs[i];
+    shard_t *shard = &ht->shards[i];
+    offset = shard_layout(offset, desc, sections);
+    shard->current = (shard_arrays_t) {
+      .ctrl = (int8_t *) (addr + sections[0].offset),
+      .keys = (char (*)[MAX_USERNAME_LEN]) (addr + sections[1].offset),
+      .values = (slot_value_t *) (addr + sections[2].offset),
+      .v6_bits = (uint64_t *) (addr + sections[3].offset),
+      .size = desc->size,
+      .n_elements = desc->n_elements,
+      .n_tombstones = desc->n_tombstones,
+      .filter = { .bits = (uint64_t *) (addr + sections[4].offset), .n_blocks = desc->filter_blocks },
+      .mapping = mapping,
+    };
+    shard->v6_count = desc->v6_count;
+    shard->v6_capacity = desc->v6_count;
+    shard->v6_free = (uint32_t) desc->v6_free;
+    if (desc->v6_count != 0) {
+      shard->v6_pool = malloc(sections[5].len);
+      assert(shard->v6_pool != NULL);
+      memcpy(shard->v6_pool, addr + sections[5].offset, sections[5].len);
+    }
+    ht->memory_used += arrays_bytes(desc->size) + sections[5].len;
+  }
+  return true;
+}
+
+/*
+ * Journal replay callback, applies one record to the table.
+ */
+
+static void replay_record(char op, const char *username, const ip_addr_t *ip, int64_t lease, void *ctx) {
+  hashtable_t *ht = (hashtable_t *) ctx;
+  if (op == JOURNAL_OP_UPDATE) {
+    userdata_t data = { 0 };
+    strncpy(data.username, username, MAX_USERNAME_LEN - 1);
+    data.ip = *ip;
+    data.lease_expiry = lease;
+    // Heartbeats aren't journaled, the update was made a lease before it expires
+    data.last_seen = lease > LEASE_TTL_SECONDS ? lease - LEASE_TTL_SECONDS : 0;
+    insert(ht, data);
+  } else {
+    delete_data(ht, username);
+  }
+}
+
+// Journal callback for a table that already holds every record, see import_hashmap()
+static void skip_record(char op, const char *username, const ip_addr_t *ip, int64_t lease, void *ctx) {
+}
+
+/*
+ * Replays the journal on top of the freshly loaded snapshot, unless
+ * replay is false, and starts journaling mutations. Throws an
+ * assertion if the journal cannot be opened or if a rotated journal
+ * cannot be merged back.
+ */
+
+static void open_journal(hashtable_t *ht, bool replay) {
+  // A snapshot was interrupted, its records still have to be replayed
+  int status_code = journal_merge(global_rotated_journal_filename, global_journal_filename);
+  assert(status_code == 0);
+  journal_t *journal = journal_open(global_journal_filename, replay ? replay_record : skip_record, ht);
+  assert(journal != NULL);
+  if (replay && journal->n_records != 0) {
+    log_write(LOG_INFO, "Replayed %lu journal records", journal->n_records);
+  }
+  ht->journal = journal;
+}
+
+/*
+ * Sets up a table around the shards that are already loaded, or empty
+ * ones if mapped is false: rebuilds the leases and the name index,
+ * which the snapshot layout doesn't hold, and opens the journal.
+ */
+
+static hashtable_t build_hashmap(hashtable_t ht, bool mapped, bool replay) {
+  if (!mapped) {
+    for (size_t i = 0; i < TABLE_SHARDS; i++) {
+      bool ok = allocate_arrays(&ht.shards[i].current, INITIAL_SHARD_SIZE);
+      assert(ok);
+      ht.shards[i].v6_free = V6_POOL_NONE;
+      ht.memory_used += arrays_bytes(INITIAL_SHARD_SIZE);
+    }
+  }
+  if (!within_memory_limit(&ht, 0)) {
+    log_write(LOG_WARNING, "The snapshot takes %lu MB, more than the memory limit", ht.memory_used >> 20);
+  }
+
+  // Neither leases nor the name index are part of the snapshot layout, rebuild them
+  ht.leases = timer_wheel_create(time(NULL));
+  ht.names = name_index_create();
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    const shard_arrays_t *arrays = &ht.shards[i].current;
+    for (size_t j = 0; j < arrays->size; j++) {
+      if (!is_full(arrays->ctrl[j])) {
+        continue;
+      }
+      name_index_insert(ht.names, arrays->keys[j]);
+      if (arrays->values[j].lease_expiry != 0) {
+        timer_wheel_add(ht.leases, arrays->keys[j], arrays->values[j].lease_expiry);
+      }
+    }
+  }
+
+  // Replayed records go through insert(), which needs the epoch domain for retired pools
+  ht.readers = epoch_create();
+  open_journal(&ht, replay);
+  ht.snapshot.pipe_fd = -1;
+  ht.snapshot.last_time = time(NULL);
+  return ht;
+}
+
+// Record layout of LEGACY_STORAGE_FILE, a size_t count precedes the records
+typedef struct LegacyUserData {
+  char username[MAX_USERNAME_LEN];
+  ip_addr_t ip;
+  bool tombstone;
+} legacy_userdata_t;
+
+/*
+ * Imports the table file of a build before leases, which stored the
+ * count of users followed by their records, into the given table and
+ * writes the first snapshot from it. The records get a fresh lease,
+ * users the journal already restored keep their newer data. The file
+ * is renamed afterwards so that it is only imported once. Throws an
+ * assertion, after logging why, if the file's size doesn't match the
+ * count, the file is left alone then.
+ */
+
+static void import_legacy_table(hashtable_t *ht) {
+  char filename[256] = { '\0' };
+  snprintf(filename, sizeof(filename), "%.*s%s", (int) (strlen(global_table_filename) - strlen(STORAGE_FILE)),
+           global_table_filename, LEGACY_STORAGE_FILE);
+  FILE *file = fopen(filename, "r");
+  if (file == NULL) {
+    return;
+  }
+
+  struct stat st;
+  size_t n_users = 0;
+  bool ok = fstat(fileno(file), &st) == 0;
+  // Builds of that era created the file empty before the first write
+  if (ok && st.st_size != 0) {
+    ok = fread(&n_users, sizeof(size_t), 1, file) == 1 && n_users <= (size_t) st.st_size / sizeof(legacy_userdata_t)
+         && (size_t) st.st_size == sizeof(size_t) + n_users * sizeof(legacy_userdata_t);
+  }
+  if (!ok) {
+    log_write(LOG_ERROR, "Refusing to import \"%s\": its size doesn't match %lu records of %lu bytes, "
+              "move it out of the way to start without it", filename, n_users, sizeof(legacy_userdata_t));
+  }
+  assert(ok);
+
+  int64_t lease = time(NULL) + LEASE_TTL_SECONDS;
+  size_t n_imported = 0;
+  for (size_t i = 0; i < n_users; i++) {
+    legacy_userdata_t record;
+    size_t status_code = fread(&record, sizeof(record), 1, file);
+    assert(status_code == 1);
+    record.username[MAX_USERNAME_LEN - 1] = '\0';
+    userdata_t existing;
+    if (record.username[0] == '\0' || (record.ip.family != AF_INET && record.ip.family != AF_INET6)
+        || table_get_locked(ht, record.username, &existing)) {
+      continue;
+    }
+    userdata_t data = { .ip = record.ip, .lease_expiry = lease, .last_seen = lease - LEASE_TTL_SECONDS };
+    memcpy(data.username, record.username, MAX_USERNAME_LEN);
+    if (insert(ht, data) == 0) {
+      n_imported++;
+    }
+  }
+  fclose(file);
+  file = NULL;
+
+  write_table(ht);
+  journal_truncate(ht->journal);
+  char imported_filename[272] = { '\0' };
+  snprintf(imported_filename, sizeof(imported_filename), "%s.imported", filename);
+  int status_code = rename(filename, imported_filename);
+  assert(status_code == 0);
+  log_write(LOG_INFO, "Imported %lu of %lu registrations from \"%s\"", n_imported, n_users, filename);
+}
+
+/*
+ * Generates the UserData hashmap, growing it past memory_limit bytes
+ * is refused (0 for no limit). Throws an assertion if a memory
+ * allocation error occurs or if the journal cannot be opened. Call
+ * free_hashmap() afterwards to avoid memory leaks! Maps the snapshot
+ * in the disk if it exists and is valid, starts with an empty table
+ * otherwise. Replays the journal afterwards. Without a snapshot, a
+ * table file of an earlier build is imported, see import_legacy_table(),
+ * which throws an assertion if the file is truncated.
+ */
+
+hashtable_t generate_hashmap(size_t memory_limit) {
+  if (global_table_filename[0] == '\0') {
+    generate_table_filename(LOOKUP_PORT);
+  }
+
+  hashtable_t ht = { .memory_limit = memory_limit };
+  int fd = open(global_table_filename, O_RDONLY);
+  bool mapped = fd >= 0 && map_snapshot(&ht, fd, global_table_filename);
+  ht = build_hashmap(ht, mapped, true);
+  if (!mapped) {
+    import_legacy_table(&ht);
+  }
+  return ht;
+}
+
+/*
+ * Generates the UserData hashmap from the snapshot another process
+ * exported into the given file, see export_table(), which is closed.
+ * The journal is opened without replaying it: the process exporting
+ * the table has appended every record to it already, and its snapshot
+ * covers them. Throws an assertion if a memory allocation error occurs
+ * or if the journal cannot be opened. Returns false if the snapshot
+ * fails validation, the table is left untouched then. Call
+ * free_hashmap() afterwards to avoid memory leaks!
+ */
+
+bool import_hashmap(int fd, size_t memory_limit, hashtable_t *out) {
+  assert(fd >= 0 && out != NULL);
+  if (global_table_filename[0] == '\0') {
+    generate_table_filename(LOOKUP_PORT);
+  }
+
+  hashtable_t ht = { .memory_limit = memory_limit };
+  if (!map_snapshot(&ht, fd, "handed-over table")) {
+    return false;
+  }
+  *out = build_hashmap(ht, true, false);
+  return true;
+}
+
+void free_hashmap(hashtable_t *hm) {
+  epoch_free(hm->readers);
+  hm->readers = NULL;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    shard_t *shard = &hm->shards[i];
+    if (shard->old != NULL) {
+      free_arrays(shard->old);
+      free(shard->old);
+      shard->old = NULL;
+    }
+    free_arrays(&shard->current);
+    free(shard->v6_pool);
+    shard->v6_pool = NULL;
+  }
+  timer_wheel_free(hm->leases);
+  hm->leases = NULL;
+  name_index_free(hm->names);
+  hm->names = NULL;
+  journal_close(hm->journal);
+  hm->journal = NULL;
+}
+
+/*
+ * Hashes the given username into 64 bits (FNV-1a followed by a
+ * 64-bit finalizer to spread the entropy into the high bits).
+ * The low 7 bits are used as the control tag, the rest select the group.
+ */
+
+uint64_t hash_username(const char *username) {
+  assert(username != NULL);
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < MAX_USERNAME_LEN && username[i] != '\0'; i++) {
+    hash ^= (uint8_t) username[i];
+    hash *= 0x100000001b3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+/*
+ * Finds the slot holding the given username using its precomputed
+ * hash. Probes one group at a time and stops at the first group that
+ * contains an empty slot. Returns -1 if the user does not exist.
+ */
+
+static int find_index(const shard_arrays_t *arrays, const char *username, uint64_t hash) {
+  size_t n_groups = arrays->size / GROUP_WIDTH;
+  size_t group = hash_group(hash, n_groups);
+  int8_t tag = hash_tag(hash);
+
+  // Triangular probing visits every group when n_groups is a power of two
+  for (size_t i = 1; i <= n_groups; i++) {
+    const int8_t *ctrl = arrays->ctrl + group * GROUP_WIDTH;
+    uint32_t matches = group_match(ctrl, tag);
+    while (matches != 0) {
+      size_t index = group * GROUP_WIDTH + __builtin_ctz(matches);
+      if (strncmp(username, arrays->keys[index], MAX_USERNAME_LEN) == 0) {
+        return (int) index;
+      }
+      matches &= matches - 1;
+    }
+    if (group_match(ctrl, CTRL_EMPTY) != 0) {
+      return -1;
+    }
+    group = (group + i) & (n_groups - 1);
+  }
+  return -1;
+}
+
+/*
+ * Looks the given username up in the current arrays of its shard and,
+ * while a resize is in progress, in the arrays being migrated. Usernames
+ * that none of the filters have seen are rejected without touching
+ * the arrays. A miss is counted in the filter metrics if count is
+ * true, which only fetches pass, writers probing for a user would skew
+ * them. Returns the slot and sets owner to the arrays holding it, or
+ * returns -1 if the user does not exist.
+ */
+
+static int lookup_slot(hashtable_t *ht, shard_t *shard, const char *username, uint64_t hash,
+                       shard_arrays_t **owner, bool count) {
+  bool filtered = true;
+  shard_arrays_t *candidates[2] = { &shard->current, shard->old };
+  for (int i = 0; i < 2 && candidates[i] != NULL; i++) {
+    if (!bloom_may_contain(&candidates[i]->filter, hash)) {
+      continue;
+    }
+    filtered = false;
+    int index = find_index(candidates[i], username, hash);
+    if (index != -1) {
+      *owner = candidates[i];
+      return index;
+    }
+  }
+
+  if (!count) {
+    return -1;
+  }
+  if (filtered) {
+    atomic_fetch_add_explicit(&ht->n_filter_rejects, 1, memory_order_relaxed);
+  } else {
+    atomic_fetch_add_explicit(&ht->n_filter_false_positives, 1, memory_order_relaxed);
+  }
+  return -1;
+}
+
+/*
+ * Places the given key and value in the first free slot of its probe
+ * sequence. The caller guarantees the username is not already in the
+ * arrays. Returns the index of the slot, -1 if the arrays are full.
+ */
+
+static int insert_unique(shard_arrays_t *arrays, const char *key, slot_value_t value, bool v6, uint64_t hash) {
+  size_t n_groups = arrays->size / GROUP_WIDTH;
+  size_t group = hash_group(hash, n_groups);
+
+  for (size_t i = 1; i <= n_groups; i++) {
+    uint32_t free_slots = group_match_free(arrays->ctrl + group * GROUP_WIDTH);
+    if (free_slots != 0) {
+      size_t index = group * GROUP_WIDTH + __builtin_ctz(free_slots);
+      if (arrays->ctrl[index] == CTRL_DELETED) {
+        arrays->n_tombstones--;
+      }
+      arrays->ctrl[index] = hash_tag(hash);
+      memcpy(arrays->keys[index], key, MAX_USERNAME_LEN);
+      arrays->values[index] = value;
+      set_v6(arrays, index, v6);
+      arrays->n_elements++;
+      bloom_add(&arrays->filter, hash);
+      return (int) index;
+    }
+    group = (group + i) & (n_groups - 1);
+  }
+  return -1;
+}
+
+/*
+ * Marks the given slot of the given arrays as deleted. A group that
+ * still has an empty slot has never been probed past, so the slot
+ * can go straight back to empty instead of leaving a tombstone.
+ */
+
+static void erase_slot(shard_arrays_t *arrays, size_t index) {
+  const int8_t *group = arrays->ctrl + index / GROUP_WIDTH * GROUP_WIDTH;
+  if (group_match(group, CTRL_EMPTY) != 0) {
+    arrays->ctrl[index] = CTRL_EMPTY;
+  } else {
+    arrays->ctrl[index] = CTRL_DELETED;
+    arrays->n_tombstones++;
+  }
+  arrays->n_elements--;
+}
+
+// Deletes a registration, unlike a migration this gives its pool entry back
+static void remove_slot(shard_t *shard, shard_arrays_t *arrays, size_t index) {
+  if (is_v6(arrays, index)) {
+    pool_remove(shard, arrays->values[index].addr);
+  }
+  erase_slot(arrays, index);
+}
+
+/*
+ * Returns the number of live entries, including the ones that
+ * have not been migrated yet.
+ */
+
+size_t table_count(const hashtable_t *ht) {
+  assert(ht != NULL);
+  size_t count = 0;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    count += ht->shards[i].current.n_elements;
+    if (ht->shards[i].old != NULL) {
+      count += ht->shards[i].old->n_elements;
+    }
+  }
+  return count;
+}
+
+// Groups probed to reach the entry in the given full slot, 1 if it sits in its home group
+static size_t probe_length(const shard_arrays_t *arrays, size_t index) {
+  size_t n_groups = arrays->size / GROUP_WIDTH;
+  size_t group = hash_group(hash_username(arrays->keys[index]), n_groups);
+  size_t probes = 1;
+  while (group != index / GROUP_WIDTH && probes <= n_groups) {
+    group = (group + probes) & (n_groups - 1);
+    probes++;
+  }
+  return probes;
+}
+
+/*
+ * Returns the average number of groups probed to find a live entry of
+ * the current arrays, 1 if every entry sits in its home group. Only
+ * PROBE_SAMPLE_SLOTS slots spread over each shard are looked at, and
+ * the shards are weighted by their number of entries, so that the cost
+ * doesn't grow with the table. Shards no larger than that are measured
+ * exactly. The caller must hold the table lock. Returns 0 for an empty
+ * table.
+ */
+
+double average_probe_length(const hashtable_t *ht) {
+  assert(ht != NULL);
+  double n_probes = 0;
+  size_t n_entries = 0;
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    const shard_arrays_t *arrays = &ht->shards[i].current;
+    size_t n_samples = arrays->size < PROBE_SAMPLE_SLOTS ? arrays->size : PROBE_SAMPLE_SLOTS;
+    size_t n_sampled = 0, n_sampled_probes = 0;
+    for (size_t k = 0; k < n_samples; k++) {
+      // An odd stride visits distinct slots of a power of two sized shard
+      size_t index = (k * PROBE_SAMPLE_STRIDE) & (arrays->size - 1);
+      if (is_full(arrays->ctrl[index])) {
+        n_sampled++;
+        n_sampled_probes += probe_length(arrays, index);
+      }
+    }
+    if (n_sampled != 0) {
+      n_probes += arrays->n_elements * (n_sampled_probes / (double) n_sampled);
+      n_entries += arrays->n_elements;
+    }
+  }
+  return n_entries != 0 ? n_probes / n_entries : 0;
+}
+
+/*
+ * Brackets a change of the table for the lock-free readers. The
+ * caller must hold the table lock, readers overlapping the bracket
+ * retry.
+ */
+
+void table_write_begin(hashtable_t *ht) {
+  uint64_t seq = atomic_load_explicit(&ht->seq, memory_order_relaxed);
+  atomic_store_explicit(&ht->seq, seq + 1, memory_order_relaxed);
+  // No store to the table may become visible before the counter turns odd
+  atomic_thread_fence(memory_order_release);
+}
+
+void table_write_end(hashtable_t *ht) {
+  uint64_t seq = atomic_load_explicit(&ht->seq, memory_order_relaxed);
+  atomic_store_explicit(&ht->seq, seq + 1, memory_order_release);
+}
+
+// Lookup under the table lock, fetches count their misses, see lookup_slot()
+static bool get_locked(hashtable_t *ht, const char *username, userdata_t *out, bool count) {
+  uint64_t hash = hash_username(username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+  shard_arrays_t *owner = NULL;
+  int index = lookup_slot(ht, shard, username, hash, &owner, count);
+  if (index != -1) {
+    unpack_slot(owner, index, shard->v6_pool, shard->v6_count, out);
+  }
+  return index != -1;
+}
+
+/*
+ * Copies the given user's data out of the table without taking the
+ * table lock. The layout of the user's shard is copied and checked
+ * against the sequence counter before it is followed, and checked
+ * again after the entry is copied, so a read that raced a writer is
+ * retried. Arrays and pools retired by a writer stay allocated until
+ * this thread leaves its epoch. Falls back to the table lock after
+ * READ_RETRIES failed attempts. Returns false if the user doesn't
+ * exist. Throws an assertion if any of the parameters are NULL.
+ */
+
+bool read_user(hashtable_t *ht, const char *username, userdata_t *out) {
+  assert(ht != NULL && username != NULL && out != NULL);
+  uint64_t hash = hash_username(username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+  // A thread can read from several tables in turn, each has a domain of its own
+  if (ht->readers != NULL && reader_domain != ht->readers->id) {
+    reader_slot = epoch_register(ht->readers);
+    reader_domain = ht->readers->id;
+  }
+
+  for (int attempt = 0; ht->readers != NULL && reader_slot >= 0 && attempt < READ_RETRIES; attempt++) {
+    epoch_enter(ht->readers, reader_slot);
+    uint64_t seq = atomic_load_explicit(&ht->seq, memory_order_acquire);
+    if (seq & 1) {
+      epoch_exit(ht->readers, reader_slot);
+      continue;
+    }
+
+    shard_arrays_t views[2];
+    int n_views = 0;
+    views[n_views++] = shard->current;
+    shard_arrays_t *old = shard->old;
+    if (old != NULL) {
+      views[n_views++] = *old;
+    }
+    const struct in6_addr *pool = shard->v6_pool;
+    size_t pool_size = shard->v6_count;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&ht->seq, memory_order_relaxed) != seq) {
+      epoch_exit(ht->readers, reader_slot);
+      continue;
+    }
+
+    bool found = false;
+    bool filtered = true;
+    bool valid = true;
+    for (int i = 0; i < n_views && !found; i++) {
+      if (!bloom_may_contain(&views[i].filter, hash)) {
+        continue;
+      }
+      filtered = false;
+      int index = find_index(&views[i], username, hash);
+      if (index != -1) {
+        valid = unpack_slot(&views[i], index, pool, pool_size, out);
+        found = true;
+      }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    valid = valid && atomic_load_explicit(&ht->seq, memory_order_relaxed) == seq;
+    epoch_exit(ht->readers, reader_slot);
+    if (!valid) {
+      continue;
+    }
+
+    if (!found) {
+      atomic_fetch_add_explicit(filtered ? &ht->n_filter_rejects : &ht->n_filter_false_positives, 1,
+                                memory_order_relaxed);
+    }
+    return found;
+  }
+
+  pthread_mutex_lock(&global_table_lock);
+  bool found = get_locked(ht, username, out, true);
+  pthread_mutex_unlock(&global_table_lock);
+  return found;
+}
+
+/*
+ * Copies the given user's data out of the table like read_user(), for
+ * callers that hold the table lock already, which read_user() may take
+ * when it falls back. Returns false if the user doesn't exist. Throws
+ * an assertion if any of the parameters are NULL.
+ */
+
+bool table_get_locked(hashtable_t *ht, const char *username, userdata_t *out) {
+  assert(ht != NULL && username != NULL && out != NULL);
+  return get_locked(ht, username, out, false);
+}
+
+static void free_old_arrays(void *arrays) {
+  free_arrays((shard_arrays_t *) arrays);
+  free(arrays);
+}
+
+/*
+ * Moves up to n_slots slots of the old arrays of the given shard into
+ * its current ones. Retires the old arrays once every slot has been
+ * migrated, they are freed as soon as no lock-free reader can hold
+ * them. Returns the number of slots visited, 0 if no resize is in
+ * progress. Throws an assertion if rehashing an element fails.
+ */
+
+static size_t shard_resize_step(hashtable_t *ht, shard_t *shard, size_t n_slots) {
+  shard_arrays_t *old = shard->old;
+  if (old == NULL) {
+    return 0;
+  }
+
+  size_t start = shard->migrate_index;
+  size_t end = n_slots < old->size - start ? start + n_slots : old->size;
+  for (size_t i = start; i < end; i++) {
+    if (is_full(old->ctrl[i])) {
+      int status_code = insert_unique(&shard->current, old->keys[i], old->values[i], is_v6(old, i),
+                                      hash_username(old->keys[i]));
+      assert(status_code != -1);
+      erase_slot(old, i);
+    }
+  }
+  shard->migrate_index = end;
+
+  if (shard->migrate_index == old->size) {
+    shard->old = NULL;
+    shard->migrate_index = 0;
+    ht->memory_used -= arrays_bytes(old->size);
+    if (ht->readers != NULL) {
+      epoch_retire(ht->readers, old, free_old_arrays);
+    } else {
+      free_old_arrays(old);
+    }
+  }
+  return end - start;
+}
+
+/*
+ * Moves up to n_slots slots in total over the shards that are being
+ * resized, SIZE_MAX finishes every pending resize. Throws an assertion
+ * if the passed parameter is NULL or if rehashing an element fails.
+ */
+
+void resize_step(hashtable_t *ht, size_t n_slots) {
+  assert(ht != NULL);
+  for (size_t i = 0; i < TABLE_SHARDS && n_slots > 0; i++) {
+    n_slots -= shard_resize_step(ht, &ht->shards[i], n_slots);
+  }
+}
+
+/*
+ * Starts an incremental resize of the given shard to the given size.
+ * The current arrays are kept aside and drained by resize_step(), fresh
+ * arrays take every new insertion. Finishes a pending resize first.
+ * Returns false if a memory allocation error occurs, the shard is left
+ * as it was then.
+ */
+
+static bool start_resize(hashtable_t *ht, shard_t *shard, size_t new_size) {
+  shard_resize_step(ht, shard, SIZE_MAX);
+
+  shard_arrays_t *old = malloc(sizeof(shard_arrays_t));
+  if (old == NULL) {
+    return false;
+  }
+  shard_arrays_t fresh;
+  if (!allocate_arrays(&fresh, new_size)) {
+    free(old);
+    return false;
+  }
+  *old = shard->current;
+  shard->current = fresh;
+  shard->old = old;
+  shard->migrate_index = 0;
+  shard->generation++;
+  ht->memory_used += arrays_bytes(new_size);
+  return true;
+}
+
+// Tombstones count towards the load so that every probe meets an empty slot
+static bool over_load_factor(const shard_arrays_t *arrays) {
+  return (arrays->n_elements + arrays->n_tombstones + 1) / (double) arrays->size >= LOAD_FACTOR;
+}
+
+/*
+ * Makes sure the current arrays of the given shard can take one more
+ * entry: finishes a pending resize, rehashes in place if the load is
+ * mostly tombstones and grows the shard by RESIZE_FACTOR otherwise.
+ * Returns false and refuses the registration if the shard is at
+ * MAX_SHARD_SIZE, the memory limit is reached or memory runs out.
+ */
+
+static bool make_room(hashtable_t *ht, shard_t *shard) {
+  if (!over_load_factor(&shard->current)) {
+    return true;
+  }
+  if (shard->old != NULL) {
+    shard_resize_step(ht, shard, SIZE_MAX);
+    if (!over_load_factor(&shard->current)) {
+      return true;
+    }
+  }
+
+  size_t size = shard->current.size;
+  size_t new_size = size * RESIZE_FACTOR;
+  if ((shard->current.n_elements + 1) / (double) size < LOAD_FACTOR / 2) {
+    new_size = size;
+  } else if (new_size > MAX_SHARD_SIZE) {
+    refuse(ht, "a shard is at MAX_SHARD_SIZE");
+    return false;
+  }
+  size_t bytes = arrays_bytes(new_size);
+  if (!within_memory_limit(ht, bytes) || !start_resize(ht, shard, new_size)) {
+    refuse_memory(ht, bytes);
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Starts shrinking the given shard's arrays by RESIZE_FACTOR once its
+ * load factor drops below SHRINK_LOAD_FACTOR. Doesn't do anything
+ * while a resize is in progress, at INITIAL_SHARD_SIZE or if memory
+ * for the smaller arrays can't be had.
+ */
+
+static void maybe_shrink(hashtable_t *ht, shard_t *shard) {
+  if (shard->old != NULL || shard->current.size <= INITIAL_SHARD_SIZE) {
+    return;
+  }
+  if (shard->current.n_elements / (double) shard->current.size < SHRINK_LOAD_FACTOR) {
+    start_resize(ht, shard, shard->current.size / RESIZE_FACTOR);
+  }
+}
+
+// Mutations are journaled and, on a node followers replicate from, logged for them
+static void record_update(hashtable_t *ht, const userdata_t *data) {
+  if (ht->journal != NULL) {
+    journal_append_update(ht->journal, data->username, data->ip, data->lease_expiry);
+  }
+  if (ht->changes != NULL) {
+    changelog_append(ht->changes, JOURNAL_OP_UPDATE, data);
+  }
+}
+
+static void record_delete(hashtable_t *ht, const char *username) {
+  if (ht->journal != NULL) {
+    journal_append_delete(ht->journal, username);
+  }
+  if (ht->changes != NULL) {
+    userdata_t data = { 0 };
+    strncpy(data.username, username, MAX_USERNAME_LEN - 1);
+    changelog_append(ht->changes, JOURNAL_OP_DELETE, &data);
+  }
+}
+
+/*
+ * Inserts the given data to the hash table. Grows the user's shard if
+ * necessary and migrates a bounded number of its slots. Throws an
+ * assertion if the passed parameters are NULL or invalid. Returns 0 on
+ * success, -1 if the table can't take the registration, the reason is
+ * logged then. If the given user's username already exists, updates
+ * the existing data with the new data.
+ */
+
+int insert(hashtable_t *ht, userdata_t data) {
+  assert(ht != NULL && data.username[0] != '\0');
+  assert(data.ip.family == AF_INET || data.ip.family == AF_INET6);
+
+  uint64_t hash = hash_username(data.username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+
+  // Existing users are updated where they are, migration moves them later
+  shard_arrays_t *owner = NULL;
+  int index = lookup_slot(ht, shard, data.username, hash, &owner, false);
+  if (index != -1) {
+    if (data.ip.family == AF_INET6 && is_v6(owner, index)) {
+      shard->v6_pool[owner->values[index].addr] = data.ip.addr.v6;
+      owner->values[index].lease_expiry = (uint32_t) data.lease_expiry;
+      owner->values[index].last_seen = (uint32_t) data.last_seen;
+    } else {
+      slot_value_t value;
+      if (pack_value(ht, shard, &data, &value) != 0) {
+        return -1;
+      }
+      if (is_v6(owner, index)) {
+        pool_remove(shard, owner->values[index].addr);
+      }
+      owner->values[index] = value;
+      set_v6(owner, index, data.ip.family == AF_INET6);
+    }
+    record_update(ht, &data);
+    // Arms a timer if the old lease had none, a later lease is picked up when it fires
+    if (ht->leases != NULL && data.lease_expiry != 0) {
+      timer_wheel_add(ht->leases, data.username, data.lease_expiry);
+    }
+    return 0;
+  }
+
+  slot_value_t value;
+  if (!make_room(ht, shard) || pack_value(ht, shard, &data, &value) != 0) {
+    return -1;
+  }
+  int status_code = insert_unique(&shard->current, data.username, value, data.ip.family == AF_INET6, hash);
+  // make_room() left the arrays below LOAD_FACTOR
+  assert(status_code != -1);
+  record_update(ht, &data);
+  if (ht->names != NULL) {
+    name_index_insert(ht->names, data.username);
+  }
+  if (ht->leases != NULL && data.lease_expiry != 0) {
+    timer_wheel_add(ht->leases, data.username, data.lease_expiry);
+  }
+  shard_resize_step(ht, shard, RESIZE_STEP_SLOTS);
+  return 0;
+}
+
+/*
+ * Finds and *LAZILY* deletes the given user from the given hash table.
+ * Starts shrinking the user's shard if it became sparse. Returns -1 if
+ * the given user does not exist in the hashmap. Returns 0 on success.
+ * Throws an assertion if any of the parameters are NULL.
+ */
+
+int delete_data(hashtable_t *ht, const char *username) {
+  assert(ht != NULL && username != NULL);
+  uint64_t hash = hash_username(username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+  shard_arrays_t *owner = NULL;
+  int index = lookup_slot(ht, shard, username, hash, &owner, false);
+  if (index == -1) {
+    return -1;
+  }
+  record_delete(ht, username);
+  remove_slot(shard, owner, index);
+  if (ht->names != NULL) {
+    name_index_delete(ht->names, username);
+  }
+  if (ht->leases != NULL) {
+    timer_wheel_cancel(ht->leases, username);
+  }
+  maybe_shrink(ht, shard);
+  shard_resize_step(ht, shard, RESIZE_STEP_SLOTS);
+  return 0;
+}
+
+/*
+ * Refreshes the last-seen time of the given user if it is registered
+ * at the given address, or at any address if it is NULL. Heartbeats are
+ * soft state: they are neither journaled nor bracketed for the
+ * lock-free readers, which see either the old or the new time, and
+ * they only reach the change log once per PRESENCE_REPLICATION_SECONDS.
+ * Must be called with the table lock held. Throws an assertion if the
+ * table or the username are NULL. Returns 0 on success, -1 if the user
+ * doesn't exist or is registered at another address.
+ */
+
+int touch_user(hashtable_t *ht, const char *username, const ip_addr_t *ip, int64_t now) {
+  static_assert(PRESENCE_REPLICATION_SECONDS + PRESENCE_HEARTBEAT_SECONDS < PRESENCE_STALE_SECONDS,
+                "followers must not see a peer that heartbeats on time as offline");
+  assert(ht != NULL && username != NULL);
+  uint64_t hash = hash_username(username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+  shard_arrays_t *owner = NULL;
+  int index = lookup_slot(ht, shard, username, hash, &owner, false);
+  if (index == -1) {
+    return -1;
+  }
+  slot_value_t *value = &owner->values[index];
+  if (ip != NULL) {
+    bool same = ip->family == AF_INET6
+                  ? is_v6(owner, index) && memcmp(&shard->v6_pool[value->addr], &ip->addr.v6, 16) == 0
+                  : !is_v6(owner, index) && memcmp(&value->addr, &ip->addr.v4, 4) == 0;
+    if (!same) {
+      return -1;
+    }
+  }
+  if (now <= value->last_seen) {
+    return 0;
+  }
+  bool replicate = now / PRESENCE_REPLICATION_SECONDS != value->last_seen / PRESENCE_REPLICATION_SECONDS;
+  value->last_seen = (uint32_t) now;
+  if (replicate && ht->changes != NULL) {
+    userdata_t data = { .last_seen = now };
+    strncpy(data.username, username, MAX_USERNAME_LEN - 1);
+    changelog_append(ht->changes, CHANGE_OP_SEEN, &data);
+  }
+  return 0;
+}
+
+/*
+ * Visits up to n_slots slots from the cursor on and calls the visitor
+ * for every entry in them. A shard's pending resize is finished before
+ * its first slot is visited, so that every entry is in the current
+ * arrays, and a shard whose arrays were replaced in between two calls
+ * is visited again from its first slot. Every entry that is in the
+ * table for the whole pass is seen at least once, entries can be seen
+ * twice. The scan stops at an entry the visitor returns false for and
+ * the next call visits that entry again. Must be called with the table
+ * lock held. Throws an assertion if any of the parameters but the
+ * context are NULL. Returns false once the cursor is past the last
+ * shard.
+ */
+
+bool table_scan(hashtable_t *ht, table_cursor_t *cursor, size_t n_slots, table_visitor_t visit, void *ctx) {
+  assert(ht != NULL && cursor != NULL && visit != NULL);
+  while (cursor->shard < TABLE_SHARDS && n_slots > 0) {
+    shard_t *shard = &ht->shards[cursor->shard];
+    if (cursor->slot != 0 && cursor->generation != shard->generation) {
+      cursor->slot = 0;
+    }
+    if (cursor->slot == 0) {
+      if (shard->old != NULL) {
+        table_write_begin(ht);
+        shard_resize_step(ht, shard, SIZE_MAX);
+        table_write_end(ht);
+      }
+      cursor->generation = shard->generation;
+    }
+    const shard_arrays_t *arrays = &shard->current;
+    for (; cursor->slot < arrays->size && n_slots > 0; cursor->slot++, n_slots--) {
+      userdata_t data;
+      if (is_full(arrays->ctrl[cursor->slot])
+          && unpack_slot(arrays, cursor->slot, shard->v6_pool, shard->v6_count, &data) && !visit(&data, ctx)) {
+        return true;
+      }
+    }
+    if (cursor->slot >= arrays->size) {
+      cursor->shard++;
+      cursor->slot = 0;
+    }
+  }
+  return cursor->shard < TABLE_SHARDS;
+}
+
+/*
+ * Copies up to limit registered usernames that start with the given
+ * prefix into out, in order and past the given name unless it is NULL
+ * or empty, see name_index_search(). Sets more if further names match.
+ * Must be called with the table lock held. Throws an assertion if any
+ * of the parameters but after are NULL. Returns the number of names
+ * copied, 0 for a table without a name index.
+ */
+
+size_t table_search(const hashtable_t *ht, const char *prefix, const char *after, size_t limit,
+                    char (*out)[MAX_USERNAME_LEN], bool *more) {
+  assert(ht != NULL && prefix != NULL && out != NULL && more != NULL);
+  *more = false;
+  return ht->names != NULL ? name_index_search(ht->names, prefix, after, limit, out, more) : 0;
+}
+
+/*
+ * Timer wheel callback. Deletes the registration if its lease ran out,
+ * reschedules the timer if the lease was renewed in the meantime and
+ * drops it if the registration no longer has a lease.
+ */
+
+static int64_t lease_expired(const char *username, int64_t now, void *ctx) {
+  hashtable_t *ht = (hashtable_t *) ctx;
+  uint64_t hash = hash_username(username);
+  shard_t *shard = &ht->shards[hash_shard(hash)];
+  shard_arrays_t *owner = NULL;
+  int index = lookup_slot(ht, shard, username, hash, &owner, false);
+  if (index == -1 || owner->values[index].lease_expiry == 0) {
+    return 0;
+  }
+  if (owner->values[index].lease_expiry > now) {
+    return owner->values[index].lease_expiry;
+  }
+  record_delete(ht, username);
+  remove_slot(shard, owner, index);
+  if (ht->names != NULL) {
+    name_index_delete(ht->names, username);
+  }
+  ht->n_expired++;
+  return 0;
+}
+
+/*
+ * Background pass over the table, meant to run about once a second.
+ * Expires the leases that ran out, starts an in-place rehash of the
+ * shards where tombstones pile up or a shrink of the sparse ones,
+ * migrates a bounded number of slots of the pending resizes and frees
+ * the arrays no reader holds anymore. Must be called with the table
+ * lock held, the table changes are bracketed for the readers. Syncs
+ * the journal when due, reaps a finished snapshot and starts a
+ * background one every SNAPSHOT_INTERVAL_SECONDS or once the journal
+ * grows past JOURNAL_COMPACT_BYTES. Throws an assertion if the passed
+ * table is NULL.
+ */
+
+void maintain_table(hashtable_t *ht, int64_t now) {
+  assert(ht != NULL);
+  table_write_begin(ht);
+  if (ht->leases != NULL) {
+    timer_wheel_advance(ht->leases, now, lease_expired, ht);
+  }
+
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    shard_t *shard = &ht->shards[i];
+    maybe_shrink(ht, shard);
+    if (shard->old == NULL && shard->current.n_tombstones > shard->current.size * TOMBSTONE_COMPACT_FACTOR
+        && within_memory_limit(ht, arrays_bytes(shard->current.size))) {
+      start_resize(ht, shard, shard->current.size);
+    }
+  }
+  resize_step(ht, MAINTAIN_STEP_SLOTS);
+  table_write_end(ht);
+  if (ht->readers != NULL) {
+    epoch_reclaim(ht->readers);
+  }
+  // A table that is still full logs again on the next refusal
+  ht->full_reported = false;
+
+  finish_snapshot(ht, false);
+  if (ht->journal != NULL) {
+    journal_sync(ht->journal, false);
+    bool due = ht->journal->size != 0 && now - ht->snapshot.last_time >= SNAPSHOT_INTERVAL_SECONDS;
+    if ((due || ht->journal->size > JOURNAL_COMPACT_BYTES) && ht->snapshot.pid == 0) {
+      start_snapshot(ht);
+      ht->snapshot.last_time = now;
+    }
+  }
+}
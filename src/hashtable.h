@@ -0,0 +1,266 @@
+#ifndef CHAT_HASHTABLE_H
+#define CHAT_HASHTABLE_H
+
+#include "bloom.h"
+#include "epoch.h"
+#include "journal.h"
+#include "name_index.h"
+#include "shared_protocol.h"
+#include "timer_wheel.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct ChangeLog;
+
+// Usernames are spread over the shards by the top bits of their hash,
+// every shard grows and shrinks on its own
+#define TABLE_SHARD_BITS (6)
+#define TABLE_SHARDS (1 << TABLE_SHARD_BITS)
+// Shard sizes must be powers of two and multiples of GROUP_WIDTH
+#define INITIAL_SHARD_SIZE (16)
+#define MAX_SHARD_SIZE (1048576) // 2 ^ 20
+#define MAX_TABLE_SIZE ((size_t) MAX_SHARD_SIZE * TABLE_SHARDS)
+#define LOAD_FACTOR (0.67)
+#define SHRINK_LOAD_FACTOR (0.15)
+#define RESIZE_FACTOR (2)
+// Slots migrated per request while a resize is in progress
+#define RESIZE_STEP_SLOTS (128)
+// Slots migrated per maintenance pass, fetches don't migrate
+#define MAINTAIN_STEP_SLOTS (RESIZE_STEP_SLOTS * 64)
+// Optimistic reads give up and take the table lock after this many tries
+#define READ_RETRIES (64)
+// Slots per shard average_probe_length() looks at, and its stride between them
+#define PROBE_SAMPLE_SLOTS (256)
+#define PROBE_SAMPLE_STRIDE (0x9E3779B1)
+// Rehash in place once tombstones take up this share of the slots
+#define TOMBSTONE_COMPACT_FACTOR (0.25)
+#define MAX_USERNAME_LEN (32)
+// IPv6 pools start with this many entries and double when full
+#define V6_POOL_INITIAL_SIZE (16)
+
+// Control bytes, one per slot. Full slots store the low 7 bits of the hash.
+#define GROUP_WIDTH (16)
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+#define STORAGE_FILE ("/table.snap")
+// Written by builds before leases and snapshots, imported once, see import_legacy_table()
+#define LEGACY_STORAGE_FILE ("/table.txt")
+
+#define SNAPSHOT_MAGIC ("CHATLKUP")
+#define SNAPSHOT_VERSION (3)
+// The header is padded to a page so that the mapped sections stay aligned
+#define SNAPSHOT_DATA_OFFSET (4096)
+#define JOURNAL_FILE ("/journal.log")
+// Holds the records a snapshot in progress covers
+#define ROTATED_JOURNAL_FILE ("/journal.log.1")
+// A snapshot is taken this often while the journal is non-empty
+#ifndef SNAPSHOT_INTERVAL_SECONDS
+#define SNAPSHOT_INTERVAL_SECONDS (300)
+#endif
+// Heartbeats only reach the change log when the last-seen time crosses
+// a multiple of this, see touch_user(). A follower's last-seen times
+// trail the leader's by less than this, which has to leave a client
+// that heartbeats on time short of PRESENCE_STALE_SECONDS.
+#ifndef PRESENCE_REPLICATION_SECONDS
+#define PRESENCE_REPLICATION_SECONDS (PRESENCE_HEARTBEAT_SECONDS)
+#endif
+
+extern char global_table_filename[256];
+extern char global_journal_filename[256];
+extern char global_rotated_journal_filename[256];
+
+// Serializes the writers, fetches only take it when optimistic reads keep failing
+extern pthread_mutex_t global_table_lock;
+
+// Unpacked view of one registration, the table stores it packed
+typedef struct UserData {
+  char username[MAX_USERNAME_LEN];
+  ip_addr_t ip;
+  int64_t lease_expiry;
+  // Last update or heartbeat in seconds since the epoch, 0 if unknown
+  int64_t last_seen;
+} userdata_t;
+
+// IPv4 addresses are stored inline, IPv6 ones in the pool of the shard
+typedef struct SlotValue {
+  uint32_t addr;
+  // Seconds since the epoch (fits until 2106), 0 for no lease
+  uint32_t lease_expiry;
+  uint32_t last_seen;
+} slot_value_t;
+
+// A snapshot mapping shared by the arrays of every shard loaded from it
+typedef struct SnapshotMapping {
+  void *addr;
+  size_t size;
+  size_t n_users;
+} snapshot_mapping_t;
+
+typedef struct ShardArrays {
+  int8_t *ctrl;
+  char (*keys)[MAX_USERNAME_LEN];
+  slot_value_t *values;
+  // One bit per slot, set if the value indexes the IPv6 pool
+  uint64_t *v6_bits;
+  size_t size;
+  size_t n_elements;
+  size_t n_tombstones;
+  // Rebuilt on every resize, deletions only leave stale bits behind
+  bloom_t filter;
+  // Set when the arrays live in a mapped snapshot instead of the heap
+  snapshot_mapping_t *mapping;
+} shard_arrays_t;
+
+typedef struct TableShard {
+  shard_arrays_t current;
+  // Previous arrays while an incremental resize is in progress
+  shard_arrays_t *old;
+  size_t migrate_index;
+  // Shared by both arrays, so migrating an entry doesn't touch it
+  struct in6_addr *v6_pool;
+  size_t v6_count;
+  size_t v6_capacity;
+  // Freed pool entries are chained through their first 4 bytes
+  uint32_t v6_free;
+  // Bumped whenever the current arrays are replaced, see table_scan()
+  uint64_t generation;
+} shard_t;
+
+typedef struct SnapshotState {
+  // Child writing the snapshot, 0 when none is running
+  pid_t pid;
+  int pipe_fd;
+  int64_t started_ms;
+  int64_t last_time;
+  int64_t fork_us;
+  int64_t duration_ms;
+  size_t bytes;
+  size_t n_written;
+  size_t n_failed;
+} snapshot_state_t;
+
+typedef struct HashTable {
+  shard_t shards[TABLE_SHARDS];
+  _Atomic size_t n_filter_rejects;
+  _Atomic size_t n_filter_false_positives;
+  // One timer per registration, NULL for tables without leases
+  timer_wheel_t *leases;
+  // Usernames in order for prefix searches, see table_search()
+  name_index_t *names;
+  size_t n_expired;
+  // Bytes taken by the arrays and pools of every shard
+  size_t memory_used;
+  // Growing past this many bytes is refused, 0 for no limit
+  size_t memory_limit;
+  // Registrations refused because the table could not grow
+  size_t n_rejected;
+  // Set once a refusal is logged, cleared by maintain_table()
+  bool full_reported;
+  // Mutations are appended here when set
+  journal_t *journal;
+  // And here on a node followers replicate from, see changelog.h
+  struct ChangeLog *changes;
+  snapshot_state_t snapshot;
+  // Odd while a writer is changing the table, readers retry then
+  _Atomic uint64_t seq;
+  // Old arrays are freed through here once no reader can hold them
+  epoch_t *readers;
+} hashtable_t;
+
+typedef struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_shards;
+  uint32_t key_size;
+  uint32_t value_size;
+  uint64_t checksum;
+} snapshot_header_t;
+
+// Follows the header, one per shard
+typedef struct SnapshotShard {
+  uint64_t size;
+  uint64_t n_elements;
+  uint64_t n_tombstones;
+  uint64_t filter_blocks;
+  uint64_t v6_count;
+  uint64_t v6_free;
+} snapshot_shard_t;
+
+// Summed over the shards, except for the size of the largest shard
+typedef struct TableStats {
+  size_t size;
+  size_t n_elements;
+  size_t n_tombstones;
+  size_t n_resizing;
+  size_t largest_shard;
+  size_t memory_used;
+  // Bytes taken by the name index, on top of memory_used
+  size_t index_memory;
+} table_stats_t;
+
+// Position of a table_scan() pass, a zeroed cursor starts at the first slot
+typedef struct TableCursor {
+  size_t shard;
+  size_t slot;
+  // Generation of the shard when its first slot was visited
+  uint64_t generation;
+} table_cursor_t;
+
+// Called for every entry a scan visits, returning false stops the scan there
+typedef bool (*table_visitor_t)(const userdata_t *, void *);
+
+void print_table(const hashtable_t *);
+
+void generate_table_filename(in_port_t);
+
+size_t write_table(hashtable_t *);
+
+int export_table(hashtable_t *);
+
+void start_snapshot(hashtable_t *);
+
+void finish_snapshot(hashtable_t *, bool);
+
+hashtable_t generate_hashmap(size_t);
+
+bool import_hashmap(int, size_t, hashtable_t *);
+
+void free_hashmap(hashtable_t *);
+
+uint64_t hash_username(const char *);
+
+size_t table_count(const hashtable_t *);
+
+table_stats_t table_stats(const hashtable_t *);
+
+double average_probe_length(const hashtable_t *);
+
+bool read_user(hashtable_t *, const char *, userdata_t *);
+
+bool table_get_locked(hashtable_t *, const char *, userdata_t *);
+
+void table_write_begin(hashtable_t *);
+
+void table_write_end(hashtable_t *);
+
+void resize_step(hashtable_t *, size_t);
+
+void maintain_table(hashtable_t *, int64_t);
+
+int insert(hashtable_t *, userdata_t);
+
+int delete_data(hashtable_t *, const char *);
+
+int touch_user(hashtable_t *, const char *, const ip_addr_t *, int64_t);
+
+bool table_scan(hashtable_t *, table_cursor_t *, size_t, table_visitor_t, void *);
+
+size_t table_search(const hashtable_t *, const char *, const char *, size_t, char (*)[MAX_USERNAME_LEN], bool *);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * Append-only journal of lookup table mutations. Every update or
+ * deletion is written as one small checksummed record as soon as it
+ * happens, fsync is batched on a timer. On startup the journal is
+ * replayed on top of the last table snapshot, a torn record at the
+ * tail is cut off. While a snapshot is being written the journal is
+ * rotated, the rotated file is dropped once the snapshot covers it.
+ *
+ * Record layout (host byte order):
+ *   crc32 (4) | op (1) | name length (1) | family (1) | reserved (1)
+ *   | name | address (4 or 16, updates only) | lease (8, updates only)
+ */
+
+#define _GNU_SOURCE
+
+#include "journal.h"
+#include "log.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEADER_SIZE (8)
+#define MAX_RECORD_SIZE (HEADER_SIZE + 255 + 16 + 8)
+
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+static uint32_t crc32(const uint8_t *data, size_t len) {
+  if (!crc_table_ready) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+      }
+      crc_table[i] = c;
+    }
+    crc_table_ready = true;
+  }
+
+  uint32_t crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < len; i++) {
+    crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFu;
+}
+
+int64_t journal_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t address_size(sa_family_t family) {
+  if (family == AF_INET) {
+    return sizeof(struct in_addr);
+  } else if (family == AF_INET6) {
+    return sizeof(struct in6_addr);
+  }
+  return 0;
+}
+
+/*
+ * Decodes the record at the start of the buffer. Returns its size,
+ * or 0 if the buffer holds an incomplete or corrupt record.
+ */
+
+static size_t decode_record(const uint8_t *buf, size_t len, journal_apply_t apply, void *ctx) {
+  if (len < HEADER_SIZE) {
+    return 0;
+  }
+  char op = (char) buf[4];
+  size_t name_len = buf[5];
+  sa_family_t family = buf[6] == 6 ? AF_INET6 : AF_INET;
+
+  size_t record_size = HEADER_SIZE + name_len;
+  if (op == JOURNAL_OP_UPDATE) {
+    record_size += address_size(family) + sizeof(int64_t);
+  } else if (op != JOURNAL_OP_DELETE) {
+    return 0;
+  }
+  if (name_len == 0 || name_len >= 32 || record_size > len) {
+    return 0;
+  }
+
+  uint32_t crc;
+  memcpy(&crc, buf, sizeof(crc));
+  if (crc != crc32(buf + 4, record_size - 4)) {
+    return 0;
+  }
+
+  char username[32] = { '\0' };
+  memcpy(username, buf + HEADER_SIZE, name_len);
+
+  ip_addr_t ip = { 0 };
+  int64_t lease = 0;
+  if (op == JOURNAL_OP_UPDATE) {
+    const uint8_t *cursor = buf + HEADER_SIZE + name_len;
+    ip.family = family;
+    memcpy(&ip.addr, cursor, address_size(family));
+    memcpy(&lease, cursor + address_size(family), sizeof(lease));
+  }
+  apply(op, username, &ip, lease, ctx);
+  return record_size;
+}
+
+/*
+ * Opens the journal at the given path, creating it if it doesn't
+ * exist, and replays every intact record through the given callback.
+ * Cuts off a torn or corrupt tail. Returns NULL if the file cannot be
+ * opened. Throws an assertion if a memory allocation error occurs.
+ * Call journal_close() afterwards to avoid leaks!
+ */
+
+journal_t *journal_open(const char *path, journal_apply_t apply, void *ctx) {
+  assert(path != NULL && apply != NULL);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    log_write(LOG_ERROR, "Could not open the journal \"%s\"", path);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t file_size = (size_t) st.st_size;
+  uint8_t *contents = NULL;
+  if (file_size > 0) {
+    contents = malloc(file_size);
+    assert(contents != NULL);
+    size_t total = 0;
+    while (total < file_size) {
+      ssize_t n = pread(fd, contents + total, file_size - total, (off_t) total);
+      if (n <= 0) {
+        break;
+      }
+      total += (size_t) n;
+    }
+    file_size = total;
+  }
+
+  size_t offset = 0;
+  size_t n_records = 0;
+  while (offset < file_size) {
+    size_t record_size = decode_record(contents + offset, file_size - offset, apply, ctx);
+    if (record_size == 0) {
+      break;
+    }
+    offset += record_size;
+    n_records++;
+  }
+  free(contents);
+
+  if (offset < (size_t) st.st_size) {
+    log_write(LOG_WARNING, "Dropping %lu bytes of torn journal tail", (size_t) st.st_size - offset);
+    if (ftruncate(fd, (off_t) offset) != 0) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  journal_t *journal = malloc(sizeof(journal_t));
+  assert(journal != NULL);
+  *journal = (journal_t) {
+    .fd = fd,
+    .size = offset,
+    .n_records = n_records,
+    .last_sync_ms = journal_now_ms(),
+    .dirty = false,
+  };
+  return journal;
+}
+
+void journal_close(journal_t *journal) {
+  if (journal == NULL) {
+    return;
+  }
+  journal_sync(journal, true);
+  close(journal->fd);
+  free(journal);
+}
+
+static int append_record(journal_t *journal, uint8_t *record, size_t size) {
+  uint32_t crc = crc32(record + 4, size - 4);
+  memcpy(record, &crc, sizeof(crc));
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t n = write(journal->fd, record + written, size - written);
+    if (n <= 0) {
+      log_write(LOG_ERROR, "Journal write failed");
+      return -1;
+    }
+    written += (size_t) n;
+  }
+
+  journal->size += size;
+  journal->n_records++;
+  journal->dirty = true;
+  journal_sync(journal, JOURNAL_SYNC_INTERVAL_MS == 0);
+  return 0;
+}
+
+/*
+ * Appends an update record. Returns 0 on success, -1 on failure.
+ * Throws an assertion if any of the parameters are NULL.
+ */
+
+int journal_append_update(journal_t *journal, const char *username, ip_addr_t ip, int64_t lease) {
+  assert(journal != NULL && username != NULL);
+  uint8_t record[MAX_RECORD_SIZE] = { 0 };
+  size_t name_len = strnlen(username, 31);
+  size_t addr_len = address_size(ip.family);
+  if (name_len == 0 || addr_len == 0) {
+    return -1;
+  }
+
+  record[4] = JOURNAL_OP_UPDATE;
+  record[5] = (uint8_t) name_len;
+  record[6] = ip.family == AF_INET6 ? 6 : 4;
+  memcpy(record + HEADER_SIZE, username, name_len);
+  memcpy(record + HEADER_SIZE + name_len, &ip.addr, addr_len);
+  memcpy(record + HEADER_SIZE + name_len + addr_len, &lease, sizeof(lease));
+  return append_record(journal, record, HEADER_SIZE + name_len + addr_len + sizeof(lease));
+}
+
+/*
+ * Appends a deletion record. Returns 0 on success, -1 on failure.
+ * Throws an assertion if any of the parameters are NULL.
+ */
+
+int journal_append_delete(journal_t *journal, const char *username) {
+  assert(journal != NULL && username != NULL);
+  uint8_t record[MAX_RECORD_SIZE] = { 0 };
+  size_t name_len = strnlen(username, 31);
+  if (name_len == 0) {
+    return -1;
+  }
+
+  record[4] = JOURNAL_OP_DELETE;
+  record[5] = (uint8_t) name_len;
+  memcpy(record + HEADER_SIZE, username, name_len);
+  return append_record(journal, record, HEADER_SIZE + name_len);
+}
+
+/*
+ * Flushes appended records to stable storage if JOURNAL_SYNC_INTERVAL_MS
+ * passed since the last sync, or right away if forced.
+ */
+
+void journal_sync(journal_t *journal, bool force) {
+  assert(journal != NULL);
+  if (!journal->dirty) {
+    return;
+  }
+  int64_t now = journal_now_ms();
+  if (!force && now - journal->last_sync_ms < JOURNAL_SYNC_INTERVAL_MS) {
+    return;
+  }
+  if (fdatasync(journal->fd) != 0) {
+    log_write(LOG_ERROR, "Journal fdatasync failed");
+    return;
+  }
+  journal->dirty = false;
+  journal->last_sync_ms = now;
+}
+
+/*
+ * Empties the journal once its records are covered by a snapshot.
+ * Returns 0 on success, -1 on failure.
+ */
+
+int journal_truncate(journal_t *journal) {
+  assert(journal != NULL);
+  if (ftruncate(journal->fd, 0) != 0 || fsync(journal->fd) != 0) {
+    log_write(LOG_ERROR, "Could not truncate the journal");
+    return -1;
+  }
+  journal->size = 0;
+  journal->n_records = 0;
+  journal->dirty = false;
+  return 0;
+}
+
+/*
+ * Moves the current journal to the rotated path and continues in a
+ * fresh file at the given path. Fails if a rotated journal still
+ * exists, its records are not covered by a snapshot yet. Returns 0 on
+ * success, -1 on failure.
+ */
+
+int journal_rotate(journal_t *journal, const char *path, const char *rotated_path) {
+  assert(journal != NULL && path != NULL && rotated_path != NULL);
+  if (access(rotated_path, F_OK) == 0) {
+    return -1;
+  }
+
+  journal_sync(journal, true);
+  if (rename(path, rotated_path) != 0) {
+    log_write(LOG_ERROR, "Could not rotate the journal");
+    return -1;
+  }
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_TRUNC, 0644);
+  if (fd < 0) {
+    // Keep appending to the rotated file, it will be merged back
+    log_write(LOG_ERROR, "Could not create a fresh journal");
+    return -1;
+  }
+
+  close(journal->fd);
+  journal->fd = fd;
+  journal->size = 0;
+  journal->n_records = 0;
+  journal->dirty = false;
+  return 0;
+}
+
+/*
+ * Appends the journal at the given path to the rotated journal and
+ * moves the result back to the given path, restoring a single journal
+ * in record order. Doesn't do anything if there is no rotated journal.
+ * Returns 0 on success, -1 on failure.
+ */
+
+int journal_merge(const char *rotated_path, const char *path) {
+  assert(rotated_path != NULL && path != NULL);
+  if (access(rotated_path, F_OK) != 0) {
+    return 0;
+  }
+
+  int out = open(rotated_path, O_WRONLY | O_APPEND);
+  if (out < 0) {
+    return -1;
+  }
+  int in = open(path, O_RDONLY);
+  if (in >= 0) {
+    uint8_t buf[65536];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+      if (write(out, buf, (size_t) n) != n) {
+        close(in);
+        close(out);
+        return -1;
+      }
+    }
+    close(in);
+  }
+
+  if (fsync(out) != 0) {
+    close(out);
+    return -1;
+  }
+  close(out);
+  return rename(rotated_path, path) == 0 ? 0 : -1;
+}
+
+/*
+ * Merges the rotated journal back in front of the open one after a
+ * failed snapshot, and continues appending to the merged file.
+ * Returns 0 on success, -1 on failure.
+ */
+
+int journal_reopen_merged(journal_t *journal, const char *path, const char *rotated_path) {
+  assert(journal != NULL && path != NULL && rotated_path != NULL);
+  journal_sync(journal, true);
+  if (journal_merge(rotated_path, path) != 0) {
+    log_write(LOG_ERROR, "Could not merge the rotated journal back");
+    return -1;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  close(journal->fd);
+  journal->fd = fd;
+  journal->size = (size_t) st.st_size;
+  return 0;
+}
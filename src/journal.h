@@ -0,0 +1,57 @@
+#ifndef CHAT_JOURNAL_H
+#define CHAT_JOURNAL_H
+
+#include "shared_protocol.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Appended records are fsync'ed together at most this often, 0 syncs every record
+#ifndef JOURNAL_SYNC_INTERVAL_MS
+#define JOURNAL_SYNC_INTERVAL_MS (100)
+#endif
+
+// The journal is folded into a fresh snapshot once it grows past this size
+#ifndef JOURNAL_COMPACT_BYTES
+#define JOURNAL_COMPACT_BYTES (64 * 1024 * 1024)
+#endif
+
+#define JOURNAL_OP_UPDATE ('U')
+#define JOURNAL_OP_DELETE ('D')
+
+typedef struct Journal {
+  int fd;
+  size_t size;
+  size_t n_records;
+  int64_t last_sync_ms;
+  bool dirty;
+} journal_t;
+
+/*
+ * Applies one replayed record: operation, username, address and lease.
+ * The address and lease are only meaningful for updates.
+ */
+typedef void (*journal_apply_t)(char, const char *, const ip_addr_t *, int64_t, void *);
+
+int64_t journal_now_ms();
+
+journal_t *journal_open(const char *, journal_apply_t, void *);
+
+void journal_close(journal_t *);
+
+int journal_append_update(journal_t *, const char *, ip_addr_t, int64_t);
+
+int journal_append_delete(journal_t *, const char *);
+
+void journal_sync(journal_t *, bool);
+
+int journal_truncate(journal_t *);
+
+int journal_rotate(journal_t *, const char *, const char *);
+
+int journal_merge(const char *, const char *);
+
+int journal_reopen_merged(journal_t *, const char *, const char *);
+
+#endif
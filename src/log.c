@@ -0,0 +1,222 @@
+/*
+ * Asynchronous logger. log_write() formats the message straight into a
+ * fixed-size record of a bounded lock-free ring and returns, a
+ * background thread prefixes the records with their level and writes
+ * them in batches, DEBUG and INFO to stdout, WARNING and ERROR to
+ * stderr. When the ring is full the record is dropped and counted
+ * instead of blocking the caller. Every slot carries a sequence number
+ * that tells producers and the writer whose turn it is, so producers
+ * only contend on one atomic counter.
+ */
+
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static log_record_t ring[LOG_RING_SIZE];
+static _Atomic size_t enqueue_pos = 0;
+// Only touched by the writer thread
+static size_t dequeue_pos = 0;
+static _Atomic size_t n_dropped = 0;
+static _Atomic log_level_t min_level = LOG_INFO;
+static _Atomic bool running = false;
+static _Atomic bool stopping = false;
+static pthread_t writer;
+
+static const char *level_prefix(log_level_t level) {
+  switch (level) {
+    case LOG_DEBUG:
+      return "[DEBUG] ";
+    case LOG_INFO:
+      return "[INFO] ";
+    case LOG_WARNING:
+      return "[WARNING] ";
+    default:
+      return "[ERROR] ";
+  }
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return;
+    }
+    data += written;
+    len -= (size_t) written;
+  }
+}
+
+typedef struct LogBatch {
+  int fd;
+  size_t len;
+  char data[LOG_BATCH_SIZE];
+} log_batch_t;
+
+static void batch_append(log_batch_t *batch, log_level_t level, const char *message) {
+  const char *prefix = level_prefix(level);
+  size_t prefix_len = strlen(prefix);
+  size_t message_len = strlen(message);
+  if (batch->len + prefix_len + message_len + 1 > LOG_BATCH_SIZE) {
+    write_all(batch->fd, batch->data, batch->len);
+    batch->len = 0;
+  }
+  memcpy(batch->data + batch->len, prefix, prefix_len);
+  memcpy(batch->data + batch->len + prefix_len, message, message_len);
+  batch->data[batch->len + prefix_len + message_len] = '\n';
+  batch->len += prefix_len + message_len + 1;
+}
+
+/*
+ * Formats every record in the ring into the batches and writes them
+ * out. Returns the number of records written.
+ */
+
+static size_t drain(log_batch_t *out, log_batch_t *err) {
+  size_t n_records = 0;
+  while (true) {
+    log_record_t *record = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if (atomic_load_explicit(&record->seq, memory_order_acquire) != dequeue_pos + 1) {
+      break;
+    }
+    batch_append(record->level >= LOG_WARNING ? err : out, record->level, record->message);
+    // Hands the slot back to the producers of the next turn
+    atomic_store_explicit(&record->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+    dequeue_pos++;
+    n_records++;
+  }
+
+  static size_t reported_drops = 0;
+  size_t drops = atomic_load_explicit(&n_dropped, memory_order_relaxed);
+  if (drops != reported_drops) {
+    char message[64];
+    snprintf(message, sizeof(message), "Dropped %lu log records, the ring was full", drops - reported_drops);
+    batch_append(err, LOG_WARNING, message);
+    reported_drops = drops;
+  }
+
+  write_all(out->fd, out->data, out->len);
+  write_all(err->fd, err->data, err->len);
+  out->len = 0;
+  err->len = 0;
+  return n_records;
+}
+
+static void *run_writer(void *arg) {
+  static log_batch_t out = { .fd = STDOUT_FILENO };
+  static log_batch_t err = { .fd = STDERR_FILENO };
+  while (true) {
+    // Checked before draining, so records logged before log_stop() are written
+    bool stop = atomic_load(&stopping);
+    if (drain(&out, &err) == 0) {
+      if (stop) {
+        break;
+      }
+      poll(NULL, 0, LOG_FLUSH_INTERVAL_MS);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts the writer thread, messages below the given level are
+ * discarded. Until it is started, log_write() writes synchronously.
+ * Must only be called once, call log_stop() before exiting so that
+ * no records are lost.
+ */
+
+void log_start(log_level_t level) {
+  atomic_store(&min_level, level);
+  for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+    atomic_init(&ring[i].seq, i);
+  }
+  // Whatever was printed synchronously must not end up behind the ring
+  fflush(stdout);
+  if (pthread_create(&writer, NULL, run_writer, NULL) != 0) {
+    fprintf(stderr, "[ERROR] Could not start the log writer, logging synchronously\n");
+    return;
+  }
+  atomic_store(&running, true);
+}
+
+/*
+ * Writes out every queued record and stops the writer thread. Threads
+ * that still log should be stopped first, messages logged afterwards
+ * are written synchronously.
+ */
+
+void log_stop() {
+  if (!atomic_load(&running)) {
+    return;
+  }
+  atomic_store(&stopping, true);
+  pthread_join(writer, NULL);
+  atomic_store(&running, false);
+}
+
+/*
+ * Logs a printf-style message at the given level, without the trailing
+ * newline. Never blocks on I/O once the writer is started: the message
+ * is truncated to LOG_MESSAGE_MAX bytes and dropped if the ring is full.
+ */
+
+void log_write(log_level_t level, const char *format, ...) {
+  assert(format != NULL);
+  if (level < atomic_load_explicit(&min_level, memory_order_relaxed)) {
+    return;
+  }
+
+  va_list args;
+  va_start(args, format);
+  if (!atomic_load_explicit(&running, memory_order_acquire)) {
+    FILE *stream = level >= LOG_WARNING ? stderr : stdout;
+    fputs(level_prefix(level), stream);
+    vfprintf(stream, format, args);
+    fputc('\n', stream);
+    va_end(args);
+    return;
+  }
+
+  size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+  log_record_t *record = NULL;
+  while (true) {
+    record = &ring[pos & (LOG_RING_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+    if (seq == pos) {
+      // The slot is free in this turn, claim it
+      if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (seq < pos) {
+      // The writer hasn't freed the slot since the last turn
+      atomic_fetch_add_explicit(&n_dropped, 1, memory_order_relaxed);
+      va_end(args);
+      return;
+    } else {
+      pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  record->level = level;
+  vsnprintf(record->message, LOG_MESSAGE_MAX, format, args);
+  va_end(args);
+  atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+}
+
+size_t log_dropped() {
+  return atomic_load_explicit(&n_dropped, memory_order_relaxed);
+}
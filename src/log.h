@@ -0,0 +1,37 @@
+#ifndef CHAT_LOG_H
+#define CHAT_LOG_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Must be a power of two
+#define LOG_RING_SIZE (4096)
+#define LOG_MESSAGE_MAX (240)
+// The writer thread sleeps this long when the ring is empty
+#define LOG_FLUSH_INTERVAL_MS (10)
+// Formatted records are collected up to this size before one write()
+#define LOG_BATCH_SIZE (64 * 1024)
+
+typedef enum LogLevel {
+  LOG_DEBUG,
+  LOG_INFO,
+  LOG_WARNING,
+  LOG_ERROR,
+} log_level_t;
+
+typedef struct LogRecord {
+  // Turn of the ring this record was last written or read in
+  _Atomic size_t seq;
+  log_level_t level;
+  char message[LOG_MESSAGE_MAX];
+} log_record_t;
+
+void log_start(log_level_t);
+
+void log_stop();
+
+void log_write(log_level_t, const char *, ...) __attribute__((format(printf, 2, 3)));
+
+size_t log_dropped();
+
+#endif
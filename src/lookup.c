@@ -1,16 +1,34 @@
-
 /*
  * This file implements the minimal lookup server
  * required by this project. It enables users to
  * search for users they want to message.
  *
- * Implements a hash table and HTTP server.
- * Uses open addressing in the hash table.
+ * Serves the hash table in hashtable.c over TLS, either one
+ * request per connection, as a session of text requests or as
+ * binary frames, and exposes metrics on a loopback admin port.
+ * Several nodes can split the usernames between them as a cluster,
+ * see cluster.h, and followers can serve fetches from a live copy of
+ * a node's table, see replication.h. A new process can take a running
+ * node's place without refusing a connection, see upgrade.h. Fetches
+ * are also answered over UDP, signed with the lookup key, see
+ * datagram.h.
  */
 
+#define _GNU_SOURCE
+
+#include "admission.h"
+#include "cluster.h"
+#include "datagram.h"
+#include "frame.h"
+#include "hashtable.h"
+#include "log.h"
 #include "lookup.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "replication.h"
 #include "shared_protocol.h"
 #include "ssl.h"
+#include "upgrade.h"
 
 #include <assert.h>
 #include <arpa/inet.h>
@@ -18,505 +36,1537 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <openssl/x509.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
-#include <math.h>
 #include <openssl/ssl.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-char global_table_filename[256] = { '\0' };
-
 volatile bool global_terminate_program = false;
 
+// Recorded by the workers, read by the admin endpoint
+static metrics_t metrics;
+static cluster_t cluster = { .self = -1 };
+static in_port_t lookup_port = LOOKUP_PORT;
+static volatile bool reload_requested = false;
+// Every node streams its changes to followers, unless it is one itself
+static replication_t replication;
+static replica_t replica;
+// Also set once this node handed its table over, see hand_over()
+static _Atomic bool following = false;
+static _Atomic bool handed_off = false;
+// What the process this one replaces handed over with -U, see take_over()
+static handoff_t handoff = { .conn = -1, .snapshot_fd = -1, .admin_fd = -1 };
+static char upgrade_filename[256];
+// Sheds abusive sources before their handshake, see admission.h
+static admission_t admission;
+static bool admission_enabled = true;
+// Signs the answers to datagram fetches, NULL if the lookup key can't
+static EVP_PKEY *signing_key = NULL;
+
 void terminate_signal(int n) {
   global_terminate_program = true;
 }
 
+void reload_signal(int n) {
+  reload_requested = true;
+}
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*
- * Prints the current state of the hashtable.
- * Throws an assertion if the given hashtable pointer
- * is NULL.
+ * Splits the usernames of a request ("method char|name|name|...|")
+ * into the given array. The trailing '|' is optional. Returns the
+ * number of usernames, or 0 if the request is malformed, has an empty
+ * or too long username or more than LOOKUP_BATCH_MAX of them.
  */
 
-void print_table(const hashtable_t *ht) {
-  assert(ht != NULL);
-  puts("[Info] Printing the current hash table...");
-  puts("------------------------");
-  printf("> Table Size: %lu\n", ht->size);
-  printf("> Number of Entries: %lu\n", ht->n_elements);
-  printf("> Load factor: %lf\n", ht->n_elements / (double) ht->size);
-  puts("------------------------");
-  for (size_t i = 0; i < ht->size; i++) {
-    if (ht->map[i].tombstone || ht->map[i].username[0] == '\0') {
-      printf("Index %lu: --\n", i);
-    } else {
-      char buf[INET6_ADDRSTRLEN + 1] = { '\0' };
-      ip_addr_t *ip = &ht->map[i].ip;
-      if (ip->family == AF_INET) {
-        inet_ntop(ip->family, &ip->addr.v4, buf, INET_ADDRSTRLEN);
-      } else {
-        inet_ntop(ip->family, &ip->addr.v6, buf, INET6_ADDRSTRLEN);
-      }
-      printf("Index %lu: \"%s\" -- \"%s\"\n", i, ht->map[i].username, buf);
+static size_t split_usernames(const char *msg, char (*names)[MAX_USERNAME_LEN]) {
+  if (msg[0] == '\0' || msg[1] != '|') {
+    return 0;
+  }
+
+  size_t n_names = 0;
+  const char *cursor = msg + 2;
+  while (*cursor != '\0') {
+    const char *end = strchr(cursor, '|');
+    size_t len = end != NULL ? (size_t) (end - cursor) : strlen(cursor);
+    if (len == 0 || len >= MAX_USERNAME_LEN || n_names == LOOKUP_BATCH_MAX) {
+      return 0;
     }
+    memcpy(names[n_names], cursor, len);
+    names[n_names][len] = '\0';
+    n_names++;
+    cursor += len + (end != NULL ? 1 : 0);
   }
+  return n_names;
 }
 
 /*
- * Generates and populates the global table filename.
- * Must be called only once in the program.
+ * Handles the given fetch request without taking the table lock.
+ * Throws an assertion if any of the parameters are NULL or if a heap
+ * allocation error occurs. Returns a heap-allocated response string.
+ * Expected format: "F|username|" or "F|username|username|...|"
+ * Returned format: "4 or 6|ip address|" per username, "E||" for the
+ * ones that don't exist. Returns NULL if a single username doesn't
+ * exist or if the request is malformed.
  */
 
-void generate_table_filename() {
-  const char *home_dir = getenv("HOME");
-  size_t len = strlen(home_dir);
+char *handle_fetch(const char *msg, hashtable_t *ht) {
+  assert(msg != NULL && ht != NULL);
+  char names[LOOKUP_BATCH_MAX][MAX_USERNAME_LEN];
+  size_t n_names = split_usernames(msg, names);
+  if (n_names == 0) {
+    return NULL;
+  }
 
-  memcpy(global_table_filename, home_dir, len);
-  global_table_filename[255] = '\0';
+  // Longest entry: type, two separators, address and terminator
+  char *response = malloc(n_names * (INET6_ADDRSTRLEN + 3) + 1);
+  assert(response != NULL);
+  size_t len = 0;
+  for (size_t i = 0; i < n_names; i++) {
+    userdata_t user;
+    char ip_str[INET6_ADDRSTRLEN] = { '\0' };
+    char type_char = 'E';
+    if (read_user(ht, names[i], &user)) {
+      if (user.ip.family == AF_INET) {
+        inet_ntop(AF_INET, &user.ip.addr.v4, ip_str, sizeof(ip_str));
+        type_char = '4';
+      } else if (user.ip.family == AF_INET6) {
+        inet_ntop(AF_INET6, &user.ip.addr.v6, ip_str, sizeof(ip_str));
+        type_char = '6';
+      }
+    }
+    if (type_char == 'E' && n_names == 1) {
+      free(response);
+      return NULL;
+    }
+    len += (size_t) sprintf(response + len, "%c|%s|", type_char, ip_str);
+  }
+  return response;
+}
 
-  size_t dir_len = strlen(DATA_DIR);
-  memcpy(global_table_filename + len, DATA_DIR, dir_len);
-  global_table_filename[255] = '\0';
+/*
+ * Converts the given socket address into an ip address. Returns false
+ * for families other than AF_INET and AF_INET6.
+ */
 
-  mkdir(global_table_filename, 0755);
+static bool peer_ip(const struct sockaddr_storage *addr, ip_addr_t *out) {
+  if (addr->ss_family == AF_INET) {
+    out->family = AF_INET;
+    out->addr.v4 = ((const struct sockaddr_in *) addr)->sin_addr;
+  } else if (addr->ss_family == AF_INET6) {
+    out->family = AF_INET6;
+    out->addr.v6 = ((const struct sockaddr_in6 *) addr)->sin6_addr;
+  } else {
+    return false;
+  }
+  return true;
+}
 
-  memcpy(global_table_filename + len + dir_len, STORAGE_FILE, strlen(STORAGE_FILE));
-  global_table_filename[255] = '\0';
+// A follower that bootstraps has an incomplete table, a name missing from it may well exist
+static bool table_complete() {
+  return !atomic_load_explicit(&replica.bootstrapping, memory_order_relaxed);
 }
 
 /*
- * Writes the given hash table's data to the disk.
- * Creates the file if it doesn't exist. Overwrites the existing data.
- * Throws an assertion if the table file cannot be opened or if a write
- * error occurs.
+ * Handles an update request (record new users or update existing
+ * ones), every username is registered at the sender's address.
+ * Usernames owned by another node of the cluster are refused. The
+ * caller must hold the table lock. Throws an assertion if any of the
+ * parameters are NULL or if a heap allocation error occurs. Returns a
+ * heap-allocated response string.
+ * Expected format: "U|username|" or "U|username|username|...|"
+ * Returned format: one 'K' (ok), 'M' (owned by another node) or 'E'
+ * (error) per username, NULL on failure of a single username or for
+ * a malformed request
  */
 
-void write_table(hashtable_t *ht) {
-  if (global_table_filename[0] == '\0') {
-    generate_table_filename();
+char *handle_update(const char *msg, hashtable_t *ht, struct sockaddr_storage *addr) {
+  assert(msg != NULL && ht != NULL);
+  char names[LOOKUP_BATCH_MAX][MAX_USERNAME_LEN];
+  size_t n_names = split_usernames(msg, names);
+  if (n_names == 0) {
+    return NULL;
   }
-  FILE *file = fopen(global_table_filename, "w");
-  assert(file != NULL);
 
-  fwrite(&ht->n_elements, sizeof(size_t), 1, file);
-  for (size_t i = 0; i < ht->size; i++) {
-    if (ht->map[i].tombstone == false && ht->map[i].username[0] != '\0') {
-      size_t status_code = fwrite(&ht->map[i], sizeof(userdata_t), 1, file);
-      assert(status_code == 1);
+  userdata_t data = { 0 };
+  data.last_seen = time(NULL);
+  data.lease_expiry = data.last_seen + LEASE_TTL_SECONDS;
+  if (!peer_ip(addr, &data.ip)) {
+    return NULL;
+  }
+
+  char *response = calloc(n_names + 1, sizeof(char));
+  assert(response != NULL);
+  for (size_t i = 0; i < n_names; i++) {
+    memcpy(data.username, names[i], MAX_USERNAME_LEN);
+    if (!cluster_owns(&cluster, data.username)) {
+      atomic_fetch_add_explicit(&metrics.n_moved, 1, memory_order_relaxed);
+      response[i] = MOVED_RESPONSE[0];
+      continue;
     }
+    response[i] = insert(ht, data) == 0 ? OK_RESPONSE[0] : ERR_RESPONSE[0];
+  }
+  if (n_names == 1 && response[0] != OK_RESPONSE[0]) {
+    free(response);
+    return NULL;
   }
+  return response;
+}
+
+/*
+ * Forwarder callback, sends the reply to a forwarded update or
+ * heartbeat in the format of the request it was forwarded for: a
+ * status frame, or for a text request one 'K', 'M' or 'E' per
+ * username and ERR_RESPONSE on failure of a single username.
+ */
 
-  fclose(file);
-  file = NULL;
+static void forward_done(forward_request_t *request, bool ok) {
+  pending_forward_t *pending = (pending_forward_t *) request;
+  bool failed = !ok;
+  if (pending->reply_opcode != 0) {
+    frame_t reply;
+    uint8_t out[FRAME_SIZE_MAX];
+    frame_init(&reply, pending->reply_opcode, ok ? FRAME_STATUS_OK : FRAME_STATUS_ERROR);
+    for (size_t i = 0; i < request->n_names && ok; i++) {
+      frame_put_status(&reply, request->statuses[i]);
+    }
+    connection_resume(pending->conn, (const char *) out, frame_encode(&reply, out), false);
+  } else {
+    char response[LOOKUP_BATCH_MAX + 2];
+    size_t len = 0;
+    for (size_t i = 0; i < request->n_names && ok; i++) {
+      response[len++] = request->statuses[i] == FRAME_STATUS_OK ? OK_RESPONSE[0]
+                      : request->statuses[i] == FRAME_STATUS_MOVED ? MOVED_RESPONSE[0] : ERR_RESPONSE[0];
+    }
+    if (!ok || (request->n_names == 1 && response[0] != OK_RESPONSE[0])) {
+      failed = true;
+      len = strlen(ERR_RESPONSE);
+      memcpy(response, ERR_RESPONSE, len);
+    }
+    if (pending->session) {
+      response[len++] = '\n';
+    }
+    connection_resume(pending->conn, response, len, !pending->session);
+  }
+  if (failed) {
+    atomic_fetch_add_explicit(&metrics.n_errors, 1, memory_order_relaxed);
+  }
+  free(pending);
 }
 
 /*
- * Generates the UserData hashmap. Throws an
- * assertion if a memory allocation error occurs, if the table
- * file cannot be opened, or if a read error occurs. Call free_hashmap()
- * afterwards to avoid memory leaks! Uses the table in the disk if it exists.
- * Creates the file otherwise.
+ * Defers the connection's reply and forwards the given names at the
+ * given address to the leader of this follower, see replica_forward().
+ * The reply is sent by forward_done(), as a frame with the given
+ * opcode or as text if it is 0. Must be called without the table lock.
+ * Throws an assertion if a heap allocation error occurs.
  */
 
-hashtable_t generate_hashmap() {
-  if (global_table_filename[0] == '\0') {
-    generate_table_filename();
+static void forward_names(connection_t *conn, uint8_t opcode, uint8_t reply_opcode, const ip_addr_t *ip,
+                          char (*names)[MAX_USERNAME_LEN], size_t n_names) {
+  pending_forward_t *pending = malloc(sizeof(pending_forward_t));
+  assert(pending != NULL);
+  pending->request = (forward_request_t) { .opcode = opcode, .ip = *ip, .n_names = n_names, .done = forward_done };
+  memcpy(pending->request.names, names, n_names * MAX_USERNAME_LEN);
+  pending->conn = conn;
+  pending->reply_opcode = reply_opcode;
+  pending->session = conn->protocol == LOOKUP_PROTOCOL_SESSION;
+  connection_defer(conn);
+  replica_forward(&replica, &pending->request);
+}
+
+/*
+ * Forwards an update request to the leader of this follower, which
+ * registers the usernames at the sender's address. The reply is
+ * deferred until the leader answered, see forward_done(). Returns
+ * false for a malformed request, which isn't forwarded.
+ */
+
+static bool forward_update(connection_t *conn, const char *msg) {
+  char names[LOOKUP_BATCH_MAX][MAX_USERNAME_LEN];
+  size_t n_names = split_usernames(msg, names);
+  ip_addr_t ip;
+  if (n_names == 0 || !peer_ip(&conn->peer, &ip)) {
+    return false;
   }
+  forward_names(conn, FRAME_OP_FORWARD, 0, &ip, names, n_names);
+  return true;
+}
 
-  FILE *file = fopen(global_table_filename, "r");
-  if (file == NULL) {
-    file = fopen(global_table_filename, "w");
-    assert(file != NULL);
-    if (file != NULL) {
-      fclose(file);
-      file = NULL;
-    }
-    userdata_t *map = calloc(INITIAL_TABLE_SIZE, sizeof(userdata_t));
-    assert(map != NULL);
-    return (hashtable_t){ .map = map, .size = INITIAL_TABLE_SIZE, .n_elements = 0 };
+// Takes an update token for the connection's peer, updates are always admitted with -A
+static bool admit_update(const connection_t *conn) {
+  return !admission_enabled || admission_update(&admission, &conn->peer);
+}
+
+/*
+ * Takes the table lock for a change unless this node forwards its
+ * changes. A node handing its table over starts forwarding while its
+ * writers wait for the lock, see hand_over(), so the check is repeated
+ * under the lock. Returns false without the lock if the change has to
+ * be forwarded.
+ */
+
+static bool lock_for_write() {
+  if (following) {
+    return false;
+  }
+  pthread_mutex_lock(&global_table_lock);
+  if (following) {
+    pthread_mutex_unlock(&global_table_lock);
+    return false;
   }
+  return true;
+}
 
-  hashtable_t ht;
-  size_t n_users = 0;
-  size_t status_code = fread(&n_users, sizeof(size_t), 1, file);
-  assert(status_code == 1);
-
-  userdata_t *map;
-  if (n_users != 0) {
-    map = calloc(n_users, sizeof(userdata_t));
-    assert(map != NULL);
-    ht.size = n_users;
-    ht.n_elements = n_users;
-    ht.map = map;
-    for (size_t i = 0; i < n_users; i++) {
-      userdata_t temp;
-      status_code = fread(&temp, sizeof(userdata_t), 1, file);
-      assert(status_code == 1);
-      insert(&ht, temp);
+/*
+ * Routes a single request to the relevant handler. Returns the
+ * heap-allocated response, or NULL if the request failed or its reply
+ * was deferred, see forward_update().
+ */
+
+static char *answer_request(hashtable_t *ht, connection_t *conn, const char *request) {
+  log_write(LOG_INFO, "Accepted request: %s", request);
+  int64_t started_us = now_us();
+  char *response = NULL;
+  if (request[0] == METHOD_UPDATE && !admit_update(conn)) {
+    atomic_fetch_add_explicit(&metrics.n_updates, 1, memory_order_relaxed);
+  } else if (request[0] == METHOD_UPDATE) {
+    atomic_fetch_add_explicit(&metrics.n_updates, 1, memory_order_relaxed);
+    if (lock_for_write()) {
+      // Inserting pays for a bounded slice of a pending resize
+      table_write_begin(ht);
+      response = handle_update(request, ht, &conn->peer);
+      table_write_end(ht);
+      pthread_mutex_unlock(&global_table_lock);
+    } else {
+      forward_update(conn, request);
     }
+  } else if (request[0] == METHOD_FETCH) {
+    atomic_fetch_add_explicit(&metrics.n_fetches, 1, memory_order_relaxed);
+    // Lock-free, see read_user()
+    response = table_complete() ? handle_fetch(request, ht) : NULL;
   } else {
-    map = calloc(INITIAL_TABLE_SIZE, sizeof(userdata_t));
-    assert(map != NULL);
-    ht.map = map;
-    ht.size = INITIAL_TABLE_SIZE;
-    ht.n_elements = 0;
+    atomic_fetch_add_explicit(&metrics.n_unknown, 1, memory_order_relaxed);
   }
-  
-  fclose(file);
-  file = NULL;
-  return ht;
-}
-
-void free_hashmap(hashtable_t *hm) {
-  free(hm->map);
-  hm->map = NULL;
+  histogram_record(&metrics.handler_us, (uint64_t) (now_us() - started_us));
+  if (conn->deferred) {
+    log_write(LOG_INFO, "Forwarded the request to the leader");
+    return NULL;
+  }
+  if (response == NULL) {
+    atomic_fetch_add_explicit(&metrics.n_errors, 1, memory_order_relaxed);
+  }
+  log_write(LOG_INFO, "Sent reply: %s", response != NULL ? response : ERR_RESPONSE);
+  return response;
 }
 
 /*
- * Finds and returns the index of the given username. Returns -1
- * if the given user does not exist in the hashtable. Throws an
- * assertion if any of the parameters are NULL.
+ * Answers every complete line in the session's input buffer in order,
+ * one reply line each. A trailing partial line waits for the next read,
+ * the lines behind a deferred reply wait until it is sent.
  */
 
-int get_index(hashtable_t *ht, const char *username) {
-  assert(ht != NULL && username != NULL && ht->map != NULL);
+static void serve_session(hashtable_t *ht, connection_t *conn) {
+  size_t start = 0;
+  char *end = NULL;
+  while ((end = memchr(conn->in + start, '\n', conn->in_len - start)) != NULL) {
+    char *line = conn->in + start;
+    start = (size_t) (end - conn->in) + 1;
+    *end = '\0';
+    if (end > line && end[-1] == '\r') {
+      end[-1] = '\0';
+    }
 
-  size_t name_len = strlen(username);
-  int hash_val = 0;
-  for (size_t i = 0; i < name_len; i++) {
-    hash_val += ((int) username[i]) * pow(HASH_PRIME, i);
+    char *response = line[0] != '\0' ? answer_request(ht, conn, line) : NULL;
+    if (conn->deferred) {
+      break;
+    }
+    const char *reply = response != NULL ? response : ERR_RESPONSE;
+    connection_reply(conn, reply, strlen(reply), false);
+    connection_reply(conn, "\n", 1, false);
+    free(response);
   }
-  hash_val %= ht->size;
+  memmove(conn->in, conn->in + start, conn->in_len - start);
+  conn->in_len -= start;
+}
 
-  // Case 1: does not exist
-  if (ht->map[hash_val].tombstone == false && ht->map[hash_val].username[0] == '\0') {
-    return -1;
+/*
+ * Answers a transfer frame from another node of the cluster, which
+ * hands off registrations this node owns now. A registration that is
+ * already here with a later lease was renewed since and is kept, it
+ * counts as taken. Frames from anyone who doesn't present the
+ * cluster's certificate or with a malformed entry fail as a whole.
+ */
+
+static void answer_transfer(hashtable_t *ht, connection_t *conn, const frame_t *request, frame_t *reply) {
+  userdata_t entries[FRAME_PAYLOAD_MAX / FRAME_TRANSFER_ENTRY_MIN];
+  size_t n_entries = 0;
+  size_t offset = 0;
+  while (offset < request->length) {
+    userdata_t *data = &entries[n_entries];
+    uint32_t lease = 0, last_seen = 0;
+    *data = (userdata_t) { 0 };
+    if (!frame_get_name(request, &offset, data->username) || !frame_get_addr(request, &offset, &data->ip)
+        || data->ip.family == AF_UNSPEC || !frame_get_u32(request, &offset, &lease)
+        || !frame_get_u32(request, &offset, &last_seen)) {
+      reply->status = FRAME_STATUS_ERROR;
+      return;
+    }
+    data->lease_expiry = lease;
+    data->last_seen = last_seen;
+    n_entries++;
   }
-  else {
-    // Quadratic probing
-    int i = 1;
-    int index = hash_val;
-    do {
-      if (ht->map[index].tombstone == false && strcmp(username, ht->map[index].username) == 0) {
-        return index;
-      }
-      index = (index + i * i) % ht->size;
-      i++;
-    } while (index != hash_val);
+  if (following || !cluster_is_peer(conn->ssl)) {
+    log_write(LOG_WARNING, "Refused a transfer from a peer outside the cluster");
+    reply->status = FRAME_STATUS_ERROR;
+    return;
   }
-
-  return -1;
+  // The sending node retries, and reaches the process this one was handed over to then
+  if (!lock_for_write()) {
+    reply->status = FRAME_STATUS_ERROR;
+    return;
+  }
+  for (size_t i = 0; i < n_entries; i++) {
+    if (!cluster_owns(&cluster, entries[i].username)) {
+      frame_put_status(reply, FRAME_STATUS_MOVED);
+      continue;
+    }
+    userdata_t existing;
+    if (table_get_locked(ht, entries[i].username, &existing) && existing.lease_expiry >= entries[i].lease_expiry) {
+      frame_put_status(reply, FRAME_STATUS_OK);
+      continue;
+    }
+    table_write_begin(ht);
+    int status_code = insert(ht, entries[i]);
+    table_write_end(ht);
+    frame_put_status(reply, status_code == 0 ? FRAME_STATUS_OK : FRAME_STATUS_ERROR);
+    atomic_fetch_add_explicit(&metrics.n_transferred, status_code == 0 ? 1 : 0, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&global_table_lock);
 }
 
 /*
- * Resizes the given hash table's array by the compile-time
- * constant RESIZE_FACTOR. Sets size to MAX_TABLE_SIZE if resizing by
- * RESIZE_FACTOR causes the table to have a larger length than MAX_TABLE_SIZE.
- * Doesn't do anything if the hashtable's size is already MAX_TABLE_SIZE.
- * Throws an assertion if the passed parameter is NULL, if a memory allocation
- * error occurs, or if rehashing all elements fails.
+ * Registers the given names at the given address, one status per name
+ * goes into the reply. Names another node of the cluster owns get
+ * FRAME_STATUS_MOVED. A follower forwards them to its leader instead
+ * and defers the connection's reply, see forward_names().
  */
 
-void resize(hashtable_t *ht) {
-  assert(ht != NULL);
+static void update_names(hashtable_t *ht, connection_t *conn, const ip_addr_t *ip, char (*names)[MAX_USERNAME_LEN],
+                         size_t n_names, frame_t *reply) {
+  if (!lock_for_write()) {
+    forward_names(conn, FRAME_OP_FORWARD, reply->opcode, ip, names, n_names);
+    return;
+  }
 
-  size_t old_size = ht->size; 
+  userdata_t data = { 0 };
+  data.ip = *ip;
+  data.last_seen = time(NULL);
+  data.lease_expiry = data.last_seen + LEASE_TTL_SECONDS;
+  table_write_begin(ht);
+  for (size_t i = 0; i < n_names; i++) {
+    memcpy(data.username, names[i], MAX_USERNAME_LEN);
+    if (!cluster_owns(&cluster, data.username)) {
+      atomic_fetch_add_explicit(&metrics.n_moved, 1, memory_order_relaxed);
+      frame_put_status(reply, FRAME_STATUS_MOVED);
+      continue;
+    }
+    frame_put_status(reply, insert(ht, data) == 0 ? FRAME_STATUS_OK : FRAME_STATUS_ERROR);
+  }
+  table_write_end(ht);
+  pthread_mutex_unlock(&global_table_lock);
+}
 
-  // This is never going to happen, so something's wrong if it executes
-  if (ht->size == MAX_TABLE_SIZE) {
+/*
+ * Refreshes the last-seen time of the given names if they are
+ * registered at the given address, one status per name goes into the
+ * reply. Only takes the table lock for lookups, see touch_user(). Names
+ * another node of the cluster owns get FRAME_STATUS_MOVED. A follower
+ * forwards them to its leader instead and defers the connection's
+ * reply, see forward_names().
+ */
+
+static void heartbeat_names(hashtable_t *ht, connection_t *conn, const ip_addr_t *ip,
+                            char (*names)[MAX_USERNAME_LEN], size_t n_names, frame_t *reply) {
+  if (!lock_for_write()) {
+    forward_names(conn, FRAME_OP_FORWARD_HEARTBEAT, reply->opcode, ip, names, n_names);
     return;
   }
-  // Overflow, I expect this to never occur
-  else if (ht->size * RESIZE_FACTOR > MAX_TABLE_SIZE) {
-    ht->size = MAX_TABLE_SIZE;
-  } else {
-    ht->size *= RESIZE_FACTOR;
-  }
 
-  userdata_t *temp_map = calloc(ht->size, sizeof(userdata_t));
-  hashtable_t temp_table = { .map = temp_map, .size = ht->size, .n_elements = 0 };
-  for (size_t i = 0; i < old_size; i++) {
-    if (ht->map[i].tombstone == false && ht->map[i].username[0] != '\0') {
-      int status_code = insert(&temp_table, ht->map[i]);
-      assert(status_code != -1);
+  int64_t now = time(NULL);
+  for (size_t i = 0; i < n_names; i++) {
+    if (!cluster_owns(&cluster, names[i])) {
+      atomic_fetch_add_explicit(&metrics.n_moved, 1, memory_order_relaxed);
+      frame_put_status(reply, FRAME_STATUS_MOVED);
+      continue;
     }
+    frame_put_status(reply, touch_user(ht, names[i], ip, now) == 0 ? FRAME_STATUS_OK : FRAME_STATUS_ERROR);
   }
-
-  free(ht->map);
-  ht->map = temp_map;
-  ht->n_elements = temp_table.n_elements;
+  pthread_mutex_unlock(&global_table_lock);
 }
 
 /*
- * Inserts the given data to the hash table. Resizes the
- * table if necessary. Throws an assertion if the passed
- * parameters are NULL or invalid. Returns 0 on success,
- * 1 on failure. If the given user's username already exists,
- * updates the existing data with the new data.
+ * Answers a prefix search with a page of names from the name index,
+ * see FRAME_OP_SEARCH. Followers answer from their copy of the table,
+ * cluster nodes with the names they hold, the client merges the pages
+ * of every node. The table lock is held for one descent of the index
+ * and a page of names, which bounds the time a search can stall
+ * writers for.
  */
 
-int insert(hashtable_t *ht, userdata_t data) {
-  assert(ht != NULL && data.username != NULL && data.tombstone == false);
+static void answer_search(hashtable_t *ht, const frame_t *request, frame_t *reply) {
+  static_assert(1 + SEARCH_PAGE_MAX * (1 + FRAME_NAME_MAX) <= FRAME_PAYLOAD_MAX, "a page must fit in a reply");
+  atomic_fetch_add_explicit(&metrics.n_searches, 1, memory_order_relaxed);
+  char prefix[MAX_USERNAME_LEN], after[MAX_USERNAME_LEN] = { '\0' };
+  size_t offset = 1;
+  size_t page_size = request->length != 0 ? request->payload[0] : 0;
+  bool valid = page_size >= 1 && page_size <= SEARCH_PAGE_MAX && frame_get_name(request, &offset, prefix)
+            && (offset == request->length || (frame_get_name(request, &offset, after) && offset == request->length));
+  if (!valid || !table_complete()) {
+    reply->status = FRAME_STATUS_ERROR;
+    return;
+  }
 
-  // If new point exists, update
-  int existing_index = get_index(ht, data.username);
-  if (existing_index != -1) {
-    ht->map[existing_index] = data;
-    return 0;
+  char names[SEARCH_PAGE_MAX][MAX_USERNAME_LEN];
+  bool more = false;
+  pthread_mutex_lock(&global_table_lock);
+  int64_t started_us = now_us();
+  size_t n_names = table_search(ht, prefix, after, page_size, names, &more);
+  histogram_record(&metrics.search_us, (uint64_t) (now_us() - started_us));
+  pthread_mutex_unlock(&global_table_lock);
+  frame_put_status(reply, more ? 1 : 0);
+  for (size_t i = 0; i < n_names; i++) {
+    frame_put_name(reply, names[i]);
   }
+}
 
-  if ((ht->n_elements + 1) / (double) ht->size >= LOAD_FACTOR) {
-    resize(ht);
+/*
+ * Answers a binary request frame into the given reply frame, which
+ * carries one entry per requested name. A malformed name or more than
+ * LOOKUP_BATCH_MAX of them fail the whole request with
+ * FRAME_STATUS_ERROR. Forwarded updates and heartbeats are only taken
+ * from followers, which present the lookup certificate, and carry the
+ * address of the client that sent them first. A node that handed its
+ * table over passes them on to the process that took it.
+ */
+
+static void answer_frame(hashtable_t *ht, connection_t *conn, const frame_t *request, frame_t *reply) {
+  if (request->opcode == FRAME_OP_TRANSFER) {
+    frame_init(reply, request->opcode, FRAME_STATUS_OK);
+    answer_transfer(ht, conn, request, reply);
+    return;
+  }
+  if (request->opcode == FRAME_OP_SEARCH) {
+    frame_init(reply, request->opcode, FRAME_STATUS_OK);
+    answer_search(ht, request, reply);
+    return;
   }
 
-  size_t name_len = strlen(data.username);
-  int hash_val = 0;
-  for (size_t i = 0; i < name_len; i++) {
-    hash_val += ((int) data.username[i]) * pow(HASH_PRIME, i);
+  ip_addr_t forwarded_ip = { 0 };
+  size_t offset = 0;
+  bool forwarded = request->opcode == FRAME_OP_FORWARD || request->opcode == FRAME_OP_FORWARD_HEARTBEAT;
+  if (forwarded && !frame_get_addr(request, &offset, &forwarded_ip)) {
+    offset = request->length + 1;
+  }
+  char names[LOOKUP_BATCH_MAX][MAX_USERNAME_LEN];
+  size_t n_names = 0;
+  while (n_names < LOOKUP_BATCH_MAX && frame_get_name(request, &offset, names[n_names])) {
+    n_names++;
+  }
+  frame_init(reply, request->opcode, FRAME_STATUS_OK);
+  if (n_names == 0 || offset != request->length) {
+    reply->status = FRAME_STATUS_ERROR;
+    return;
   }
-  hash_val %= ht->size;
 
-  // Quadratic probing
-  int i = 1;
-  int index = hash_val;
-  do {
-    // Empty spot found
-    if (ht->map[index].tombstone == true || ht->map[index].username[0] == '\0') {
-      ht->map[index] = data;
-      ht->n_elements++;
-      return 0;
+  if (request->opcode == FRAME_OP_FETCH) {
+    atomic_fetch_add_explicit(&metrics.n_fetches, 1, memory_order_relaxed);
+    if (!table_complete()) {
+      reply->status = FRAME_STATUS_ERROR;
+      return;
+    }
+    for (size_t i = 0; i < n_names; i++) {
+      userdata_t user;
+      // Lock-free, see read_user()
+      bool found = read_user(ht, names[i], &user);
+      frame_put_addr(reply, found ? &user.ip : NULL);
+      frame_put_u32(reply, found ? (uint32_t) user.last_seen : 0);
+    }
+  } else if (request->opcode == FRAME_OP_UPDATE) {
+    atomic_fetch_add_explicit(&metrics.n_updates, 1, memory_order_relaxed);
+    ip_addr_t ip;
+    if (!admit_update(conn) || !peer_ip(&conn->peer, &ip)) {
+      reply->status = FRAME_STATUS_ERROR;
+      return;
+    }
+    update_names(ht, conn, &ip, names, n_names, reply);
+  } else if (request->opcode == FRAME_OP_HEARTBEAT) {
+    atomic_fetch_add_explicit(&metrics.n_heartbeats, 1, memory_order_relaxed);
+    ip_addr_t ip;
+    if (!admit_update(conn) || !peer_ip(&conn->peer, &ip)) {
+      reply->status = FRAME_STATUS_ERROR;
+      return;
+    }
+    heartbeat_names(ht, conn, &ip, names, n_names, reply);
+  } else if (forwarded) {
+    bool heartbeat = request->opcode == FRAME_OP_FORWARD_HEARTBEAT;
+    atomic_fetch_add_explicit(heartbeat ? &metrics.n_heartbeats : &metrics.n_updates, 1, memory_order_relaxed);
+    if ((following && !handed_off) || forwarded_ip.family == AF_UNSPEC || !cluster_is_peer(conn->ssl)) {
+      log_write(LOG_WARNING, "Refused a forwarded update from a peer that is no follower");
+      reply->status = FRAME_STATUS_ERROR;
+      return;
+    }
+    if (heartbeat) {
+      heartbeat_names(ht, conn, &forwarded_ip, names, n_names, reply);
+    } else {
+      update_names(ht, conn, &forwarded_ip, names, n_names, reply);
     }
-    index = (index + i * i) % ht->size;
-    i++;
-  } while (index != hash_val);
-  return -1;
+  } else {
+    atomic_fetch_add_explicit(&metrics.n_unknown, 1, memory_order_relaxed);
+    reply->status = FRAME_STATUS_ERROR;
+  }
 }
 
 /*
- * Finds and *LAZILY* deletes the given user from the given hash table.
- * Returns -1 if the given user does not exist in the hashmap.
- * Returns 0 on success. Throws an assertion if any of the
- * parameters are NULL.
+ * Hands the connection over to the replication if the request is a
+ * valid FRAME_OP_REPLICATE from a follower, which presents the lookup
+ * certificate, as the first frame of its connection. Anything else
+ * gets an error frame and the connection is closed.
  */
 
-int delete_data(hashtable_t *ht, const char *username) {
-  assert(ht != NULL && username != NULL);
-  int index = get_index(ht, username);
-  if (index == -1) {
-    return -1;
+static void start_replication(connection_t *conn, const frame_t *request) {
+  uint64_t stream = 0, from = 0;
+  size_t offset = 0;
+  bool valid = !following && conn->out_len == 0 && frame_get_u64(request, &offset, &stream)
+               && frame_get_u64(request, &offset, &from) && offset == request->length;
+  if (valid && cluster_is_peer(conn->ssl)
+      && replication_serve(&replication, conn->ssl, conn->fd, stream, from) == 0) {
+    connection_detach(conn);
+    return;
   }
-  ht->map[index].tombstone = true;
-  ht->n_elements--;
-  return 0;
+  log_write(LOG_WARNING, "Refused a replication request");
+  atomic_fetch_add_explicit(&metrics.n_errors, 1, memory_order_relaxed);
+  frame_t reply;
+  uint8_t out[FRAME_SIZE_MAX];
+  frame_init(&reply, request->opcode, FRAME_STATUS_ERROR);
+  connection_reply(conn, (const char *) out, frame_encode(&reply, out), true);
 }
 
 /*
- * Handles the given fetch request. Returns NULL if the
- * given username doesn't exist in the hash table.
- * Throws an assertion if any of the parameters are NULL or
- * if a heap allocation error occurs. Returns a heap-allocated response string. 
- * Expected format: "method char|username|"
- * Returned format: "4 or 6|ip address|"
+ * Answers every complete frame in the connection's input buffer in
+ * order. A frame split over several reads waits in the buffer until it
+ * is complete, so do the frames behind a deferred reply. Garbage or an
+ * unsupported version get an error frame and the connection is closed.
  */
 
-char *handle_fetch(const char *msg, hashtable_t *ht) {
-  char buf[MAX_USERNAME_LEN] = { '\0' };
-  int status_code = sscanf(msg, "%*c|%31[^|]|", buf);
-  buf[31] = '\0';
-  // The discarded char is not counted
-  if (status_code != 1) {
-    return NULL;
+static void serve_frames(hashtable_t *ht, connection_t *conn) {
+  static_assert(FRAME_SIZE_MAX < CONNECTION_BUFFER_SIZE, "a full frame must fit in the input buffer");
+  const uint8_t *in = (const uint8_t *) conn->in;
+  size_t start = 0;
+  frame_t request, reply;
+  uint8_t out[FRAME_SIZE_MAX];
+  while (start < conn->in_len) {
+    long frame_len = frame_decode(in + start, conn->in_len - start, &request);
+    if (frame_len == 0) {
+      break;
+    }
+    if (frame_len < 0 || request.version != FRAME_VERSION) {
+      log_write(LOG_WARNING, "Closing a connection after an invalid frame");
+      atomic_fetch_add_explicit(&metrics.n_invalid, 1, memory_order_relaxed);
+      frame_init(&reply, frame_len < 0 ? 0 : request.opcode, frame_len < 0 ? FRAME_STATUS_ERROR : FRAME_STATUS_VERSION);
+      connection_reply(conn, (const char *) out, frame_encode(&reply, out), true);
+      conn->in_len = 0;
+      return;
+    }
+    start += (size_t) frame_len;
+    if (request.opcode == FRAME_OP_REPLICATE) {
+      start_replication(conn, &request);
+      conn->in_len = 0;
+      return;
+    }
+
+    log_write(LOG_INFO, "Accepted frame: opcode %d, %u bytes", request.opcode, request.length);
+    int64_t started_us = now_us();
+    answer_frame(ht, conn, &request, &reply);
+    histogram_record(&metrics.handler_us, (uint64_t) (now_us() - started_us));
+    if (conn->deferred) {
+      // The frames behind it wait until its reply is sent, replies keep the order of the requests
+      break;
+    }
+    if (reply.status != FRAME_STATUS_OK) {
+      atomic_fetch_add_explicit(&metrics.n_errors, 1, memory_order_relaxed);
+    }
+    connection_reply(conn, (const char *) out, frame_encode(&reply, out), false);
   }
-  int index = get_index(ht, buf);
-  if (index == -1) {
-    return NULL;
+  memmove(conn->in, conn->in + start, conn->in_len - start);
+  conn->in_len -= start;
+}
+
+/*
+ * Reactor callback. A connection whose first byte is FRAME_MAGIC
+ * speaks binary frames, see serve_frames(). A connection that starts
+ * with the session hello stays open and is served line by line, see
+ * serve_session(). Any other connection sends a single text request
+ * and is closed once the reply is written, invalid requests are closed
+ * without a reply.
+ */
+
+static void serve_request(connection_t *conn, void *ctx) {
+  hashtable_t *ht = (hashtable_t *) ctx;
+  if (conn->protocol == LOOKUP_PROTOCOL_SINGLE && (uint8_t) conn->in[0] == FRAME_MAGIC) {
+    conn->protocol = LOOKUP_PROTOCOL_BINARY;
+  }
+  if (conn->protocol == LOOKUP_PROTOCOL_BINARY) {
+    serve_frames(ht, conn);
+    return;
+  }
+  if (conn->protocol == LOOKUP_PROTOCOL_SESSION) {
+    serve_session(ht, conn);
+    return;
   }
-  ip_addr_t ip = ht->map[index].ip;
 
-  const void *src = NULL;
-  size_t len = 0;
-  char type_char = 'X';
-  if (ip.family == AF_INET) {
-    src = &ip.addr.v4;
-    len = INET_ADDRSTRLEN;
-    type_char = '4';
-  } else if (ip.family == AF_INET6) {
-    src = &ip.addr.v6;
-    len = INET6_ADDRSTRLEN;
-    type_char = '6';
-  } else {
-    return NULL;
+  char *buf = conn->in;
+  int bytes_read = (int) conn->in_len;
+  log_write(LOG_DEBUG, "%d bytes received, request: %s", bytes_read, buf);
+
+  if (bytes_read >= 2 && buf[0] == METHOD_SESSION && buf[1] == '|') {
+    char *end = memchr(buf, '\n', conn->in_len);
+    if (end == NULL) {
+      // Wait for the rest of the hello line
+      return;
+    }
+    size_t hello_len = (size_t) (end - buf) + 1;
+    memmove(buf, buf + hello_len, conn->in_len - hello_len);
+    conn->in_len -= hello_len;
+    conn->protocol = LOOKUP_PROTOCOL_SESSION;
+    connection_reply(conn, OK_RESPONSE, strlen(OK_RESPONSE), false);
+    connection_reply(conn, "\n", 1, false);
+    // Requests may have been pipelined right behind the hello
+    serve_session(ht, conn);
+    return;
   }
-  
-  char *ip_str = calloc(sizeof(char), len);
-  assert(ip_str != NULL);
-  inet_ntop(ip.family, src, ip_str, len);
-  char *response = malloc(sizeof(char) * len + 4);
-  assert(response != NULL);
-  sprintf(response, "%c|%s|", type_char, ip_str);
-  response[len + 4] = '\0';
-  free(ip_str);
+  conn->in_len = 0;
 
-  return response;
+  if (bytes_read != 0 && (buf[bytes_read - 1] == '\r'
+                      || buf[bytes_read - 1] == '\n')) {
+    buf[bytes_read - 1] = '\0';
+    bytes_read--;
+  }
+
+  char method = '\0';
+  if (bytes_read == 0 || sscanf(buf, "%c", &method) != 1) {
+    atomic_fetch_add_explicit(&metrics.n_invalid, 1, memory_order_relaxed);
+    connection_reply(conn, NULL, 0, true);
+    return;
+  }
+
+  char *response = answer_request(ht, conn, buf);
+  if (conn->deferred) {
+    return;
+  }
+  const char *reply = response != NULL ? response : ERR_RESPONSE;
+  connection_reply(conn, reply, strlen(reply), true);
+  free(response);
+}
+
+static bool same_ip(const ip_addr_t *a, const ip_addr_t *b) {
+  if (a->family != b->family) {
+    return false;
+  }
+  if (a->family == AF_INET) {
+    return a->addr.v4.s_addr == b->addr.v4.s_addr;
+  }
+  return a->family != AF_INET6 || memcmp(&a->addr.v6, &b->addr.v6, sizeof(struct in6_addr)) == 0;
 }
 
 /*
- * Handles an update request (record new user or update existing).
- * Throws an assertion if any of the parameters are NULL or if a
- * heap allocation error occurs. Returns a heap-allocated response
- * string.
- * Expected format: "U|username|"
- * Returned format: "K (ok)" or NULL on failure
+ * Returns the signed answer to a datagram fetch of the given username.
+ * Answers are cached per worker and only signed anew once the
+ * registration changed, including its last-seen time, or half of the
+ * signature's lifetime is over, so a popular name costs one signature
+ * per heartbeat at most. Names that aren't registered aren't signed
+ * for at all, so made-up names can't make a worker sign, their clients
+ * ask over TLS. Returns NULL if the name isn't registered, the table
+ * is incomplete or the answer couldn't be signed, and sets missed in
+ * the first case.
  */
 
-char *handle_update(const char *msg, hashtable_t *ht, struct sockaddr_storage *addr) {
-  assert(msg != NULL && ht != NULL);
-
-  userdata_t data = { 0 };
-  data.tombstone = false;
-  int status_code = sscanf(msg, "%*c|%32[^|]|", data.username);
-  if (status_code != 1) {
+static const datagram_answer_t *answer_datagram(worker_t *worker, hashtable_t *ht, const char *username,
+                                                uint32_t now, bool *missed) {
+  userdata_t user;
+  *missed = false;
+  if (!table_complete()) {
     return NULL;
   }
-  data.username[31] = '\0';
-
-  if (addr->ss_family == AF_INET) {
-    data.ip.family = AF_INET;
-    data.ip.addr.v4 = ((struct sockaddr_in *) addr)->sin_addr;
-  } else if (addr->ss_family == AF_INET6) {
-    data.ip.family = AF_INET6;
-    data.ip.addr.v6 = ((struct sockaddr_in6 *) addr)->sin6_addr;
-  } else {
+  // Lock-free, see read_user()
+  if (!read_user(ht, username, &user)) {
+    *missed = true;
     return NULL;
   }
+  uint32_t last_seen = (uint32_t) user.last_seen;
 
-  int result = insert(ht, data);
-  return result == 0 ? strdup(OK_RESPONSE) : NULL;
+  datagram_answer_t *answer = &worker->answers[hash_username(username) & (DATAGRAM_CACHE_SLOTS - 1)];
+  if (answer->len != 0 && strcmp(answer->username, username) == 0 && same_ip(&answer->ip, &user.ip)
+      && answer->last_seen == last_seen && answer->expires > now + DATAGRAM_SIGNATURE_SECONDS / 2) {
+    return answer;
+  }
+  *answer = (datagram_answer_t) { .ip = user.ip, .last_seen = last_seen, .expires = now + DATAGRAM_SIGNATURE_SECONDS };
+  strcpy(answer->username, username);
+  atomic_fetch_add_explicit(&metrics.n_signatures, 1, memory_order_relaxed);
+  if (!datagram_sign(answer, signing_key)) {
+    answer->len = 0;
+    return NULL;
+  }
+  return answer;
 }
 
 /*
- * Initializes an input using given SSL_CTX pointer and
- * routes the received request to the relevant handler.
- * Throws an assertion if any of the parameters are NULL.
+ * Answers up to DATAGRAM_BATCH fetch queries waiting on a worker's
+ * datagram socket, the reactor calls it again while more are waiting.
+ * Anything but a valid query is dropped without a reply, so is a query
+ * the admission control sheds, before any signing, see
+ * admission_datagram(). A query that can't be answered, a miss
+ * included, gets an unsigned error, so that its client falls back to
+ * TLS right away. Replies that don't fit into the socket's
+ * buffer are dropped, their clients fall back as well.
  */
 
-void endpoint_manager(SSL_CTX *ctx, hashtable_t *ht) {
-  assert(ctx != NULL && ht != NULL);
-  signal(SIGINT, terminate_signal);
+static void serve_datagrams(int fd, void *arg) {
+  worker_t *worker = (worker_t *) arg;
+  hashtable_t *ht = (hashtable_t *) worker->reactor->handler_ctx;
+  uint8_t in[DATAGRAM_BATCH][DATAGRAM_QUERY_SIZE];
+  uint8_t out[DATAGRAM_BATCH][DATAGRAM_QUERY_SIZE];
+  struct sockaddr_storage peers[DATAGRAM_BATCH];
+  struct iovec in_iov[DATAGRAM_BATCH], out_iov[DATAGRAM_BATCH];
+  struct mmsghdr queries[DATAGRAM_BATCH], replies[DATAGRAM_BATCH];
+  for (size_t i = 0; i < DATAGRAM_BATCH; i++) {
+    in_iov[i] = (struct iovec) { .iov_base = in[i], .iov_len = sizeof(in[i]) };
+    queries[i] = (struct mmsghdr) {
+      .msg_hdr = { .msg_name = &peers[i], .msg_namelen = sizeof(peers[i]), .msg_iov = &in_iov[i], .msg_iovlen = 1 },
+    };
+  }
+  int n_queries = recvmmsg(fd, queries, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+  if (n_queries <= 0) {
+    return;
+  }
+
+  uint32_t now = (uint32_t) time(NULL);
+  unsigned n_replies = 0;
+  for (int i = 0; i < n_queries; i++) {
+    uint32_t id = 0;
+    char username[FRAME_NAME_MAX + 1];
+    int query = datagram_decode_query(in[i], queries[i].msg_len, &id, username);
+    if (query < 0) {
+      atomic_fetch_add_explicit(&metrics.n_datagrams_dropped, 1, memory_order_relaxed);
+      continue;
+    }
+    if (admission_enabled && !admission_datagram(&admission, &peers[i])) {
+      continue;
+    }
+    bool missed = false;
+    const datagram_answer_t *answer = query == 0 ? answer_datagram(worker, ht, username, now, &missed) : NULL;
+    uint8_t status = answer != NULL ? FRAME_STATUS_OK : query == 0 ? FRAME_STATUS_ERROR : FRAME_STATUS_VERSION;
+    atomic_fetch_add_explicit(answer != NULL ? &metrics.n_datagrams
+                              : missed ? &metrics.n_datagrams_missed : &metrics.n_datagrams_refused,
+                              1, memory_order_relaxed);
+    out_iov[n_replies] = (struct iovec) {
+      .iov_base = out[n_replies],
+      .iov_len = datagram_encode_reply(id, status, answer, out[n_replies]),
+    };
+    replies[n_replies] = (struct mmsghdr) {
+      .msg_hdr = {
+        .msg_name = &peers[i],
+        .msg_namelen = queries[i].msg_hdr.msg_namelen,
+        .msg_iov = &out_iov[n_replies],
+        .msg_iovlen = 1,
+      },
+    };
+    n_replies++;
+  }
+  if (n_replies > 0) {
+    sendmmsg(fd, replies, n_replies, MSG_DONTWAIT);
+  }
+}
+
+/*
+ * Opens a listening socket on the lookup port. SO_REUSEPORT lets every
+ * worker bind its own socket, the kernel spreads new connections over
+ * them. Returns the socket, or -1 on failure.
+ */
 
+static int open_endpoint() {
   int endpoint = socket(AF_INET6, SOCK_STREAM, 0);
-  if (endpoint == 0) {
-    fprintf(stderr, "[ERROR] Failed initializing endpoint socket (%d)\n", errno);
-    return;
+  if (endpoint < 0) {
+    log_write(LOG_ERROR, "Failed initializing endpoint socket (%d)", errno);
+    return -1;
   }
 
   int opt = 1;
-  if (setsockopt(endpoint, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0) {
-    fprintf(stderr, "[ERROR] setsockopt() failed (%d)\n", errno);
-    return;
+  if (setsockopt(endpoint, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0
+      || setsockopt(endpoint, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0) {
+    log_write(LOG_ERROR, "setsockopt() failed (%d)", errno);
+    close(endpoint);
+    return -1;
   }
 
   struct sockaddr_in6 addr = { 0 };
   int addr_size = sizeof(addr);
   addr.sin6_family = AF_INET6;
   addr.sin6_addr = in6addr_any;
-  addr.sin6_port = htons(LOOKUP_PORT);
+  addr.sin6_port = htons(lookup_port);
 
   if (bind(endpoint, (struct sockaddr *) &addr, (socklen_t) addr_size) < 0) {
-    fprintf(stderr, "[ERROR] bind() failed (%d)\n", errno);
-    return;
+    log_write(LOG_ERROR, "bind() failed (%d)", errno);
+    close(endpoint);
+    return -1;
   }
 
-  if (listen(endpoint, 10) < 0) {
-    fprintf(stderr, "[ERROR] listen() failed (%d)\n", errno);
-    return;
+  if (listen(endpoint, SOMAXCONN) < 0) {
+    log_write(LOG_ERROR, "listen() failed (%d)", errno);
+    close(endpoint);
+    return -1;
   }
-  printf("[INFO] Listening on port %d...\n", LOOKUP_PORT);
+  return endpoint;
+}
 
+/*
+ * Opens a UDP socket on the lookup port for signed fetches, one per
+ * worker like the listening sockets. Returns the socket, or -1 on
+ * failure.
+ */
+
+static int open_datagram_endpoint() {
+  int endpoint = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (endpoint < 0) {
+    return -1;
+  }
+
+  int opt = 1;
+  struct sockaddr_in6 addr = { 0 };
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(lookup_port);
+  if (setsockopt(endpoint, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) != 0
+      || bind(endpoint, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    close(endpoint);
+    return -1;
+  }
+  return endpoint;
+}
 
+// Keeps its distance to the lookup port, so that every node of a host gets its own
+static in_port_t admin_port() {
+  return (in_port_t) (LOOKUP_ADMIN_PORT + lookup_port - LOOKUP_PORT);
+}
+
+/*
+ * Opens the admin socket on the loopback interface, it is polled by
+ * the maintenance thread. Returns the socket, or -1 on failure.
+ */
+
+static int open_admin_endpoint() {
+  int endpoint = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (endpoint < 0) {
+    return -1;
+  }
+
+  int opt = 1;
+  struct sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(admin_port());
+  if (setsockopt(endpoint, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) != 0
+      || bind(endpoint, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(endpoint, 16) < 0) {
+    close(endpoint);
+    return -1;
+  }
+  return endpoint;
+}
+
+/*
+ * Appends formatted text to the metrics in the given buffer of
+ * METRICS_BUFFER_SIZE bytes. Text that doesn't fit is cut off, the
+ * length never goes past the last byte before the terminator.
+ */
+
+static void append_metrics(char *out, size_t *len, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(out + *len, METRICS_BUFFER_SIZE - *len, format, args);
+  va_end(args);
+  if (n > 0) {
+    *len = *len + (size_t) n < METRICS_BUFFER_SIZE ? *len + (size_t) n : METRICS_BUFFER_SIZE - 1;
+  }
+}
+
+static void append_histogram(char *out, size_t *len, const histogram_t *histogram, const char *name) {
+  size_t n = histogram_format(histogram, name, out + *len, METRICS_BUFFER_SIZE - *len);
+  *len = *len + n < METRICS_BUFFER_SIZE ? *len + n : METRICS_BUFFER_SIZE - 1;
+}
+
+/*
+ * Writes the request counters, the latency histograms and the table
+ * statistics in the Prometheus text format into the given buffer of
+ * METRICS_BUFFER_SIZE bytes, cut off with a warning if they don't fit.
+ * The caller must hold the table lock. Returns the length of the text.
+ */
+
+static size_t format_metrics(const hashtable_t *ht, char *out) {
+  size_t len = 0;
+  append_metrics(out, &len,
+                 "# TYPE lookup_requests_total counter\n"
+                 "lookup_requests_total{method=\"fetch\"} %lu\n"
+                 "lookup_requests_total{method=\"update\"} %lu\n"
+                 "lookup_requests_total{method=\"heartbeat\"} %lu\n"
+                 "lookup_requests_total{method=\"search\"} %lu\n"
+                 "lookup_requests_total{method=\"unknown\"} %lu\n"
+                 "# TYPE lookup_errors_total counter\n"
+                 "lookup_errors_total %lu\n"
+                 "# TYPE lookup_invalid_requests_total counter\n"
+                 "lookup_invalid_requests_total %lu\n"
+                 "# TYPE lookup_cluster_nodes gauge\n"
+                 "lookup_cluster_nodes %lu\n"
+                 "# TYPE lookup_cluster_moved_total counter\n"
+                 "lookup_cluster_moved_total %lu\n"
+                 "# TYPE lookup_cluster_received_total counter\n"
+                 "lookup_cluster_received_total %lu\n"
+                 "# TYPE lookup_cluster_handed_off_total counter\n"
+                 "lookup_cluster_handed_off_total %lu\n"
+                 "# TYPE lookup_cluster_handoff_failures_total counter\n"
+                 "lookup_cluster_handoff_failures_total %lu\n"
+                 "# TYPE lookup_cluster_handoff_pending gauge\n"
+                 "lookup_cluster_handoff_pending %d\n",
+                 atomic_load(&metrics.n_fetches), atomic_load(&metrics.n_updates),
+                 atomic_load(&metrics.n_heartbeats), atomic_load(&metrics.n_searches), atomic_load(&metrics.n_unknown),
+                 atomic_load(&metrics.n_errors),
+                 atomic_load(&metrics.n_invalid), cluster.ring.n_nodes, atomic_load(&metrics.n_moved),
+                 atomic_load(&metrics.n_transferred), cluster.n_handed_off, cluster.n_handoff_failures,
+                 cluster.handoff_pending ? 1 : 0);
+  if (following) {
+    uint64_t next_seq = atomic_load(&replica.next_seq);
+    uint64_t leader_seq = atomic_load(&replica.leader_seq);
+    append_metrics(out, &len,
+                   "# TYPE lookup_replica_synced gauge\n"
+                   "lookup_replica_synced %d\n"
+                   "# TYPE lookup_replica_bootstrapping gauge\n"
+                   "lookup_replica_bootstrapping %d\n"
+                   "# TYPE lookup_replica_seq gauge\n"
+                   "lookup_replica_seq %lu\n"
+                   "# TYPE lookup_replica_lag_changes gauge\n"
+                   "lookup_replica_lag_changes %lu\n"
+                   "# TYPE lookup_replica_bootstraps_total counter\n"
+                   "lookup_replica_bootstraps_total %lu\n"
+                   "# TYPE lookup_replica_applied_total counter\n"
+                   "lookup_replica_applied_total %lu\n"
+                   "# TYPE lookup_replica_forwarded_total counter\n"
+                   "lookup_replica_forwarded_total %lu\n"
+                   "# TYPE lookup_replica_forward_failures_total counter\n"
+                   "lookup_replica_forward_failures_total %lu\n",
+                   atomic_load(&replica.synced) ? 1 : 0, atomic_load(&replica.bootstrapping) ? 1 : 0, next_seq,
+                   leader_seq > next_seq ? leader_seq - next_seq : 0,
+                   atomic_load(&replica.n_bootstraps), atomic_load(&replica.n_applied),
+                   atomic_load(&replica.n_forwarded), atomic_load(&replica.n_forward_failures));
+    append_histogram(out, &len, &replica.lag_us, "lookup_replica_lag_us");
+  } else {
+    append_metrics(out, &len,
+                   "# TYPE lookup_replication_followers gauge\n"
+                   "lookup_replication_followers %lu\n"
+                   "# TYPE lookup_replication_seq gauge\n"
+                   "lookup_replication_seq %lu\n"
+                   "# TYPE lookup_replication_snapshots_total counter\n"
+                   "lookup_replication_snapshots_total %lu\n"
+                   "# TYPE lookup_replication_overruns_total counter\n"
+                   "lookup_replication_overruns_total %lu\n",
+                   atomic_load(&replication.n_followers), changelog_next(replication.log),
+                   atomic_load(&replication.n_snapshots), atomic_load(&replication.n_overruns));
+  }
+  append_metrics(out, &len,
+                 "# TYPE lookup_datagrams_total counter\n"
+                 "lookup_datagrams_total{result=\"answered\"} %lu\n"
+                 "lookup_datagrams_total{result=\"refused\"} %lu\n"
+                 "lookup_datagrams_total{result=\"missed\"} %lu\n"
+                 "lookup_datagrams_total{result=\"dropped\"} %lu\n"
+                 "# TYPE lookup_datagram_signatures_total counter\n"
+                 "lookup_datagram_signatures_total %lu\n",
+                 atomic_load(&metrics.n_datagrams), atomic_load(&metrics.n_datagrams_refused),
+                 atomic_load(&metrics.n_datagrams_missed), atomic_load(&metrics.n_datagrams_dropped),
+                 atomic_load(&metrics.n_signatures));
+  append_metrics(out, &len,
+                 "# TYPE lookup_admission_enabled gauge\n"
+                 "lookup_admission_enabled %d\n"
+                 "# TYPE lookup_admission_shed_total counter\n",
+                 admission_enabled ? 1 : 0);
+  for (size_t i = 0; i < SHED_REASONS; i++) {
+    append_metrics(out, &len, "lookup_admission_shed_total{reason=\"%s\"} %lu\n",
+                   shed_reason_names[i], atomic_load(&admission.n_shed[i]));
+  }
+  append_histogram(out, &len, &metrics.handshake_us, "lookup_handshake_us");
+  append_histogram(out, &len, &metrics.handler_us, "lookup_handler_us");
+  append_histogram(out, &len, &metrics.search_us, "lookup_search_us");
+  table_stats_t stats = table_stats(ht);
+  append_metrics(out, &len,
+                 "# TYPE lookup_table_size gauge\n"
+                 "lookup_table_size %lu\n"
+                 "# TYPE lookup_table_elements gauge\n"
+                 "lookup_table_elements %lu\n"
+                 "# TYPE lookup_table_load_factor gauge\n"
+                 "lookup_table_load_factor %.4lf\n"
+                 "# TYPE lookup_table_tombstones gauge\n"
+                 "lookup_table_tombstones %lu\n"
+                 "# TYPE lookup_table_probe_length gauge\n"
+                 "lookup_table_probe_length %.4lf\n"
+                 "# TYPE lookup_table_resizing gauge\n"
+                 "lookup_table_resizing %lu\n"
+                 "# TYPE lookup_table_largest_shard gauge\n"
+                 "lookup_table_largest_shard %lu\n"
+                 "# TYPE lookup_table_memory_bytes gauge\n"
+                 "lookup_table_memory_bytes %lu\n"
+                 "# TYPE lookup_index_memory_bytes gauge\n"
+                 "lookup_index_memory_bytes %lu\n"
+                 "# TYPE lookup_table_memory_limit_bytes gauge\n"
+                 "lookup_table_memory_limit_bytes %lu\n"
+                 "# TYPE lookup_table_refused_total counter\n"
+                 "lookup_table_refused_total %lu\n"
+                 "# TYPE lookup_filter_rejects_total counter\n"
+                 "lookup_filter_rejects_total %lu\n"
+                 "# TYPE lookup_filter_false_positives_total counter\n"
+                 "lookup_filter_false_positives_total %lu\n"
+                 "# TYPE lookup_leases_expired_total counter\n"
+                 "lookup_leases_expired_total %lu\n"
+                 "# TYPE lookup_log_dropped_total counter\n"
+                 "lookup_log_dropped_total %lu\n",
+                 stats.size, stats.n_elements, stats.n_elements / (double) stats.size, stats.n_tombstones,
+                 average_probe_length(ht), stats.n_resizing, stats.largest_shard,
+                 stats.memory_used, stats.index_memory, ht->memory_limit, ht->n_rejected,
+                 atomic_load(&ht->n_filter_rejects), atomic_load(&ht->n_filter_false_positives),
+                 ht->n_expired, log_dropped());
+  if (len == METRICS_BUFFER_SIZE - 1) {
+    log_write(LOG_WARNING, "The metrics don't fit into METRICS_BUFFER_SIZE (%d bytes) and were cut off",
+              METRICS_BUFFER_SIZE);
+  }
+  return len;
+}
+
+/*
+ * Answers the pending connections of the admin socket with the current
+ * metrics as an HTTP/1.0 reply and closes them, so that curl and
+ * Prometheus can scrape it. Slow clients are given up on after 100ms,
+ * this runs on the maintenance thread.
+ */
+
+static void serve_admin(int endpoint, hashtable_t *ht) {
+  int fd;
+  while ((fd = accept4(endpoint, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // The request itself doesn't matter, every path gets the metrics.
+    // It is read anyway so that closing doesn't reset the connection.
+    char request[1024];
+    recv(fd, request, sizeof(request), 0);
+
+    char *body = malloc(METRICS_BUFFER_SIZE);
+    assert(body != NULL);
+    pthread_mutex_lock(&global_table_lock);
+    size_t body_len = format_metrics(ht, body);
+    pthread_mutex_unlock(&global_table_lock);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %lu\r\n\r\n", body_len);
+    send(fd, header, (size_t) header_len, MSG_NOSIGNAL);
+    send(fd, body, body_len, MSG_NOSIGNAL);
+    free(body);
+    close(fd);
+  }
+}
+
+static void *run_worker(void *arg) {
+  worker_t *worker = (worker_t *) arg;
   while (!global_terminate_program) {
-    int handler_fd = accept(endpoint, (struct sockaddr *) &addr, (socklen_t *) &addr_size);
-    if (handler_fd < 0) {
-      continue;
+    if (handed_off) {
+      reactor_drain(worker->reactor);
+      if (worker->reactor->n_connections == 0) {
+        break;
+      }
     }
-
-    SSL *ssl = SSL_new(ctx);
-    if (SSL_set_fd(ssl, handler_fd) != 1) {
-      SSL_shutdown(ssl);
-      close(handler_fd);
-      SSL_free(ssl);
-      continue;
+    if (reactor_poll(worker->reactor, 1000) < 0) {
+      log_write(LOG_ERROR, "epoll_wait() failed (%d)", errno);
+      break;
     }
-    if (SSL_accept(ssl) <= 0) {
-      SSL_shutdown(ssl);
-      close(handler_fd);
-      SSL_free(ssl);
-      continue;
+  }
+  atomic_store(&worker->done, true);
+  return NULL;
+}
+
+/*
+ * Hands this node over to a new process that connected to the upgrade
+ * socket. The table is exported to shared memory and offered together
+ * with the listening sockets and the admin socket, which keep queueing
+ * connections meanwhile. The table lock is held from the export until
+ * the new process has loaded the table, so writers wait and nothing
+ * is written that the new process doesn't have, fetches go on. Writes
+ * that reach this process afterwards are forwarded to the new one.
+ * Returns true once the new process took over, this one only drains
+ * its connections then, false if the upgrade failed and this node
+ * keeps serving.
+ */
+
+static bool hand_over(hashtable_t *ht, int upgrade, const worker_t *workers, int n_workers, int admin) {
+  static_assert(UPGRADE_MAX_LISTENERS >= MAX_WORKERS, "every worker's listener is handed over");
+  int conn = upgrade_accept(upgrade);
+  if (conn < 0) {
+    return false;
+  }
+  log_write(LOG_INFO, "A new process is taking over, handing the table over...");
+  int64_t started_us = now_us();
+  bool was_following = following;
+  if (was_following) {
+    // Its changes would land in a table that is being handed over
+    replica_stop(&replica);
+  } else {
+    // The new process accepts on the same sockets, late writes are forwarded there
+    replica.leader = (ring_node_t) { .addr = { .family = AF_INET }, .port = lookup_port };
+    replica.leader.addr.addr.v4.s_addr = htonl(INADDR_LOOPBACK);
+    if ((replica.ctx == NULL && (replica.ctx = init_openssl(CLIENT)) == NULL) || replica_forward_start(&replica) != 0) {
+      close(conn);
+      return false;
     }
+  }
 
-    char buf[1024] = { '\0' };
-    int bytes_read = SSL_read(ssl, buf, sizeof(buf) - 1);
-    buf[1023] = '\0';
-    printf("[INFO] %d bytes received, request: %s\n", bytes_read, buf);
+  // A stopped replica's table matches its position, the new process continues the stream from there
+  handoff_t offer = {
+    .conn = conn,
+    .admin_fd = admin,
+    .n_listeners = (size_t) n_workers,
+    .stream = was_following ? replica.stream : 0,
+    .next_seq = was_following ? atomic_load(&replica.next_seq) : 0,
+  };
+  for (int i = 0; i < n_workers; i++) {
+    offer.listeners[i] = workers[i].endpoint;
+    if (workers[i].datagram >= 0) {
+      offer.datagrams[offer.n_datagrams++] = workers[i].datagram;
+    }
+  }
+  pthread_mutex_lock(&global_table_lock);
+  // A snapshot in progress has the journal split in two, the new process opens one
+  finish_snapshot(ht, true);
+  table_write_begin(ht);
+  offer.snapshot_fd = export_table(ht);
+  table_write_end(ht);
+  bool ok = offer.snapshot_fd >= 0 && upgrade_offer(conn, &offer) == 0 && upgrade_commit(conn) == 0;
+  if (ok) {
+    following = true;
+    handed_off = true;
+  }
+  pthread_mutex_unlock(&global_table_lock);
+  if (offer.snapshot_fd >= 0) {
+    close(offer.snapshot_fd);
+  }
+  close(conn);
 
-    if (bytes_read != 0 && (buf[bytes_read - 1] == '\r'
-                        || buf[bytes_read - 1] == '\n')) {
-      buf[bytes_read - 1] = '\0';
-      bytes_read--;
+  if (!ok) {
+    log_write(LOG_WARNING, "The new process didn't take over, serving on");
+    if (was_following) {
+      replica_start(&replica, ht);
     }
+    return false;
+  }
+  // Followers reconnect to the new process and start over from its table
+  replication_stop(&replication);
+  log_write(LOG_INFO, "Handed the table and %d listening sockets over in %ld ms, draining...", n_workers,
+            (now_us() - started_us) / 1000);
+  return true;
+}
 
-    if (bytes_read == 0) {
-      SSL_shutdown(ssl);
-      close(handler_fd);
-      SSL_free(ssl);
-      continue;
+/*
+ * Waits at most UPGRADE_DRAIN_MS for the workers of a node that handed
+ * its table over to close their last connection, the ones left are
+ * closed when the workers are joined.
+ */
+
+static void drain_workers(worker_t *workers, int n_workers) {
+  int64_t deadline_us = now_us() + (int64_t) UPGRADE_DRAIN_MS * 1000;
+  int n_done = 0;
+  while (!global_terminate_program && now_us() < deadline_us) {
+    n_done = 0;
+    for (int i = 0; i < n_workers; i++) {
+      n_done += atomic_load(&workers[i].done) ? 1 : 0;
+    }
+    if (n_done == n_workers) {
+      break;
     }
+    poll(NULL, 0, 50);
+  }
+  log_write(LOG_INFO, "%d of %d workers drained", n_done, n_workers);
+}
 
-    char method = '\0';
-    int status_code = sscanf(buf, "%c", &method);
-    if (status_code != 1) {
-      SSL_shutdown(ssl);
-      close(handler_fd);
-      SSL_free(ssl);
-      continue;
+/*
+ * Initializes an input using given SSL_CTX pointer and
+ * routes the received requests to the relevant handler.
+ * Connections are served concurrently by the given number of
+ * worker threads, each running an epoll reactor on its own
+ * listening socket, while this thread maintains the table.
+ * Sockets taken over from a previous process are used first.
+ * Returns once the program terminates or the node was handed
+ * over and drained. Throws an assertion if any of the
+ * parameters are NULL or if a memory allocation error occurs.
+ */
+
+void endpoint_manager(SSL_CTX *ctx, hashtable_t *ht, int n_workers) {
+  assert(ctx != NULL && ht != NULL && n_workers > 0);
+  signal(SIGINT, terminate_signal);
+  // Rereads the cluster file
+  signal(SIGHUP, reload_signal);
+  // A peer that disappears mid-write must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  // Followers and the nodes of a cluster share the lookup key, so any of them can answer
+  datagram_answer_t probe = { .username = "probe" };
+  EVP_PKEY *key = SSL_CTX_get0_privatekey(ctx);
+  signing_key = key != NULL && datagram_sign(&probe, key) ? key : NULL;
+  if (signing_key == NULL) {
+    log_write(LOG_WARNING, "The lookup key can't sign datagrams, fetches are only answered over TLS");
+  }
+
+  worker_t *workers = calloc(n_workers, sizeof(worker_t));
+  assert(workers != NULL);
+  int n_started = 0;
+  for (; n_started < n_workers; n_started++) {
+    worker_t *worker = &workers[n_started];
+    worker->endpoint = (size_t) n_started < handoff.n_listeners ? handoff.listeners[n_started] : open_endpoint();
+    if (worker->endpoint < 0) {
+      break;
+    }
+    worker->reactor = reactor_create(worker->endpoint, ctx, serve_request, ht);
+    if (worker->reactor == NULL) {
+      close(worker->endpoint);
+      break;
+    }
+    worker->reactor->handshake_us = &metrics.handshake_us;
+    worker->reactor->admission = admission_enabled ? &admission : NULL;
+    worker->datagram = (size_t) n_started < handoff.n_datagrams ? handoff.datagrams[n_started] : -1;
+    if (signing_key != NULL && worker->datagram < 0) {
+      worker->datagram = open_datagram_endpoint();
+    }
+    bool datagrams = signing_key != NULL && worker->datagram >= 0
+                  && reactor_add_datagrams(worker->reactor, worker->datagram, serve_datagrams, worker) == 0;
+    if (datagrams) {
+      worker->answers = calloc(DATAGRAM_CACHE_SLOTS, sizeof(datagram_answer_t));
+      assert(worker->answers != NULL);
+    } else {
+      if (signing_key != NULL) {
+        log_write(LOG_WARNING, "Worker %d could not open its datagram socket (%d)", n_started, errno);
+      }
+      if (worker->datagram >= 0) {
+        close(worker->datagram);
+      }
+      worker->datagram = -1;
+    }
+    if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+      log_write(LOG_ERROR, "Could not start worker %d", n_started);
+      reactor_free(worker->reactor);
+      close(worker->endpoint);
+      if (worker->datagram >= 0) {
+        close(worker->datagram);
+      }
+      free(worker->answers);
+      break;
     }
+  }
 
-    printf("[INFO] Accepted request: %s\n", buf);
-    char *response = NULL;
-    if (method == METHOD_UPDATE) {
-      struct sockaddr_storage peer;
-      socklen_t size = sizeof(peer);
-      getpeername(handler_fd, (struct sockaddr *) &peer, &size);
-      response = handle_update(buf, ht, &peer);
-    } else if (method == METHOD_FETCH) {
-      response = handle_fetch(buf, ht);
-    }
-    
-    if (response != NULL) {
-      printf("[INFO] Sent reply: %s\n", response);
-      SSL_write(ssl, response, strlen(response));
-      free(response);
-      response = NULL;
+  int admin = -1, upgrade = -1;
+  if (n_started == n_workers) {
+    log_write(LOG_INFO, "Listening on port %d with %d workers%s...", lookup_port, n_workers,
+              signing_key != NULL ? ", signed fetches over UDP as well" : "");
+    admin = handoff.admin_fd >= 0 ? handoff.admin_fd : open_admin_endpoint();
+    if (admin < 0) {
+      log_write(LOG_WARNING, "Could not open the admin port %d (%d), metrics are disabled", admin_port(), errno);
     } else {
-      printf("[INFO] Sent reply: %s\n", ERR_RESPONSE);
-      SSL_write(ssl, ERR_RESPONSE, strlen(ERR_RESPONSE));
+      log_write(LOG_INFO, "Serving metrics on 127.0.0.1:%d", admin_port());
+    }
+    upgrade = upgrade_listen(upgrade_filename);
+    if (upgrade < 0) {
+      log_write(LOG_WARNING, "Could not open the upgrade socket, restarts will refuse connections");
+    }
+    // Polling a negative descriptor just sleeps
+    struct pollfd polls[2] = { { .fd = admin, .events = POLLIN }, { .fd = upgrade, .events = POLLIN } };
+    time_t last_maintenance = 0;
+    while (!global_terminate_program && !handed_off) {
+      time_t now = time(NULL);
+      if (reload_requested) {
+        reload_requested = false;
+        if (cluster.filename[0] != '\0') {
+          cluster_load(&cluster);
+        }
+      }
+      if (now != last_maintenance) {
+        pthread_mutex_lock(&global_table_lock);
+        maintain_table(ht, now);
+        pthread_mutex_unlock(&global_table_lock);
+        cluster_handoff(&cluster, ht, now);
+        last_maintenance = now;
+      }
+      if (poll(polls, 2, 1000) <= 0) {
+        continue;
+      }
+      if (polls[0].revents & POLLIN) {
+        serve_admin(admin, ht);
+      }
+      if ((polls[1].revents & POLLIN) && hand_over(ht, upgrade, workers, n_started, admin)) {
+        drain_workers(workers, n_started);
+      }
+    }
+  }
+  global_terminate_program = true;
+  if (admin >= 0) {
+    close(admin);
+  }
+  if (upgrade >= 0) {
+    close(upgrade);
+    // The path belongs to the process that took over
+    if (!handed_off) {
+      unlink(upgrade_filename);
     }
+  }
 
-    SSL_shutdown(ssl);
-    close(handler_fd);
-    SSL_free(ssl);
+  for (int i = 0; i < n_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  // Replies to forwards still queued go to the mailboxes of the reactors freed below
+  replica_forward_stop(&replica);
+  size_t n_accepted = 0, n_timeouts = 0, n_rejected = 0;
+  for (int i = 0; i < n_started; i++) {
+    n_accepted += workers[i].reactor->n_accepted;
+    n_timeouts += workers[i].reactor->n_timeouts;
+    n_rejected += workers[i].reactor->n_rejected;
+    reactor_free(workers[i].reactor);
+    close(workers[i].endpoint);
+    if (workers[i].datagram >= 0) {
+      close(workers[i].datagram);
+    }
+    free(workers[i].answers);
   }
-  close(endpoint);
+  log_write(LOG_INFO, "Served %lu connections, %lu timed out, %lu rejected", n_accepted, n_timeouts, n_rejected);
+  free(workers);
 }
 
-int main() {
-  generate_table_filename();
+/*
+ * Takes the table and the listening sockets over from the node running
+ * on this port, see hand_over(). Returns 0 once the old process stopped
+ * writing to its table and this one serves instead, -1 on failure, the
+ * old process keeps serving then.
+ */
+
+static int take_over(size_t memory_limit, hashtable_t *ht) {
+  int64_t started_us = now_us();
+  if (upgrade_request(upgrade_filename, &handoff) != 0) {
+    log_write(LOG_ERROR, "Found no node on port %d to take over from", lookup_port);
+    return -1;
+  }
+  bool loaded = import_hashmap(handoff.snapshot_fd, memory_limit, ht);
+  handoff.snapshot_fd = -1;
+  if (!loaded) {
+    log_write(LOG_ERROR, "Could not load the handed-over table");
+    return -1;
+  }
+  if (upgrade_confirm(&handoff) != 0) {
+    log_write(LOG_ERROR, "The running node gave up on the upgrade");
+    return -1;
+  }
+  log_write(LOG_INFO, "Took %lu users and %lu listening sockets over in %ld ms", table_count(ht),
+            handoff.n_listeners, (now_us() - started_us) / 1000);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  // One per core unless -w says otherwise, hosts with more cores than MAX_WORKERS get MAX_WORKERS
+  long n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  n_workers = n_workers < 1 ? 1 : n_workers > MAX_WORKERS ? MAX_WORKERS : n_workers;
+  log_level_t log_level = LOG_INFO;
+  long memory_limit_mb = 0;
+  long port = LOOKUP_PORT;
+  const char *cluster_filename = NULL;
+  const char *leader = NULL;
+  bool taking_over = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:p:c:f:m:AUqv")) != -1) {
+    if (opt == 'w') {
+      n_workers = strtol(optarg, NULL, 10);
+    } else if (opt == 'p') {
+      port = strtol(optarg, NULL, 10);
+    } else if (opt == 'c') {
+      // Node list of the cluster, reread on SIGHUP
+      cluster_filename = optarg;
+    } else if (opt == 'f') {
+      // Serve a copy of this node's table, see replication.h
+      leader = optarg;
+    } else if (opt == 'm') {
+      // Registrations that would grow the table past this are refused
+      memory_limit_mb = strtol(optarg, NULL, 10);
+    } else if (opt == 'A') {
+      // Every source is admitted, e.g. for load tests from a single host
+      admission_enabled = false;
+    } else if (opt == 'U') {
+      // Replace the node running on this port without refusing connections, see upgrade.h
+      taking_over = true;
+    } else if (opt == 'q') {
+      // Only warnings and errors, no line per request
+      log_level = LOG_WARNING;
+    } else if (opt == 'v') {
+      log_level = LOG_DEBUG;
+    } else {
+      fprintf(stderr, "Usage: %s [-w workers] [-p port] [-c cluster file | -f leader address[:port]] "
+              "[-m table memory limit in MB] [-A] [-U] [-q | -v]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (n_workers < 1 || n_workers > MAX_WORKERS) {
+    log_write(LOG_ERROR, "The worker count must be between 1 and %d", MAX_WORKERS);
+    return 1;
+  }
+  if (memory_limit_mb < 0) {
+    log_write(LOG_ERROR, "The memory limit can't be negative");
+    return 1;
+  }
+  // The admin port moves along with it
+  if (port < 1 || port > 65535 - (LOOKUP_ADMIN_PORT - LOOKUP_PORT)) {
+    log_write(LOG_ERROR, "Invalid port %ld", port);
+    return 1;
+  }
+  lookup_port = (in_port_t) port;
+  if (leader != NULL) {
+    ring_t ring;
+    if (cluster_filename != NULL || ring_parse(&ring, leader) != 0 || ring.n_nodes != 1) {
+      log_write(LOG_ERROR, "A follower takes a single leader and no cluster file");
+      ring_free(&ring);
+      return 1;
+    }
+    replica.leader = ring.nodes[0];
+    ring_free(&ring);
+    following = true;
+  }
+
+  generate_table_filename(lookup_port);
+  // Next to the table, so that every node of a host gets its own
+  snprintf(upgrade_filename, sizeof(upgrade_filename), "%.*s%s",
+           (int) (strlen(global_table_filename) - strlen(STORAGE_FILE)), global_table_filename, UPGRADE_SOCKET_FILE);
   get_cert_dirs();
   SSL_CTX *ctx = init_openssl(SERVER);
   if (ctx == NULL) {
@@ -526,16 +1576,72 @@ int main() {
     return 1;
   }
 
-  hashtable_t ht = generate_hashmap();
+  if (cluster_filename != NULL) {
+    snprintf(cluster.filename, sizeof(cluster.filename), "%s", cluster_filename);
+    cluster.port = lookup_port;
+    cluster.ctx = init_openssl(CLIENT);
+    if (cluster.ctx == NULL || cluster_load(&cluster) != 0) {
+      return 1;
+    }
+    if (cluster.self == -1) {
+      log_write(LOG_ERROR, "No node of %s is this host on port %d", cluster.filename, lookup_port);
+      return 1;
+    }
+  }
+  if (following) {
+    replica.ctx = init_openssl(CLIENT);
+    if (replica.ctx == NULL) {
+      return 1;
+    }
+  }
+
+  log_start(log_level);
+  admission_init(&admission);
+  hashtable_t ht;
+  if (!taking_over) {
+    ht = generate_hashmap((size_t) memory_limit_mb << 20);
+  } else if (take_over((size_t) memory_limit_mb << 20, &ht) != 0) {
+    return 1;
+  } else if (handoff.n_listeners > (size_t) n_workers) {
+    // A listener nobody accepts on would hold its queued connections forever
+    log_write(LOG_INFO, "Starting %lu workers, one per listening socket taken over", handoff.n_listeners);
+    n_workers = (long) handoff.n_listeners;
+  }
+  if (following) {
+    replica.stream = handoff.stream;
+    atomic_store(&replica.next_seq, handoff.next_seq);
+    if (replica_start(&replica, &ht) != 0 || replica_forward_start(&replica) != 0) {
+      return 1;
+    }
+  } else {
+    replication_start(&replication, &ht);
+  }
 
-  endpoint_manager(ctx, &ht);
+  endpoint_manager(ctx, &ht, (int) n_workers);
+  replica_stop(&replica);
+  replication_stop(&replication);
+  // The workers are joined, whatever is logged from here on is written synchronously
+  log_stop();
 
-  puts("\n[INFO] Saving the table to disk...");
-  write_table(&ht);
-  print_table(&ht);
+  if (handed_off) {
+    // The files belong to the process that took over, its journal holds everything written here
+    log_write(LOG_INFO, "Handed over, leaving the table to the new process");
+  } else {
+    puts("\n[INFO] Saving the table to disk...");
+    finish_snapshot(&ht, true);
+    write_table(&ht);
+    journal_truncate(ht.journal);
+    unlink(global_rotated_journal_filename);
+    print_table(&ht);
+  }
 
-  puts("[INFO] Shutting down...");
+  log_write(LOG_INFO, "Shutting down...");
   SSL_CTX_free(ctx);
+  cluster_free(&cluster);
+  if (replica.ctx != NULL) {
+    SSL_CTX_free(replica.ctx);
+  }
+  admission_free(&admission);
   free_hashmap(&ht);
   return 0;
 }
@@ -1,64 +1,63 @@
 #ifndef CHAT_LOOKUP_H
 #define CHAT_LOOKUP_H
 
+#include "datagram.h"
+#include "hashtable.h"
+#include "reactor.h"
+#include "replication.h"
 #include "shared_protocol.h"
 
 #include <netinet/in.h>
 #include <openssl/crypto.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <sys/socket.h>
 
-#define INITIAL_TABLE_SIZE (16)
-#define MAX_TABLE_SIZE (1048576) // 2 ^ 20
-#define HASH_PRIME (7)
-#define LOAD_FACTOR (0.67)
-#define RESIZE_FACTOR (2)
-#define MAX_USERNAME_LEN (32)
-
-#define STORAGE_FILE ("/table.txt")
-
-extern char global_table_filename[256];
+// Upper bound for the -w option, defaults to one worker per core up to this
+#define MAX_WORKERS (64)
+// Metrics are served as plain text on this port of the loopback interface,
+// nodes on another port than LOOKUP_PORT move it along by the same offset
+#ifndef LOOKUP_ADMIN_PORT
+#define LOOKUP_ADMIN_PORT (56733)
+#endif
+#define METRICS_BUFFER_SIZE (8192)
 
 extern volatile bool global_terminate_program;
 
-typedef struct UserData {
-  char username[32];
-  ip_addr_t ip;
-  bool tombstone;
-} userdata_t;
-
-typedef struct HashTable {
-  userdata_t *map;
-  size_t size;
-  size_t n_elements;
-} hashtable_t;
+typedef struct Worker {
+  pthread_t thread;
+  int endpoint;
+  // UDP socket for signed fetches, -1 if they are disabled
+  int datagram;
+  // DATAGRAM_CACHE_SLOTS signed answers by username, NULL if they are disabled
+  datagram_answer_t *answers;
+  reactor_t *reactor;
+  // Set once the worker returns, a draining one after its last connection
+  _Atomic bool done;
+} worker_t;
+
+// A follower's update or heartbeat waiting for the leader, the reply is sent once it answered
+typedef struct PendingForward {
+  // First, so that the forwarder's callback finds the rest
+  forward_request_t request;
+  connection_t *conn;
+  // Opcode of a binary reply, 0 for a text one
+  uint8_t reply_opcode;
+  // A session's text reply ends with a newline and keeps the connection open
+  bool session;
+} pending_forward_t;
 
 void terminate_signal(int);
 
-void print_table(const hashtable_t *);
-
-void generate_table_filename();
-
-void write_table(hashtable_t *);
-
-hashtable_t generate_hashmap();
-
-void free_hashmap(hashtable_t *);
-
-int get_index(hashtable_t *, const char *);
-
-void resize(hashtable_t *);
-
-int insert(hashtable_t *, userdata_t);
-
-int delete_data(hashtable_t *, const char *);
+void reload_signal(int);
 
 char *handle_fetch(const char *, hashtable_t *);
 
 char *handle_update(const char *, hashtable_t *, struct sockaddr_storage *);
 
-void endpoint_manager(SSL_CTX *, hashtable_t *);
+void endpoint_manager(SSL_CTX *, hashtable_t *, int);
 
-int main();
+int main(int, char **);
 
 #endif
@@ -1,5 +1,6 @@
 #include "cli.h"
 #include "database.h"
+#include "log.h"
 #include "server.h"
 #include "shared_protocol.h"
 #include "ssl.h"
@@ -50,6 +51,7 @@ int main(int argc, char **argv) {
   username[31] = '\0';
 
   get_cert_dirs();
+  log_start(LOG_INFO);
 
   SSL_CTX *client_ctx = init_openssl(CLIENT);
   if (client_ctx == NULL) {
@@ -66,8 +68,7 @@ int main(int argc, char **argv) {
   }
 
 
-  ip_addr_t lookup_addr = (ip_addr_t) { .family = AF_INET, .addr.v4.s_addr = htonl(LOOKUP_ADDR)};
-  int status_code = update_lookup_server(username, lookup_addr, client_ctx);
+  int status_code = update_lookup_server(username, client_ctx);
   if (status_code == -1) {
     puts("[WARNING] Could not update the lookup server with the current IP.");
   }
@@ -76,10 +77,17 @@ int main(int argc, char **argv) {
   server_args_t args = { .ctx = server_ctx, .db = db };
   pthread_create(&thread, NULL, receive_messages, &args);
 
+  pthread_t lease_thread;
+  lease_args_t lease_args = { .username = username, .ctx = client_ctx };
+  pthread_create(&lease_thread, NULL, renew_lease, &lease_args);
+
   cli_loop(db, username, client_ctx);
 
   global_terminate_program = true;
   pthread_join(thread, NULL);
+  pthread_join(lease_thread, NULL);
+  close_lookup_session();
+  log_stop();
 
   sqlite3_close(db);
   SSL_CTX_free(client_ctx);
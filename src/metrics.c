@@ -0,0 +1,112 @@
+/*
+ * Counters and latency histograms of the lookup server. Histograms
+ * are log-linear like HdrHistogram: every power of two is split into
+ * HISTOGRAM_SUB_BUCKETS linear buckets, so percentiles keep a fixed
+ * relative error at any magnitude while recording stays one relaxed
+ * atomic increment.
+ */
+
+#include "metrics.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static size_t bucket_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) {
+    return (size_t) value;
+  }
+  uint64_t limit = (1ULL << (HISTOGRAM_MAX_BITS + 1)) - 1;
+  if (value > limit) {
+    value = limit;
+  }
+  int magnitude = 63 - __builtin_clzll(value);
+  size_t block = (size_t) (magnitude - HISTOGRAM_SUB_BITS + 1);
+  size_t sub = (size_t) (value >> (magnitude - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return block * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that falls into the given bucket
+static uint64_t bucket_upper(size_t index) {
+  size_t block = index / HISTOGRAM_SUB_BUCKETS;
+  uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+  if (block == 0) {
+    return sub;
+  }
+  int shift = (int) block - 1;
+  return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/*
+ * Records a value. Safe to call from any thread. Throws an assertion
+ * if the histogram is NULL.
+ */
+
+void histogram_record(histogram_t *histogram, uint64_t value) {
+  assert(histogram != NULL);
+  atomic_fetch_add_explicit(&histogram->counts[bucket_index(value)], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  while (value > max && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                               memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+/*
+ * Returns the value below which the given fraction (0 to 1) of the
+ * recorded values fall, rounded up to its bucket's upper bound. Values
+ * recorded concurrently may or may not be included. Returns 0 for an
+ * empty histogram.
+ */
+
+uint64_t histogram_percentile(const histogram_t *histogram, double fraction) {
+  assert(histogram != NULL);
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    counts[i] = atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t) (fraction * (double) total + 0.5);
+  rank = rank == 0 ? 1 : rank > total ? total : rank;
+  uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) {
+      uint64_t upper = bucket_upper(i);
+      return upper < max ? upper : max;
+    }
+  }
+  return max;
+}
+
+/*
+ * Writes the histogram in the Prometheus text format as a summary
+ * with p50, p99 and p999 quantiles, a count, a sum and a max. Returns
+ * the number of characters that the full text needs, like snprintf().
+ */
+
+size_t histogram_format(const histogram_t *histogram, const char *name, char *out, size_t size) {
+  assert(histogram != NULL && name != NULL && (out != NULL || size == 0));
+  int len = snprintf(out, size,
+                     "# TYPE %s summary\n"
+                     "%s{quantile=\"0.5\"} %lu\n"
+                     "%s{quantile=\"0.99\"} %lu\n"
+                     "%s{quantile=\"0.999\"} %lu\n"
+                     "%s_count %lu\n"
+                     "%s_sum %lu\n"
+                     "%s_max %lu\n",
+                     name,
+                     name, histogram_percentile(histogram, 0.5),
+                     name, histogram_percentile(histogram, 0.99),
+                     name, histogram_percentile(histogram, 0.999),
+                     name, atomic_load(&histogram->count),
+                     name, atomic_load(&histogram->sum),
+                     name, atomic_load(&histogram->max));
+  return len < 0 ? 0 : (size_t) len;
+}
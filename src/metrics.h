@@ -0,0 +1,57 @@
+#ifndef CHAT_METRICS_H
+#define CHAT_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Every power of two is split into this many linear buckets, ~6% error
+#define HISTOGRAM_SUB_BITS (4)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+// Values past 2^41 (microseconds: ~25 days) land in the last bucket
+#define HISTOGRAM_MAX_BITS (40)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear (HDR style) histogram that any thread may record into
+typedef struct Histogram {
+  _Atomic uint64_t counts[HISTOGRAM_BUCKETS];
+  _Atomic uint64_t count;
+  _Atomic uint64_t sum;
+  _Atomic uint64_t max;
+} histogram_t;
+
+typedef struct Metrics {
+  _Atomic uint64_t n_fetches;
+  _Atomic uint64_t n_updates;
+  _Atomic uint64_t n_heartbeats;
+  _Atomic uint64_t n_searches;
+  _Atomic uint64_t n_unknown;
+  // Requests answered with an error
+  _Atomic uint64_t n_errors;
+  // Connections dropped for a request that couldn't be parsed at all
+  _Atomic uint64_t n_invalid;
+  // Registrations refused because another node of the cluster owns them
+  _Atomic uint64_t n_moved;
+  // Registrations taken over from other nodes of the cluster
+  _Atomic uint64_t n_transferred;
+  // Fetch queries over UDP by outcome, see datagram.h
+  _Atomic uint64_t n_datagrams;
+  _Atomic uint64_t n_datagrams_refused;
+  // Fetches of names that aren't registered, refused without a signature
+  _Atomic uint64_t n_datagrams_missed;
+  _Atomic uint64_t n_datagrams_dropped;
+  // Answers signed for them, the others came from a worker's cache
+  _Atomic uint64_t n_signatures;
+  histogram_t handshake_us;
+  histogram_t handler_us;
+  // Time a prefix search holds the table lock for
+  histogram_t search_us;
+} metrics_t;
+
+void histogram_record(histogram_t *, uint64_t);
+
+uint64_t histogram_percentile(const histogram_t *, double);
+
+size_t histogram_format(const histogram_t *, const char *, char *, size_t);
+
+#endif
@@ -0,0 +1,375 @@
+/*
+ * A B+ tree over the usernames, kept next to the hash table so that
+ * the lookup server can answer prefix searches. Names only live in the
+ * leaves, which are chained in order, so a search descends once to the
+ * first name it returns and walks the chain from there. Nodes that
+ * drop below half full borrow from or merge with a sibling, which
+ * bounds the leaves a page of results can span.
+ */
+
+#define _GNU_SOURCE
+
+#include "name_index.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LEAF_BYTES (sizeof(name_node_t))
+#define INNER_BYTES (sizeof(name_node_t) + (NAME_NODE_KEYS + 1) * sizeof(name_node_t *))
+
+static name_node_t *new_node(name_index_t *index, bool leaf) {
+  name_node_t *node = calloc(1, leaf ? LEAF_BYTES : INNER_BYTES);
+  assert(node != NULL);
+  node->leaf = leaf;
+  index->memory_used += leaf ? LEAF_BYTES : INNER_BYTES;
+  if (leaf) {
+    index->n_leaves++;
+  } else {
+    index->n_inner++;
+  }
+  return node;
+}
+
+static void free_node(name_index_t *index, name_node_t *node) {
+  index->memory_used -= node->leaf ? LEAF_BYTES : INNER_BYTES;
+  if (node->leaf) {
+    index->n_leaves--;
+  } else {
+    index->n_inner--;
+  }
+  free(node);
+}
+
+static void free_subtree(name_index_t *index, name_node_t *node) {
+  if (!node->leaf) {
+    for (size_t i = 0; i <= node->n_keys; i++) {
+      free_subtree(index, node->children[i]);
+    }
+  }
+  free_node(index, node);
+}
+
+// Zero pads the name into a key, longer names are cut
+static void make_key(char *key, const char *name) {
+  memset(key, 0, NAME_KEY_LEN);
+  strncpy(key, name, NAME_KEY_LEN - 1);
+}
+
+// Index of the first key not smaller than the given one
+static size_t lower_bound(const name_node_t *node, const char *key) {
+  size_t low = 0, high = node->n_keys;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (memcmp(node->keys[mid], key, NAME_KEY_LEN) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Index of the child of an inner node whose subtree may hold the key
+static size_t child_index(const name_node_t *node, const char *key) {
+  size_t low = 0, high = node->n_keys;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (memcmp(node->keys[mid], key, NAME_KEY_LEN) <= 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static void insert_key(name_node_t *node, size_t index, const char *key) {
+  memmove(node->keys[index + 1], node->keys[index], (node->n_keys - index) * NAME_KEY_LEN);
+  memcpy(node->keys[index], key, NAME_KEY_LEN);
+  node->n_keys++;
+}
+
+static void remove_key(name_node_t *node, size_t index) {
+  memmove(node->keys[index], node->keys[index + 1], (node->n_keys - index - 1) * NAME_KEY_LEN);
+  node->n_keys--;
+}
+
+static void insert_child(name_node_t *node, size_t index, name_node_t *child) {
+  memmove(&node->children[index + 1], &node->children[index], (node->n_keys + 1 - index) * sizeof(name_node_t *));
+  node->children[index] = child;
+}
+
+static void remove_child(name_node_t *node, size_t index) {
+  memmove(&node->children[index], &node->children[index + 1], (node->n_keys - index) * sizeof(name_node_t *));
+}
+
+/*
+ * Creates an empty index. Throws an assertion if a memory allocation
+ * error occurs. Call name_index_free() afterwards to avoid memory
+ * leaks!
+ */
+
+name_index_t *name_index_create() {
+  name_index_t *index = calloc(1, sizeof(name_index_t));
+  assert(index != NULL);
+  index->root = new_node(index, true);
+  index->height = 1;
+  return index;
+}
+
+void name_index_free(name_index_t *index) {
+  if (index == NULL) {
+    return;
+  }
+  free_subtree(index, index->root);
+  free(index);
+}
+
+/*
+ * Splits a full node that the given key (and, for inner nodes, the
+ * child right of it) goes into at the given index. The upper half
+ * moves to a new right sibling, which is returned, and the separator
+ * between the two is copied out.
+ */
+
+static name_node_t *split_node(name_index_t *index, name_node_t *node, size_t at, const char *key,
+                               name_node_t *child, char *separator) {
+  char keys[NAME_NODE_KEYS + 1][NAME_KEY_LEN];
+  name_node_t *children[NAME_NODE_KEYS + 2];
+  memcpy(keys, node->keys, at * NAME_KEY_LEN);
+  memcpy(keys[at], key, NAME_KEY_LEN);
+  memcpy(keys[at + 1], node->keys[at], (NAME_NODE_KEYS - at) * NAME_KEY_LEN);
+  if (!node->leaf) {
+    memcpy(children, node->children, (at + 1) * sizeof(name_node_t *));
+    children[at + 1] = child;
+    memcpy(&children[at + 2], &node->children[at + 1], (NAME_NODE_KEYS - at) * sizeof(name_node_t *));
+  }
+
+  size_t mid = (NAME_NODE_KEYS + 1) / 2;
+  name_node_t *right = new_node(index, node->leaf);
+  memcpy(separator, keys[mid], NAME_KEY_LEN);
+  memcpy(node->keys, keys, mid * NAME_KEY_LEN);
+  node->n_keys = (uint16_t) mid;
+  if (node->leaf) {
+    // Leaves keep the separator as their first name
+    memcpy(right->keys, keys[mid], (NAME_NODE_KEYS + 1 - mid) * NAME_KEY_LEN);
+    right->n_keys = (uint16_t) (NAME_NODE_KEYS + 1 - mid);
+    right->next = node->next;
+    node->next = right;
+  } else {
+    // Inner nodes pass it up instead
+    memcpy(right->keys, keys[mid + 1], (NAME_NODE_KEYS - mid) * NAME_KEY_LEN);
+    memcpy(node->children, children, (mid + 1) * sizeof(name_node_t *));
+    memcpy(right->children, &children[mid + 1], (NAME_NODE_KEYS + 1 - mid) * sizeof(name_node_t *));
+    right->n_keys = (uint16_t) (NAME_NODE_KEYS - mid);
+  }
+  return right;
+}
+
+/*
+ * Inserts the key into the subtree. Returns the new right sibling of
+ * the node if it had to split and copies the separator, NULL otherwise.
+ */
+
+static name_node_t *insert_into(name_index_t *index, name_node_t *node, const char *key, char *separator,
+                                bool *added) {
+  if (node->leaf) {
+    size_t i = lower_bound(node, key);
+    if (i < node->n_keys && memcmp(node->keys[i], key, NAME_KEY_LEN) == 0) {
+      *added = false;
+      return NULL;
+    }
+    *added = true;
+    if (node->n_keys < NAME_NODE_KEYS) {
+      insert_key(node, i, key);
+      return NULL;
+    }
+    return split_node(index, node, i, key, NULL, separator);
+  }
+
+  size_t i = child_index(node, key);
+  char child_separator[NAME_KEY_LEN];
+  name_node_t *sibling = insert_into(index, node->children[i], key, child_separator, added);
+  if (sibling == NULL) {
+    return NULL;
+  }
+  if (node->n_keys < NAME_NODE_KEYS) {
+    insert_child(node, i + 1, sibling);
+    insert_key(node, i, child_separator);
+    return NULL;
+  }
+  return split_node(index, node, i, child_separator, sibling, separator);
+}
+
+/*
+ * Adds the given name to the index. Throws an assertion if any of the
+ * parameters are NULL or if a memory allocation error occurs. Returns
+ * false if the name was already there.
+ */
+
+bool name_index_insert(name_index_t *index, const char *name) {
+  assert(index != NULL && name != NULL);
+  char key[NAME_KEY_LEN], separator[NAME_KEY_LEN];
+  make_key(key, name);
+  bool added = false;
+  name_node_t *sibling = insert_into(index, index->root, key, separator, &added);
+  if (sibling != NULL) {
+    name_node_t *root = new_node(index, false);
+    root->children[0] = index->root;
+    root->children[1] = sibling;
+    memcpy(root->keys[0], separator, NAME_KEY_LEN);
+    root->n_keys = 1;
+    index->root = root;
+    index->height++;
+  }
+  index->n_names += added;
+  return added;
+}
+
+/*
+ * Refills the child at the given index of an inner node after it
+ * dropped below the minimum, from a sibling that can spare a key or by
+ * merging it with one.
+ */
+
+static void rebalance(name_index_t *index, name_node_t *parent, size_t i) {
+  name_node_t *child = parent->children[i];
+  name_node_t *left = i > 0 ? parent->children[i - 1] : NULL;
+  name_node_t *right = i < parent->n_keys ? parent->children[i + 1] : NULL;
+
+  if (left != NULL && left->n_keys > NAME_NODE_MIN_KEYS) {
+    if (child->leaf) {
+      insert_key(child, 0, left->keys[left->n_keys - 1]);
+      memcpy(parent->keys[i - 1], child->keys[0], NAME_KEY_LEN);
+    } else {
+      insert_child(child, 0, left->children[left->n_keys]);
+      insert_key(child, 0, parent->keys[i - 1]);
+      memcpy(parent->keys[i - 1], left->keys[left->n_keys - 1], NAME_KEY_LEN);
+    }
+    left->n_keys--;
+    return;
+  }
+  if (right != NULL && right->n_keys > NAME_NODE_MIN_KEYS) {
+    if (child->leaf) {
+      insert_key(child, child->n_keys, right->keys[0]);
+      remove_key(right, 0);
+      memcpy(parent->keys[i], right->keys[0], NAME_KEY_LEN);
+    } else {
+      child->children[child->n_keys + 1] = right->children[0];
+      insert_key(child, child->n_keys, parent->keys[i]);
+      memcpy(parent->keys[i], right->keys[0], NAME_KEY_LEN);
+      remove_child(right, 0);
+      remove_key(right, 0);
+    }
+    return;
+  }
+
+  // Neither sibling can spare a key, so the two fit in one node
+  size_t at = left != NULL ? i - 1 : i;
+  name_node_t *into = parent->children[at], *from = parent->children[at + 1];
+  if (into->leaf) {
+    memcpy(into->keys[into->n_keys], from->keys, from->n_keys * NAME_KEY_LEN);
+    into->n_keys += from->n_keys;
+    into->next = from->next;
+  } else {
+    memcpy(into->keys[into->n_keys], parent->keys[at], NAME_KEY_LEN);
+    memcpy(into->keys[into->n_keys + 1], from->keys, from->n_keys * NAME_KEY_LEN);
+    memcpy(&into->children[into->n_keys + 1], from->children, (from->n_keys + 1) * sizeof(name_node_t *));
+    into->n_keys += from->n_keys + 1;
+  }
+  remove_child(parent, at + 1);
+  remove_key(parent, at);
+  free_node(index, from);
+}
+
+static bool delete_from(name_index_t *index, name_node_t *node, const char *key) {
+  if (node->leaf) {
+    size_t i = lower_bound(node, key);
+    if (i == node->n_keys || memcmp(node->keys[i], key, NAME_KEY_LEN) != 0) {
+      return false;
+    }
+    remove_key(node, i);
+    return true;
+  }
+
+  size_t i = child_index(node, key);
+  if (!delete_from(index, node->children[i], key)) {
+    return false;
+  }
+  if (node->children[i]->n_keys < NAME_NODE_MIN_KEYS) {
+    rebalance(index, node, i);
+  }
+  return true;
+}
+
+/*
+ * Removes the given name from the index. Throws an assertion if any of
+ * the parameters are NULL. Returns false if the name wasn't there.
+ */
+
+bool name_index_delete(name_index_t *index, const char *name) {
+  assert(index != NULL && name != NULL);
+  char key[NAME_KEY_LEN];
+  make_key(key, name);
+  if (!delete_from(index, index->root, key)) {
+    return false;
+  }
+  // A root left with a single child is replaced by it
+  if (!index->root->leaf && index->root->n_keys == 0) {
+    name_node_t *root = index->root;
+    index->root = root->children[0];
+    free_node(index, root);
+    index->height--;
+  }
+  index->n_names--;
+  return true;
+}
+
+/*
+ * Copies up to limit names that start with the given prefix into out,
+ * in order and, if after isn't NULL or empty, from the first name past
+ * it on, so that the last name of a page continues the search. Sets
+ * more if further names match. Visits one node per level and the
+ * leaves the page spans, at most limit / NAME_NODE_MIN_KEYS + 2 of
+ * them. Throws an assertion if any of the parameters but after are
+ * NULL. Returns the number of names copied.
+ */
+
+size_t name_index_search(const name_index_t *index, const char *prefix, const char *after, size_t limit,
+                         char (*out)[NAME_KEY_LEN], bool *more) {
+  assert(index != NULL && prefix != NULL && out != NULL && more != NULL);
+  *more = false;
+  size_t prefix_len = strnlen(prefix, NAME_KEY_LEN - 1);
+  char start[NAME_KEY_LEN];
+  make_key(start, prefix);
+  bool past_start = false;
+  if (after != NULL && after[0] != '\0' && strncmp(after, prefix, NAME_KEY_LEN) >= 0) {
+    make_key(start, after);
+    past_start = true;
+  }
+
+  const name_node_t *node = index->root;
+  while (!node->leaf) {
+    node = node->children[child_index(node, start)];
+  }
+  size_t i = lower_bound(node, start);
+  if (past_start && i < node->n_keys && memcmp(node->keys[i], start, NAME_KEY_LEN) == 0) {
+    i++;
+  }
+
+  size_t n_found = 0;
+  for (; node != NULL; node = node->next, i = 0) {
+    for (; i < node->n_keys; i++) {
+      if (strncmp(node->keys[i], prefix, prefix_len) != 0) {
+        return n_found;
+      }
+      if (n_found == limit) {
+        *more = true;
+        return n_found;
+      }
+      memcpy(out[n_found++], node->keys[i], NAME_KEY_LEN);
+    }
+  }
+  return n_found;
+}
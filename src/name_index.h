@@ -0,0 +1,54 @@
+#ifndef CHAT_NAME_INDEX_H
+#define CHAT_NAME_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NAME_KEY_LEN (32)
+// Names per node, every node but the root holds at least the minimum
+#define NAME_NODE_KEYS (63)
+#define NAME_NODE_MIN_KEYS (NAME_NODE_KEYS / 2)
+
+/*
+ * A node of the tree. Leaves hold the names and are chained in order,
+ * inner nodes hold separators, every name in the subtree left of a
+ * separator is smaller and every name right of it is at least as big.
+ * Names are zero padded, so memcmp() orders them like strcmp().
+ */
+typedef struct NameNode {
+  uint16_t n_keys;
+  bool leaf;
+  // Next leaf in order, leaves only
+  struct NameNode *next;
+  char keys[NAME_NODE_KEYS][NAME_KEY_LEN];
+  // n_keys + 1 children, only allocated for inner nodes
+  struct NameNode *children[];
+} name_node_t;
+
+/*
+ * Ordered set of usernames for prefix searches, a B+ tree. Lookups,
+ * insertions and deletions touch one node per level, a search visits
+ * the leaves its page spans on top of that. Not thread safe.
+ */
+typedef struct NameIndex {
+  name_node_t *root;
+  size_t n_names;
+  size_t n_leaves;
+  size_t n_inner;
+  size_t height;
+  // Bytes taken by the nodes
+  size_t memory_used;
+} name_index_t;
+
+name_index_t *name_index_create();
+
+void name_index_free(name_index_t *);
+
+bool name_index_insert(name_index_t *, const char *);
+
+bool name_index_delete(name_index_t *, const char *);
+
+size_t name_index_search(const name_index_t *, const char *, const char *, size_t, char (*)[NAME_KEY_LEN], bool *);
+
+#endif
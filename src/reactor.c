@@ -0,0 +1,621 @@
+/*
+ * An epoll reactor serving TLS connections. Sockets are non-blocking
+ * and every connection is a small state machine (handshake, reading a
+ * request, writing the reply) that is advanced whenever its socket is
+ * ready, so a client that stalls only holds up itself. Connections
+ * that don't finish a step before their deadline are dropped. A
+ * connection the handler keeps open after a reply waits for its next
+ * request under the longer idle deadline. A draining reactor accepts
+ * nothing new and closes every connection as soon as it is idle. A
+ * datagram socket can be polled along with the connections. A handler
+ * may defer a reply to another thread, the connection then waits
+ * outside of epoll until the reply is posted back through the
+ * reactor's mailbox.
+ */
+
+#define _GNU_SOURCE
+
+#include "reactor.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void list_remove(connection_t *conn) {
+  connection_list_t *list = conn->list;
+  if (conn->prev != NULL) {
+    conn->prev->next = conn->next;
+  } else {
+    list->head = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  } else {
+    list->tail = conn->prev;
+  }
+  conn->prev = NULL;
+  conn->next = NULL;
+  conn->list = NULL;
+}
+
+static void list_append(connection_list_t *list, connection_t *conn) {
+  conn->prev = list->tail;
+  conn->next = NULL;
+  if (list->tail != NULL) {
+    list->tail->next = conn;
+  } else {
+    list->head = conn;
+  }
+  list->tail = conn;
+  conn->list = list;
+}
+
+/*
+ * Every deadline of a list is the same distance from now, so moving
+ * the connection to the tail keeps the list ordered by deadline.
+ */
+
+static void set_deadline(reactor_t *reactor, connection_t *conn, bool idle) {
+  if (conn->list != NULL) {
+    list_remove(conn);
+  }
+  conn->deadline_ms = now_ms() + (idle ? CONNECTION_IDLE_TIMEOUT_MS : CONNECTION_TIMEOUT_MS);
+  list_append(idle ? &reactor->idle : &reactor->active, conn);
+}
+
+// Frees the connection without touching its socket or TLS state
+static void release_connection(reactor_t *reactor, connection_t *conn) {
+  if (conn->state == CONN_HANDSHAKE) {
+    reactor->n_handshakes--;
+  }
+  if (conn->admitted) {
+    admission_release(reactor->admission, &conn->peer);
+  }
+  list_remove(conn);
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  free(conn->out);
+  free(conn);
+  reactor->n_connections--;
+}
+
+/*
+ * Closes the connection and frees it. A graceful close sends a TLS
+ * close_notify first, that is not allowed after a fatal TLS error.
+ */
+
+static void close_connection(reactor_t *reactor, connection_t *conn, bool graceful) {
+  SSL *ssl = conn->ssl;
+  int fd = conn->fd;
+  release_connection(reactor, conn);
+  if (graceful) {
+    // Best effort, the socket is non-blocking and the peer's reply isn't awaited
+    SSL_shutdown(ssl);
+  }
+  SSL_free(ssl);
+  close(fd);
+}
+
+static bool watch(reactor_t *reactor, connection_t *conn, uint32_t events) {
+  if (conn->events == events) {
+    return true;
+  }
+  struct epoll_event event = { .events = events, .data.ptr = conn };
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0) {
+    return false;
+  }
+  conn->events = events;
+  return true;
+}
+
+/*
+ * Waits for whatever a TLS call that didn't complete needs, or closes
+ * the connection if the call failed.
+ */
+
+static void wait_for(reactor_t *reactor, connection_t *conn, int ret) {
+  int error = SSL_get_error(conn->ssl, ret);
+  uint32_t events = 0;
+  if (error == SSL_ERROR_WANT_READ) {
+    events = EPOLLIN;
+  } else if (error == SSL_ERROR_WANT_WRITE) {
+    events = EPOLLOUT;
+  }
+  if (events == 0 || !watch(reactor, conn, events)) {
+    close_connection(reactor, conn, error == SSL_ERROR_ZERO_RETURN);
+  }
+}
+
+/*
+ * Stops watching a connection whose handler deferred its reply until
+ * connection_resume() posts it. Its socket leaves epoll, so that a
+ * hangup isn't reported over and over meanwhile.
+ */
+
+static void wait_for_reply(reactor_t *reactor, connection_t *conn) {
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  conn->events = 0;
+  conn->state = CONN_WAITING;
+  list_remove(conn);
+  list_append(&reactor->waiting, conn);
+}
+
+/*
+ * Passes the buffered request bytes to the handler and moves on to
+ * writing its reply. Returns false if the connection was closed,
+ * detached or waits for a deferred reply.
+ */
+
+static bool handle_input(reactor_t *reactor, connection_t *conn) {
+  reactor->handler(conn, reactor->handler_ctx);
+  if (conn->detached) {
+    release_connection(reactor, conn);
+    return false;
+  }
+  if (conn->out_len == 0) {
+    if (conn->close_after_write) {
+      close_connection(reactor, conn, true);
+      return false;
+    }
+    if (conn->deferred) {
+      wait_for_reply(reactor, conn);
+      return false;
+    }
+    return true;
+  }
+  conn->state = CONN_WRITING;
+  return true;
+}
+
+/*
+ * Advances the connection's state machine as far as the socket
+ * allows without blocking. The connection may be freed on return.
+ */
+
+static void drive(reactor_t *reactor, connection_t *conn) {
+  // Errors of other connections must not leak into SSL_get_error()
+  ERR_clear_error();
+  while (true) {
+    if (conn->state == CONN_HANDSHAKE) {
+      int ret = SSL_do_handshake(conn->ssl);
+      if (ret != 1) {
+        wait_for(reactor, conn, ret);
+        return;
+      }
+      conn->state = CONN_READING;
+      reactor->n_handshakes--;
+      if (reactor->handshake_us != NULL) {
+        histogram_record(reactor->handshake_us, (uint64_t) (now_us() - conn->accepted_us));
+      }
+    }
+
+    if (conn->state == CONN_READING) {
+      size_t space = sizeof(conn->in) - 1 - conn->in_len;
+      if (space == 0) {
+        // The handler didn't consume a full buffer, the request is too long
+        close_connection(reactor, conn, false);
+        return;
+      }
+      int ret = SSL_read(conn->ssl, conn->in + conn->in_len, (int) space);
+      if (ret <= 0) {
+        wait_for(reactor, conn, ret);
+        return;
+      }
+      if (conn->list == &reactor->idle) {
+        // The next request has to arrive in full before the short deadline
+        set_deadline(reactor, conn, false);
+      }
+      conn->in_len += (size_t) ret;
+      conn->in[conn->in_len] = '\0';
+      if (!handle_input(reactor, conn)) {
+        return;
+      }
+    }
+
+    if (conn->state == CONN_WRITING) {
+      int ret = SSL_write(conn->ssl, conn->out + conn->out_sent, (int) (conn->out_len - conn->out_sent));
+      if (ret <= 0) {
+        wait_for(reactor, conn, ret);
+        return;
+      }
+      conn->out_sent += (size_t) ret;
+      if (conn->out_sent < conn->out_len) {
+        continue;
+      }
+      // A draining reactor closes between requests, pipelined ones are answered first
+      if (conn->close_after_write || (reactor->draining && conn->in_len == 0 && !conn->deferred)) {
+        close_connection(reactor, conn, true);
+        return;
+      }
+      conn->out_len = 0;
+      conn->out_sent = 0;
+      if (conn->deferred) {
+        // The replies queued in front of the deferred one are out
+        wait_for_reply(reactor, conn);
+        return;
+      }
+      conn->state = CONN_READING;
+      set_deadline(reactor, conn, conn->in_len == 0);
+    }
+
+    if (conn->state == CONN_WAITING) {
+      return;
+    }
+  }
+}
+
+/*
+ * Queues the replies posted to the mailbox on their connections and
+ * serves whatever the clients pipelined behind the deferred requests.
+ */
+
+static void deliver_replies(reactor_t *reactor) {
+  uint64_t n_posted;
+  if (read(reactor->wakeup_fd, &n_posted, sizeof(n_posted)) != sizeof(n_posted)) {
+    return;
+  }
+  pthread_mutex_lock(&reactor->mailbox_lock);
+  deferred_reply_t *reply = reactor->mailbox;
+  reactor->mailbox = NULL;
+  pthread_mutex_unlock(&reactor->mailbox_lock);
+
+  while (reply != NULL) {
+    deferred_reply_t *next = reply->next;
+    connection_t *conn = reply->conn;
+    connection_reply(conn, reply->data, reply->len, reply->close);
+    free(reply->data);
+    free(reply);
+    reply = next;
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+      close_connection(reactor, conn, false);
+      continue;
+    }
+    conn->events = EPOLLIN;
+    conn->deferred = false;
+    conn->state = CONN_READING;
+    set_deadline(reactor, conn, false);
+    if (conn->in_len != 0 && !handle_input(reactor, conn)) {
+      continue;
+    }
+    if (conn->out_len != 0) {
+      conn->state = CONN_WRITING;
+    }
+    drive(reactor, conn);
+  }
+}
+
+static void accept_connections(reactor_t *reactor) {
+  while (true) {
+    struct sockaddr_storage peer;
+    socklen_t size = sizeof(peer);
+    int fd = accept4(reactor->listen_fd, (struct sockaddr *) &peer, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    if (reactor->n_connections >= MAX_CONNECTIONS) {
+      close(fd);
+      reactor->n_rejected++;
+      continue;
+    }
+    if (reactor->admission != NULL && !admission_accept(reactor->admission, &peer, reactor->n_handshakes)) {
+      // A reset instead of a FIN keeps the refused socket out of TIME_WAIT
+      struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+      setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+      close(fd);
+      continue;
+    }
+
+    // Replies are small and written in one go, don't hold them back for ACKs
+    int opt = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    connection_t *conn = calloc(1, sizeof(connection_t));
+    assert(conn != NULL);
+    conn->reactor = reactor;
+    conn->fd = fd;
+    conn->peer = peer;
+    conn->accepted_us = now_us();
+    conn->ssl = SSL_new(reactor->ctx);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, fd) != 1
+        || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+      if (reactor->admission != NULL) {
+        admission_release(reactor->admission, &peer);
+      }
+      SSL_free(conn->ssl);
+      close(fd);
+      free(conn);
+      continue;
+    }
+    SSL_set_accept_state(conn->ssl);
+    // The reply buffer may be reallocated between retries of a write
+    SSL_set_mode(conn->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    conn->events = EPOLLIN;
+    conn->state = CONN_HANDSHAKE;
+    conn->admitted = reactor->admission != NULL;
+    set_deadline(reactor, conn, false);
+    reactor->n_connections++;
+    reactor->n_handshakes++;
+    reactor->n_accepted++;
+
+    drive(reactor, conn);
+  }
+}
+
+/*
+ * Creates a reactor accepting TLS connections on the given listening
+ * socket, which is switched to non-blocking mode. The handler is
+ * called with the given context for every request. Returns NULL on
+ * failure. Throws an assertion if a memory allocation error occurs.
+ * Call reactor_free() afterwards to avoid memory leaks!
+ */
+
+reactor_t *reactor_create(int listen_fd, SSL_CTX *ctx, request_handler_t handler, void *handler_ctx) {
+  assert(ctx != NULL && handler != NULL);
+  int flags = fcntl(listen_fd, F_GETFL);
+  if (flags < 0 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    fprintf(stderr, "[ERROR] Could not make the listening socket non-blocking (%d)\n", errno);
+    return NULL;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    fprintf(stderr, "[ERROR] epoll_create1() failed (%d)\n", errno);
+    return NULL;
+  }
+  // The listening socket is told apart from connections by a NULL pointer
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0) {
+    fprintf(stderr, "[ERROR] epoll_ctl() failed (%d)\n", errno);
+    close(epoll_fd);
+    return NULL;
+  }
+
+  reactor_t *reactor = calloc(1, sizeof(reactor_t));
+  assert(reactor != NULL);
+  // Told apart from the other sockets by pointing at the reactor's descriptor of it
+  reactor->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  event = (struct epoll_event) { .events = EPOLLIN, .data.ptr = &reactor->wakeup_fd };
+  if (reactor->wakeup_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd, &event) != 0) {
+    fprintf(stderr, "[ERROR] Could not set up the reactor's mailbox (%d)\n", errno);
+    if (reactor->wakeup_fd >= 0) {
+      close(reactor->wakeup_fd);
+    }
+    close(epoll_fd);
+    free(reactor);
+    return NULL;
+  }
+  pthread_mutex_init(&reactor->mailbox_lock, NULL);
+  reactor->epoll_fd = epoll_fd;
+  reactor->listen_fd = listen_fd;
+  reactor->ctx = ctx;
+  reactor->handler = handler;
+  reactor->handler_ctx = handler_ctx;
+  reactor->datagram_fd = -1;
+  return reactor;
+}
+
+/*
+ * Polls the given datagram socket, which is switched to non-blocking
+ * mode, along with the connections and calls the handler with the
+ * given context whenever it is readable. The socket is left open by
+ * reactor_free(). Throws an assertion if the reactor is NULL or polls
+ * one already. Returns 0 on success, -1 on failure.
+ */
+
+int reactor_add_datagrams(reactor_t *reactor, int fd, datagram_handler_t handler, void *handler_ctx) {
+  assert(reactor != NULL && handler != NULL && reactor->datagram_fd < 0);
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+    return -1;
+  }
+  // Told apart from the listening socket and the connections by pointing at the reactor
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = reactor };
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    return -1;
+  }
+  reactor->datagram_fd = fd;
+  reactor->datagram_handler = handler;
+  reactor->datagram_ctx = handler_ctx;
+  return 0;
+}
+
+/*
+ * Closes every open connection and frees the reactor. The listening
+ * socket is left open.
+ */
+
+void reactor_free(reactor_t *reactor) {
+  if (reactor == NULL) {
+    return;
+  }
+  while (reactor->active.head != NULL) {
+    close_connection(reactor, reactor->active.head, false);
+  }
+  while (reactor->idle.head != NULL) {
+    close_connection(reactor, reactor->idle.head, false);
+  }
+  while (reactor->waiting.head != NULL) {
+    close_connection(reactor, reactor->waiting.head, false);
+  }
+  while (reactor->mailbox != NULL) {
+    deferred_reply_t *next = reactor->mailbox->next;
+    free(reactor->mailbox->data);
+    free(reactor->mailbox);
+    reactor->mailbox = next;
+  }
+  pthread_mutex_destroy(&reactor->mailbox_lock);
+  close(reactor->wakeup_fd);
+  close(reactor->epoll_fd);
+  free(reactor);
+}
+
+/*
+ * Waits at most the given number of milliseconds for socket events,
+ * handles them and drops the connections whose deadline has passed.
+ * Returns the number of events handled, or -1 if waiting failed for
+ * another reason than a signal.
+ */
+
+int reactor_poll(reactor_t *reactor, int timeout_ms) {
+  assert(reactor != NULL);
+  connection_list_t *lists[] = { &reactor->active, &reactor->idle };
+  int64_t now = now_ms();
+  for (int i = 0; i < 2; i++) {
+    if (lists[i]->head != NULL && lists[i]->head->deadline_ms - now < timeout_ms) {
+      int64_t until = lists[i]->head->deadline_ms - now;
+      timeout_ms = until < 0 ? 0 : (int) until;
+    }
+  }
+
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  int n_events = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+  if (n_events < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+
+  for (int i = 0; i < n_events; i++) {
+    if (events[i].data.ptr == NULL) {
+      accept_connections(reactor);
+    } else if (events[i].data.ptr == reactor) {
+      reactor->datagram_handler(reactor->datagram_fd, reactor->datagram_ctx);
+    } else if (events[i].data.ptr == &reactor->wakeup_fd) {
+      deliver_replies(reactor);
+    } else {
+      drive(reactor, (connection_t *) events[i].data.ptr);
+    }
+  }
+
+  now = now_ms();
+  for (int i = 0; i < 2; i++) {
+    while (lists[i]->head != NULL && lists[i]->head->deadline_ms <= now) {
+      close_connection(reactor, lists[i]->head, false);
+      reactor->n_timeouts++;
+    }
+  }
+  return n_events;
+}
+
+/*
+ * Stops accepting connections and closes the ones waiting for their
+ * next request, the others are closed once their reply is written.
+ * Connections that haven't sent a request yet get to send one, so a
+ * client whose connection was accepted is always answered. The
+ * datagram socket isn't read anymore either. Both sockets are left
+ * open, another reactor or process can keep serving them.
+ */
+
+void reactor_drain(reactor_t *reactor) {
+  assert(reactor != NULL);
+  if (reactor->draining) {
+    return;
+  }
+  reactor->draining = true;
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listen_fd, NULL);
+  if (reactor->datagram_fd >= 0) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->datagram_fd, NULL);
+  }
+  while (reactor->idle.head != NULL) {
+    close_connection(reactor, reactor->idle.head, true);
+  }
+}
+
+/*
+ * Queues the given bytes to be sent once the handler returns. The
+ * connection is closed after the reply is written if close is set,
+ * a reply without bytes then just closes it. Throws an assertion if a
+ * memory allocation error occurs.
+ */
+
+void connection_reply(connection_t *conn, const char *data, size_t len, bool close) {
+  assert(conn != NULL && (data != NULL || len == 0));
+  if (len != 0) {
+    char *out = realloc(conn->out, conn->out_len + len);
+    assert(out != NULL);
+    memcpy(out + conn->out_len, data, len);
+    conn->out = out;
+    conn->out_len += len;
+  }
+  conn->close_after_write = conn->close_after_write || close;
+}
+
+/*
+ * Hands the connection's socket and TLS state over to the handler,
+ * which must have taken them: the reactor stops watching the socket
+ * and frees the connection once the handler returns, without closing
+ * either. Queued reply bytes are dropped. Throws an assertion if the
+ * connection is NULL.
+ */
+
+void connection_detach(connection_t *conn) {
+  assert(conn != NULL);
+  conn->detached = true;
+}
+
+/*
+ * Defers the reply to the request the handler is answering: the
+ * handler returns without a reply for it and without consuming the
+ * requests behind it, replies queued in front of it are still sent.
+ * The connection then waits until the reply is passed to
+ * connection_resume(), which has to happen exactly once and in bounded
+ * time, the connection has no deadline meanwhile. Throws an assertion
+ * if the connection is NULL or deferred already.
+ */
+
+void connection_defer(connection_t *conn) {
+  assert(conn != NULL && !conn->deferred);
+  conn->deferred = true;
+}
+
+/*
+ * Posts the reply of a deferred request to the connection's reactor,
+ * which queues it like connection_reply() and goes on serving the
+ * connection. May be called from any thread, the connection must not
+ * be touched afterwards. Throws an assertion if the connection isn't
+ * deferred or if a memory allocation error occurs.
+ */
+
+void connection_resume(connection_t *conn, const char *data, size_t len, bool close) {
+  assert(conn != NULL && conn->deferred && (data != NULL || len == 0));
+  deferred_reply_t *reply = malloc(sizeof(deferred_reply_t));
+  assert(reply != NULL);
+  *reply = (deferred_reply_t) { .conn = conn, .data = NULL, .len = len, .close = close };
+  if (len != 0) {
+    reply->data = malloc(len);
+    assert(reply->data != NULL);
+    memcpy(reply->data, data, len);
+  }
+  reactor_t *reactor = conn->reactor;
+  pthread_mutex_lock(&reactor->mailbox_lock);
+  reply->next = reactor->mailbox;
+  reactor->mailbox = reply;
+  pthread_mutex_unlock(&reactor->mailbox_lock);
+  uint64_t one = 1;
+  // Only fails if the counter would overflow, the reactor is woken up either way then
+  if (write(reactor->wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+    return;
+  }
+}
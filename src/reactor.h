@@ -0,0 +1,146 @@
+#ifndef CHAT_REACTOR_H
+#define CHAT_REACTOR_H
+
+#include "admission.h"
+#include "metrics.h"
+
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define REACTOR_MAX_EVENTS (256)
+#define CONNECTION_BUFFER_SIZE (1024)
+// A connection is dropped if it doesn't finish a handshake or a request in time
+#ifndef CONNECTION_TIMEOUT_MS
+#define CONNECTION_TIMEOUT_MS (5000)
+#endif
+// Connections kept open between requests are dropped after this long
+#ifndef CONNECTION_IDLE_TIMEOUT_MS
+#define CONNECTION_IDLE_TIMEOUT_MS (5 * 60 * 1000)
+#endif
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS (16384)
+#endif
+
+typedef enum ConnectionState {
+  CONN_HANDSHAKE,
+  CONN_READING,
+  CONN_WRITING,
+  // The handler deferred its reply, see connection_defer()
+  CONN_WAITING,
+} connection_state_t;
+
+struct Connection;
+struct Reactor;
+
+// Doubly linked, ordered by deadline since all deadlines of a list are equally far out
+typedef struct ConnectionList {
+  struct Connection *head;
+  struct Connection *tail;
+} connection_list_t;
+
+typedef struct Connection {
+  struct Reactor *reactor;
+  int fd;
+  SSL *ssl;
+  connection_state_t state;
+  struct sockaddr_storage peer;
+  // Epoll events currently watched
+  uint32_t events;
+  char in[CONNECTION_BUFFER_SIZE];
+  size_t in_len;
+  char *out;
+  size_t out_len;
+  size_t out_sent;
+  bool close_after_write;
+  // Set once the handler took the socket over, see connection_detach()
+  bool detached;
+  // Set from connection_defer() until the reply is passed to connection_resume()
+  bool deferred;
+  // Counts against its source's open connections, see admission.h
+  bool admitted;
+  // Owned by the handler, 0 on a fresh connection
+  int protocol;
+  // Busy connections live in the reactor's active list, the ones
+  // waiting for their next request in its idle list and the ones
+  // waiting for a deferred reply in its waiting list
+  connection_list_t *list;
+  int64_t deadline_ms;
+  int64_t accepted_us;
+  struct Connection *prev;
+  struct Connection *next;
+} connection_t;
+
+/*
+ * Called whenever new request bytes are read. Consumes the request
+ * from the input buffer and queues a reply with connection_reply(),
+ * or defers it with connection_defer() and consumes nothing behind it.
+ */
+typedef void (*request_handler_t)(connection_t *, void *);
+
+// Called whenever the reactor's datagram socket is readable
+typedef void (*datagram_handler_t)(int, void *);
+
+// A deferred reply on its way back to the reactor's thread, see connection_resume()
+typedef struct DeferredReply {
+  connection_t *conn;
+  char *data;
+  size_t len;
+  bool close;
+  struct DeferredReply *next;
+} deferred_reply_t;
+
+typedef struct Reactor {
+  int epoll_fd;
+  int listen_fd;
+  SSL_CTX *ctx;
+  request_handler_t handler;
+  void *handler_ctx;
+  connection_list_t active;
+  connection_list_t idle;
+  // Without deadlines, whoever deferred a reply answers it in bounded time
+  connection_list_t waiting;
+  size_t n_connections;
+  size_t n_accepted;
+  size_t n_timeouts;
+  size_t n_rejected;
+  // Connections in CONN_HANDSHAKE
+  size_t n_handshakes;
+  // Handshake times are recorded here when set
+  histogram_t *handshake_us;
+  // New connections are checked here before their handshake when set
+  admission_t *admission;
+  // Set by reactor_drain(), connections are closed once they are idle
+  bool draining;
+  // Polled along with the connections when not -1, see reactor_add_datagrams()
+  int datagram_fd;
+  datagram_handler_t datagram_handler;
+  void *datagram_ctx;
+  // Signalled by connection_resume() whenever it posts to the mailbox
+  int wakeup_fd;
+  pthread_mutex_t mailbox_lock;
+  deferred_reply_t *mailbox;
+} reactor_t;
+
+reactor_t *reactor_create(int, SSL_CTX *, request_handler_t, void *);
+
+void reactor_free(reactor_t *);
+
+int reactor_add_datagrams(reactor_t *, int, datagram_handler_t, void *);
+
+int reactor_poll(reactor_t *, int);
+
+void reactor_drain(reactor_t *);
+
+void connection_reply(connection_t *, const char *, size_t, bool);
+
+void connection_detach(connection_t *);
+
+void connection_defer(connection_t *);
+
+void connection_resume(connection_t *, const char *, size_t, bool);
+
+#endif
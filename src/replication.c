@@ -0,0 +1,880 @@
+/*
+ * Leader/follower replication of the lookup table. A follower opens a
+ * TLS connection to the leader's lookup port and sends a
+ * FRAME_OP_REPLICATE frame, the leader's reactor then hands the
+ * connection to a sender thread that only writes from there on: the
+ * reply, a snapshot of the table if the follower can't continue where
+ * it left off, and then every change from the leader's change log as
+ * it happens. The snapshot is taken in chunks while the table keeps
+ * changing, the changes from the moment it started are sent after it,
+ * so the follower converges on the leader's table. A follower's
+ * updates travel the other way, a forwarder thread pipelines them to
+ * the leader over a connection of its own.
+ */
+
+#define _GNU_SOURCE
+
+#include "replication.h"
+
+#include "cluster.h"
+#include "frame.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Frames on their way to a follower, written out once the buffer fills up
+typedef struct StreamBuffer {
+  SSL *ssl;
+  uint8_t data[REPLICATION_BUFFER_SIZE];
+  size_t len;
+} stream_buffer_t;
+
+typedef struct SnapshotChunk {
+  stream_buffer_t *out;
+  frame_t frame;
+  size_t n_entries;
+} snapshot_chunk_t;
+
+typedef struct NameBatch {
+  char names[REPLICATION_READ_RECORDS][MAX_USERNAME_LEN];
+  size_t n_names;
+} name_batch_t;
+
+// Forwards written to the leader at once, and how their names were split into frames
+typedef struct ForwardBatch {
+  forward_request_t *requests[REPLICA_FORWARD_BATCH];
+  size_t n_requests;
+  uint8_t n_frames[REPLICA_FORWARD_BATCH];
+  uint8_t frame_names[REPLICA_FORWARD_BATCH][LOOKUP_BATCH_MAX];
+} forward_batch_t;
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Changes are stamped with the wall clock, which both sides of a stream on one host share
+static int64_t wall_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_timeout(int fd, int option, int timeout_ms) {
+  struct timeval timeout = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+  setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+static bool flush_stream(stream_buffer_t *out) {
+  if (out->len == 0) {
+    return true;
+  }
+  bool ok = SSL_write(out->ssl, out->data, (int) out->len) == (int) out->len;
+  out->len = 0;
+  return ok;
+}
+
+// Queues the frame, writes the buffer out first if it can't take it
+static bool push_frame(stream_buffer_t *out, const frame_t *frame) {
+  if (out->len + FRAME_SIZE_MAX > sizeof(out->data) && !flush_stream(out)) {
+    return false;
+  }
+  out->len += frame_encode(frame, out->data + out->len);
+  return true;
+}
+
+/*
+ * Table visitor, adds the registration to the snapshot frame being
+ * filled. Stops the scan once the buffer can't take another frame, it
+ * can't be written out while the table lock is held.
+ */
+
+static bool snapshot_entry(const userdata_t *data, void *ctx) {
+  snapshot_chunk_t *chunk = (snapshot_chunk_t *) ctx;
+  if (chunk->frame.length + FRAME_TRANSFER_ENTRY_MAX > FRAME_PAYLOAD_MAX) {
+    if (chunk->out->len + FRAME_SIZE_MAX > sizeof(chunk->out->data)) {
+      return false;
+    }
+    chunk->out->len += frame_encode(&chunk->frame, chunk->out->data + chunk->out->len);
+    frame_init(&chunk->frame, FRAME_OP_SNAPSHOT, FRAME_STATUS_OK);
+  }
+  frame_put_name(&chunk->frame, data->username);
+  frame_put_addr(&chunk->frame, &data->ip);
+  frame_put_u32(&chunk->frame, (uint32_t) data->lease_expiry);
+  frame_put_u32(&chunk->frame, (uint32_t) data->last_seen);
+  chunk->n_entries++;
+  return true;
+}
+
+/*
+ * Streams every registration of the table as snapshot frames and ends
+ * them with an empty one. The table lock is taken for one buffer of
+ * frames at a time and never held while writing. Returns false if the
+ * follower went away or the replication is stopping.
+ */
+
+static bool send_snapshot(replication_t *replication, stream_buffer_t *out, size_t *n_entries) {
+  snapshot_chunk_t *chunk = malloc(sizeof(snapshot_chunk_t));
+  assert(chunk != NULL);
+  chunk->out = out;
+  chunk->n_entries = 0;
+  frame_init(&chunk->frame, FRAME_OP_SNAPSHOT, FRAME_STATUS_OK);
+
+  table_cursor_t cursor = { 0 };
+  bool more = true, ok = true;
+  while (more && ok) {
+    pthread_mutex_lock(&global_table_lock);
+    more = table_scan(replication->ht, &cursor, REPLICATION_SCAN_SLOTS, snapshot_entry, chunk);
+    pthread_mutex_unlock(&global_table_lock);
+    ok = !atomic_load(&replication->stopping) && flush_stream(out);
+  }
+  frame_t end;
+  frame_init(&end, FRAME_OP_SNAPSHOT, FRAME_STATUS_OK);
+  ok = ok && (chunk->frame.length == 0 || push_frame(out, &chunk->frame)) && push_frame(out, &end)
+       && flush_stream(out);
+  *n_entries = chunk->n_entries;
+  free(chunk);
+  return ok;
+}
+
+static size_t change_size(const change_record_t *record) {
+  size_t size = 1 + 1 + strlen(record->data.username);
+  if (record->op == JOURNAL_OP_UPDATE) {
+    size += 1 + (record->data.ip.family == AF_INET6 ? 16 : 4) + 4 + 4;
+  } else if (record->op == CHANGE_OP_SEEN) {
+    size += 4;
+  }
+  return size;
+}
+
+/*
+ * Writes the given changes, the first of which has the given sequence
+ * number, as change frames. No changes make a heartbeat frame. Returns
+ * false if the follower went away.
+ */
+
+static bool send_changes(stream_buffer_t *out, uint64_t seq, const change_record_t *records, size_t n_records) {
+  size_t i = 0;
+  do {
+    size_t end = i, length = FRAME_CHANGES_HEADER;
+    while (end < n_records && length + change_size(&records[end]) <= FRAME_PAYLOAD_MAX) {
+      length += change_size(&records[end]);
+      end++;
+    }
+    frame_t frame;
+    frame_init(&frame, FRAME_OP_CHANGES, FRAME_STATUS_OK);
+    frame_put_u64(&frame, seq + i);
+    frame_put_u64(&frame, (uint64_t) (end > i ? records[end - 1].time_us : wall_us()));
+    for (; i < end; i++) {
+      frame_put_status(&frame, (uint8_t) records[i].op);
+      frame_put_name(&frame, records[i].data.username);
+      if (records[i].op == JOURNAL_OP_UPDATE) {
+        frame_put_addr(&frame, &records[i].data.ip);
+        frame_put_u32(&frame, (uint32_t) records[i].data.lease_expiry);
+        frame_put_u32(&frame, (uint32_t) records[i].data.last_seen);
+      } else if (records[i].op == CHANGE_OP_SEEN) {
+        frame_put_u32(&frame, (uint32_t) records[i].data.last_seen);
+      }
+    }
+    if (!push_frame(out, &frame)) {
+      return false;
+    }
+  } while (i < n_records);
+  return flush_stream(out);
+}
+
+static void format_peer(int fd, char *out) {
+  struct sockaddr_storage ss = { 0 };
+  socklen_t ss_length = sizeof(ss);
+  ring_node_t node = { 0 };
+  getpeername(fd, (struct sockaddr *) &ss, &ss_length);
+  if (ss.ss_family == AF_INET6) {
+    node.addr.family = AF_INET6;
+    node.addr.addr.v6 = ((struct sockaddr_in6 *) &ss)->sin6_addr;
+    node.port = ntohs(((struct sockaddr_in6 *) &ss)->sin6_port);
+  } else if (ss.ss_family == AF_INET) {
+    node.addr.family = AF_INET;
+    node.addr.addr.v4 = ((struct sockaddr_in *) &ss)->sin_addr;
+    node.port = ntohs(((struct sockaddr_in *) &ss)->sin_port);
+  }
+  ring_node_format(&node, out);
+}
+
+/*
+ * Sender thread of one follower. Answers its request, sends a snapshot
+ * first unless the follower's position is still in the change log,
+ * then streams the log until the follower goes away, falls behind the
+ * log or the replication stops.
+ */
+
+static void *run_sender(void *arg) {
+  follower_t *follower = (follower_t *) arg;
+  replication_t *replication = follower->replication;
+  change_log_t *log = replication->log;
+  char peer[RING_NODE_STRLEN];
+  format_peer(follower->fd, peer);
+  // The reactor left the socket non-blocking
+  int flags = fcntl(follower->fd, F_GETFL);
+  fcntl(follower->fd, F_SETFL, flags & ~O_NONBLOCK);
+  set_timeout(follower->fd, SO_SNDTIMEO, REPLICATION_TIMEOUT_MS);
+
+  stream_buffer_t *out = malloc(sizeof(stream_buffer_t));
+  change_record_t *records = malloc(REPLICATION_READ_RECORDS * sizeof(change_record_t));
+  assert(out != NULL && records != NULL);
+  out->ssl = follower->ssl;
+  out->len = 0;
+
+  uint64_t next = follower->from;
+  bool snapshot = follower->stream != log->stream || changelog_read(log, next, records, 0, 0) < 0;
+  if (snapshot) {
+    next = changelog_next(log);
+  }
+  frame_t reply;
+  frame_init(&reply, FRAME_OP_REPLICATE, FRAME_STATUS_OK);
+  frame_put_u64(&reply, log->stream);
+  frame_put_u64(&reply, next);
+  frame_put_status(&reply, snapshot ? 1 : 0);
+  bool ok = push_frame(out, &reply) && flush_stream(out);
+  log_write(LOG_INFO, "Follower %s connected, %s", peer, snapshot ? "sending a snapshot" : "resuming its stream");
+
+  if (ok && snapshot) {
+    int64_t started_ms = now_ms();
+    size_t n_entries = 0;
+    ok = send_snapshot(replication, out, &n_entries);
+    atomic_fetch_add(&replication->n_snapshots, 1);
+    log_write(ok ? LOG_INFO : LOG_WARNING, "Sent %lu registrations to follower %s in %ld ms%s", n_entries, peer,
+              now_ms() - started_ms, ok ? "" : ", the snapshot was cut short");
+  }
+  while (ok && !atomic_load(&replication->stopping)) {
+    long n_records = changelog_read(log, next, records, REPLICATION_READ_RECORDS, REPLICATION_HEARTBEAT_MS);
+    if (n_records < 0) {
+      atomic_fetch_add(&replication->n_overruns, 1);
+      log_write(LOG_WARNING, "Follower %s fell more than %d changes behind, it has to start over",
+                peer, CHANGELOG_RECORDS);
+      break;
+    }
+    ok = send_changes(out, next, records, (size_t) n_records);
+    next += (uint64_t) n_records;
+  }
+  if (!ok && !atomic_load(&replication->stopping)) {
+    log_write(LOG_INFO, "Follower %s disconnected", peer);
+  }
+
+  if (ok) {
+    SSL_shutdown(follower->ssl);
+  }
+  SSL_free(follower->ssl);
+  close(follower->fd);
+  free(out);
+  free(records);
+  atomic_fetch_sub(&replication->n_followers, 1);
+  atomic_store(&follower->done, true);
+  return NULL;
+}
+
+/*
+ * Starts logging the table's changes for followers. Must be called
+ * before the table is served. Throws an assertion if any of the
+ * parameters are NULL or if a memory allocation error occurs. Call
+ * replication_stop() afterwards to avoid memory leaks!
+ */
+
+void replication_start(replication_t *replication, hashtable_t *ht) {
+  assert(replication != NULL && ht != NULL);
+  *replication = (replication_t) { .ht = ht, .log = changelog_create() };
+  pthread_mutex_init(&replication->lock, NULL);
+  ht->changes = replication->log;
+}
+
+/*
+ * Takes over a follower's connection, a TLS connection on a
+ * non-blocking socket that asked to continue from the given stream id
+ * and sequence number, and streams the table to it from a thread of
+ * its own. Reaps the threads of followers that are gone. Throws an
+ * assertion if any of the parameters are NULL. Returns 0 on success,
+ * -1 if there are REPLICATION_MAX_FOLLOWERS followers already or the
+ * thread can't be started, the connection is left to the caller then.
+ */
+
+int replication_serve(replication_t *replication, SSL *ssl, int fd, uint64_t stream, uint64_t from) {
+  assert(replication != NULL && ssl != NULL);
+  pthread_mutex_lock(&replication->lock);
+  follower_t *slot = NULL;
+  for (size_t i = 0; i < REPLICATION_MAX_FOLLOWERS; i++) {
+    follower_t *follower = &replication->followers[i];
+    if (follower->active && atomic_load(&follower->done)) {
+      pthread_join(follower->thread, NULL);
+      follower->active = false;
+    }
+    if (!follower->active && slot == NULL) {
+      slot = follower;
+    }
+  }
+  if (slot == NULL || atomic_load(&replication->stopping)) {
+    pthread_mutex_unlock(&replication->lock);
+    return -1;
+  }
+
+  *slot = (follower_t) { .replication = replication, .ssl = ssl, .fd = fd, .stream = stream, .from = from };
+  atomic_fetch_add(&replication->n_followers, 1);
+  if (pthread_create(&slot->thread, NULL, run_sender, slot) != 0) {
+    atomic_fetch_sub(&replication->n_followers, 1);
+    pthread_mutex_unlock(&replication->lock);
+    return -1;
+  }
+  slot->active = true;
+  pthread_mutex_unlock(&replication->lock);
+  return 0;
+}
+
+/*
+ * Ends every follower's stream, stops logging changes and frees the
+ * change log. Must be called without the table lock.
+ */
+
+void replication_stop(replication_t *replication) {
+  if (replication == NULL || replication->log == NULL) {
+    return;
+  }
+  atomic_store(&replication->stopping, true);
+  pthread_mutex_lock(&replication->lock);
+  for (size_t i = 0; i < REPLICATION_MAX_FOLLOWERS; i++) {
+    if (replication->followers[i].active) {
+      pthread_join(replication->followers[i].thread, NULL);
+      replication->followers[i].active = false;
+    }
+  }
+  pthread_mutex_unlock(&replication->lock);
+
+  pthread_mutex_lock(&global_table_lock);
+  replication->ht->changes = NULL;
+  pthread_mutex_unlock(&global_table_lock);
+  changelog_free(replication->log);
+  replication->log = NULL;
+  pthread_mutex_destroy(&replication->lock);
+}
+
+// Table visitor, collects usernames until the batch is full
+static bool collect_name(const userdata_t *data, void *ctx) {
+  name_batch_t *batch = (name_batch_t *) ctx;
+  if (batch->n_names == REPLICATION_READ_RECORDS) {
+    return false;
+  }
+  memcpy(batch->names[batch->n_names++], data->username, MAX_USERNAME_LEN);
+  return true;
+}
+
+// Deletes every registration, a batch at a time, before a snapshot is applied
+static void clear_table(hashtable_t *ht) {
+  name_batch_t *batch = malloc(sizeof(name_batch_t));
+  assert(batch != NULL);
+  table_cursor_t cursor = { 0 };
+  bool more = true;
+  while (more) {
+    batch->n_names = 0;
+    pthread_mutex_lock(&global_table_lock);
+    more = table_scan(ht, &cursor, REPLICATION_SCAN_SLOTS, collect_name, batch);
+    table_write_begin(ht);
+    for (size_t i = 0; i < batch->n_names; i++) {
+      delete_data(ht, batch->names[i]);
+    }
+    table_write_end(ht);
+    pthread_mutex_unlock(&global_table_lock);
+  }
+  free(batch);
+}
+
+/*
+ * Applies the registrations of a snapshot frame to the local table.
+ * Returns false if the frame is malformed.
+ */
+
+static bool apply_snapshot(replica_t *replica, const frame_t *frame) {
+  userdata_t entries[FRAME_PAYLOAD_MAX / FRAME_TRANSFER_ENTRY_MIN];
+  size_t n_entries = 0;
+  size_t offset = 0;
+  while (offset < frame->length) {
+    userdata_t *data = &entries[n_entries];
+    uint32_t lease = 0, last_seen = 0;
+    *data = (userdata_t) { 0 };
+    if (!frame_get_name(frame, &offset, data->username) || !frame_get_addr(frame, &offset, &data->ip)
+        || data->ip.family == AF_UNSPEC || !frame_get_u32(frame, &offset, &lease)
+        || !frame_get_u32(frame, &offset, &last_seen)) {
+      return false;
+    }
+    data->lease_expiry = lease;
+    data->last_seen = last_seen;
+    n_entries++;
+  }
+
+  pthread_mutex_lock(&global_table_lock);
+  table_write_begin(replica->ht);
+  for (size_t i = 0; i < n_entries; i++) {
+    insert(replica->ht, entries[i]);
+  }
+  table_write_end(replica->ht);
+  pthread_mutex_unlock(&global_table_lock);
+  atomic_fetch_add(&replica->n_applied, n_entries);
+  return true;
+}
+
+/*
+ * Applies the changes of a change frame that this replica hasn't
+ * applied yet to the local table and records how long they took to
+ * arrive. Returns false if the frame is malformed or skips changes.
+ */
+
+static bool apply_changes(replica_t *replica, const frame_t *frame) {
+  // The smallest change is a deletion of a one byte name
+  change_record_t changes[FRAME_PAYLOAD_MAX / 3];
+  size_t n_changes = 0;
+  size_t offset = 0;
+  uint64_t seq = 0, time_us = 0;
+  if (!frame_get_u64(frame, &offset, &seq) || !frame_get_u64(frame, &offset, &time_us)) {
+    return false;
+  }
+  while (offset < frame->length) {
+    change_record_t *change = &changes[n_changes];
+    *change = (change_record_t) { .op = (char) frame->payload[offset++] };
+    if (!frame_get_name(frame, &offset, change->data.username)) {
+      return false;
+    }
+    uint32_t lease = 0, last_seen = 0;
+    if (change->op == JOURNAL_OP_UPDATE) {
+      if (!frame_get_addr(frame, &offset, &change->data.ip) || change->data.ip.family == AF_UNSPEC
+          || !frame_get_u32(frame, &offset, &lease) || !frame_get_u32(frame, &offset, &last_seen)) {
+        return false;
+      }
+      change->data.lease_expiry = lease;
+      change->data.last_seen = last_seen;
+    } else if (change->op == CHANGE_OP_SEEN) {
+      if (!frame_get_u32(frame, &offset, &last_seen)) {
+        return false;
+      }
+      change->data.last_seen = last_seen;
+    } else if (change->op != JOURNAL_OP_DELETE) {
+      return false;
+    }
+    n_changes++;
+  }
+
+  uint64_t next_seq = atomic_load(&replica->next_seq);
+  if (seq > next_seq) {
+    log_write(LOG_WARNING, "The leader skipped from change %lu to %lu", next_seq, seq);
+    return false;
+  }
+  size_t n_applied = 0;
+  pthread_mutex_lock(&global_table_lock);
+  table_write_begin(replica->ht);
+  for (size_t i = 0; i < n_changes; i++) {
+    if (seq + i < next_seq) {
+      continue;
+    }
+    if (changes[i].op == JOURNAL_OP_UPDATE) {
+      insert(replica->ht, changes[i].data);
+    } else if (changes[i].op == CHANGE_OP_SEEN) {
+      touch_user(replica->ht, changes[i].data.username, NULL, changes[i].data.last_seen);
+    } else {
+      delete_data(replica->ht, changes[i].data.username);
+    }
+    n_applied++;
+  }
+  table_write_end(replica->ht);
+  pthread_mutex_unlock(&global_table_lock);
+
+  if (seq + n_changes > next_seq) {
+    atomic_store(&replica->next_seq, seq + n_changes);
+  }
+  if (seq + n_changes > atomic_load(&replica->leader_seq)) {
+    atomic_store(&replica->leader_seq, seq + n_changes);
+  }
+  if (n_changes != 0) {
+    int64_t lag_us = wall_us() - (int64_t) time_us;
+    histogram_record(&replica->lag_us, lag_us > 0 ? (uint64_t) lag_us : 0);
+  }
+  atomic_fetch_add(&replica->n_applied, n_applied);
+  return true;
+}
+
+/*
+ * Asks the leader for its stream from this replica's position on and
+ * applies it: the snapshot if the leader sends one, then the changes.
+ * Returns once the stream breaks or the replica is stopping.
+ */
+
+static void follow(replica_t *replica, SSL *ssl) {
+  uint8_t in[FRAME_SIZE_MAX * 2];
+  size_t in_len = 0;
+  uint8_t out[FRAME_SIZE_MAX];
+  frame_t frame;
+  frame_init(&frame, FRAME_OP_REPLICATE, FRAME_STATUS_OK);
+  frame_put_u64(&frame, replica->stream);
+  frame_put_u64(&frame, atomic_load(&replica->next_seq));
+  size_t out_len = frame_encode(&frame, out);
+  if (SSL_write(ssl, out, (int) out_len) != (int) out_len) {
+    return;
+  }
+
+  uint64_t stream = 0, start = 0;
+  size_t offset = 0;
+  if (cluster_read_frame(ssl, in, &in_len, &frame) != 0 || frame.opcode != FRAME_OP_REPLICATE
+      || frame.status != FRAME_STATUS_OK || !frame_get_u64(&frame, &offset, &stream)
+      || !frame_get_u64(&frame, &offset, &start) || offset >= frame.length) {
+    log_write(LOG_WARNING, "The leader refused to stream its table");
+    return;
+  }
+
+  if (frame.payload[offset] != 0) {
+    // A bootstrap that is cut short starts over
+    replica->stream = 0;
+    log_write(LOG_INFO, "Bootstrapping from a snapshot of the leader's table...");
+    int64_t started_ms = now_ms();
+    size_t n_before = atomic_load(&replica->n_applied);
+    atomic_store(&replica->bootstrapping, true);
+    clear_table(replica->ht);
+    while (true) {
+      if (cluster_read_frame(ssl, in, &in_len, &frame) != 0 || frame.opcode != FRAME_OP_SNAPSHOT) {
+        return;
+      }
+      if (frame.length == 0) {
+        break;
+      }
+      if (!apply_snapshot(replica, &frame)) {
+        return;
+      }
+    }
+    atomic_store(&replica->bootstrapping, false);
+    atomic_fetch_add(&replica->n_bootstraps, 1);
+    log_write(LOG_INFO, "Bootstrapped %lu registrations in %ld ms", atomic_load(&replica->n_applied) - n_before,
+              now_ms() - started_ms);
+  }
+  replica->stream = stream;
+  atomic_store(&replica->next_seq, start);
+  atomic_store(&replica->leader_seq, start);
+  atomic_store(&replica->synced, true);
+
+  while (!atomic_load(&replica->stopping)) {
+    if (cluster_read_frame(ssl, in, &in_len, &frame) != 0 || frame.opcode != FRAME_OP_CHANGES
+        || !apply_changes(replica, &frame)) {
+      break;
+    }
+  }
+  atomic_store(&replica->synced, false);
+}
+
+// Keeps a stream from the leader open, reconnecting every REPLICATION_RETRY_MS
+static void *run_replica(void *arg) {
+  replica_t *replica = (replica_t *) arg;
+  char leader[RING_NODE_STRLEN];
+  ring_node_format(&replica->leader, leader);
+  bool reachable = true;
+  while (!atomic_load(&replica->stopping)) {
+    int fd = -1;
+    SSL *ssl = cluster_connect(&replica->leader, replica->ctx, &fd);
+    if (ssl != NULL) {
+      // Heartbeats keep an idle stream from timing out
+      set_timeout(fd, SO_RCVTIMEO, REPLICATION_TIMEOUT_MS);
+      log_write(LOG_INFO, "Following the leader %s", leader);
+      reachable = true;
+      follow(replica, ssl);
+      SSL_shutdown(ssl);
+      SSL_free(ssl);
+      close(fd);
+      if (!atomic_load(&replica->stopping)) {
+        log_write(LOG_WARNING, "Lost the stream from the leader %s, reconnecting", leader);
+      }
+    } else if (reachable) {
+      log_write(LOG_WARNING, "Could not reach the leader %s, retrying every %d ms", leader, REPLICATION_RETRY_MS);
+      reachable = false;
+    }
+
+    for (int waited = 0; waited < REPLICATION_RETRY_MS && !atomic_load(&replica->stopping); waited += 100) {
+      struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000000 };
+      nanosleep(&ts, NULL);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts following the replica's leader into the given table, which
+ * is emptied once the leader sends a snapshot. The leader and the
+ * client context must be set. Throws an assertion if any of the
+ * parameters are NULL. Returns 0 on success, -1 if the thread can't
+ * be started. Call replica_stop() afterwards!
+ */
+
+int replica_start(replica_t *replica, hashtable_t *ht) {
+  assert(replica != NULL && ht != NULL && replica->ctx != NULL);
+  replica->ht = ht;
+  atomic_store(&replica->stopping, false);
+  if (pthread_create(&replica->thread, NULL, run_replica, replica) != 0) {
+    log_write(LOG_ERROR, "Could not start following the leader");
+    return -1;
+  }
+  replica->running = true;
+  return 0;
+}
+
+// Must be called without the table lock
+void replica_stop(replica_t *replica) {
+  if (replica == NULL || !replica->running) {
+    return;
+  }
+  atomic_store(&replica->stopping, true);
+  pthread_join(replica->thread, NULL);
+  replica->running = false;
+}
+
+// Counts the forward as failed and hands it back
+static void fail_forward(replica_t *replica, forward_request_t *request) {
+  atomic_fetch_add(&replica->n_forward_failures, request->n_names);
+  request->done(request, false);
+}
+
+/*
+ * Queues the frames of the batch's forwards from the given one on,
+ * every forward is split into as many frames as its names take next
+ * to its address.
+ */
+
+static bool write_forwards(stream_buffer_t *out, forward_batch_t *batch, size_t first) {
+  for (size_t i = first; i < batch->n_requests; i++) {
+    const forward_request_t *request = batch->requests[i];
+    batch->n_frames[i] = 0;
+    size_t next = 0;
+    while (next < request->n_names) {
+      frame_t frame;
+      frame_init(&frame, request->opcode, FRAME_STATUS_OK);
+      frame_put_addr(&frame, &request->ip);
+      size_t n_names = 0;
+      while (next + n_names < request->n_names && frame_put_name(&frame, request->names[next + n_names])) {
+        n_names++;
+      }
+      if (!push_frame(out, &frame)) {
+        return false;
+      }
+      batch->frame_names[i][batch->n_frames[i]++] = (uint8_t) n_names;
+      next += n_names;
+    }
+  }
+  return flush_stream(out);
+}
+
+/*
+ * Writes the batch's forwards from the given one on to the leader and
+ * then reads the replies, which come in the same order, every forward
+ * that is answered in full is done. Returns the number of forwards
+ * answered, the connection is broken if that's fewer than were sent.
+ */
+
+static size_t send_forwards(replica_t *replica, SSL *ssl, stream_buffer_t *out, forward_batch_t *batch,
+                            size_t first) {
+  out->ssl = ssl;
+  out->len = 0;
+  if (!write_forwards(out, batch, first)) {
+    return 0;
+  }
+  uint8_t in[FRAME_SIZE_MAX * 2];
+  size_t in_len = 0;
+  for (size_t i = first; i < batch->n_requests; i++) {
+    forward_request_t *request = batch->requests[i];
+    size_t next = 0;
+    for (size_t j = 0; j < batch->n_frames[i]; j++) {
+      frame_t reply;
+      size_t n_names = batch->frame_names[i][j];
+      if (cluster_read_frame(ssl, in, &in_len, &reply) != 0 || reply.opcode != request->opcode
+          || reply.status != FRAME_STATUS_OK || reply.length != n_names) {
+        return i - first;
+      }
+      memcpy(request->statuses + next, reply.payload, n_names);
+      next += n_names;
+    }
+    atomic_fetch_add(&replica->n_forwarded, request->n_names);
+    request->done(request, true);
+  }
+  return batch->n_requests - first;
+}
+
+static void close_forwarder(SSL **ssl, int *fd) {
+  if (*ssl == NULL) {
+    return;
+  }
+  SSL_shutdown(*ssl);
+  SSL_free(*ssl);
+  close(*fd);
+  *ssl = NULL;
+  *fd = -1;
+}
+
+/*
+ * Forwarder thread of a follower. Takes batches of forwards off the
+ * queue and pipelines them to the leader over its connection, which is
+ * opened on first use and once more if it went stale. If the leader
+ * can't be reached, the batch and everything queued behind it fail and
+ * new forwards are refused for REPLICATION_RETRY_MS, so that clients
+ * don't queue up behind a leader that is down. Forwards still queued
+ * once the replica stops forwarding fail as well.
+ */
+
+static void *run_forwarder(void *arg) {
+  replica_t *replica = (replica_t *) arg;
+  stream_buffer_t *out = malloc(sizeof(stream_buffer_t));
+  forward_batch_t *batch = malloc(sizeof(forward_batch_t));
+  assert(out != NULL && batch != NULL);
+  SSL *ssl = NULL;
+  int fd = -1;
+  while (true) {
+    pthread_mutex_lock(&replica->forward_lock);
+    while (replica->queue_head == NULL && !replica->forward_stopping) {
+      pthread_cond_wait(&replica->forward_ready, &replica->forward_lock);
+    }
+    bool stopping = replica->forward_stopping;
+    batch->n_requests = 0;
+    while (replica->queue_head != NULL && (stopping || batch->n_requests < REPLICA_FORWARD_BATCH)) {
+      forward_request_t *request = replica->queue_head;
+      replica->queue_head = request->next;
+      replica->n_queued--;
+      if (stopping) {
+        fail_forward(replica, request);
+      } else {
+        batch->requests[batch->n_requests++] = request;
+      }
+    }
+    if (replica->queue_head == NULL) {
+      replica->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&replica->forward_lock);
+    if (stopping) {
+      break;
+    }
+
+    size_t n_answered = 0;
+    for (int attempt = 0; attempt < 2 && n_answered < batch->n_requests; attempt++) {
+      if (ssl == NULL && (ssl = cluster_connect(&replica->leader, replica->ctx, &fd)) == NULL) {
+        break;
+      }
+      n_answered += send_forwards(replica, ssl, out, batch, n_answered);
+      if (n_answered < batch->n_requests) {
+        // The leader drops idle connections, a stale one gets one more try
+        close_forwarder(&ssl, &fd);
+      }
+    }
+    if (n_answered == batch->n_requests) {
+      continue;
+    }
+    atomic_store(&replica->leader_down_until_ms, now_ms() + REPLICATION_RETRY_MS);
+    log_write(LOG_WARNING, "Could not forward to the leader, refusing forwards for %d ms", REPLICATION_RETRY_MS);
+    for (size_t i = n_answered; i < batch->n_requests; i++) {
+      fail_forward(replica, batch->requests[i]);
+    }
+    pthread_mutex_lock(&replica->forward_lock);
+    forward_request_t *request = replica->queue_head;
+    replica->queue_head = NULL;
+    replica->queue_tail = NULL;
+    replica->n_queued = 0;
+    pthread_mutex_unlock(&replica->forward_lock);
+    while (request != NULL) {
+      forward_request_t *next = request->next;
+      fail_forward(replica, request);
+      request = next;
+    }
+  }
+  close_forwarder(&ssl, &fd);
+  free(out);
+  free(batch);
+  return NULL;
+}
+
+/*
+ * Starts the thread that forwards updates to the replica's leader,
+ * unless it runs already. The leader and the client context must be
+ * set. Throws an assertion if the replica is NULL. Returns 0 on
+ * success, -1 if the thread can't be started. Call
+ * replica_forward_stop() afterwards!
+ */
+
+int replica_forward_start(replica_t *replica) {
+  assert(replica != NULL && replica->ctx != NULL);
+  if (atomic_load(&replica->forwarding)) {
+    return 0;
+  }
+  pthread_mutex_init(&replica->forward_lock, NULL);
+  pthread_cond_init(&replica->forward_ready, NULL);
+  replica->queue_head = NULL;
+  replica->queue_tail = NULL;
+  replica->n_queued = 0;
+  replica->forward_stopping = false;
+  atomic_store(&replica->leader_down_until_ms, 0);
+  if (pthread_create(&replica->forwarder, NULL, run_forwarder, replica) != 0) {
+    log_write(LOG_ERROR, "Could not start forwarding to the leader");
+    return -1;
+  }
+  atomic_store(&replica->forwarding, true);
+  return 0;
+}
+
+/*
+ * Stops the forwarder thread, the forwards still queued fail. Nothing
+ * may call replica_forward() anymore.
+ */
+
+void replica_forward_stop(replica_t *replica) {
+  if (replica == NULL || !atomic_load(&replica->forwarding)) {
+    return;
+  }
+  pthread_mutex_lock(&replica->forward_lock);
+  replica->forward_stopping = true;
+  pthread_cond_signal(&replica->forward_ready);
+  pthread_mutex_unlock(&replica->forward_lock);
+  pthread_join(replica->forwarder, NULL);
+  atomic_store(&replica->forwarding, false);
+  pthread_cond_destroy(&replica->forward_ready);
+  pthread_mutex_destroy(&replica->forward_lock);
+}
+
+/*
+ * Queues a registration (FRAME_OP_FORWARD) or a heartbeat
+ * (FRAME_OP_FORWARD_HEARTBEAT) of the request's names at its address
+ * for the leader. The forwarder thread fills in the leader's status
+ * per name and calls the request's done callback, which takes the
+ * request back, once the leader answered or couldn't be reached. Never
+ * blocks for the leader: a request is refused right away, with done
+ * called from the calling thread, while the leader is known to be
+ * down, once REPLICA_FORWARD_QUEUE requests are waiting or if the
+ * replica doesn't forward. Throws an assertion if any of the
+ * parameters are NULL.
+ */
+
+void replica_forward(replica_t *replica, forward_request_t *request) {
+  assert(replica != NULL && request != NULL && request->done != NULL);
+  bool queued = false;
+  if (atomic_load(&replica->forwarding) && now_ms() >= atomic_load(&replica->leader_down_until_ms)) {
+    pthread_mutex_lock(&replica->forward_lock);
+    if (!replica->forward_stopping && replica->n_queued < REPLICA_FORWARD_QUEUE) {
+      request->next = NULL;
+      if (replica->queue_tail != NULL) {
+        replica->queue_tail->next = request;
+      } else {
+        replica->queue_head = request;
+      }
+      replica->queue_tail = request;
+      replica->n_queued++;
+      pthread_cond_signal(&replica->forward_ready);
+      queued = true;
+    }
+    pthread_mutex_unlock(&replica->forward_lock);
+  }
+  if (!queued) {
+    fail_forward(replica, request);
+  }
+}
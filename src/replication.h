@@ -0,0 +1,153 @@
+#ifndef CHAT_REPLICATION_H
+#define CHAT_REPLICATION_H
+
+#include "changelog.h"
+#include "hashtable.h"
+#include "metrics.h"
+#include "ring.h"
+#include "shared_protocol.h"
+
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLICATION_MAX_FOLLOWERS (16)
+// An idle stream carries an empty change frame this often
+#define REPLICATION_HEARTBEAT_MS (1000)
+// Either side drops a stream that stalls for this long
+#define REPLICATION_TIMEOUT_MS (5000)
+// A follower that lost its leader reconnects after this long
+#define REPLICATION_RETRY_MS (1000)
+// Slots looked through for a snapshot chunk while holding the table lock
+#define REPLICATION_SCAN_SLOTS (1 << 14)
+// Frames are collected up to this many bytes before they are written
+#define REPLICATION_BUFFER_SIZE (64 * 1024)
+// Changes read from the log at once
+#define REPLICATION_READ_RECORDS (512)
+// Forwards waiting for the leader beyond this many are refused
+#ifndef REPLICA_FORWARD_QUEUE
+#define REPLICA_FORWARD_QUEUE (1024)
+#endif
+// Forwards written to the leader before their replies are read
+#define REPLICA_FORWARD_BATCH (32)
+
+struct Replication;
+
+// A follower's stream, served by a thread of its own
+typedef struct Follower {
+  struct Replication *replication;
+  pthread_t thread;
+  SSL *ssl;
+  int fd;
+  // Where the follower asked to continue from
+  uint64_t stream;
+  uint64_t from;
+  bool active;
+  // Set by the thread once it is done, it is joined by the next caller
+  _Atomic bool done;
+} follower_t;
+
+/*
+ * Leader side of the replication. Every change to the table is logged
+ * in memory, see changelog.h. A follower connects like any client and
+ * asks for the changes from its last sequence number on, its
+ * connection is then taken over by a thread that streams them. A
+ * follower that is new or fell too far behind gets a snapshot of the
+ * table first.
+ */
+typedef struct Replication {
+  hashtable_t *ht;
+  change_log_t *log;
+  // Guards the follower slots
+  pthread_mutex_t lock;
+  follower_t followers[REPLICATION_MAX_FOLLOWERS];
+  _Atomic bool stopping;
+  _Atomic size_t n_followers;
+  _Atomic size_t n_snapshots;
+  // Streams dropped because their follower fell behind the log
+  _Atomic size_t n_overruns;
+} replication_t;
+
+struct ForwardRequest;
+
+// Called once the leader answered a forward, ok is false if it
+// couldn't be reached or refused the forward
+typedef void (*forward_done_t)(struct ForwardRequest *, bool);
+
+// A registration or heartbeat on its way to the leader, see replica_forward()
+typedef struct ForwardRequest {
+  // FRAME_OP_FORWARD or FRAME_OP_FORWARD_HEARTBEAT
+  uint8_t opcode;
+  ip_addr_t ip;
+  char names[LOOKUP_BATCH_MAX][MAX_USERNAME_LEN];
+  size_t n_names;
+  // Filled in with the leader's status per name before done is called
+  uint8_t statuses[LOOKUP_BATCH_MAX];
+  forward_done_t done;
+  struct ForwardRequest *next;
+} forward_request_t;
+
+/*
+ * Follower side. A thread keeps a stream from the leader open and
+ * applies it to the local table: a snapshot first if the leader asks
+ * for it, then every change. The table is emptied for a snapshot, it
+ * must not be read from while the replica is bootstrapping. Fetches
+ * are answered from the local table, updates are forwarded to the
+ * leader by a thread of their own, so that no worker waits for it.
+ */
+typedef struct Replica {
+  ring_node_t leader;
+  // Presents the lookup certificate, which the leader checks
+  SSL_CTX *ctx;
+  hashtable_t *ht;
+  pthread_t thread;
+  bool running;
+  _Atomic bool stopping;
+  // Position in the leader's stream, only valid with a stream id
+  uint64_t stream;
+  _Atomic uint64_t next_seq;
+  // Sequence number of the next change on the leader, as last heard
+  _Atomic uint64_t leader_seq;
+  _Atomic bool synced;
+  // Set from the start of a snapshot until one was applied in full,
+  // the table is incomplete meanwhile
+  _Atomic bool bootstrapping;
+  _Atomic size_t n_bootstraps;
+  _Atomic size_t n_applied;
+  _Atomic size_t n_forwarded;
+  _Atomic size_t n_forward_failures;
+  // Time from a change on the leader to it being applied here
+  histogram_t lag_us;
+  pthread_t forwarder;
+  _Atomic bool forwarding;
+  // Guards the forward queue
+  pthread_mutex_t forward_lock;
+  pthread_cond_t forward_ready;
+  forward_request_t *queue_head;
+  forward_request_t *queue_tail;
+  size_t n_queued;
+  bool forward_stopping;
+  // Forwards are refused until then after the leader couldn't be reached
+  _Atomic int64_t leader_down_until_ms;
+} replica_t;
+
+void replication_start(replication_t *, hashtable_t *);
+
+int replication_serve(replication_t *, SSL *, int, uint64_t, uint64_t);
+
+void replication_stop(replication_t *);
+
+int replica_start(replica_t *, hashtable_t *);
+
+void replica_stop(replica_t *);
+
+int replica_forward_start(replica_t *);
+
+void replica_forward_stop(replica_t *);
+
+void replica_forward(replica_t *, forward_request_t *);
+
+#endif
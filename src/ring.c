@@ -0,0 +1,225 @@
+#include "ring.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * FNV-1a with a murmur3 finalizer. Independent of the hash table's
+ * hash on purpose: the usernames of one node still have to spread
+ * over every shard of its table.
+ */
+
+static uint64_t ring_hash(const char *str) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (; *str != '\0'; str++) {
+    hash = (hash ^ (uint8_t) *str) * 0x100000001B3ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_points(const void *a, const void *b) {
+  const ring_point_t *p = (const ring_point_t *) a;
+  const ring_point_t *q = (const ring_point_t *) b;
+  if (p->hash != q->hash) {
+    return p->hash < q->hash ? -1 : 1;
+  }
+  return p->node < q->node ? -1 : p->node > q->node;
+}
+
+static bool same_node(const ring_node_t *a, const ring_node_t *b) {
+  if (a->port != b->port || a->addr.family != b->addr.family) {
+    return false;
+  }
+  if (a->addr.family == AF_INET) {
+    return a->addr.addr.v4.s_addr == b->addr.addr.v4.s_addr;
+  }
+  return memcmp(&a->addr.addr.v6, &b->addr.addr.v6, sizeof(struct in6_addr)) == 0;
+}
+
+/*
+ * Writes the node as "address:port", IPv6 addresses in brackets, into
+ * the given buffer of RING_NODE_STRLEN bytes. Throws an assertion if
+ * any of the parameters are NULL.
+ */
+
+void ring_node_format(const ring_node_t *node, char *out) {
+  assert(node != NULL && out != NULL);
+  char addr[INET6_ADDRSTRLEN] = { '\0' };
+  inet_ntop(node->addr.family, &node->addr.addr, addr, sizeof(addr));
+  if (node->addr.family == AF_INET6) {
+    snprintf(out, RING_NODE_STRLEN, "[%s]:%u", addr, node->port);
+  } else {
+    snprintf(out, RING_NODE_STRLEN, "%s:%u", addr, node->port);
+  }
+}
+
+/*
+ * Adds the given node and its RING_VNODES points to the ring. Throws
+ * an assertion if the ring is NULL or if a memory allocation error
+ * occurs. Returns 0 on success, -1 if the node is already on the ring
+ * or the ring holds RING_MAX_NODES nodes.
+ */
+
+int ring_add(ring_t *ring, ring_node_t node) {
+  assert(ring != NULL);
+  if (ring->n_nodes == RING_MAX_NODES || ring_find(ring, node) != -1) {
+    return -1;
+  }
+
+  ring_point_t *points = realloc(ring->points, (ring->n_points + RING_VNODES) * sizeof(ring_point_t));
+  assert(points != NULL);
+  char name[RING_NODE_STRLEN];
+  ring_node_format(&node, name);
+  for (size_t i = 0; i < RING_VNODES; i++) {
+    char point_name[RING_NODE_STRLEN + 8];
+    snprintf(point_name, sizeof(point_name), "%s#%lu", name, i);
+    points[ring->n_points + i] = (ring_point_t) { .hash = ring_hash(point_name), .node = (uint32_t) ring->n_nodes };
+  }
+  ring->points = points;
+  ring->n_points += RING_VNODES;
+  ring->nodes[ring->n_nodes++] = node;
+  qsort(ring->points, ring->n_points, sizeof(ring_point_t), compare_points);
+  return 0;
+}
+
+/*
+ * Parses a single "address", "address:port" or "[address]:port" entry,
+ * the port defaults to LOOKUP_PORT. Returns false if it is malformed.
+ */
+
+static bool parse_node(const char *entry, ring_node_t *out) {
+  char addr[INET6_ADDRSTRLEN] = { '\0' };
+  const char *port = NULL;
+  size_t len = 0;
+  if (entry[0] == '[') {
+    const char *end = strchr(entry, ']');
+    if (end == NULL || (end[1] != '\0' && end[1] != ':')) {
+      return false;
+    }
+    len = (size_t) (end - entry - 1);
+    memcpy(addr, entry + 1, len < sizeof(addr) ? len : 0);
+    port = end[1] == ':' ? end + 2 : NULL;
+  } else {
+    const char *colon = strchr(entry, ':');
+    // More than one colon is a bare IPv6 address
+    if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+      len = (size_t) (colon - entry);
+      port = colon + 1;
+    } else {
+      len = strlen(entry);
+    }
+    memcpy(addr, entry, len < sizeof(addr) ? len : 0);
+  }
+  if (len == 0 || len >= sizeof(addr)) {
+    return false;
+  }
+
+  *out = (ring_node_t) { .port = LOOKUP_PORT };
+  if (inet_pton(AF_INET, addr, &out->addr.addr.v4) == 1) {
+    out->addr.family = AF_INET;
+  } else if (inet_pton(AF_INET6, addr, &out->addr.addr.v6) == 1) {
+    out->addr.family = AF_INET6;
+  } else {
+    return false;
+  }
+  if (port != NULL) {
+    char *end = NULL;
+    long value = strtol(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || value < 1 || value > 65535) {
+      return false;
+    }
+    out->port = (in_port_t) value;
+  }
+  return true;
+}
+
+/*
+ * Builds a ring from a node list. Entries are separated by commas or
+ * whitespace, '#' starts a comment that runs to the end of the line,
+ * see parse_node() for the entries. Throws an assertion if any of the
+ * parameters are NULL. Returns 0 on success, -1 if an entry is
+ * malformed or repeated, if there are too many or no entries at all.
+ * Call ring_free() afterwards in either case!
+ */
+
+int ring_parse(ring_t *ring, const char *list) {
+  assert(ring != NULL && list != NULL);
+  *ring = (ring_t) { 0 };
+  const char *cursor = list;
+  while (*cursor != '\0') {
+    if (*cursor == '#') {
+      cursor += strcspn(cursor, "\n");
+      continue;
+    }
+    size_t len = strcspn(cursor, ", \t\r\n#");
+    if (len == 0) {
+      cursor++;
+      continue;
+    }
+    char entry[RING_NODE_STRLEN];
+    ring_node_t node;
+    if (len >= sizeof(entry)) {
+      return -1;
+    }
+    memcpy(entry, cursor, len);
+    entry[len] = '\0';
+    if (!parse_node(entry, &node) || ring_add(ring, node) != 0) {
+      return -1;
+    }
+    cursor += len;
+  }
+  return ring->n_nodes != 0 ? 0 : -1;
+}
+
+void ring_free(ring_t *ring) {
+  if (ring == NULL) {
+    return;
+  }
+  free(ring->points);
+  *ring = (ring_t) { 0 };
+}
+
+/*
+ * Returns the index of the given node in the ring's node list, or -1
+ * if it isn't on the ring. Throws an assertion if the ring is NULL.
+ */
+
+long ring_find(const ring_t *ring, ring_node_t node) {
+  assert(ring != NULL);
+  for (size_t i = 0; i < ring->n_nodes; i++) {
+    if (same_node(&ring->nodes[i], &node)) {
+      return (long) i;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Returns the index of the node that owns the given username. Throws
+ * an assertion if any of the parameters are NULL or if the ring has no
+ * nodes.
+ */
+
+size_t ring_owner(const ring_t *ring, const char *username) {
+  assert(ring != NULL && username != NULL && ring->n_points != 0);
+  uint64_t hash = ring_hash(username);
+  size_t low = 0, high = ring->n_points;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (ring->points[mid].hash < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  // Past the last point the ring wraps around to the first one
+  return ring->points[low < ring->n_points ? low : 0].node;
+}
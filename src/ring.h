@@ -0,0 +1,54 @@
+#ifndef CHAT_RING_H
+#define CHAT_RING_H
+
+#include "shared_protocol.h"
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Points every node places on the ring, more of them spread the
+// usernames more evenly over the nodes
+#define RING_VNODES (512)
+#define RING_MAX_NODES (64)
+// Longest "[address]:port" entry of a node list, with the terminator
+#define RING_NODE_STRLEN (INET6_ADDRSTRLEN + 9)
+
+typedef struct RingNode {
+  ip_addr_t addr;
+  in_port_t port;
+} ring_node_t;
+
+typedef struct RingPoint {
+  uint64_t hash;
+  uint32_t node;
+} ring_point_t;
+
+/*
+ * Consistent-hash ring over the nodes of a lookup cluster. A username
+ * belongs to the node of the first point at or after its hash. The
+ * points of a node only depend on its address and port, so a node
+ * joining or leaving only moves the usernames next to its own points.
+ */
+typedef struct Ring {
+  ring_node_t nodes[RING_MAX_NODES];
+  size_t n_nodes;
+  // Sorted by hash, RING_VNODES per node
+  ring_point_t *points;
+  size_t n_points;
+} ring_t;
+
+int ring_parse(ring_t *, const char *);
+
+void ring_free(ring_t *);
+
+int ring_add(ring_t *, ring_node_t);
+
+long ring_find(const ring_t *, ring_node_t);
+
+size_t ring_owner(const ring_t *, const char *);
+
+void ring_node_format(const ring_node_t *, char *);
+
+#endif
@@ -1,45 +1,52 @@
+#define _GNU_SOURCE
+
 #include "server.h"
 
 #include "database.h"
+#include "datagram.h"
+#include "frame.h"
+#include "log.h"
 #include "shared_protocol.h"
 
 #include <arpa/inet.h>
 #include <asm-generic/socket.h>
 #include <assert.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/crypto.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
+#include <openssl/x509.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 bool global_terminate_program = false;
 
+static lookup_cluster_t *global_lookup_cluster = NULL;
+static pthread_mutex_t shared_cluster_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void handle_terminate(int n) {
   global_terminate_program = true;
 }
 
 /*
- * Updates the lookup server with the current ip address
- * of the given username. Throws an assertion error if
- * the given parameters are NULL or if the username is not less than 32.
- * Returns 0 on success and -1 on failure.
+ * Connects to the lookup server at the given address and port and
+ * completes the TLS handshake. Returns the connection and sets the
+ * socket, or returns NULL on failure.
  */
 
-int update_lookup_server(const char *username, ip_addr_t addr, SSL_CTX *ctx) {
-  assert(username != NULL && ctx != NULL);
-  assert(strlen(username) < 32);
-
-  char message[36] = { '\0' };
-  sprintf(message, "U|%s|", username);
-
+static SSL *connect_lookup(ip_addr_t addr, in_port_t port, SSL_CTX *ctx, int *out_fd) {
   int fd = socket(addr.family, SOCK_STREAM, 0);
   if (fd < 0) {
-    return -1;
+    return NULL;
   }
 
   struct sockaddr_storage ss = { 0 };
@@ -49,29 +56,31 @@ int update_lookup_server(const char *username, ip_addr_t addr, SSL_CTX *ctx) {
     struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
     sin->sin_family = addr.family;
     sin->sin_addr = addr.addr.v4;
-    sin->sin_port = htons(LOOKUP_PORT);
+    sin->sin_port = htons(port);
     ss_length = sizeof(*sin);
   } else if (addr.family == AF_INET6) {
     struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &ss;
     sin->sin6_family = addr.family;
     sin->sin6_addr = addr.addr.v6;
-    sin->sin6_port = htons(LOOKUP_PORT);
+    sin->sin6_port = htons(port);
     ss_length = sizeof(*sin);
   } else {
     close(fd);
-    return -1;
+    return NULL;
   }
 
-  int status_code = connect(fd, (struct sockaddr *) &ss, ss_length);
-  if (status_code != 0) {
+  if (connect(fd, (struct sockaddr *) &ss, ss_length) != 0) {
     close(fd);
-    return -1;
+    return NULL;
   }
+  // Pipelined requests are flushed in one write, small ones must not wait for ACKs
+  int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
 
   SSL *ssl = SSL_new(ctx);
   if (ssl == NULL) {
     close(fd);
-    return -1;
+    return NULL;
   }
 
   SSL_set_fd(ssl, fd);
@@ -79,32 +88,833 @@ int update_lookup_server(const char *username, ip_addr_t addr, SSL_CTX *ctx) {
   if (SSL_connect(ssl) != 1) {
     SSL_free(ssl);
     close(fd);
+    return NULL;
+  }
+  *out_fd = fd;
+  return ssl;
+}
+
+static void session_disconnect(lookup_session_t *session) {
+  if (session->ssl != NULL) {
+    SSL_shutdown(session->ssl);
+    SSL_free(session->ssl);
+    close(session->fd);
+  }
+  session->ssl = NULL;
+  session->fd = -1;
+  session->buf_len = 0;
+}
+
+static int write_all(SSL *ssl, const char *data, size_t len) {
+  while (len > 0) {
+    int written = SSL_write(ssl, data, (int) len);
+    if (written <= 0) {
+      return -1;
+    }
+    data += written;
+    len -= (size_t) written;
+  }
+  return 0;
+}
+
+/*
+ * Reads the next reply frame of the session. Returns 0 on success, -1
+ * on failure or if the server doesn't speak our frame version.
+ */
+
+static int session_read_frame(lookup_session_t *session, frame_t *out) {
+  while (true) {
+    long frame_len = frame_decode(session->buf, session->buf_len, out);
+    if (frame_len < 0) {
+      return -1;
+    }
+    if (frame_len > 0) {
+      session->buf_len -= (size_t) frame_len;
+      memmove(session->buf, session->buf + frame_len, session->buf_len);
+      return out->version == FRAME_VERSION && out->status != FRAME_STATUS_VERSION ? 0 : -1;
+    }
+    int bytes_read = SSL_read(session->ssl, session->buf + session->buf_len, sizeof(session->buf) - session->buf_len);
+    if (bytes_read <= 0) {
+      return -1;
+    }
+    session->buf_len += (size_t) bytes_read;
+  }
+}
+
+/*
+ * Pins the key of the certificate the lookup server presented on the
+ * session's first handshake, datagram answers are only trusted if it
+ * signed them. Another key on a later handshake is logged and not
+ * pinned, fetches then fall back to TLS since no answer verifies.
+ */
+
+static void pin_key(lookup_session_t *session) {
+  X509 *cert = SSL_get1_peer_certificate(session->ssl);
+  EVP_PKEY *key = cert != NULL ? X509_get_pubkey(cert) : NULL;
+  X509_free(cert);
+  if (key == NULL || session->pinned == NULL) {
+    session->pinned = key;
+    return;
+  }
+  if (EVP_PKEY_eq(session->pinned, key) != 1) {
+    log_write(LOG_WARNING, "The lookup server presents another key than on the first connection, "
+                           "its signed answers are not trusted");
+  }
+  EVP_PKEY_free(key);
+}
+
+/*
+ * Creates a session with the lookup server at the given address and
+ * port. The
+ * connection is opened on the first request and kept open, so the
+ * handshake is paid once instead of once per request. Requests are
+ * sent as binary frames, see frame.h, fetches are tried as signed
+ * datagrams first, see datagram.h. Sessions can be
+ * shared between threads. Throws an assertion if the context is NULL or
+ * if a memory allocation error occurs. Call lookup_session_close()
+ * afterwards to avoid memory leaks!
+ */
+
+lookup_session_t *lookup_session_open(ip_addr_t addr, in_port_t port, SSL_CTX *ctx) {
+  assert(ctx != NULL);
+  lookup_session_t *session = calloc(1, sizeof(lookup_session_t));
+  assert(session != NULL);
+  session->addr = addr;
+  session->port = port;
+  session->ctx = ctx;
+  session->fd = -1;
+  session->datagrams = true;
+  session->udp_fd = -1;
+  pthread_mutex_init(&session->lock, NULL);
+  return session;
+}
+
+void lookup_session_close(lookup_session_t *session) {
+  if (session == NULL) {
+    return;
+  }
+  session_disconnect(session);
+  if (session->udp_fd >= 0) {
+    close(session->udp_fd);
+  }
+  EVP_PKEY_free(session->pinned);
+  pthread_mutex_destroy(&session->lock);
+  free(session);
+}
+
+/*
+ * Sends the given request frames back to back without waiting for
+ * replies, then reads the replies, which the server sends in request
+ * order. Reconnects once if the server dropped the connection in the
+ * meantime, which is safe since lookup requests are idempotent. Throws
+ * an assertion if any of the parameters are NULL. Returns 0 on
+ * success, -1 on failure.
+ */
+
+int lookup_session_pipeline(lookup_session_t *session, const frame_t *requests, size_t n_requests, frame_t *replies) {
+  assert(session != NULL && requests != NULL && replies != NULL);
+
+  uint8_t *buf = malloc(n_requests * FRAME_SIZE_MAX);
+  if (buf == NULL) {
     return -1;
   }
+  size_t len = 0;
+  for (size_t i = 0; i < n_requests; i++) {
+    len += frame_encode(&requests[i], buf + len);
+  }
 
-  SSL_write(ssl, message, strlen(message));
-  char response_buf[64] = { '\0' };
-  int bytes_read = SSL_read(ssl, response_buf, 63);
-  if (bytes_read <= 0) {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(fd);
-    return -1;   
+  pthread_mutex_lock(&session->lock);
+  int result = -1;
+  for (int attempt = 0; attempt < 2 && result != 0; attempt++) {
+    if (session->ssl == NULL) {
+      session->ssl = connect_lookup(session->addr, session->port, session->ctx, &session->fd);
+      if (session->ssl == NULL) {
+        break;
+      }
+      pin_key(session);
+    }
+    result = write_all(session->ssl, (const char *) buf, len);
+    for (size_t i = 0; result == 0 && i < n_requests; i++) {
+      result = session_read_frame(session, &replies[i]);
+    }
+    if (result != 0) {
+      session_disconnect(session);
+    }
   }
+  pthread_mutex_unlock(&session->lock);
+  free(buf);
+  return result;
+}
 
-  if (strncmp(response_buf, OK_RESPONSE, strlen(OK_RESPONSE)) != 0) {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
+/*
+ * Updates the lookup server with the session user's current ip
+ * address. Throws an assertion error if the given parameters are
+ * NULL or if the username is not less than 32.
+ * Returns 0 on success and -1 on failure.
+ */
+
+int lookup_session_update(lookup_session_t *session, const char *username) {
+  assert(session != NULL && username != NULL);
+  assert(strlen(username) < 32);
+
+  bool ok = false;
+  const char *usernames[] = { username };
+  if (lookup_session_update_many(session, usernames, 1, &ok) != 0) {
+    return -1;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Fetches and returns the requested user's ip address through the
+ * session. Throws an assertion error if any of the parameters are
+ * NULL. Sets the reference-passed boolean to false on failure.
+ */
+
+ip_addr_t lookup_session_fetch(lookup_session_t *session, const char *username, bool *success) {
+  assert(session != NULL && username != NULL && success != NULL);
+
+  ip_addr_t result = { 0 };
+  const char *usernames[] = { username };
+  if (lookup_session_fetch_many(session, usernames, 1, &result, NULL, success) != 0) {
+    *success = false;
+  }
+  return *success ? result : (ip_addr_t) { 0 };
+}
+
+/*
+ * Builds one request frame per LOOKUP_BATCH_MAX usernames and sends
+ * them all pipelined. Returns the reply frames, or NULL on failure.
+ * Free the returned array afterwards!
+ */
+
+static frame_t *batch_request(lookup_session_t *session, uint8_t opcode, const char **usernames, size_t n_usernames) {
+  size_t n_frames = (n_usernames + LOOKUP_BATCH_MAX - 1) / LOOKUP_BATCH_MAX;
+  frame_t *requests = malloc(n_frames * sizeof(frame_t));
+  frame_t *replies = malloc(n_frames * sizeof(frame_t));
+  if (requests == NULL || replies == NULL) {
+    free(requests);
+    free(replies);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < n_usernames; i++) {
+    if (i % LOOKUP_BATCH_MAX == 0) {
+      frame_init(&requests[i / LOOKUP_BATCH_MAX], opcode, FRAME_STATUS_OK);
+    }
+    assert(strlen(usernames[i]) < 32);
+    // An empty name fails its whole frame on the server
+    frame_put_name(&requests[i / LOOKUP_BATCH_MAX], usernames[i]);
+  }
+
+  int result = lookup_session_pipeline(session, requests, n_frames, replies);
+  free(requests);
+  if (result != 0) {
+    free(replies);
+    return NULL;
+  }
+  return replies;
+}
+
+/*
+ * Fetches the given users over TLS in one round trip, LOOKUP_BATCH_MAX
+ * usernames per request frame. Sets the results like
+ * lookup_session_fetch_many(). Returns 0 on success and -1 if the
+ * requests failed.
+ */
+
+static int fetch_frames(lookup_session_t *session, const char **usernames, size_t n_usernames, ip_addr_t *out,
+                        int64_t *last_seen, bool *found) {
+  frame_t *replies = batch_request(session, FRAME_OP_FETCH, usernames, n_usernames);
+  if (replies == NULL) {
+    return -1;
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < n_usernames; i++) {
+    frame_t *reply = &replies[i / LOOKUP_BATCH_MAX];
+    if (i % LOOKUP_BATCH_MAX == 0) {
+      offset = 0;
+    }
+    // A failed frame has no entries, its users count as not found
+    uint32_t seen = 0;
+    found[i] = reply->status == FRAME_STATUS_OK && frame_get_addr(reply, &offset, &out[i])
+            && frame_get_u32(reply, &offset, &seen) && out[i].family != AF_UNSPEC;
+    if (!found[i]) {
+      out[i] = (ip_addr_t) { 0 };
+      seen = 0;
+    }
+    if (last_seen != NULL) {
+      last_seen[i] = seen;
+    }
+  }
+  free(replies);
+  return 0;
+}
+
+// Connected, so that a host without a datagram socket on the port is reported as ECONNREFUSED
+static int open_datagram_socket(ip_addr_t addr, in_port_t port) {
+  struct sockaddr_storage ss = { 0 };
+  socklen_t ss_length = 0;
+  if (addr.family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
+    sin->sin_family = AF_INET;
+    sin->sin_addr = addr.addr.v4;
+    sin->sin_port = htons(port);
+    ss_length = sizeof(*sin);
+  } else if (addr.family == AF_INET6) {
+    struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &ss;
+    sin->sin6_family = AF_INET6;
+    sin->sin6_addr = addr.addr.v6;
+    sin->sin6_port = htons(port);
+    ss_length = sizeof(*sin);
+  } else {
+    return -1;
+  }
+
+  int fd = socket(addr.family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *) &ss, ss_length) != 0) {
     close(fd);
-    return -1;   
+    return -1;
+  }
+  return fd;
+}
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sends one signed fetch query per user back to back and waits up to
+ * DATAGRAM_TIMEOUT_MS for the replies, see datagram.h. Sets answered[i]
+ * and the results of every user whose answer is signed with the pinned
+ * key, for the user that was asked for and not expired. Does nothing
+ * before a key is pinned, for more than DATAGRAM_FETCH_MAX users or
+ * while datagrams are paused. The caller must hold the session's lock.
+ * Returns the number of answered users.
+ */
+
+static size_t datagram_fetch(lookup_session_t *session, const char **usernames, size_t n_usernames, ip_addr_t *out,
+                             int64_t *last_seen, bool *found, bool *answered) {
+  time_t now = time(NULL);
+  if (!session->datagrams || session->pinned == NULL || n_usernames > DATAGRAM_FETCH_MAX
+      || now < session->datagrams_paused_until) {
+    return 0;
+  }
+  if (session->udp_fd < 0 && (session->udp_fd = open_datagram_socket(session->addr, session->port)) < 0) {
+    return 0;
   }
 
-  SSL_shutdown(ssl);
-  SSL_free(ssl);
-  close(fd);
+  // Random, so that only the server sees which reply belongs to which query
+  uint32_t ids[DATAGRAM_FETCH_MAX];
+  bool pending[DATAGRAM_FETCH_MAX] = { false };
+  uint8_t buf[DATAGRAM_QUERY_SIZE];
+  if (RAND_bytes((unsigned char *) ids, sizeof(ids)) != 1) {
+    return 0;
+  }
+  size_t n_sent = 0;
+  for (size_t i = 0; i < n_usernames; i++) {
+    size_t len = datagram_encode_query(ids[i], usernames[i], buf);
+    pending[i] = len != 0 && send(session->udp_fd, buf, len, 0) == (ssize_t) len;
+    n_sent += pending[i] ? 1 : 0;
+  }
+
+  size_t n_replies = 0, n_answered = 0;
+  bool refused = false;
+  int64_t deadline_ms = now_ms() + DATAGRAM_TIMEOUT_MS;
+  while (n_replies < n_sent && !refused) {
+    struct pollfd pfd = { .fd = session->udp_fd, .events = POLLIN };
+    int64_t left_ms = deadline_ms - now_ms();
+    if (left_ms <= 0 || poll(&pfd, 1, (int) left_ms) <= 0) {
+      break;
+    }
+    ssize_t len = recv(session->udp_fd, buf, sizeof(buf), MSG_DONTWAIT);
+    refused = len < 0 && errno == ECONNREFUSED;
+    uint32_t id = 0;
+    uint8_t status = 0;
+    datagram_answer_t answer;
+    if (len <= 0 || !datagram_decode_reply(buf, (size_t) len, &id, &status, &answer)) {
+      continue;
+    }
+    // Replies to earlier queries that came in late are skipped
+    size_t i = 0;
+    while (i < n_usernames && !(pending[i] && ids[i] == id)) {
+      i++;
+    }
+    if (i == n_usernames) {
+      continue;
+    }
+    pending[i] = false;
+    n_replies++;
+    // Anything but a valid answer sends the user over TLS
+    if (status != FRAME_STATUS_OK || strcmp(answer.username, usernames[i]) != 0 || answer.expires < (uint32_t) now
+        || !datagram_verify(&answer, session->pinned)) {
+      continue;
+    }
+    answered[i] = true;
+    found[i] = answer.ip.family != AF_UNSPEC;
+    out[i] = found[i] ? answer.ip : (ip_addr_t) { 0 };
+    if (last_seen != NULL) {
+      last_seen[i] = found[i] ? answer.last_seen : 0;
+    }
+    n_answered++;
+  }
+
+  session->n_unanswered = n_replies == 0 ? session->n_unanswered + 1 : 0;
+  if (refused || session->n_unanswered >= DATAGRAM_BACKOFF_ROUNDS) {
+    log_write(LOG_INFO, "The lookup server doesn't answer datagrams, fetching over TLS for %d s",
+              DATAGRAM_BACKOFF_SECONDS);
+    session->datagrams_paused_until = now + DATAGRAM_BACKOFF_SECONDS;
+    session->n_unanswered = 0;
+  }
+  return n_answered;
+}
+
+/*
+ * Fetches the ip addresses of all the given users in one round trip,
+ * as signed datagrams if possible, see datagram_fetch(), and over TLS
+ * for the users they don't answer. Sets found[i] and out[i] for every
+ * username, and last_seen[i] unless it is NULL (0 if the server
+ * doesn't know). Throws an assertion error if any of the other
+ * parameters are NULL or if a username is not less than 32. Returns 0
+ * on success and -1 if the requests failed.
+ */
+
+int lookup_session_fetch_many(lookup_session_t *session, const char **usernames, size_t n_usernames, ip_addr_t *out,
+                              int64_t *last_seen, bool *found) {
+  assert(session != NULL && usernames != NULL && out != NULL && found != NULL);
+  if (n_usernames == 0) {
+    return 0;
+  }
+  bool answered[DATAGRAM_FETCH_MAX] = { false };
+  pthread_mutex_lock(&session->lock);
+  size_t n_answered = datagram_fetch(session, usernames, n_usernames, out, last_seen, found, answered);
+  pthread_mutex_unlock(&session->lock);
+  if (n_answered == 0) {
+    return fetch_frames(session, usernames, n_usernames, out, last_seen, found);
+  }
+
+  const char *rest[DATAGRAM_FETCH_MAX];
+  ip_addr_t rest_out[DATAGRAM_FETCH_MAX];
+  int64_t rest_seen[DATAGRAM_FETCH_MAX];
+  bool rest_found[DATAGRAM_FETCH_MAX];
+  size_t n_rest = 0;
+  for (size_t i = 0; i < n_usernames; i++) {
+    if (!answered[i]) {
+      rest[n_rest++] = usernames[i];
+    }
+  }
+  if (n_rest == 0) {
+    return 0;
+  }
+  if (fetch_frames(session, rest, n_rest, rest_out, rest_seen, rest_found) != 0) {
+    return -1;
+  }
+  for (size_t i = 0, j = 0; i < n_usernames; i++) {
+    if (answered[i]) {
+      continue;
+    }
+    out[i] = rest_out[j];
+    found[i] = rest_found[j];
+    if (last_seen != NULL) {
+      last_seen[i] = rest_seen[j];
+    }
+    j++;
+  }
+  return 0;
+}
+
+/*
+ * Sends the given usernames with a request that is answered with a
+ * status per name and sets ok[i] for every username. Returns 0 on
+ * success and -1 if the requests failed.
+ */
+
+static int status_request(lookup_session_t *session, uint8_t opcode, const char **usernames, size_t n_usernames,
+                          bool *ok) {
+  if (n_usernames == 0) {
+    return 0;
+  }
+  frame_t *replies = batch_request(session, opcode, usernames, n_usernames);
+  if (replies == NULL) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < n_usernames; i++) {
+    frame_t *reply = &replies[i / LOOKUP_BATCH_MAX];
+    size_t offset = i % LOOKUP_BATCH_MAX;
+    ok[i] = reply->status == FRAME_STATUS_OK && offset < reply->length
+         && reply->payload[offset] == FRAME_STATUS_OK;
+    if (reply->status == FRAME_STATUS_OK && offset < reply->length && reply->payload[offset] == FRAME_STATUS_MOVED) {
+      log_write(LOG_WARNING, "%s belongs to another lookup node, is %s out of date?", usernames[i], LOOKUP_NODES_ENV);
+    }
+  }
+  free(replies);
   return 0;
 }
 
+/*
+ * Registers all the given usernames at this host's address in one
+ * round trip, LOOKUP_BATCH_MAX usernames per request frame. Sets ok[i]
+ * for every username, a username owned by another node of the
+ * cluster is not ok. Throws an assertion error if any of the
+ * parameters are NULL or if a username is not less than 32. Returns 0
+ * on success and -1 if the requests failed.
+ */
+
+int lookup_session_update_many(lookup_session_t *session, const char **usernames, size_t n_usernames, bool *ok) {
+  assert(session != NULL && usernames != NULL && ok != NULL);
+  return status_request(session, FRAME_OP_UPDATE, usernames, n_usernames, ok);
+}
+
+/*
+ * Refreshes the last-seen time of all the given usernames in one round
+ * trip. Sets ok[i] for every username, a username that isn't
+ * registered at this host's address (anymore) is not ok and has to be
+ * updated. Throws an assertion error if any of the parameters are NULL
+ * or if a username is not less than 32. Returns 0 on success and -1 if
+ * the requests failed.
+ */
+
+int lookup_session_heartbeat_many(lookup_session_t *session, const char **usernames, size_t n_usernames, bool *ok) {
+  assert(session != NULL && usernames != NULL && ok != NULL);
+  return status_request(session, FRAME_OP_HEARTBEAT, usernames, n_usernames, ok);
+}
+
+/*
+ * Asks for up to page_size (1 to SEARCH_PAGE_MAX) registered usernames
+ * that start with the given prefix, in order and past the given name
+ * unless it is NULL, so that the last name of a page asks for the next
+ * one. Copies them into out and sets n_found, and more if further
+ * names match. Throws an assertion error if any of the parameters but
+ * after are NULL or if the page size is out of range. Returns 0 on
+ * success and -1 if the request failed, no names are found then.
+ */
+
+int lookup_session_search(lookup_session_t *session, const char *prefix, const char *after, size_t page_size,
+                          char (*out)[FRAME_NAME_MAX + 1], size_t *n_found, bool *more) {
+  assert(session != NULL && prefix != NULL && out != NULL && n_found != NULL && more != NULL);
+  assert(page_size >= 1 && page_size <= SEARCH_PAGE_MAX);
+  *n_found = 0;
+  *more = false;
+  frame_t request, reply;
+  frame_init(&request, FRAME_OP_SEARCH, FRAME_STATUS_OK);
+  frame_put_status(&request, (uint8_t) page_size);
+  if (!frame_put_name(&request, prefix) || (after != NULL && after[0] != '\0' && !frame_put_name(&request, after))) {
+    return -1;
+  }
+  if (lookup_session_pipeline(session, &request, 1, &reply) != 0 || reply.status != FRAME_STATUS_OK
+      || reply.length == 0) {
+    return -1;
+  }
+
+  size_t offset = 1;
+  while (*n_found < page_size && frame_get_name(&reply, &offset, out[*n_found])) {
+    (*n_found)++;
+  }
+  *more = reply.payload[0] != 0;
+  return 0;
+}
+
+/*
+ * Opens sessions to every node of the given node list, see
+ * ring_parse(), or to LOOKUP_ADDR on LOOKUP_PORT if the list is NULL.
+ * No connection is opened before the first request to a node. Throws
+ * an assertion if the context is NULL or if a memory allocation error
+ * occurs. Returns NULL if the node list is invalid. Call
+ * lookup_cluster_close() afterwards to avoid memory leaks!
+ */
+
+lookup_cluster_t *lookup_cluster_open(const char *nodes, SSL_CTX *ctx) {
+  assert(ctx != NULL);
+  lookup_cluster_t *cluster = calloc(1, sizeof(lookup_cluster_t));
+  assert(cluster != NULL);
+  cluster->ctx = ctx;
+  if (nodes != NULL) {
+    if (ring_parse(&cluster->ring, nodes) != 0) {
+      ring_free(&cluster->ring);
+      free(cluster);
+      return NULL;
+    }
+  } else {
+    ring_node_t node = { .addr = { .family = AF_INET, .addr.v4.s_addr = htonl(LOOKUP_ADDR) }, .port = LOOKUP_PORT };
+    ring_add(&cluster->ring, node);
+  }
+  for (size_t i = 0; i < cluster->ring.n_nodes; i++) {
+    cluster->sessions[i] = lookup_session_open(cluster->ring.nodes[i].addr, cluster->ring.nodes[i].port, ctx);
+  }
+  return cluster;
+}
+
+void lookup_cluster_close(lookup_cluster_t *cluster) {
+  if (cluster == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < cluster->ring.n_nodes; i++) {
+    lookup_session_close(cluster->sessions[i]);
+  }
+  ring_free(&cluster->ring);
+  free(cluster);
+}
+
+/*
+ * Sends the given usernames to the nodes that own them, one pipelined
+ * round trip per node, and scatters the results back in order: out[i],
+ * last_seen[i] (unless NULL) and found[i] for fetches, ok[i] for
+ * updates and heartbeats. Names on a node that couldn't be reached are
+ * not found or not ok. Returns 0 on success, -1 if the requests to any
+ * node failed.
+ */
+
+static int cluster_request(lookup_cluster_t *cluster, uint8_t opcode, const char **usernames, size_t n_usernames,
+                           ip_addr_t *out, int64_t *last_seen, bool *results) {
+  size_t *owners = malloc(n_usernames * sizeof(size_t));
+  const char **names = malloc(n_usernames * sizeof(char *));
+  ip_addr_t *addrs = malloc(n_usernames * sizeof(ip_addr_t));
+  int64_t *seen = malloc(n_usernames * sizeof(int64_t));
+  bool *node_results = malloc(n_usernames * sizeof(bool));
+  assert(owners != NULL && names != NULL && addrs != NULL && seen != NULL && node_results != NULL);
+  for (size_t i = 0; i < n_usernames; i++) {
+    owners[i] = ring_owner(&cluster->ring, usernames[i]);
+  }
+
+  int result = 0;
+  for (size_t node = 0; node < cluster->ring.n_nodes; node++) {
+    size_t n_names = 0;
+    for (size_t i = 0; i < n_usernames; i++) {
+      if (owners[i] == node) {
+        names[n_names++] = usernames[i];
+      }
+    }
+    if (n_names == 0) {
+      continue;
+    }
+
+    lookup_session_t *session = cluster->sessions[node];
+    int status_code = opcode == FRAME_OP_FETCH
+                        ? lookup_session_fetch_many(session, names, n_names, addrs, seen, node_results)
+                        : status_request(session, opcode, names, n_names, node_results);
+    if (status_code != 0) {
+      result = -1;
+    }
+    for (size_t i = 0, j = 0; i < n_usernames; i++) {
+      if (owners[i] != node) {
+        continue;
+      }
+      results[i] = status_code == 0 && node_results[j];
+      if (opcode == FRAME_OP_FETCH) {
+        out[i] = results[i] ? addrs[j] : (ip_addr_t) { 0 };
+      }
+      if (opcode == FRAME_OP_FETCH && last_seen != NULL) {
+        last_seen[i] = results[i] ? seen[j] : 0;
+      }
+      j++;
+    }
+  }
+  free(owners);
+  free(names);
+  free(addrs);
+  free(seen);
+  free(node_results);
+  return result;
+}
+
+/*
+ * Fetches the ip addresses of all the given users, each from the node
+ * that owns it. Sets found[i] and out[i] for every username, and
+ * last_seen[i] unless it is NULL. Throws an assertion error if any of
+ * the other parameters are NULL or if a username is not less than 32.
+ * Returns 0 on success and -1 if the requests to any node failed, its
+ * users count as not found.
+ */
+
+int lookup_cluster_fetch_many(lookup_cluster_t *cluster, const char **usernames, size_t n_usernames, ip_addr_t *out,
+                              int64_t *last_seen, bool *found) {
+  assert(cluster != NULL && usernames != NULL && out != NULL && found != NULL);
+  return n_usernames != 0 ? cluster_request(cluster, FRAME_OP_FETCH, usernames, n_usernames, out, last_seen, found)
+                          : 0;
+}
+
+/*
+ * Registers all the given usernames at this host's address, each on
+ * the node that owns it. Sets ok[i] for every username. Throws an
+ * assertion error if any of the parameters are NULL or if a username
+ * is not less than 32. Returns 0 on success and -1 if the requests to
+ * any node failed, its users are not ok.
+ */
+
+int lookup_cluster_update_many(lookup_cluster_t *cluster, const char **usernames, size_t n_usernames, bool *ok) {
+  assert(cluster != NULL && usernames != NULL && ok != NULL);
+  return n_usernames != 0 ? cluster_request(cluster, FRAME_OP_UPDATE, usernames, n_usernames, NULL, NULL, ok) : 0;
+}
+
+/*
+ * Refreshes the last-seen time of all the given usernames, each on the
+ * node that owns it. Sets ok[i] for every username. Throws an
+ * assertion error if any of the parameters are NULL or if a username
+ * is not less than 32. Returns 0 on success and -1 if the requests to
+ * any node failed, its users are not ok.
+ */
+
+int lookup_cluster_heartbeat_many(lookup_cluster_t *cluster, const char **usernames, size_t n_usernames, bool *ok) {
+  assert(cluster != NULL && usernames != NULL && ok != NULL);
+  return n_usernames != 0 ? cluster_request(cluster, FRAME_OP_HEARTBEAT, usernames, n_usernames, NULL, NULL, ok) : 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp((const char *) a, (const char *) b);
+}
+
+/*
+ * Searches every node of the cluster for usernames that start with the
+ * given prefix and merges their pages into one, see
+ * lookup_session_search(). A name that is being handed off between two
+ * nodes is only returned once. Throws an assertion error if any of the
+ * parameters but after are NULL or if the page size is out of range.
+ * Returns 0 on success and -1 if the request to any node failed, the
+ * names found on the other nodes are still returned.
+ */
+
+int lookup_cluster_search(lookup_cluster_t *cluster, const char *prefix, const char *after, size_t page_size,
+                          char (*out)[FRAME_NAME_MAX + 1], size_t *n_found, bool *more) {
+  assert(cluster != NULL && prefix != NULL && out != NULL && n_found != NULL && more != NULL);
+  assert(page_size >= 1 && page_size <= SEARCH_PAGE_MAX);
+  char (*names)[FRAME_NAME_MAX + 1] = malloc(cluster->ring.n_nodes * page_size * (FRAME_NAME_MAX + 1));
+  assert(names != NULL);
+
+  int result = 0;
+  size_t n_names = 0;
+  *more = false;
+  for (size_t node = 0; node < cluster->ring.n_nodes; node++) {
+    size_t n_node = 0;
+    bool node_more = false;
+    if (lookup_session_search(cluster->sessions[node], prefix, after, page_size, names + n_names, &n_node,
+                              &node_more) != 0) {
+      result = -1;
+    }
+    n_names += n_node;
+    *more = *more || node_more;
+  }
+
+  qsort(names, n_names, FRAME_NAME_MAX + 1, compare_names);
+  *n_found = 0;
+  for (size_t i = 0; i < n_names; i++) {
+    if (i > 0 && strcmp(names[i], names[i - 1]) == 0) {
+      continue;
+    }
+    if (*n_found == page_size) {
+      *more = true;
+      break;
+    }
+    memcpy(out[(*n_found)++], names[i], FRAME_NAME_MAX + 1);
+  }
+  free(names);
+  return result;
+}
+
+/*
+ * Returns the cluster shared by the one-off lookup functions below,
+ * opening it from LOOKUP_NODES_ENV on first use. Returns NULL if it
+ * was opened with another context or if the node list is invalid.
+ */
+
+static lookup_cluster_t *shared_cluster(SSL_CTX *ctx) {
+  pthread_mutex_lock(&shared_cluster_lock);
+  if (global_lookup_cluster == NULL) {
+    const char *nodes = getenv(LOOKUP_NODES_ENV);
+    global_lookup_cluster = lookup_cluster_open(nodes, ctx);
+    if (global_lookup_cluster == NULL) {
+      log_write(LOG_ERROR, "Invalid lookup node list in %s: %s", LOOKUP_NODES_ENV, nodes);
+    }
+  }
+  lookup_cluster_t *cluster = global_lookup_cluster;
+  pthread_mutex_unlock(&shared_cluster_lock);
+
+  if (cluster == NULL || cluster->ctx != ctx) {
+    return NULL;
+  }
+  return cluster;
+}
+
+/*
+ * Closes the sessions shared by update_lookup_server() and
+ * fetch_user_ip(), if they were opened.
+ */
+
+void close_lookup_session() {
+  pthread_mutex_lock(&shared_cluster_lock);
+  lookup_cluster_close(global_lookup_cluster);
+  global_lookup_cluster = NULL;
+  pthread_mutex_unlock(&shared_cluster_lock);
+}
+
+/*
+ * Updates the lookup node that owns the given username with the
+ * current ip address. Throws an assertion error if the given
+ * parameters are NULL or if the username is not less than 32.
+ * Goes through shared sessions, see lookup_cluster_open().
+ * Returns 0 on success and -1 on failure.
+ */
+
+int update_lookup_server(const char *username, SSL_CTX *ctx) {
+  assert(username != NULL && ctx != NULL);
+  lookup_cluster_t *cluster = shared_cluster(ctx);
+  if (cluster == NULL) {
+    return -1;
+  }
+  bool ok = false;
+  const char *usernames[] = { username };
+  if (lookup_cluster_update_many(cluster, usernames, 1, &ok) != 0) {
+    return -1;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Tells the lookup node that owns the given username that this host is
+ * online. Throws an assertion error if the given parameters are NULL or
+ * if the username is not less than 32. Goes through shared sessions,
+ * see lookup_cluster_open(). Returns 0 on success and -1 on failure,
+ * including a username that isn't registered at this host's address.
+ */
+
+int heartbeat_lookup_server(const char *username, SSL_CTX *ctx) {
+  assert(username != NULL && ctx != NULL);
+  lookup_cluster_t *cluster = shared_cluster(ctx);
+  if (cluster == NULL) {
+    return -1;
+  }
+  bool ok = false;
+  const char *usernames[] = { username };
+  if (lookup_cluster_heartbeat_many(cluster, usernames, 1, &ok) != 0) {
+    return -1;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Searches the whole cluster for a page of SEARCH_PAGE_MAX registered
+ * usernames that start with the given prefix, past the given name
+ * unless it is NULL, see lookup_cluster_search(). Throws an assertion
+ * error if any of the parameters but after are NULL. Goes through
+ * shared sessions, see lookup_cluster_open(). Returns 0 on success and
+ * -1 on failure, the names that were found are still returned.
+ */
+
+int search_lookup_server(const char *prefix, const char *after, SSL_CTX *ctx, char (*out)[FRAME_NAME_MAX + 1],
+                         size_t *n_found, bool *more) {
+  assert(prefix != NULL && ctx != NULL && out != NULL && n_found != NULL && more != NULL);
+  *n_found = 0;
+  *more = false;
+  lookup_cluster_t *cluster = shared_cluster(ctx);
+  if (cluster == NULL) {
+    return -1;
+  }
+  return lookup_cluster_search(cluster, prefix, after, SEARCH_PAGE_MAX, out, n_found, more);
+}
+
 /*
  * Sends a message to a peer. Asserts that parameters are not NULL.
  * Returns 0 on success, -1 on failure.
@@ -194,115 +1004,65 @@ int send_message(const char *my_username, const char *content, ip_addr_t addr, S
 
 /*
  * Fetches and returns the requested user's ip address from the lookup
- * server. Throws an assertion error if any of the parameters are NULL.
- * Sets the reference-passed boolean to false on failure.
+ * node that owns it, and when the user was last seen online unless
+ * last_seen is NULL (0 if the server doesn't know). Throws an
+ * assertion error if any of the other parameters are NULL. Sets the
+ * reference-passed boolean to false on failure. Goes through shared
+ * sessions, see lookup_cluster_open().
  */
 
-ip_addr_t fetch_user_ip(const char *username, ip_addr_t addr, SSL_CTX *ctx, bool *success) {
+ip_addr_t fetch_user_ip(const char *username, SSL_CTX *ctx, int64_t *last_seen, bool *success) {
   assert(username != NULL && ctx != NULL && success != NULL);
-
-  char message[36] = { '\0' };
-  sprintf(message, "F|%s|", username);
-
-  int fd = socket(addr.family, SOCK_STREAM, 0);
-
-  if (fd < 0) {
-    return (ip_addr_t) { 0 };
-  }
-
-  struct sockaddr_storage ss = { 0 };
-  socklen_t ss_length = 0;
-
-  if (addr.family == AF_INET) {
-    struct sockaddr_in *sin = (struct sockaddr_in *) &ss;
-    sin->sin_family = addr.family;
-    sin->sin_addr = addr.addr.v4;
-    sin->sin_port = htons(LOOKUP_PORT);
-    ss_length = sizeof(*sin);
-  } else if (addr.family == AF_INET6) {
-    struct sockaddr_in6 *sin = (struct sockaddr_in6 *) &ss;
-    sin->sin6_family = addr.family;
-    sin->sin6_addr = addr.addr.v6;
-    sin->sin6_port = htons(LOOKUP_PORT);
-    ss_length = sizeof(*sin);
-  } else {
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
-
-  int status_code = connect(fd, (struct sockaddr *) &ss, ss_length);
-  if (status_code != 0) {
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
-
-  SSL *ssl = SSL_new(ctx);
-  if (ssl == NULL) {
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
-
-  SSL_set_fd(ssl, fd);
-
-  if (SSL_connect(ssl) != 1) {
-    SSL_free(ssl);
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
-
-  SSL_write(ssl, message, strlen(message));
-  char response_buf[64] = { '\0' };
-  int bytes_read = SSL_read(ssl, response_buf, 63);
-  if (bytes_read <= 0) {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(fd);
+  *success = false;
+  lookup_cluster_t *cluster = shared_cluster(ctx);
+  ip_addr_t result = { 0 };
+  const char *usernames[] = { username };
+  if (cluster == NULL || lookup_cluster_fetch_many(cluster, usernames, 1, &result, last_seen, success) != 0) {
     *success = false;
-    return (ip_addr_t) { 0 };
   }
+  return *success ? result : (ip_addr_t) { 0 };
+}
 
-  char ip_buf[64] = { '\0' };
-  char ip_type = '\0';
-
-  status_code = sscanf(response_buf, "%c|%63[^|]|", &ip_type, ip_buf);
-  if (status_code != 2) {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
+/*
+ * Will run in the background, sends a heartbeat to the lookup server
+ * every PRESENCE_HEARTBEAT_SECONDS and renews the registration before
+ * its lease runs out. A heartbeat the server refuses means that the
+ * registration expired or this host's address changed, the
+ * registration is renewed right away then. Retries sooner after a
+ * failed renewal. Will throw an assertion if the passed argument is
+ * NULL.
+ */
 
-  ip_addr_t result = { 0 };
-  int convertion_result = 1;
-  if (ip_type == '4') {
-    result.family = AF_INET;
-    convertion_result = inet_pton(AF_INET, ip_buf, &result.addr.v4);
-  } else if (ip_type == '6') {
-    result.family = AF_INET6;
-    convertion_result = inet_pton(AF_INET6, ip_buf, &result.addr.v6);
-  } else {
-    SSL_shutdown(ssl);
-    SSL_free(ssl);
-    close(fd);
-    *success = false;
-    return (ip_addr_t) { 0 };
-  }
+void *renew_lease(void *args_ptr) {
+  assert(args_ptr != NULL);
+  lease_args_t *args = (lease_args_t *) args_ptr;
 
-  SSL_shutdown(ssl);
-  SSL_free(ssl);
-  close(fd);
+  time_t next_renewal = time(NULL) + LEASE_RENEW_SECONDS;
+  time_t next_heartbeat = time(NULL) + PRESENCE_HEARTBEAT_SECONDS;
+  while (!global_terminate_program) {
+    // Sleep in short steps so that termination is noticed quickly
+    poll(NULL, 0, 500);
+    time_t now = time(NULL);
+    if (now >= next_heartbeat && now < next_renewal) {
+      next_heartbeat = now + PRESENCE_HEARTBEAT_SECONDS;
+      if (heartbeat_lookup_server(args->username, args->ctx) != 0) {
+        next_renewal = now;
+      }
+    }
+    if (now < next_renewal) {
+      continue;
+    }
 
-  if (convertion_result <= 0) {
-    *success = false;
-    return (ip_addr_t) { 0 };
+    // An update counts as a heartbeat as well
+    next_heartbeat = now + PRESENCE_HEARTBEAT_SECONDS;
+    if (update_lookup_server(args->username, args->ctx) == 0) {
+      next_renewal = time(NULL) + LEASE_RENEW_SECONDS;
+    } else {
+      log_write(LOG_WARNING, "Could not renew the registration on the lookup server.");
+      next_renewal = time(NULL) + LEASE_RETRY_SECONDS;
+    }
   }
-  *success = true;
-  return result;
+  return NULL;
 }
 
 /*
@@ -318,7 +1078,7 @@ void *receive_messages(void *args_ptr) {
 
   int fd = socket(AF_INET6, SOCK_STREAM, 0);
   if (fd < 0) {
-    puts("[ERROR] Failed to create listening socket!");
+    log_write(LOG_ERROR, "Failed to create listening socket!");
     return NULL;
   }
 
@@ -333,14 +1093,14 @@ void *receive_messages(void *args_ptr) {
 
   int status_code = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
   if (status_code < 0) {
-    puts("[ERROR] Could not bind to the client port!");
+    log_write(LOG_ERROR, "Could not bind to the client port!");
     close(fd);
     return NULL;
   }
 
   status_code = listen(fd, 32);
   if (status_code < 0) {
-    puts("[ERROR] An error occured while attempting to listen to incoming connections!");
+    log_write(LOG_ERROR, "An error occured while attempting to listen to incoming connections!");
     close(fd);
     return NULL;
   }
@@ -351,7 +1111,7 @@ void *receive_messages(void *args_ptr) {
 
     if (poll_status < 0) {
       if (global_terminate_program) break;
-      puts("[WARNING] Poll error.");
+      log_write(LOG_WARNING, "Poll error.");
       continue;
     } else if (poll_status == 0) {
       // Timeout, check flag again
@@ -363,13 +1123,13 @@ void *receive_messages(void *args_ptr) {
 
     int client_fd = accept(fd, (struct sockaddr *) &peer, &peer_len);
     if (client_fd < 0) {
-      puts("[WARNING] Could not accept incoming connection.");
+      log_write(LOG_WARNING, "Could not accept incoming connection.");
       continue;
     }
 
     SSL *ssl = SSL_new(ctx);
     if (ssl == NULL) {
-      puts("[WARNING] Could not initialize SSL.");
+      log_write(LOG_WARNING, "Could not initialize SSL.");
       close(client_fd);
       continue;
     }
@@ -377,7 +1137,7 @@ void *receive_messages(void *args_ptr) {
     SSL_set_fd(ssl, client_fd);
 
     if (SSL_accept(ssl) != 1) {
-      puts("[WARNING] Could not SSL-Accept incoming connection.");
+      log_write(LOG_WARNING, "Could not SSL-Accept incoming connection.");
       SSL_free(ssl);
       close(client_fd);
       continue;
@@ -389,7 +1149,7 @@ void *receive_messages(void *args_ptr) {
     SSL_free(ssl);
     ssl = NULL;
   }
-  puts("[INFO] Closed client socket.");
+  log_write(LOG_INFO, "Closed client socket.");
   return NULL;
 }
 
@@ -422,7 +1182,7 @@ void handle_incoming(SSL *ssl, struct sockaddr_storage *peer, sqlite3 *sql) {
   // Username pubkey validation here
   X509 *cert = SSL_get1_peer_certificate(ssl);
   if (cert == NULL) {
-    printf("[WARNING] Rejected unverified message from so-called: %s", username);
+    log_write(LOG_WARNING, "Rejected unverified message from so-called: %s", username);
     return;
   }
 
@@ -439,7 +1199,7 @@ void handle_incoming(SSL *ssl, struct sockaddr_storage *peer, sqlite3 *sql) {
   int chat_id = -1;
   if (fingerprint == NULL) {
     // TOFU: Trust On First Use
-    printf("[INFO] New user detected: %s. Storing fingerprint.\n", username);
+    log_write(LOG_INFO, "New user detected: %s. Storing fingerprint.", username);
     chat_id = add_chat(sql, username, hash);
     if (chat_id == -1) {
       SSL_write(ssl, ERR_RESPONSE, strlen(ERR_RESPONSE));
@@ -447,7 +1207,7 @@ void handle_incoming(SSL *ssl, struct sockaddr_storage *peer, sqlite3 *sql) {
     }
   } else {
     if (memcmp(hash, fingerprint, SHA256_DIGEST_LENGTH) != 0) {
-      printf("[WARNING] Rejected unverified message from so-called: %s (Fingerprint mismatch!)\n", username);
+      log_write(LOG_WARNING, "Rejected unverified message from so-called: %s (Fingerprint mismatch!)", username);
       free(fingerprint);
       SSL_write(ssl, ERR_RESPONSE, strlen(ERR_RESPONSE));
       return;
@@ -465,7 +1225,7 @@ void handle_incoming(SSL *ssl, struct sockaddr_storage *peer, sqlite3 *sql) {
 
   if (chat_id != -1) {
     if (!insert_message(sql, chat_id, false, content_start)) {
-      puts("[WARNING] Failed to save incoming message to database.");
+      log_write(LOG_WARNING, "Failed to save incoming message to database.");
     }
   }
 
@@ -1,29 +1,117 @@
 #ifndef CHAT_SERVER_H
 #define CHAT_SERVER_H
 
+#include "datagram.h"
+#include "frame.h"
+#include "ring.h"
 #include "shared_protocol.h"
 
 #include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #define CLIENT_PORT (47906)
 #define SERVER_PORT (47907)
 
+#define LEASE_RENEW_SECONDS (LEASE_TTL_SECONDS / 4)
+#define LEASE_RETRY_SECONDS (60)
+
+// Node list of the lookup cluster ("address:port,..."), see ring_parse().
+// Defaults to LOOKUP_ADDR on LOOKUP_PORT.
+#define LOOKUP_NODES_ENV ("CHAT_LOOKUP_NODES")
+
 typedef struct ServerArgs {
   SSL_CTX *ctx;
   sqlite3 *db;
 } server_args_t;
 
+// A long-lived, pipelined connection to the lookup server
+typedef struct LookupSession {
+  ip_addr_t addr;
+  in_port_t port;
+  SSL_CTX *ctx;
+  SSL *ssl;
+  int fd;
+  // Received bytes not consumed as a reply frame yet
+  uint8_t buf[FRAME_SIZE_MAX * 2];
+  size_t buf_len;
+  // Fetches are tried as signed datagrams first unless cleared, see datagram.h
+  bool datagrams;
+  // Connected UDP socket, opened by the first datagram fetch
+  int udp_fd;
+  // Key of the certificate of the session's first handshake, datagram answers must be signed with it
+  EVP_PKEY *pinned;
+  // Datagram fetches in a row that got no reply at all, they are paused after a few
+  int n_unanswered;
+  time_t datagrams_paused_until;
+  pthread_mutex_t lock;
+} lookup_session_t;
+
+// One session per node of a lookup cluster, requests go to the node that owns the username
+typedef struct LookupCluster {
+  ring_t ring;
+  SSL_CTX *ctx;
+  lookup_session_t *sessions[RING_MAX_NODES];
+} lookup_cluster_t;
+
+typedef struct LeaseArgs {
+  const char *username;
+  SSL_CTX *ctx;
+} lease_args_t;
+
 extern bool global_terminate_program;
 
 void handle_terminate(int);
 
-int update_lookup_server(const char *, ip_addr_t, SSL_CTX *);
+lookup_session_t *lookup_session_open(ip_addr_t, in_port_t, SSL_CTX *);
+
+void lookup_session_close(lookup_session_t *);
+
+int lookup_session_pipeline(lookup_session_t *, const frame_t *, size_t, frame_t *);
+
+int lookup_session_update(lookup_session_t *, const char *);
+
+ip_addr_t lookup_session_fetch(lookup_session_t *, const char *, bool *);
+
+int lookup_session_fetch_many(lookup_session_t *, const char **, size_t, ip_addr_t *, int64_t *, bool *);
+
+int lookup_session_update_many(lookup_session_t *, const char **, size_t, bool *);
+
+int lookup_session_heartbeat_many(lookup_session_t *, const char **, size_t, bool *);
+
+int lookup_session_search(lookup_session_t *, const char *, const char *, size_t, char (*)[FRAME_NAME_MAX + 1],
+                          size_t *, bool *);
+
+lookup_cluster_t *lookup_cluster_open(const char *, SSL_CTX *);
+
+void lookup_cluster_close(lookup_cluster_t *);
+
+int lookup_cluster_fetch_many(lookup_cluster_t *, const char **, size_t, ip_addr_t *, int64_t *, bool *);
+
+int lookup_cluster_update_many(lookup_cluster_t *, const char **, size_t, bool *);
+
+int lookup_cluster_heartbeat_many(lookup_cluster_t *, const char **, size_t, bool *);
+
+int lookup_cluster_search(lookup_cluster_t *, const char *, const char *, size_t, char (*)[FRAME_NAME_MAX + 1],
+                          size_t *, bool *);
+
+void close_lookup_session();
+
+int update_lookup_server(const char *, SSL_CTX *);
+
+int heartbeat_lookup_server(const char *, SSL_CTX *);
+
+int search_lookup_server(const char *, const char *, SSL_CTX *, char (*)[FRAME_NAME_MAX + 1], size_t *, bool *);
 
 int send_message(const char *, const char *, ip_addr_t, SSL_CTX *, unsigned char *);
 
-ip_addr_t fetch_user_ip(const char *, ip_addr_t, SSL_CTX *, bool *);
+ip_addr_t fetch_user_ip(const char *, SSL_CTX *, int64_t *, bool *);
+
+void *renew_lease(void *);
 
 void *receive_messages(void *);
 
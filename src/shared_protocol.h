@@ -6,11 +6,31 @@
 
 #define METHOD_UPDATE ('U')
 #define METHOD_FETCH ('F')
+// Opens a session: "S|\n", then one '\n'-terminated request and reply per line
+#define METHOD_SESSION ('S')
 #define ERR_RESPONSE ("E\0")
 #define OK_RESPONSE ("K\0")
+// Per username of an update: another node of the lookup cluster owns it
+#define MOVED_RESPONSE ("M\0")
 
 #define LOOKUP_PORT (56732)
 
+#define LOOKUP_PROTOCOL_SINGLE (0)
+#define LOOKUP_PROTOCOL_SESSION (1)
+// Length-prefixed binary frames, see frame.h
+#define LOOKUP_PROTOCOL_BINARY (2)
+// Usernames per FETCH or UPDATE request, "F|name|name|...|" or one frame
+#define LOOKUP_BATCH_MAX (24)
+// Usernames per page of a prefix search
+#define SEARCH_PAGE_MAX (20)
+
+// Registrations expire on the lookup server unless renewed by an update
+#define LEASE_TTL_SECONDS (24 * 60 * 60)
+// Clients refresh their last-seen time on the lookup server this often
+#define PRESENCE_HEARTBEAT_SECONDS (60)
+// Peers whose last heartbeat is older than this are taken to be offline
+#define PRESENCE_STALE_SECONDS (3 * PRESENCE_HEARTBEAT_SECONDS)
+
 #ifndef LOOKUP_ADDR
 #define LOOKUP_ADDR (0xAC140002) // 172.20.0.2 in host byte order, to be used in docker
 #endif
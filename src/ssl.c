@@ -76,6 +76,8 @@ SSL_CTX *init_openssl(enum ContextMode mode) {
   if (mode == SERVER) {
     // Request certificate but don't fail if verification fails (we do manual TOFU)
     SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, verify_callback);
+    // Sessions can't be resumed with peer verification on unless they are tied to a context
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *) "chat-cli", strlen("chat-cli"));
   } else {
     SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
   }
@@ -0,0 +1,253 @@
+/*
+ * Stress test for the lock-free reads of the lookup server's hash
+ * table. Reader threads look up a set of stable users, which must
+ * always be found with their own name and one of the addresses they
+ * were ever given, and a set of missing users, which must never be
+ * found. Meanwhile a single writer, holding the table lock like the
+ * server does, inserts and deletes batches of other users so that the
+ * shards keep growing, shrinking and rehashing in place, rewrites the
+ * stable users between IPv4 and IPv6 addresses, sends them heartbeats
+ * and drives maintenance. Runs for a given time and exits with 1 if a
+ * reader saw a wrong answer. The table runs without its journal and
+ * without leases, its files live in a temporary directory.
+ */
+
+#define _GNU_SOURCE
+
+#include "hashtable.h"
+#include "journal.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STRESS_MAX_READERS (64)
+#define STRESS_STABLE_USERS (20000)
+// Inserted and deleted again every round, enough to resize most shards twice
+#define STRESS_CHURN_USERS (200000)
+// Every this many churned users a stable one is rewritten and sent a heartbeat
+#define STRESS_REWRITE_INTERVAL (7)
+
+typedef struct Reader {
+  pthread_t thread;
+  uint64_t seed;
+  size_t n_reads;
+  size_t n_errors;
+} reader_t;
+
+static hashtable_t ht;
+static atomic_bool stopping;
+// Last-seen times written so far never exceed this
+static _Atomic int64_t clock_now;
+static char temp_dir[] = "/tmp/stress-hashtable-XXXXXX";
+
+// xorshift64*
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Makes a user whose address encodes the given value, as an IPv4 or a
+ * (link-local looking) IPv6 address, so that a reader can tell a torn
+ * or misplaced address from one the writer stored.
+ */
+
+static userdata_t make_user(const char *prefix, size_t i, uint32_t value, bool v6) {
+  userdata_t data = { 0 };
+  snprintf(data.username, sizeof(data.username), "%s%lu", prefix, i);
+  if (v6) {
+    data.ip.family = AF_INET6;
+    data.ip.addr.v6.s6_addr[0] = 0xfe;
+    data.ip.addr.v6.s6_addr[1] = 0x80;
+    memcpy(&data.ip.addr.v6.s6_addr[12], &value, sizeof(value));
+  } else {
+    data.ip.family = AF_INET;
+    data.ip.addr.v4.s_addr = value;
+  }
+  return data;
+}
+
+static bool has_value(const userdata_t *data, uint32_t value) {
+  if (data->ip.family == AF_INET) {
+    return data->ip.addr.v4.s_addr == value;
+  }
+  uint32_t stored;
+  memcpy(&stored, &data->ip.addr.v6.s6_addr[12], sizeof(stored));
+  return data->ip.family == AF_INET6 && data->ip.addr.v6.s6_addr[0] == 0xfe && data->ip.addr.v6.s6_addr[1] == 0x80
+      && stored == value;
+}
+
+static void *run_reader(void *arg) {
+  reader_t *reader = arg;
+  char name[MAX_USERNAME_LEN];
+  userdata_t out;
+  while (!atomic_load_explicit(&stopping, memory_order_relaxed)) {
+    size_t i = next_random(&reader->seed) % STRESS_STABLE_USERS;
+    snprintf(name, sizeof(name), "stable%lu", i);
+    if (!read_user(&ht, name, &out) || strcmp(out.username, name) != 0 || !has_value(&out, (uint32_t) i)
+        || out.last_seen < 0 || out.last_seen > atomic_load(&clock_now)) {
+      reader->n_errors++;
+    }
+    snprintf(name, sizeof(name), "missing%lu", i);
+    if (read_user(&ht, name, &out)) {
+      reader->n_errors++;
+    }
+    reader->n_reads += 2;
+  }
+  return NULL;
+}
+
+static void locked_insert(userdata_t data) {
+  pthread_mutex_lock(&global_table_lock);
+  table_write_begin(&ht);
+  insert(&ht, data);
+  table_write_end(&ht);
+  pthread_mutex_unlock(&global_table_lock);
+}
+
+static void locked_delete(const char *username) {
+  pthread_mutex_lock(&global_table_lock);
+  table_write_begin(&ht);
+  delete_data(&ht, username);
+  table_write_end(&ht);
+  pthread_mutex_unlock(&global_table_lock);
+}
+
+// Heartbeats update the last-seen time in place under the lock only, like heartbeat_names() does
+static void locked_touch(const char *username) {
+  pthread_mutex_lock(&global_table_lock);
+  touch_user(&ht, username, NULL, atomic_fetch_add(&clock_now, 1) + 1);
+  pthread_mutex_unlock(&global_table_lock);
+}
+
+static void locked_maintain() {
+  pthread_mutex_lock(&global_table_lock);
+  maintain_table(&ht, 1);
+  pthread_mutex_unlock(&global_table_lock);
+}
+
+/*
+ * Counts the shards whose size changed since the last call, and the
+ * compactions in place, which keep the size but bump the generation.
+ */
+
+static size_t count_resizes(uint64_t *generations) {
+  size_t n_resizes = 0;
+  pthread_mutex_lock(&global_table_lock);
+  for (size_t i = 0; i < TABLE_SHARDS; i++) {
+    n_resizes += ht.shards[i].generation - generations[i];
+    generations[i] = ht.shards[i].generation;
+  }
+  pthread_mutex_unlock(&global_table_lock);
+  return n_resizes;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-d seconds] [-r readers]\n", name);
+}
+
+int main(int argc, char **argv) {
+  long seconds = 10;
+  long n_readers = 4;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:r:")) != -1) {
+    if (opt == 'd') {
+      seconds = strtol(optarg, NULL, 10);
+    } else if (opt == 'r') {
+      n_readers = strtol(optarg, NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (seconds < 1 || n_readers < 1 || n_readers > STRESS_MAX_READERS) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (mkdtemp(temp_dir) == NULL) {
+    fprintf(stderr, "[ERROR] Could not create a temporary directory\n");
+    return 1;
+  }
+  snprintf(global_table_filename, sizeof(global_table_filename), "%s%s", temp_dir, STORAGE_FILE);
+  snprintf(global_journal_filename, sizeof(global_journal_filename), "%s%s", temp_dir, JOURNAL_FILE);
+  snprintf(global_rotated_journal_filename, sizeof(global_rotated_journal_filename), "%s%s",
+           temp_dir, ROTATED_JOURNAL_FILE);
+  ht = generate_hashmap(0);
+  journal_close(ht.journal);
+  ht.journal = NULL;
+
+  for (size_t i = 0; i < STRESS_STABLE_USERS; i++) {
+    locked_insert(make_user("stable", i, (uint32_t) i, i % 2 == 0));
+  }
+  uint64_t generations[TABLE_SHARDS] = { 0 };
+  count_resizes(generations);
+
+  reader_t readers[STRESS_MAX_READERS] = { 0 };
+  for (long i = 0; i < n_readers; i++) {
+    readers[i].seed = 0x9E3779B97F4A7C15ULL * (uint64_t) (i + 1);
+    if (pthread_create(&readers[i].thread, NULL, run_reader, &readers[i]) != 0) {
+      fprintf(stderr, "[ERROR] Could not start reader %ld\n", i);
+      return 1;
+    }
+  }
+
+  size_t n_rounds = 0;
+  size_t n_resizes = 0;
+  time_t end = time(NULL) + seconds;
+  while (time(NULL) < end) {
+    for (size_t i = 0; i < STRESS_CHURN_USERS; i++) {
+      locked_insert(make_user("churn", i, (uint32_t) i, i % 3 == 0));
+      if (i % STRESS_REWRITE_INTERVAL == 0) {
+        size_t stable = i % STRESS_STABLE_USERS;
+        userdata_t data = make_user("stable", stable, (uint32_t) stable, (stable + n_rounds + 1) % 2 == 0);
+        locked_insert(data);
+        locked_touch(data.username);
+      }
+    }
+    n_resizes += count_resizes(generations);
+    for (size_t i = 0; i < STRESS_CHURN_USERS; i++) {
+      char name[MAX_USERNAME_LEN];
+      snprintf(name, sizeof(name), "churn%lu", i);
+      locked_delete(name);
+      if (i % 1000 == 0) {
+        locked_maintain();
+      }
+    }
+    // Shrinks only start from maintenance, and finish through it
+    for (size_t i = 0; i < 100; i++) {
+      locked_maintain();
+    }
+    n_resizes += count_resizes(generations);
+    n_rounds++;
+  }
+  atomic_store(&stopping, true);
+
+  size_t n_reads = 0;
+  size_t n_errors = 0;
+  for (long i = 0; i < n_readers; i++) {
+    pthread_join(readers[i].thread, NULL);
+    n_reads += readers[i].n_reads;
+    n_errors += readers[i].n_errors;
+  }
+  table_stats_t stats = table_stats(&ht);
+  printf("%lu rounds, %lu shard resizes, %lu reads by %ld readers, %lu wrong\n", n_rounds, n_resizes, n_reads,
+         n_readers, n_errors);
+  printf("table ends with %lu entries in %lu slots\n", stats.n_elements, stats.size);
+  free_hashmap(&ht);
+
+  unlink(global_table_filename);
+  unlink(global_journal_filename);
+  unlink(global_rotated_journal_filename);
+  rmdir(temp_dir);
+  return n_errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+/*
+ * A hashed timer wheel with one second ticks. Timers are hashed into
+ * a slot by their expiry, so adding one is O(1) and every tick only
+ * walks the single slot that may contain due timers. A key has at most
+ * one timer, which a small hash index finds for moving or cancelling.
+ */
+
+#include "timer_wheel.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Buckets of the key index before it first grows
+#ifndef TIMER_INDEX_INITIAL
+#define TIMER_INDEX_INITIAL (64)
+#endif
+
+/*
+ * Creates an empty wheel whose clock starts at the given time.
+ * Throws an assertion if a memory allocation error occurs.
+ * Call timer_wheel_free() afterwards to avoid memory leaks!
+ */
+
+timer_wheel_t *timer_wheel_create(int64_t now) {
+  timer_wheel_t *wheel = calloc(1, sizeof(timer_wheel_t));
+  assert(wheel != NULL);
+  wheel->current = now;
+  wheel->index_size = TIMER_INDEX_INITIAL;
+  wheel->index = calloc(wheel->index_size, sizeof(timer_node_t *));
+  assert(wheel->index != NULL);
+  return wheel;
+}
+
+void timer_wheel_free(timer_wheel_t *wheel) {
+  if (wheel == NULL) {
+    return;
+  }
+  for (size_t i = 0; i < WHEEL_SLOTS; i++) {
+    timer_node_t *node = wheel->slots[i];
+    while (node != NULL) {
+      timer_node_t *next = node->next;
+      free(node);
+      node = next;
+    }
+  }
+  free(wheel->index);
+  free(wheel);
+}
+
+static size_t key_hash(const char *key) {
+  // FNV-1a, keys are short and already truncated to TIMER_KEY_LEN
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < TIMER_KEY_LEN && key[i] != '\0'; i++) {
+    hash ^= (unsigned char) key[i];
+    hash *= 1099511628211ULL;
+  }
+  return (size_t) hash;
+}
+
+static timer_node_t **index_find(const timer_wheel_t *wheel, const char *key) {
+  timer_node_t **link = &wheel->index[key_hash(key) % wheel->index_size];
+  while (*link != NULL && strncmp((*link)->key, key, TIMER_KEY_LEN - 1) != 0) {
+    link = &(*link)->index_next;
+  }
+  return link;
+}
+
+static void index_grow(timer_wheel_t *wheel) {
+  size_t size = wheel->index_size * 2;
+  timer_node_t **index = calloc(size, sizeof(timer_node_t *));
+  assert(index != NULL);
+  for (size_t i = 0; i < wheel->index_size; i++) {
+    timer_node_t *node = wheel->index[i];
+    while (node != NULL) {
+      timer_node_t *next = node->index_next;
+      size_t bucket = key_hash(node->key) % size;
+      node->index_next = index[bucket];
+      index[bucket] = node;
+      node = next;
+    }
+  }
+  free(wheel->index);
+  wheel->index = index;
+  wheel->index_size = size;
+}
+
+static void schedule(timer_wheel_t *wheel, timer_node_t *node) {
+  // Timers that are already due fire on the next tick
+  if (node->expiry <= wheel->current) {
+    node->expiry = wheel->current + 1;
+  }
+  size_t slot = (size_t) node->expiry % WHEEL_SLOTS;
+  node->next = wheel->slots[slot];
+  if (node->next != NULL) {
+    node->next->pprev = &node->next;
+  }
+  node->pprev = &wheel->slots[slot];
+  wheel->slots[slot] = node;
+}
+
+static void unschedule(timer_node_t *node) {
+  *node->pprev = node->next;
+  if (node->next != NULL) {
+    node->next->pprev = node->pprev;
+  }
+}
+
+/*
+ * Arms the timer of the given key. A key that already has one keeps it
+ * and only moves it when the new expiry is earlier, a later one is left
+ * to the callback to return when the timer fires. Throws an assertion if
+ * any of the parameters are NULL or if a memory allocation error occurs.
+ */
+
+void timer_wheel_add(timer_wheel_t *wheel, const char *key, int64_t expiry) {
+  assert(wheel != NULL && key != NULL);
+  timer_node_t **link = index_find(wheel, key);
+  if (*link != NULL) {
+    timer_node_t *node = *link;
+    if (node->pprev != NULL && expiry < node->expiry) {
+      unschedule(node);
+      node->expiry = expiry;
+      schedule(wheel, node);
+    }
+    return;
+  }
+
+  timer_node_t *node = malloc(sizeof(timer_node_t));
+  assert(node != NULL);
+  strncpy(node->key, key, TIMER_KEY_LEN - 1);
+  node->key[TIMER_KEY_LEN - 1] = '\0';
+  node->expiry = expiry;
+  node->index_next = NULL;
+  *link = node;
+  schedule(wheel, node);
+  wheel->n_timers++;
+  if (wheel->n_timers > wheel->index_size) {
+    index_grow(wheel);
+  }
+}
+
+/*
+ * Drops the timer of the given key if it has one. Must not be called
+ * from a callback of timer_wheel_advance(). Throws an assertion if any
+ * of the parameters are NULL.
+ */
+
+void timer_wheel_cancel(timer_wheel_t *wheel, const char *key) {
+  assert(wheel != NULL && key != NULL);
+  timer_node_t **link = index_find(wheel, key);
+  timer_node_t *node = *link;
+  if (node == NULL) {
+    return;
+  }
+  *link = node->index_next;
+  unschedule(node);
+  free(node);
+  wheel->n_timers--;
+}
+
+/*
+ * Advances the wheel to the given time and runs the callback for every
+ * timer that became due. A long gap walks every slot at most once.
+ * Returns the number of timers that were dropped.
+ */
+
+size_t timer_wheel_advance(timer_wheel_t *wheel, int64_t now, timer_callback_t callback, void *ctx) {
+  assert(wheel != NULL && callback != NULL);
+  if (now <= wheel->current) {
+    return 0;
+  }
+
+  int64_t n_ticks = now - wheel->current;
+  if (n_ticks > WHEEL_SLOTS) {
+    n_ticks = WHEEL_SLOTS;
+  }
+  int64_t start = wheel->current;
+  wheel->current = now;
+
+  size_t n_dropped = 0;
+  timer_node_t *due = NULL;
+  for (int64_t tick = 1; tick <= n_ticks; tick++) {
+    timer_node_t **link = &wheel->slots[(size_t) (start + tick) % WHEEL_SLOTS];
+    while (*link != NULL) {
+      timer_node_t *node = *link;
+      if (node->expiry > now) {
+        // Still has rounds to go
+        link = &node->next;
+        continue;
+      }
+      unschedule(node);
+      // Marks it as firing, the callback decides when it runs again
+      node->pprev = NULL;
+      node->next = due;
+      due = node;
+    }
+  }
+
+  // Callbacks run after unlinking, so they may add timers for other keys
+  while (due != NULL) {
+    timer_node_t *node = due;
+    due = node->next;
+    int64_t expiry = callback(node->key, now, ctx);
+    if (expiry != 0) {
+      node->expiry = expiry;
+      schedule(wheel, node);
+    } else {
+      timer_node_t **link = index_find(wheel, node->key);
+      *link = node->index_next;
+      free(node);
+      wheel->n_timers--;
+      n_dropped++;
+    }
+  }
+  return n_dropped;
+}
@@ -0,0 +1,46 @@
+#ifndef CHAT_TIMER_WHEEL_H
+#define CHAT_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One slot per second, a timer further out than that waits for extra rounds
+#define WHEEL_SLOTS (4096)
+#define TIMER_KEY_LEN (32)
+
+typedef struct TimerNode {
+  struct TimerNode *next;
+  // Link that points at this node, so cancelling unlinks in O(1)
+  struct TimerNode **pprev;
+  // Chain in the key index
+  struct TimerNode *index_next;
+  int64_t expiry;
+  char key[TIMER_KEY_LEN];
+} timer_node_t;
+
+/*
+ * Called for every timer that fires. Returns the expiry to reschedule
+ * the timer at, or 0 to drop it.
+ */
+typedef int64_t (*timer_callback_t)(const char *, int64_t, void *);
+
+typedef struct TimerWheel {
+  timer_node_t *slots[WHEEL_SLOTS];
+  int64_t current;
+  size_t n_timers;
+  // Finds the timer of a key, there is at most one per key
+  timer_node_t **index;
+  size_t index_size;
+} timer_wheel_t;
+
+timer_wheel_t *timer_wheel_create(int64_t);
+
+void timer_wheel_free(timer_wheel_t *);
+
+void timer_wheel_add(timer_wheel_t *, const char *, int64_t);
+
+void timer_wheel_cancel(timer_wheel_t *, const char *);
+
+size_t timer_wheel_advance(timer_wheel_t *, int64_t, timer_callback_t, void *);
+
+#endif
@@ -0,0 +1,264 @@
+/*
+ * Restarts a lookup node without refusing a single connection. The
+ * running node listens on a Unix socket next to its table, a new
+ * process started with -U connects to it and gets the node's listening
+ * and datagram sockets passed over (SCM_RIGHTS) together with a
+ * snapshot of the table in shared memory. Connections and datagrams
+ * keep queueing on the same sockets while the new process loads the
+ * table. Once it is ready the old process stops writing to the table,
+ * the new one starts accepting and the old one drains the connections
+ * it still has.
+ *
+ * Messages are sequenced packets: the request and the offer are an
+ * upgrade_message_t each, the offer carries the snapshot, the admin
+ * socket if there is one, the listeners and the datagram sockets in
+ * this order. The new process answers UPGRADE_READY, the old one
+ * UPGRADE_GO.
+ */
+
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void set_timeouts(int fd) {
+  struct timeval timeout = { .tv_sec = UPGRADE_TIMEOUT_MS / 1000, .tv_usec = UPGRADE_TIMEOUT_MS % 1000 * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+  *addr = (struct sockaddr_un) { .sun_family = AF_UNIX };
+  size_t len = strlen(path);
+  if (len >= sizeof(addr->sun_path)) {
+    log_write(LOG_WARNING, "The upgrade socket path \"%s\" is too long", path);
+    return false;
+  }
+  memcpy(addr->sun_path, path, len + 1);
+  return true;
+}
+
+static upgrade_message_t message_header() {
+  upgrade_message_t message = { .version = UPGRADE_VERSION };
+  memcpy(message.magic, UPGRADE_MAGIC, sizeof(message.magic));
+  return message;
+}
+
+static bool valid_message(const upgrade_message_t *message) {
+  return memcmp(message->magic, UPGRADE_MAGIC, sizeof(message->magic)) == 0 && message->version == UPGRADE_VERSION;
+}
+
+static int send_byte(int fd, char byte) {
+  return send(fd, &byte, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static int expect_byte(int fd, char byte) {
+  char in = '\0';
+  return recv(fd, &in, 1, 0) == 1 && in == byte ? 0 : -1;
+}
+
+/*
+ * Opens the non-blocking Unix socket a process taking this one's place
+ * connects to, replacing whatever is at the given path. Only the owner
+ * may connect. Returns the socket, or -1 on failure.
+ */
+
+int upgrade_listen(const char *path) {
+  assert(path != NULL);
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  // Left behind by a crash, or by the process this one took over from
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || chmod(path, 0600) != 0 || listen(fd, 4) != 0) {
+    log_write(LOG_WARNING, "Could not listen on the upgrade socket \"%s\" (%d)", path, errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Accepts a pending connection on the upgrade socket and reads its
+ * request. Connections from processes of other users or versions are
+ * closed. Returns the blocking connection, or -1 if there is none or
+ * it was refused.
+ */
+
+int upgrade_accept(int listen_fd) {
+  int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (conn < 0) {
+    return -1;
+  }
+  set_timeouts(conn);
+
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 || cred.uid != geteuid()) {
+    log_write(LOG_WARNING, "Refused an upgrade from another user");
+    close(conn);
+    return -1;
+  }
+  upgrade_message_t request;
+  if (recv(conn, &request, sizeof(request), 0) != sizeof(request) || !valid_message(&request)) {
+    log_write(LOG_WARNING, "Refused an upgrade request of another version");
+    close(conn);
+    return -1;
+  }
+  return conn;
+}
+
+/*
+ * Passes the snapshot, the admin socket, the listeners and the datagram
+ * sockets of the given handoff over the connection. The descriptors
+ * stay open on this side. Throws an assertion if there are no or too
+ * many listeners or too many datagram sockets. Returns 0 on success,
+ * -1 on failure.
+ */
+
+int upgrade_offer(int conn, const handoff_t *handoff) {
+  assert(handoff != NULL && handoff->n_listeners > 0 && handoff->n_listeners <= UPGRADE_MAX_LISTENERS);
+  assert(handoff->n_datagrams <= UPGRADE_MAX_LISTENERS);
+  upgrade_message_t offer = message_header();
+  offer.n_listeners = (uint32_t) handoff->n_listeners;
+  offer.n_datagrams = (uint32_t) handoff->n_datagrams;
+  offer.has_admin = handoff->admin_fd >= 0 ? 1 : 0;
+  offer.stream = handoff->stream;
+  offer.next_seq = handoff->next_seq;
+
+  int fds[UPGRADE_MAX_FDS];
+  size_t n_fds = 0;
+  fds[n_fds++] = handoff->snapshot_fd;
+  if (handoff->admin_fd >= 0) {
+    fds[n_fds++] = handoff->admin_fd;
+  }
+  memcpy(fds + n_fds, handoff->listeners, handoff->n_listeners * sizeof(int));
+  n_fds += handoff->n_listeners;
+  memcpy(fds + n_fds, handoff->datagrams, handoff->n_datagrams * sizeof(int));
+  n_fds += handoff->n_datagrams;
+
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control = { 0 };
+  struct iovec iov = { .iov_base = &offer, .iov_len = sizeof(offer) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = CMSG_SPACE(n_fds * sizeof(int)),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+  return sendmsg(conn, &msg, MSG_NOSIGNAL) == sizeof(offer) ? 0 : -1;
+}
+
+/*
+ * Waits for the new process to load the offered table and lets it
+ * start serving. The caller must have stopped writing to its table by
+ * then. Returns 0 on success, -1 if the new process gave up or timed
+ * out, the caller keeps serving then.
+ */
+
+int upgrade_commit(int conn) {
+  return expect_byte(conn, UPGRADE_READY) == 0 && send_byte(conn, UPGRADE_GO) == 0 ? 0 : -1;
+}
+
+/*
+ * Connects to the node listening on the upgrade socket at the given
+ * path and takes the offered descriptors into the given handoff, the
+ * connection stays open for upgrade_confirm(). Returns 0 on success,
+ * -1 on failure, nothing is left open then.
+ */
+
+int upgrade_request(const char *path, handoff_t *handoff) {
+  assert(path != NULL && handoff != NULL);
+  *handoff = (handoff_t) { .conn = -1, .snapshot_fd = -1, .admin_fd = -1 };
+  struct sockaddr_un addr;
+  if (!socket_address(path, &addr)) {
+    return -1;
+  }
+  int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (conn < 0) {
+    return -1;
+  }
+  set_timeouts(conn);
+  upgrade_message_t request = message_header();
+  if (connect(conn, (struct sockaddr *) &addr, sizeof(addr)) != 0
+      || send(conn, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+    close(conn);
+    return -1;
+  }
+
+  upgrade_message_t offer;
+  union {
+    char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = &offer, .iov_len = sizeof(offer) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control) };
+  ssize_t received = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  int fds[UPGRADE_MAX_FDS];
+  size_t n_fds = 0;
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+    n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+  }
+  bool valid = received == sizeof(offer) && valid_message(&offer) && (msg.msg_flags & MSG_CTRUNC) == 0
+            && offer.n_listeners >= 1 && offer.n_listeners <= UPGRADE_MAX_LISTENERS
+            && offer.n_datagrams <= UPGRADE_MAX_LISTENERS && offer.has_admin <= 1
+            && n_fds == 1 + offer.has_admin + offer.n_listeners + offer.n_datagrams;
+  if (!valid) {
+    for (size_t i = 0; i < n_fds; i++) {
+      close(fds[i]);
+    }
+    close(conn);
+    return -1;
+  }
+
+  handoff->conn = conn;
+  handoff->snapshot_fd = fds[0];
+  handoff->admin_fd = offer.has_admin ? fds[1] : -1;
+  handoff->n_listeners = offer.n_listeners;
+  handoff->stream = offer.stream;
+  handoff->next_seq = offer.next_seq;
+  handoff->n_datagrams = offer.n_datagrams;
+  memcpy(handoff->listeners, fds + 1 + offer.has_admin, offer.n_listeners * sizeof(int));
+  memcpy(handoff->datagrams, fds + 1 + offer.has_admin + offer.n_listeners, offer.n_datagrams * sizeof(int));
+  return 0;
+}
+
+/*
+ * Tells the old process that the table is loaded and waits until it
+ * stopped writing to its own, then closes the connection. Returns 0
+ * once this process may serve, -1 if the old process gave up.
+ */
+
+int upgrade_confirm(handoff_t *handoff) {
+  assert(handoff != NULL && handoff->conn >= 0);
+  int result = send_byte(handoff->conn, UPGRADE_READY) == 0 && expect_byte(handoff->conn, UPGRADE_GO) == 0 ? 0 : -1;
+  close(handoff->conn);
+  handoff->conn = -1;
+  return result;
+}
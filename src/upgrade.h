@@ -0,0 +1,76 @@
+#ifndef CHAT_UPGRADE_H
+#define CHAT_UPGRADE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Lives next to the node's table, see generate_table_filename()
+#define UPGRADE_SOCKET_FILE ("/upgrade.sock")
+#define UPGRADE_MAGIC ("CHATUPGR")
+#define UPGRADE_VERSION (2)
+// Listening and datagram sockets handed over at most, one each per worker
+#define UPGRADE_MAX_LISTENERS (64)
+// The snapshot, the admin socket, the listeners and the datagram sockets
+#define UPGRADE_MAX_FDS (2 + 2 * UPGRADE_MAX_LISTENERS)
+// Either side gives up on a handover that stalls for this long. The
+// old process holds the table lock while the new one loads the table.
+#ifndef UPGRADE_TIMEOUT_MS
+#define UPGRADE_TIMEOUT_MS (30000)
+#endif
+// The old process closes the connections it still serves after this long
+#ifndef UPGRADE_DRAIN_MS
+#define UPGRADE_DRAIN_MS (10000)
+#endif
+
+// Sent by the new process once it loaded the table, answered by the old one once it stopped writing
+#define UPGRADE_READY ('R')
+#define UPGRADE_GO ('G')
+
+// First message of either side, the offer carries the descriptors
+typedef struct UpgradeMessage {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_listeners;
+  uint32_t n_datagrams;
+  // Set if an admin socket follows the snapshot
+  uint32_t has_admin;
+  // Position of a follower in its leader's stream, see replica_t
+  uint64_t stream;
+  uint64_t next_seq;
+} upgrade_message_t;
+
+/*
+ * What a running lookup node hands over to the process taking its
+ * place: a snapshot of its table in shared memory and the sockets it
+ * listens on, so that connections queued on them are never refused.
+ */
+typedef struct Handoff {
+  // Connection between the two processes, -1 once closed
+  int conn;
+  // Anonymous shared memory file, see export_table()
+  int snapshot_fd;
+  // -1 if the old process had no admin socket
+  int admin_fd;
+  int listeners[UPGRADE_MAX_LISTENERS];
+  size_t n_listeners;
+  // Signed fetches, see datagram.h, none if the old process served no datagrams
+  int datagrams[UPGRADE_MAX_LISTENERS];
+  size_t n_datagrams;
+  // A follower's table matches this position, the new process continues from it
+  uint64_t stream;
+  uint64_t next_seq;
+} handoff_t;
+
+int upgrade_listen(const char *);
+
+int upgrade_accept(int);
+
+int upgrade_offer(int, const handoff_t *);
+
+int upgrade_commit(int);
+
+int upgrade_request(const char *, handoff_t *);
+
+int upgrade_confirm(handoff_t *);
+
+#endif